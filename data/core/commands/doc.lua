@@ -31,30 +31,34 @@ local function append_line_if_last_line(line)
   end
 end
 
-local function save(filename)
+local function save(filename, on_saved)
   local abs_filename
   if filename then
     filename = core.normalize_to_project_dir(filename)
     abs_filename = core.project_absolute_path(filename)
   end
-  local ok, err = pcall(doc().save, doc(), filename, abs_filename)
-  if ok then
-    local saved_filename = doc().filename
-    core.log("Saved \"%s\"", saved_filename)
-  else
-    core.error(err)
-    core.nag_view:show("Saving failed", string.format("Couldn't save file \"%s\". Do you want to save to another location?", doc().filename), {
-      { text = "Yes", default_yes = true },
-      { text = "No", default_no = true }
-    }, function(item)
-      if item.text == "Yes" then
-        core.add_thread(function()
-          -- we need to run this in a thread because of the odd way the nagview is.
-          command.perform("doc:save-as")
-        end)
-      end
-    end)
-  end
+  local saved_doc = doc()
+  -- saving from a thread lets Doc:save yield while the file is being written
+  core.add_thread(function()
+    local ok, err = pcall(saved_doc.save, saved_doc, filename, abs_filename)
+    if ok then
+      core.log("Saved \"%s\"", saved_doc.filename)
+      if on_saved then on_saved() end
+    else
+      core.error(err)
+      core.nag_view:show("Saving failed", string.format("Couldn't save file \"%s\". Do you want to save to another location?", saved_doc.filename), {
+        { text = "Yes", default_yes = true },
+        { text = "No", default_no = true }
+      }, function(item)
+        if item.text == "Yes" then
+          core.add_thread(function()
+            -- we need to run this in a thread because of the odd way the nagview is.
+            command.perform("doc:save-as")
+          end)
+        end
+      end)
+    end
+  end)
 end
 
 local function cut_or_copy(delete)
@@ -614,11 +618,12 @@ local commands = {
     core.command_view:enter("Rename", {
       text = old_filename,
       submit = function(filename)
-        save(common.home_expand(filename))
-        core.log("Renamed \"%s\" to \"%s\"", old_filename, filename)
-        if filename ~= old_filename then
-          os.remove(old_filename)
-        end
+        save(common.home_expand(filename), function()
+          core.log("Renamed \"%s\" to \"%s\"", old_filename, filename)
+          if filename ~= old_filename then
+            os.remove(old_filename)
+          end
+        end)
       end,
       suggest = function (text)
         return common.home_encode_list(common.path_suggest(common.home_expand(text)))
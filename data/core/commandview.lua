@@ -281,18 +281,40 @@ function CommandView:update_suggestions()
   local text = self:get_text()
   local t = self.state.suggest(self.last_change == "suggestion" and self.user_supplied_text or text) or {}
   local res = {}
-  for i, item in ipairs(t) do
-    if type(item) == "string" then
-      item = { text = item }
+  local mt = getmetatable(t)
+  local lazy = mt and mt.__len
+  if lazy then
+    -- lists with a length of their own build their items as they're
+    -- accessed, so only the visible ones are materialized
+    res = t
+  else
+    for i, item in ipairs(t) do
+      if type(item) == "string" then
+        item = { text = item }
+      end
+      res[i] = item
     end
-    res[i] = item
   end
   if self.suggestions and self.last_change == "suggestion" then
     local new_suggestion_idx
-    for i, v in ipairs(res) do
-      if v.text == self.suggestions[self.suggestion_idx].text then
-        new_suggestion_idx = i
-        break
+    local selected = self.suggestions[self.suggestion_idx].text
+    if lazy then
+      -- only search the page of the previous index, and the rows already
+      -- built, instead of building the whole list
+      local _ = res[self.suggestion_idx]
+      for i, v in next, res do
+        if v.text == selected and (not new_suggestion_idx or i < new_suggestion_idx) then
+          new_suggestion_idx = i
+        end
+      end
+      -- keep the selected row in place when its text wasn't built yet
+      new_suggestion_idx = new_suggestion_idx or self.suggestion_idx
+    else
+      for i, v in ipairs(res) do
+        if v.text == selected then
+          new_suggestion_idx = i
+          break
+        end
       end
     end
     self.suggestion_idx = new_suggestion_idx
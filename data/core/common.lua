@@ -151,27 +151,9 @@ function common.splice(t, at, remove, insert)
 end
 
 
-local function compare_score(a, b)
-  if a.score == b.score then
-    return a.text < b.text
-  end
-  return a.score > b.score
-end
-
-local function fuzzy_match_items(items, needle, files)
-  local res = {}
+local function fuzzy_match_items(items, needle, files, limit)
   needle = (PLATFORM == "Windows" and files) and needle:gsub('/', PATHSEP) or needle
-  for _, item in ipairs(items) do
-    local score = system.fuzzy_match(tostring(item), needle, files)
-    if score then
-      table.insert(res, { text = item, score = score })
-    end
-  end
-  table.sort(res, compare_score)
-  for i, item in ipairs(res) do
-    res[i] = item.text
-  end
-  return res
+  return system.fuzzy_match_list(items, needle, files, limit)
 end
 
 
@@ -184,10 +166,10 @@ end
 ---@param needle string
 ---@param files boolean If true, the matching process will be performed in reverse to better match paths.
 ---@return number
----@overload fun(haystack: string[], needle: string, files: boolean): string[]
-function common.fuzzy_match(haystack, needle, files)
+---@overload fun(haystack: string[], needle: string, files: boolean, limit?: integer): string[]
+function common.fuzzy_match(haystack, needle, files, limit)
   if type(haystack) == "table" then
-    return fuzzy_match_items(haystack, needle, files)
+    return fuzzy_match_items(haystack, needle, files, limit)
   end
   return system.fuzzy_match(haystack, needle, files)
 end
@@ -200,21 +182,22 @@ end
 ---@param haystack string[]
 ---@param recents string[]
 ---@param needle string
+---@param limit? integer The maximum amount of strings from the haystack.
 ---@return string[]
-function common.fuzzy_match_with_recents(haystack, recents, needle)
+function common.fuzzy_match_with_recents(haystack, recents, needle, limit)
   if needle == "" then
     local recents_ext = {}
     for i = 2, #recents do
       table.insert(recents_ext, recents[i])
     end
     table.insert(recents_ext, recents[1])
-    local others = common.fuzzy_match(haystack, "", true)
+    local others = common.fuzzy_match(haystack, "", true, limit)
     for i = 1, #others do
       table.insert(recents_ext, others[i])
     end
     return recents_ext
   else
-    return fuzzy_match_items(haystack, needle, true)
+    return fuzzy_match_items(haystack, needle, true, limit)
   end
 end
 
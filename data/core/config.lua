@@ -106,6 +106,35 @@ config.undo_merge_timeout = 0.3
 ---@type number
 config.max_undos = 10000
 
+---Tokenizes documents for syntax highlighting from a worker thread,
+---when the syntax can be handled by the native lexer.
+---
+---The default is true.
+---@type boolean
+config.threaded_highlighting = true
+
+---Keeps an index of the files of each project, built from a worker thread
+---and kept up to date from file system notifications, used to list them
+---without walking the project directories again.
+---
+---The default is true.
+---@type boolean
+config.project_index = true
+
+---Saves the project indexes to the user directory when closing projects,
+---so that they only need to be checked for changes when opened again.
+---
+---The default is true.
+---@type boolean
+config.persist_project_index = true
+
+---Renders the ASCII and Latin-1 glyphs of the fonts in `style` from a
+---background thread at startup, so that they are ready when first drawn.
+---
+---The default is true.
+---@type boolean
+config.prewarm_fonts = true
+
 ---The maximum number of tabs shown at a time.
 ---
 ---The default is 8.
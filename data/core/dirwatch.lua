@@ -89,20 +89,27 @@ function dirwatch:unwatch(directory)
 end
 
 -- designed to be run inside a coroutine.
+-- The callback receives the changed directory or file, and when known the
+-- list of changes to the files in it, as { name = string, kind = string }.
 function dirwatch:check(change_callback, scan_time, wait_time)
   local had_change = false
   local last_error
-  self.monitor:check(function(id)
+  self.monitor:check(function(id, changes)
     had_change = true
     if self.monitor:mode() == "single" then
       local path = common.dirname(id)
       if not string.match(id, "^/") and not string.match(id, "^%a:[/\\]") then
         path = common.dirname(self.single_watch_top .. PATHSEP .. id)
       end
-      change_callback(path)
+      -- the id is the changed file itself, report it as a change of its directory
+      if changes then
+        local name = common.basename(id)
+        for _, change in ipairs(changes) do change.name = name end
+      end
+      change_callback(path, changes)
     elseif self.reverse_watched[id] then
       local path = self.reverse_watched[id]
-      change_callback(path)
+      change_callback(path, changes)
       local info = system.get_file_info(path)
       if info and info.type == "file" then
         self:unwatch(path)
@@ -1,5 +1,4 @@
 local core = require "core"
-local common = require "core.common"
 local config = require "core.config"
 local tokenizer = require "core.tokenizer"
 local Object = require "core.object"
@@ -15,41 +14,128 @@ function Highlighter:new(doc)
   self:reset()
 end
 
+-- Amount of lines tokenized by each background job, and the distance between
+-- the previous states passed to it, to stop once the state converges again.
+local JOB_LINES = 2000
+local CHECKPOINT_INTERVAL = 50
+
+
+local function is_valid(self, i)
+  local state = (i > 1) and self.lines[i - 1].state
+  local line = self.lines[i]
+  return line and line.init_state == state and line.text == self.doc.lines[i] and not line.resume
+end
+
+
+-- retokenize a slice of lines from the first invalid one in this thread
+local function tokenize_slice(self)
+  local max = math.min(self.first_invalid_line + 40, self.max_wanted_line)
+  local retokenized_from
+  for i = self.first_invalid_line, max do
+    local state = (i > 1) and self.lines[i - 1].state
+    local line = self.lines[i]
+    if line and line.resume and (line.init_state ~= state or line.text ~= self.doc.lines[i]) then
+      -- Reset the progress if no longer valid
+      line.resume = nil
+    end
+    if not (line and line.init_state == state and line.text == self.doc.lines[i] and not line.resume) then
+      retokenized_from = retokenized_from or i
+      self.lines[i] = self:tokenize_line(i, state, line and line.resume)
+      if self.lines[i].resume then
+        self.first_invalid_line = i
+        goto done
+      end
+    elseif retokenized_from then
+      self:update_notify(retokenized_from, i - retokenized_from - 1)
+      retokenized_from = nil
+    end
+  end
+
+  self.first_invalid_line = max + 1
+  ::done::
+  if retokenized_from then
+    self:update_notify(retokenized_from, max - retokenized_from)
+  end
+  core.redraw = true
+end
+
+
+local function start_job(self)
+  local first = self.first_invalid_line
+  -- lines the job couldn't tokenize, like ones reporting bad patterns,
+  -- are left to tokenize_slice
+  if not config.threaded_highlighting or first == self.job_stopped_line then
+    return false
+  end
+  local lex = tokenizer.get_lexer(self.doc.syntax)
+  if not lex then return false end
+  local last = math.min(first + JOB_LINES - 1, #self.doc.lines)
+  local checkpoints = {}
+  for i = first + CHECKPOINT_INTERVAL, last, CHECKPOINT_INTERVAL do
+    local line = self.lines[i]
+    if line and not line.resume then
+      checkpoints[i - first + 1] = line.init_state
+    end
+  end
+  local state = (first > 1) and self.lines[first - 1].state or nil
+  local text = self.doc.lines:get_text(first, 1, last, math.huge, true)
+  self.job = lex:highlight(text, state, checkpoints)
+  self.job_last_line = last
+  return true
+end
+
+
+local function cancel_job(self)
+  if self.job then
+    self.job:cancel()
+    self.job = nil
+  end
+end
+
+
+-- apply the lines tokenized by the job since the last poll
+local function poll_job(self)
+  local lines, status = self.job:poll()
+  local first = self.first_invalid_line
+  for i, line in ipairs(lines) do
+    local idx = first + i - 1
+    line.init_state = (idx > 1) and self.lines[idx - 1].state
+    self.lines[idx] = line
+  end
+  if #lines > 0 then
+    self.first_invalid_line = first + #lines
+    self:update_notify(first, #lines - 1)
+    core.redraw = true
+  end
+  if status then
+    self.job = nil
+    if status == "stopped" then
+      self.job_stopped_line = self.first_invalid_line
+    end
+  end
+  return status
+end
+
+
 -- init incremental syntax highlighting
 function Highlighter:start()
   if self.running then return end
   self.running = true
   core.add_thread(function()
     while self.first_invalid_line <= self.max_wanted_line do
-      local max = math.min(self.first_invalid_line + 40, self.max_wanted_line)
-      local retokenized_from
-      for i = self.first_invalid_line, max do
-        local state = (i > 1) and self.lines[i - 1].state
-        local line = self.lines[i]
-        if line and line.resume and (line.init_state ~= state or line.text ~= self.doc.lines[i]) then
-          -- Reset the progress if no longer valid
-          line.resume = nil
-        end
-        if not (line and line.init_state == state and line.text == self.doc.lines[i] and not line.resume) then
-          retokenized_from = retokenized_from or i
-          self.lines[i] = self:tokenize_line(i, state, line and line.resume)
-          if self.lines[i].resume then
-            self.first_invalid_line = i
-            goto yield
-          end
-        elseif retokenized_from then
-          self:update_notify(retokenized_from, i - retokenized_from - 1)
-          retokenized_from = nil
+      if self.job then
+        if not poll_job(self) then coroutine.yield(1 / config.fps) end
+      elseif is_valid(self, self.first_invalid_line) then
+        -- skip lines left valid, like the ones after a job converged
+        local max = math.min(self.first_invalid_line + JOB_LINES, self.max_wanted_line)
+        while self.first_invalid_line <= max and is_valid(self, self.first_invalid_line) do
+          self.first_invalid_line = self.first_invalid_line + 1
         end
+        coroutine.yield(0)
+      elseif not start_job(self) then
+        tokenize_slice(self)
+        coroutine.yield(0)
       end
-
-      self.first_invalid_line = max + 1
-      ::yield::
-      if retokenized_from then
-        self:update_notify(retokenized_from, max - retokenized_from)
-      end
-      core.redraw = true
-      coroutine.yield(0)
     end
     self.max_wanted_line = 0
     self.running = false
@@ -70,7 +156,9 @@ function Highlighter:reset()
 end
 
 function Highlighter:soft_reset()
-  for i=1,#self.lines do
+  cancel_job(self)
+  self.job_stopped_line = nil
+  for i in pairs(self.lines) do
     self.lines[i] = false
   end
   self.first_invalid_line = 1
@@ -78,22 +166,29 @@ function Highlighter:soft_reset()
 end
 
 function Highlighter:invalidate(idx)
+  if self.job and idx <= self.job_last_line then
+    cancel_job(self)
+  end
   self.first_invalid_line = math.min(self.first_invalid_line, idx)
   set_max_wanted_lines(self, math.min(self.max_wanted_line, #self.doc.lines))
 end
 
+-- self.lines is sparse, so shift it using the document line count
 function Highlighter:insert_notify(line, n)
   self:invalidate(line)
-  local blanks = { }
-  for i = 1, n do
-    blanks[i] = false
+  table.move(self.lines, line, #self.doc.lines - n, line + n)
+  for i = line, line + n - 1 do
+    self.lines[i] = false
   end
-  common.splice(self.lines, line, 0, blanks)
 end
 
 function Highlighter:remove_notify(line, n)
   self:invalidate(line)
-  common.splice(self.lines, line, n)
+  local last = #self.doc.lines + n
+  table.move(self.lines, line + n, last, line)
+  for i = last - n + 1, last do
+    self.lines[i] = nil
+  end
 end
 
 function Highlighter:update_notify(line, n)
@@ -106,6 +201,11 @@ function Highlighter:tokenize_line(idx, state, resume)
   res.init_state = state
   res.text = self.doc.lines[idx]
   res.tokens, res.state, res.resume = tokenizer.tokenize(self.doc.syntax, res.text, state, resume)
+  local lex = not res.resume and tokenizer.get_lexer(self.doc.syntax)
+  if lex then
+    -- keep the tokens as offsets into the text instead of separate strings
+    res.tokens = lex:pack(res.tokens, res.text) or res.tokens
+  end
   return res
 end
 
@@ -11,15 +11,6 @@ local Doc = Object:extend()
 
 function Doc:__tostring() return "Doc" end
 
-local function split_lines(text)
-  local res = {}
-  for line in (text .. "\n"):gmatch("(.-)\n") do
-    table.insert(res, line)
-  end
-  return res
-end
-
-
 function Doc:new(filename, abs_filename, new_file)
   self.new_file = new_file
   self:reset()
@@ -35,7 +26,7 @@ function Doc:new(filename, abs_filename, new_file)
 end
 
 function Doc:reset()
-  self.lines = { "\n" }
+  self.lines = piecetable.new("\n")
   self.selections = { 1, 1, 1, 1 }
   self.last_selection = 1
   self.undo_stack = { idx = 1 }
@@ -67,23 +58,10 @@ function Doc:set_filename(filename, abs_filename)
 end
 
 function Doc:load(filename)
-  local fp = assert(io.open(filename, "rb"))
+  local lines, crlf = assert(piecetable.load(filename))
   self:reset()
-  self.lines = {}
-  local i = 1
-  for line in fp:lines() do
-    if line:byte(-1) == 13 then
-      line = line:sub(1, -2)
-      self.crlf = true
-    end
-    table.insert(self.lines, line .. "\n")
-    self.highlighter.lines[i] = false
-    i = i + 1
-  end
-  if #self.lines == 0 then
-    table.insert(self.lines, "\n")
-  end
-  fp:close()
+  self.lines = lines
+  if crlf then self.crlf = true end
   self:reset_syntax()
 end
 
@@ -96,6 +74,28 @@ function Doc:reload()
   end
 end
 
+---Threads waiting in Doc:save() for their file to be written,
+---resumed by the main loop on a `docsaved` event.
+---@type table<thread, boolean>
+Doc.save_waiting = setmetatable({}, { __mode = "k" })
+
+-- how long a thread waits at most, in case the `docsaved` event was lost
+local SAVE_WAIT = 1
+
+-- Waits for a save job to finish; in a thread of core.add_thread() this
+-- yields, so that the editor stays responsive while the file is written.
+-- Other coroutines are resumed by their caller, so they block instead.
+local function wait_save(job)
+  local cr = coroutine.running()
+  if core.is_thread(cr) then
+    while not job:done() do
+      Doc.save_waiting[cr] = true
+      coroutine.yield(SAVE_WAIT)
+    end
+  end
+  return job:wait()
+end
+
 function Doc:save(filename, abs_filename)
   if not filename then
     assert(self.filename, "no filename set to default to")
@@ -105,30 +105,22 @@ function Doc:save(filename, abs_filename)
     assert(self.filename or abs_filename, "calling save on unnamed doc without absolute path")
   end
 
-  local fp
-  if PLATFORM == "Windows" then
-    -- On Windows, opening a hidden file with wb fails with a permission error.
-    -- To get around this, we must open the file as r+b and truncate.
-    -- Since r+b fails if file doesn't exist, fall back to wb.
-    fp = io.open(abs_filename, "r+b")
-    if fp then
-      system.ftruncate(fp)
-    else
-      -- file probably doesn't exist, create one
-      fp = assert (io.open(abs_filename, "wb"))
-    end
-  else
-    fp = assert (io.open(abs_filename, "wb"))
-  end
+  -- don't let an older snapshot finish writing after this one
+  if self.save_job then wait_save(self.save_job) end
+
+  -- The buffer is snapshotted and written by a worker thread to a temporary
+  -- file, which then atomically replaces the target.
+  local job = self.lines:save(abs_filename, self.crlf)
+  local change_id = self:get_change_id()
+  self.save_job = job
+  local ok, err = wait_save(job)
+  if self.save_job == job then self.save_job = nil end
+  assert(ok, err)
 
-  for _, line in ipairs(self.lines) do
-    if self.crlf then line = line:gsub("\n", "\r\n") end
-    fp:write(line)
-  end
-  fp:close()
   self:set_filename(filename, abs_filename)
   self.new_file = false
-  self:clean()
+  -- edits made while saving are not part of the saved file
+  self.clean_change_id = change_id
 end
 
 function Doc:get_name()
@@ -311,16 +303,7 @@ end
 
 local function position_offset_byte(self, line, col, offset)
   line, col = self:sanitize_position(line, col)
-  col = col + offset
-  while line > 1 and col < 1 do
-    line = line - 1
-    col = col + #self.lines[line]
-  end
-  while line < #self.lines and col > #self.lines[line] do
-    col = col - #self.lines[line]
-    line = line + 1
-  end
-  return self:sanitize_position(line, col)
+  return self:sanitize_position(self.lines:position_offset(line, col, offset))
 end
 
 
@@ -355,16 +338,7 @@ function Doc:get_text(line1, col1, line2, col2, inclusive)
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
-  local col2_offset = inclusive and 0 or 1
-  if line1 == line2 then
-    return self.lines[line1]:sub(col1, col2 - col2_offset)
-  end
-  local lines = { self.lines[line1]:sub(col1) }
-  for i = line1 + 1, line2 - 1 do
-    table.insert(lines, self.lines[i])
-  end
-  table.insert(lines, self.lines[line2]:sub(1, col2 - col2_offset))
-  return table.concat(lines)
+  return self.lines:get_text(line1, col1, line2, col2, inclusive)
 end
 
 function Doc:get_char(line, col)
@@ -413,24 +387,13 @@ end
 
 
 function Doc:raw_insert(line, col, text, undo_stack, time)
-  -- split text into lines and merge with line at insertion point
-  local lines = split_lines(text)
-  local len = #lines[#lines]
-  local before = self.lines[line]:sub(1, col - 1)
-  local after = self.lines[line]:sub(col)
-  for i = 1, #lines - 1 do
-    lines[i] = lines[i] .. "\n"
-  end
-  lines[1] = before .. lines[1]
-  lines[#lines] = lines[#lines] .. after
-
-  -- splice lines into line array
-  common.splice(self.lines, line, 1, lines)
+  -- insert text into the buffer; len is the length after the last newline
+  local lines_added, len = self.lines:insert(line, col, text)
 
   -- keep cursors where they should be
   for idx, cline1, ccol1, cline2, ccol2 in self:get_selections(true, true) do
     if cline1 < line then break end
-    local line_addition = (line < cline1 or col < ccol1) and #lines - 1 or 0
+    local line_addition = (line < cline1 or col < ccol1) and lines_added or 0
     local column_addition = line == cline1 and ccol1 > col and len or 0
     self:set_selections(idx, cline1 + line_addition, ccol1 + column_addition, cline2 + line_addition,
       ccol2 + column_addition)
@@ -442,7 +405,7 @@ function Doc:raw_insert(line, col, text, undo_stack, time)
   push_undo(undo_stack, time, "remove", line, col, line2, col2)
 
   -- update highlighter and assure selection is in bounds
-  self.highlighter:insert_notify(line, #lines - 1)
+  self.highlighter:insert_notify(line, lines_added)
   self:sanitize_selection()
 end
 
@@ -452,15 +415,11 @@ function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   push_undo(undo_stack, time, "selection", table.unpack(self.selections))
   push_undo(undo_stack, time, "insert", line1, col1, text)
 
-  -- get line content before/after removed text
-  local before = self.lines[line1]:sub(1, col1 - 1)
-  local after = self.lines[line2]:sub(col2)
-
   local line_removal = line2 - line1
   local col_removal = col2 - col1
 
-  -- splice line into line array
-  common.splice(self.lines, line1, line_removal + 1, { before .. after })
+  -- remove text from the buffer
+  self.lines:remove(line1, col1, line2, col2)
 
   local merge = false
 
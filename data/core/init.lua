@@ -79,6 +79,13 @@ end
 function core.add_project(project)
   project = type(project) == "string" and Project(common.normalize_volume(project)) or project
   table.insert(core.projects, project)
+  -- started from a thread, to use the configuration loaded after the first
+  -- project, unless the project was removed meanwhile
+  core.add_thread(function()
+    for _, p in ipairs(core.projects) do
+      if p == project then project:start_index() end
+    end
+  end)
   core.redraw = true
   return project
 end
@@ -89,6 +96,7 @@ function core.remove_project(project, force)
     if project == core.projects[i] or project == core.projects[i].path then
       local project = core.projects[i]
       table.remove(core.projects, i)
+      project:close()
       return project
     end
   end
@@ -422,6 +430,16 @@ function core.init()
   -- Load core and user plugins giving preference to user ones with same name.
   local plugins_success, plugins_refuse_list = core.load_plugins()
 
+  -- The fonts are configured by now, render their common glyphs in the background
+  if config.prewarm_fonts then
+    for _, name in ipairs({ "font", "code_font", "icon_font", "big_font", "icon_big_font" }) do
+      if style[name] then style[name]:prewarm() end
+    end
+    for _, font in pairs(style.syntax_fonts) do
+      font:prewarm()
+    end
+  end
+
   do
     local pdir, pname = project_dir_abs:match("(.*)[/\\\\](.*)")
     core.log("Opening project %q from directory %s", pname, pdir)
@@ -763,6 +781,19 @@ function core.add_thread(f, weak_ref, ...)
 end
 
 
+---Tells whether a coroutine is a thread added by `core.add_thread()`.
+---Only those are resumed by the main loop, so only they can yield to wait
+---for an event; coroutines running inside them are resumed by their caller.
+---@param cr thread
+---@return boolean
+function core.is_thread(cr)
+  for _, thread in pairs(core.threads) do
+    if thread.cr == cr then return true end
+  end
+  return false
+end
+
+
 function core.push_clip_rect(x, y, w, h)
   local x2, y2, w2, h2 = table.unpack(core.clip_rect_stack[#core.clip_rect_stack])
   local r, b, r2, b2 = x+w, y+h, x2+w2, y2+h2
@@ -958,6 +989,22 @@ function core.compose_window_title(title)
 end
 
 
+-- set when threads were woken up during a step, so that they run without waiting
+local threads_woken = false
+
+-- Resumes the threads registered in a table of waiting coroutines, such as
+-- the ones waiting for a process, or for a document to be saved.
+local function wake_waiting(waiting)
+  for _, thread in pairs(core.threads) do
+    if waiting[thread.cr] then
+      waiting[thread.cr] = nil
+      thread.wake = 0
+      threads_woken = true
+    end
+  end
+end
+
+
 function core.step()
   -- handle events
   local did_keymap = false
@@ -972,11 +1019,16 @@ function core.step()
       -- required to avoid flashing and refresh issues on mobile
       core.redraw = true
       break
+    elseif type == "processready" then
+      wake_waiting(process.waiting)
+    elseif type == "docsaved" then
+      wake_waiting(Doc.save_waiting)
     else
       local _, res = core.try(core.on_event, type, a, b, c, d)
       did_keymap = res or did_keymap
     end
-    core.redraw = true
+    -- processes are drawn by whoever waits for them, if needed
+    if type ~= "processready" then core.redraw = true end
   end
 
   local width, height = core.window:get_size()
@@ -1074,6 +1126,9 @@ function core.run()
       did_step = true
     end
     if core.restart_request or core.quit_request then break end
+    if threads_woken then
+      time_to_wake, threads_woken = 0, false
+    end
 
     if not did_redraw then
       if system.window_has_focus(core.window) or not did_step or run_threads_full < 2 then
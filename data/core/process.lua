@@ -12,6 +12,20 @@ local common = require "core.common"
 process.stream = {}
 process.stream.__index = process.stream
 
+---Coroutines waiting for output to be ready in stream:read(), or for a process
+---to exit in process:wait(), resumed by the main loop on a `processready` event.
+---@type table<thread, boolean>
+process.waiting = setmetatable({}, { __mode = "k" })
+
+-- how long a coroutine waits at most, when a `processready` event can tell it earlier
+local READY_WAIT = 1
+
+-- Only the threads of `core.add_thread()` are resumed by a `processready`
+-- event, coroutines running inside them have to poll.
+local function is_core_thread(cr)
+  return require("core").is_thread(cr)
+end
+
 ---Creates a stream from a process.
 ---@param proc process The process to wrap.
 ---@param fd process.streamtype The standard stream of the process to wrap.
@@ -27,7 +41,7 @@ end
 ---Options that can be passed to stream.read().
 ---@class process.stream.readoption
 ---@field public timeout number The number of seconds to wait before the function throws an error. Reads do not time out by default.
----@field public scan number The number of seconds to yield in a coroutine. Defaults to `1/config.fps`.
+---@field public scan number The number of seconds to yield in a coroutine. Defaults to waiting until output is ready, or `1/config.fps` on platforms where this can't be known and outside of `core.add_thread()` threads.
 
 ---Reads data from the stream.
 ---
@@ -78,10 +92,17 @@ function process.stream:read(bytes, options)
         if s then target = self.len - #chunk + s end
       end
     elseif coroutine.isyieldable() then
-      if options.timeout and system.get_time() - start > options.timeout then
+      local elapsed = system.get_time() - start
+      if options.timeout and elapsed > options.timeout then
         error("timeout expired")
       end
-      coroutine.yield(options.scan or (1 / config.fps))
+      local wait = options.scan or (1 / config.fps)
+      local cr = coroutine.running()
+      if self.process.process:ready_event(self.fd) and is_core_thread(cr) then
+        process.waiting[cr] = true
+        wait = options.scan or math.min(READY_WAIT, (options.timeout or math.huge) - elapsed)
+      end
+      coroutine.yield(wait)
     else
       break
     end
@@ -132,13 +153,21 @@ end
 ---the function yields to the main thread occassionally to avoid blocking the editor. <br>
 ---Otherwise, the function blocks the editor until the process exited or the timeout has expired.
 ---@param timeout? number The amount of seconds to wait. If omitted, the function will wait indefinitely.
----@param scan? number The amount of seconds to yield while scanning. If omittted, the scan rate will be the FPS.
+---@param scan? number The amount of seconds to yield while scanning. If omittted, waits until the process exits, or the scan rate will be the FPS on platforms where this can't be known and outside of `core.add_thread()` threads.
 ---@return integer|nil exit_code The exit code for this process, or nil if the wait timed out.
 function process:wait(timeout, scan)
   if not coroutine.isyieldable() then return self.process:wait(timeout) end
   local start = system.get_time()
-  while self.process:running() and (system.get_time() - start > (timeout or math.huge)) do
-    coroutine.yield(scan or (1 / config.fps))
+  while true do
+    local elapsed = system.get_time() - start
+    if not self.process:running() or elapsed >= (timeout or math.huge) then break end
+    local wait = scan or (1 / config.fps)
+    local cr = coroutine.running()
+    if self.process:ready_event() and is_core_thread(cr) then
+      process.waiting[cr] = true
+      wait = scan or math.min(READY_WAIT, (timeout or math.huge) - elapsed)
+    end
+    coroutine.yield(wait)
   end
   return self.process:returncode()
 end
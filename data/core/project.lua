@@ -5,6 +5,7 @@ local Project = Object:extend()
 local core = require "core"
 local common = require "core.common"
 local config = require "core.config"
+local Dirwatch = require "core.dirwatch"
 
 -- inspect config.ignore_files patterns and prepare ready to use entries.
 local function compile_ignore_files()
@@ -130,12 +131,89 @@ local function find_files_rec(project, path)
 end
 
 
+-- Iterates the files of the project, taking them from the index once it's
+-- built, in which case the size and modification time are the indexed ones.
 function Project:files()
+  if self.index and not self.index:is_scanning() then
+    local files = self.index:files(self.path .. PATHSEP, true)
+    return coroutine.wrap(function()
+      for _, info in ipairs(files) do
+        coroutine.yield(self, info)
+      end
+    end)
+  end
   return coroutine.wrap(function()
     find_files_rec(self, self.path)
   end)
 end
 
 
+-- Returns the paths of every file of the project prefixed with `prefix`,
+-- waiting for the index to be built, so it must be called from a coroutine.
+-- Returns nil if the project isn't indexed.
+function Project:indexed_files(prefix)
+  while self.index and self.index:is_scanning() do
+    coroutine.yield(0.05)
+  end
+  return self.index and (self.index:files(prefix))
+end
+
+
+-- Starts indexing the project files from a worker thread, along with a
+-- thread watching the indexed directories to keep the index up to date.
+function Project:start_index()
+  if self.index or not config.project_index then return end
+  local cache
+  if config.persist_project_index then
+    local dir = USERDIR .. PATHSEP .. "project_index"
+    if system.get_file_info(dir) or common.mkdirp(dir) then
+      cache = dir .. PATHSEP .. self.path:gsub("[^%w%-%.]", "_")
+    end
+  end
+  local ok, index = pcall(projectindex.new, self.path, self.compiled, config.file_size_limit * 1e6, cache)
+  if not ok then
+    core.warn("cannot index project %s: %s", self.path, index)
+    return
+  end
+  self.index = index
+  local watch = Dirwatch.new()
+  core.add_thread(function()
+    while self.index == index do
+      local added, removed = index:poll()
+      if not added then
+        -- the files are listed by walking the project again
+        core.warn("cannot index project %s: %s", self.path, removed)
+        index:close()
+        self.index = nil
+        break
+      end
+      for _, dir in ipairs(added) do watch:watch(dir) end
+      for _, dir in ipairs(removed) do watch:unwatch(dir) end
+      watch:check(function(dir, changes)
+        -- only the changed entries are updated when they are all known
+        local names = changes and {}
+        for _, change in ipairs(changes or {}) do
+          if not change.name then names = nil break end
+          table.insert(names, change.name)
+        end
+        index:refresh(dir, names)
+      end)
+      coroutine.yield(0.05)
+    end
+  end)
+end
+
+
+-- Stops indexing the project, saving the index when persisting it.
+function Project:close()
+  if not self.index then return end
+  local ok, err = self.index:close()
+  if ok == nil and err then
+    core.warn("cannot save the index of project %s: %s", self.path, err)
+  end
+  self.index = nil
+end
+
+
 
 return Project
@@ -47,7 +47,10 @@ local function push_tokens(t, syn, pattern, full_text, find_results)
   else
     local start, fin = find_results[1], find_results[2]
     local text = full_text:usub(start, fin)
-    push_token(t, syn.symbols[text] or pattern.type, text)
+    -- The end delimiter of a subsyntax can match without the position
+    -- captures its type table is meant for, so use the first type.
+    local type = type(pattern.type) == "table" and pattern.type[1] or pattern.type
+    push_token(t, syn.symbols[text] or type, text)
   end
 end
 
@@ -128,6 +131,27 @@ local function report_bad_pattern(log_fn, syntax, pattern_idx, msg, ...)
             syntax.name or "unnamed", ...)
 end
 
+-- Compiled native lexers, recompiled when new syntaxes are added as they
+-- could change how subsyntax names are resolved.
+local lexers = setmetatable({}, { __mode = "k" })
+
+local function report_native_bad_pattern(syntax, pattern_idx, level, msg, ...)
+  report_bad_pattern(core[level], syntax, pattern_idx, msg, ...)
+end
+
+---Get the native lexer compiled for a syntax, or nil if it can't be compiled.
+---@param syntax_def table
+---@return lexer?
+function tokenizer.get_lexer(syntax_def)
+  local compiled = lexers[syntax_def]
+  if not compiled or compiled.items ~= #syntax.items then
+    local ok, lex = pcall(lexer.new, syntax_def, syntax.get, report_native_bad_pattern)
+    compiled = { lexer = ok and lex, items = #syntax.items }
+    lexers[syntax_def] = compiled
+  end
+  return compiled.lexer
+end
+
 ---@param incoming_syntax table
 ---@param text string
 ---@param state string
@@ -141,6 +165,14 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
     return { "normal", text }, state
   end
 
+  -- The native lexer gives the same results much faster, the code below
+  -- is only used if it fails, like on invalid UTF-8 or unsupported captures.
+  local lex = tokenizer.get_lexer(incoming_syntax)
+  if lex then
+    local tokens, new_state, new_resume = lex:tokenize(text, state, resume, 0.5 / config.fps)
+    if tokens then return tokens, new_state, new_resume end
+  end
+
   if resume then
     res = resume.res
     -- Remove "incomplete" tokens
@@ -407,6 +439,9 @@ local function iter(t, i)
 end
 
 function tokenizer.each_token(t)
+  if type(t) == "userdata" then
+    return lexer.each_token(t)
+  end
   return iter, t, -1
 end
 
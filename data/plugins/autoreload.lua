@@ -130,8 +130,12 @@ end
 
 Doc.save = function(self, ...)
   local res = save(self, ...)
-  -- if starting with an unsaved document with a filename.
-  if not times[self] then watch:watch(self.abs_filename, true) end
+  -- if starting with an unsaved document with a filename, or if saving
+  -- replaced the watched file with a new one.
+  if not times[self] or visible[self] then
+    watch:unwatch(self.abs_filename)
+    watch:watch(self.abs_filename, true)
+  end
   update_time(self)
   return res
 end
@@ -17,20 +17,51 @@ config.plugins.findfile = common.merge({
   max_loop_time = 0.5 / config.fps
 }, config.plugins.findfile)
 
+-- how many suggestions are fetched at once from the fuzzy session
+local PAGE_SIZE = 100
+
+-- A list of the matches of the session, fetched a page at a time as they're
+-- accessed, after the recently visited files.
+local function suggestions_view(session, matches, recents)
+  return setmetatable({}, {
+    __len = function() return #recents + matches end,
+    __index = function(t, i)
+      if math.type(i) ~= "integer" or i < 1 or i > #recents + matches then return end
+      if i <= #recents then
+        rawset(t, i, { text = recents[i] })
+      else
+        local first = i - #recents - (i - #recents - 1) % PAGE_SIZE
+        for j, text in ipairs(session:get(first, first + PAGE_SIZE - 1)) do
+          rawset(t, #recents + first + j - 1, { text = text })
+        end
+      end
+      return rawget(t, i)
+    end
+  })
+end
+
 
 command.add(nil, {
   ["core:find-file"] = function()
-    local files, complete = {}, false
+    local files, complete = system.fuzzy_session(true), false
     local refresh = coroutine.wrap(function()
       local start, total = system.get_time(), 0
       for i, project in ipairs(core.projects) do
+        -- indexed projects are listed at once, without limits
+        local indexed = project:indexed_files(i == 1 and "" or common.home_encode(project.path) .. PATHSEP)
+        if complete then return end
+        if indexed then
+          files:add(indexed)
+          core.command_view:update_suggestions()
+          goto next_project
+        end
         for project, item in project:files() do
           if complete then return end
-          if #files > config.plugins.findfile.file_limit then 
+          if files:count() > config.plugins.findfile.file_limit then 
             core.command_view:update_suggestions() 
             return 
           end
-          table.insert(files, i == 1 and item.filename:sub(#project.path + 2) or common.home_encode(item.filename))
+          files:add(i == 1 and item.filename:sub(#project.path + 2) or common.home_encode(item.filename))
           local diff = system.get_time() - start
           if diff > config.plugins.findfile.max_loop_time then
             core.command_view:update_suggestions()
@@ -40,6 +71,7 @@ command.add(nil, {
             start = system.get_time()
           end
         end
+        ::next_project::
       end
     end)
 
@@ -52,7 +84,6 @@ command.add(nil, {
         end
       end)
     end
-    local original_files
     core.command_view:enter("Open File From Project", {
       submit = function(text, item)
         text = item and item.text or text
@@ -60,11 +91,15 @@ command.add(nil, {
         complete = true
       end,
       suggest = function(text)
-        if original_files and text == "" then 
-          return original_files
+        -- the session narrows down its previous matches as the text grows
+        local needle = PLATFORM == "Windows" and text:gsub('/', PATHSEP) or text
+        local recents = {}
+        if text == "" then
+          local visited = core.visited_files
+          table.move(visited, 2, #visited, 1, recents)
+          recents[#recents + 1] = visited[1]
         end
-        original_files = common.fuzzy_match_with_recents(files, core.visited_files, text)
-        return original_files
+        return suggestions_view(files, files:match(needle), recents)
       end,
       cancel = function()
         complete = true
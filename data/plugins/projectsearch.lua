@@ -1,6 +1,7 @@
 -- mod-version:4
 local core = require "core"
 local common = require "core.common"
+local config = require "core.config"
 local keymap = require "core.keymap"
 local command = require "core.command"
 local style = require "core.style"
@@ -50,7 +51,34 @@ local function find_all_matches_in_file(t, filename, fn)
 end
 
 
+-- Amount of matches added to the results by each poll of a native search.
+local POLL_LIMIT = 1000
+
+local function each_project_file(path, fn)
+  for k, project in ipairs(core.projects) do
+    local indexed = project:indexed_files(project.path .. PATHSEP)
+    local function visit(filename)
+      if not path or filename:find(path, 1, true) == 1 then fn(filename) end
+    end
+    if indexed then
+      for _, filename in ipairs(indexed) do visit(filename) end
+    else
+      for dir_name, file in project:files() do
+        if file.type == "file" then visit(file.filename) end
+      end
+    end
+  end
+end
+
+
+---Searches the project files, with a native `filesearch` when `fn` holds its
+---options, or by calling `fn` on each line to get the column of its match.
+---@param path string
+---@param text string
+---@param fn (fun(line_text:string):...)|{ regex?: boolean, insensitive?: boolean }
 function ResultsView:begin_search(path, text, fn)
+  if self.search then self.search:cancel() end
+  self.search = nil
   self.search_args = { path, text, fn }
   self.results = {}
   self.last_file_idx = 1
@@ -58,21 +86,41 @@ function ResultsView:begin_search(path, text, fn)
   self.searching = true
   self.selected_idx = 0
 
+  local results = self.results
   core.add_thread(function()
-    local i = 1
-    for k, project in ipairs(core.projects) do
-      for dir_name, file in project:files() do
-        if file.type == "file" and (not path or file.filename:find(path, 1, true) == 1) then
-          find_all_matches_in_file(self.results, file.filename, fn)
+    if type(fn) == "table" then
+      local files = {}
+      each_project_file(path, function(filename) table.insert(files, filename) end)
+      -- the search may have been started again while listing the files
+      if results ~= self.results then return end
+      local search, err = filesearch.new(files, text, fn)
+      if not search then
+        core.error("%s", err)
+      else
+        self.search = search
+        while self.search == search do
+          local matches, searched, searching = search:poll(POLL_LIMIT)
+          for _, match in ipairs(matches) do table.insert(results, match) end
+          self.last_file_idx = searched
+          core.redraw = true
+          if not searching then break end
+          coroutine.yield(#matches < POLL_LIMIT and 1 / config.fps or 0)
         end
+        if self.search ~= search then return end
+        self.search = nil
+      end
+    else
+      local i = 1
+      each_project_file(path, function(filename)
+        find_all_matches_in_file(results, filename, fn)
         self.last_file_idx = i
         i = i + 1
-      end
+      end)
     end
     self.searching = false
     self.brightness = 100
     core.redraw = true
-  end, self.results)
+  end, results)
 
   self.scroll.to.y = 0
 end
@@ -234,7 +282,7 @@ end
 
 ---@param path string
 ---@param text string
----@param fn fun(line_text:string):...
+---@param fn (fun(line_text:string):...)|{ regex?: boolean, insensitive?: boolean }
 ---@return plugins.projectsearch.resultsview?
 local function begin_search(path, text, fn)
   if text == "" then
@@ -267,13 +315,7 @@ projectsearch.ResultsView = ResultsView
 ---@return plugins.projectsearch.resultsview?
 function projectsearch.search_plain(text, path, insensitive)
   if insensitive then text = text:lower() end
-  return begin_search(path, text, function(line_text)
-    if insensitive then
-      return line_text:lower():find(text, nil, true)
-    else
-      return line_text:find(text, nil, true)
-    end
-  end)
+  return begin_search(path, text, { insensitive = insensitive })
 end
 
 ---@param text string
@@ -288,9 +330,7 @@ function projectsearch.search_regex(text, path, insensitive)
     re, errmsg = regex.compile(text)
   end
   if not re then core.log("%s", errmsg) return end
-  return begin_search(path, text, function(line_text)
-    return regex.cmatch(re, line_text)
-  end)
+  return begin_search(path, text, { regex = true, insensitive = insensitive })
 end
 
 ---@param text string
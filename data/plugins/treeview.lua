@@ -41,6 +41,11 @@ local function get_depth(filename)
 end
 
 
+local function compare_files(a, b)
+  return system.path_compare(a.name, a.type, b.name, b.type)
+end
+
+
 local function replace_alpha(color, alpha)
   local r, g, b = table.unpack(color)
   return { r, g, b, alpha }
@@ -112,28 +117,82 @@ function TreeView:get_cached(project, path)
   end
   if t.expanded and t.type == "dir" and not t.files then
     t.files = {}
-    for i, file in ipairs(system.list_dir(path)) do
-      local l = path .. PATHSEP .. file
-      local f
-      if self.show_ignored then
-        f = system.get_file_info(l)
-      else
-        f = project:get_file_info(l)
-      end
-      if f and f.type then
-        f.name = file
-        f.abs_filename = l
-        f.ignored = self.show_ignored and project:is_ignored(f, l)
+    -- the project index holds the same entries, once it listed the directory
+    local indexed = not self.show_ignored and project.index and project.index:list_dir(path)
+    if indexed then
+      for _, f in ipairs(indexed) do
+        f.abs_filename = path .. PATHSEP .. f.name
+        f.ignored = false
         table.insert(t.files, f)
+        self.cache[f.abs_filename] = nil
+      end
+    else
+      for i, file in ipairs(system.list_dir(path)) do
+        local f = self:get_file_entry(project, path, file)
+        if f then table.insert(t.files, f) end
+        self.cache[path .. PATHSEP .. file] = nil
       end
-      self.cache[l] = nil
     end
-    table.sort(t.files, function(a, b) return system.path_compare(a.name, a.type, b.name, b.type) end)
+    table.sort(t.files, compare_files)
   end
   return t
 end
 
 
+function TreeView:get_file_entry(project, directory, file)
+  local l = directory .. PATHSEP .. file
+  local f
+  if self.show_ignored then
+    f = system.get_file_info(l)
+  else
+    f = project:get_file_info(l)
+  end
+  if f and f.type then
+    f.name = file
+    f.abs_filename = l
+    f.ignored = self.show_ignored and project:is_ignored(f, l)
+    return f
+  end
+end
+
+
+-- Applies the changes reported for a directory to its cached listing, or
+-- drops the listing when the changed files aren't known.
+function TreeView:update_cached(directory, changes)
+  local t = self.cache[directory]
+  if not changes or not t or not t.files then
+    self.cache[directory] = nil
+    return
+  end
+  local names = {}
+  for _, change in ipairs(changes) do
+    if not change.name then
+      self.cache[directory] = nil
+      return
+    end
+    names[change.name] = true
+  end
+  for name in pairs(names) do
+    for i, f in ipairs(t.files) do
+      if f.name == name then
+        table.remove(t.files, i)
+        break
+      end
+    end
+    local f = self:get_file_entry(t.project, directory, name)
+    if f then
+      local lo, hi = 1, #t.files + 1
+      while lo < hi do
+        local mid = (lo + hi) // 2
+        if compare_files(t.files[mid], f) then lo = mid + 1 else hi = mid end
+      end
+      table.insert(t.files, lo, f)
+    end
+    self.cache[directory .. PATHSEP .. name] = nil
+  end
+end
+
+
 function TreeView:get_name()
   return nil
 end
@@ -562,8 +621,8 @@ end
 core.add_thread(function()
   while true do
     for k,v in pairs(view.watches) do
-      v:check(function(directory)
-        view.cache[directory] = nil
+      v:check(function(directory, changes)
+        view:update_cached(directory, changes)
       end)
     end
     coroutine.yield(0.01)
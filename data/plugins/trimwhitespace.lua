@@ -79,7 +79,7 @@ function trimwhitespace.trim_empty_end_lines(doc, raw_remove)
       if not raw_remove then
         doc:remove(l-1, math.huge, l, math.huge)
       else
-        table.remove(doc.lines, l)
+        doc.lines:remove(l - 1, #doc.lines[l - 1], l, 1)
       end
     else
       break
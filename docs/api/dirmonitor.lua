@@ -7,7 +7,15 @@
 ---@class dirmonitor
 dirmonitor = {}
 
----@alias dirmonitor.callback fun(fd_or_path:integer|string)
+---@alias dirmonitor.callback fun(fd_or_path:integer|string, changes?:dirmonitor.change[])
+
+---
+---A change to a file inside a monitored directory.
+---
+---The name is missing when the change is about the monitored path itself.
+---@class dirmonitor.change
+---@field name? string
+---@field kind "created"|"deleted"|"modified"|"moved_from"|"moved_to"
 
 ---
 ---Creates a new dirmonitor object.
@@ -45,6 +53,10 @@ function dirmonitor:unwatch(fd_or_path) end
 ---edited, removed or added. A file descriptor will be passed to the
 ---callback in "multiple" mode or a path in "single" mode.
 ---
+---The callback is called once per file descriptor or path, along with the
+---list of changes in the order they happened, or nil when the backend can't
+---tell what changed, or too many changes happened to report them all.
+---
 ---If an error occurred during the callback execution, the error callback will be called with the error object.
 ---This callback should not manipulate coroutines to avoid deadlocks.
 ---
@@ -0,0 +1,48 @@
+---@meta
+
+---
+---Search of text in a list of files, from a pool of worker threads.
+---
+---Files are read in chunks, and the matches of each file are handed over
+---once it is searched, in the order of the files.
+---@class filesearch
+filesearch = {}
+
+---
+---A match, with an excerpt of its line cut around it.
+---@class filesearch.match
+---@field file string
+---@field text string
+---@field line integer
+---@field col integer Byte offset of the match in the line, starting at 1.
+
+---
+---Starts searching the files for a text, reporting the first match of each line.
+---
+---Plain searches ignore the case of ASCII letters when `insensitive` is set,
+---regexes use the PCRE2 syntax.
+---
+---@param files string[] Paths of the files.
+---@param text string
+---@param options? { regex?: boolean, insensitive?: boolean }
+---
+---@return filesearch? search Nil if the regex failed to compile.
+---@return string? error
+function filesearch.new(files, text, options) end
+
+---
+---Get the matches found since the last poll.
+---
+---@param limit? integer Maximum amount of matches returned.
+---
+---@return filesearch.match[] matches
+---@return integer searched Number of files searched so far.
+---@return boolean searching False once every match was returned.
+function filesearch:poll(limit) end
+
+---
+---Stops searching. Matches of the files already searched can still be polled.
+function filesearch:cancel() end
+
+
+return filesearch
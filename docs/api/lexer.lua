@@ -0,0 +1,102 @@
+---@meta
+
+---
+---Native implementation of the syntax tokenizer.
+---
+---A lexer is compiled once from a syntax definition, as passed to
+---`syntax.add`, along with every subsyntax it references, and produces the
+---same tokens and states as `core.tokenizer`.
+---@class lexer
+lexer = {}
+
+---
+---Compiles a syntax definition.
+---
+---Patterns and symbols are copied, so changes to the syntax table
+---after compiling it are not seen by the lexer.
+---
+---@param syntax table
+---@param get_syntax fun(name: string): table Resolves subsyntax names into syntax definitions.
+---@param report? fun(syntax: table, pattern_idx: integer, level: "warn"|"error", msg: string, got: integer, needed: integer) Called once for every malformed pattern found while tokenizing.
+---
+---@return lexer
+function lexer.new(syntax, get_syntax, report) end
+
+---
+---Iterates packed tokens the same way as `tokenizer.each_token`.
+---
+---@param tokens lexer.tokens
+---
+---@return fun(tokens: lexer.tokens, i: integer): integer?, string, string
+---@return lexer.tokens
+---@return integer
+function lexer.each_token(tokens) end
+
+---
+---Tokenizes a line of text.
+---
+---If the time budget is spent, the remaining text is returned as an
+---`incomplete` token, along with a table that can be passed back to resume.
+---
+---@param text string
+---@param state? string The state returned for the previous line.
+---@param resume? table
+---@param budget? number Maximum time to spend in seconds, unlimited by default.
+---
+---@return string[]? tokens Alternating token types and texts, or nil if the text can't be tokenized.
+---@return string state_or_error
+---@return table? resume
+function lexer:tokenize(text, state, resume, budget) end
+
+---
+---Starts tokenizing lines of text from a worker thread.
+---
+---Lines are tokenized in order until the end of the text, or until a line
+---starts with the same state as its checkpoint, as the lines after it would
+---be tokenized the same as before. The job also stops at lines that can't
+---be tokenized by the lexer, which should be tokenized with `tokenize`.
+---
+---@param text string Lines of text, each one ending with a newline.
+---@param state? string The state of the line before the first one.
+---@param checkpoints? table<integer, string> States the lines, indexed from the first one, started with when last tokenized.
+---
+---@return lexer.job
+function lexer:highlight(text, state, checkpoints) end
+
+---
+---Packs the tokens of a line, as returned by `tokenize`.
+---
+---@param tokens string[]
+---@param text string The line the tokens were taken from.
+---
+---@return lexer.tokens? tokens Nil if the tokens don't cover the text or use types unknown to the lexer.
+function lexer:pack(tokens, text) end
+
+
+---
+---Tokens of a line stored as offsets into its text, which can be read like
+---the alternating types and texts returned by `tokenize`, but not modified.
+---@class lexer.tokens
+---@operator len: integer
+---@field [integer] string
+local tokens = {}
+
+
+---
+---A running job started by `lexer:highlight`.
+---@class lexer.job
+local job = {}
+
+---
+---Get the lines tokenized since the last poll, without blocking.
+---
+---@return { text: string, tokens: lexer.tokens, state: string }[] lines
+---@return "done"|"converged"|"stopped"|nil status Why the job ended, or nil if it's still running.
+function job:poll() end
+
+---
+---Stops the job, the lines it already tokenized can still be polled.
+function job:cancel() end
+
+
+return lexer
@@ -0,0 +1,137 @@
+---@meta
+
+---
+---Text buffer that stores a document as pieces of immutable byte buffers,
+---kept in a balanced tree indexed by byte and line count, so that edits,
+---line lookups and substring extraction run in logarithmic time.
+---
+---Lines can be read by indexing the piece table with a line number, the
+---same way as a table of strings, and `#piecetable` returns the amount of
+---lines. Every line but the last one includes its trailing newline.
+---
+---Positions are given as 1-based line and byte column pairs, and are
+---clamped to the document contents the same way `Doc:sanitize_position`
+---does.
+---@class piecetable
+---@operator len: integer
+---@field [integer] string
+piecetable = {}
+
+---
+---Creates a new piece table.
+---
+---@param text? string Initial contents.
+---
+---@return piecetable
+function piecetable.new(text) end
+
+---
+---Loads a file into a new piece table.
+---
+---Lines ending in CRLF are converted to LF, and a newline is appended
+---if the file doesn't end with one.
+---
+---@param path string
+---
+---@return piecetable? piecetable
+---@return boolean|string crlf_or_error Whether the file used CRLF line endings, or the error message.
+function piecetable.load(path) end
+
+---
+---Inserts text at the given position.
+---
+---@param line integer
+---@param col integer
+---@param text string
+---
+---@return integer newlines Amount of newlines inserted.
+---@return integer tail Length in bytes of the text after the last inserted newline.
+function piecetable:insert(line, col, text) end
+
+---
+---Removes the text between two positions, the end position not included.
+---
+---@param line1 integer
+---@param col1 integer
+---@param line2 integer
+---@param col2 integer
+---
+---@return integer lines Amount of lines removed.
+function piecetable:remove(line1, col1, line2, col2) end
+
+---
+---Get the text between two positions, or the whole contents
+---if no positions are given.
+---
+---@param line1? integer
+---@param col1? integer
+---@param line2? integer
+---@param col2? integer
+---@param inclusive? boolean Include the character at the end position.
+---
+---@return string
+function piecetable:get_text(line1, col1, line2, col2, inclusive) end
+
+---
+---Get the contents of a line, including its newline.
+---
+---@param line integer
+---
+---@return string?
+function piecetable:get_line(line) end
+
+---
+---Get the size of the contents in bytes.
+---
+---@return integer
+function piecetable:get_size() end
+
+---
+---Starts saving the contents to a file from a worker thread.
+---
+---The contents are snapshotted when called, so the piece table can keep
+---being edited while saving. They are written to a temporary file in the
+---same directory, which is synced and then renamed over the target, keeping
+---its permissions and writing through symlinks. If the temporary file can't
+---be created, or the target has hard links, the file is written in place.
+---
+---A "docsaved" event is sent by `system.poll_event` once the job is done.
+---
+---@param path string
+---@param crlf? boolean Write newlines as CRLF.
+---
+---@return piecetable.savejob
+function piecetable:save(path, crlf) end
+
+---
+---Moves a position by the given amount of bytes, crossing lines as needed.
+---
+---@param line integer
+---@param col integer
+---@param offset integer
+---
+---@return integer line
+---@return integer col
+function piecetable:position_offset(line, col, offset) end
+
+
+---
+---A running save started by `piecetable:save`.
+---@class piecetable.savejob
+local savejob = {}
+
+---
+---Check if the job has finished, without blocking.
+---
+---@return boolean
+function savejob:done() end
+
+---
+---Waits for the job to finish.
+---
+---@return boolean? saved
+---@return string? error
+function savejob:wait() end
+
+
+return piecetable
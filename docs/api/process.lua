@@ -147,8 +147,6 @@ function process:pid() end
 ---@param len? integer Amount of bytes to read, defaults to 2048.
 ---
 ---@return string | nil
----@return string errmsg
----@return process.errortype | integer errcode
 function process:read(stream, len) end
 
 ---
@@ -158,8 +156,6 @@ function process:read(stream, len) end
 ---@param len? integer Amount of bytes to read, defaults to 2048.
 ---
 ---@return string | nil
----@return string errmsg
----@return process.errortype | integer errcode
 function process:read_stdout(len) end
 
 ---
@@ -169,10 +165,18 @@ function process:read_stdout(len) end
 ---@param len? integer Amount of bytes to read, defaults to 2048.
 ---
 ---@return string | nil
----@return string errmsg
----@return process.errortype | integer errcode
 function process:read_stderr(len) end
 
+---
+---Tells whether a `processready` event is sent once there is more to read
+---from the given stream, or once the process exits when no stream is given,
+---so that readers can wait for it instead of polling.
+---
+---@param stream? process.streamtype
+---
+---@return boolean
+function process:ready_event(stream) end
+
 ---
 ---Write to the stdin, if the process fails with a ERROR_PIPE it is
 ---automatically destroyed returning nil along error message and code.
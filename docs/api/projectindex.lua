@@ -0,0 +1,88 @@
+---@meta
+
+---
+---Index of the files of a project, built and updated from a worker thread.
+---
+---The index lists every file and directory under its root that isn't
+---ignored, and is kept up to date by refreshing the directories reported
+---as changed, usually by a `dirmonitor`.
+---@class projectindex
+projectindex = {}
+
+---
+---A filter as compiled by `core.project`.
+---@class projectindex.filter
+---@field pattern string Lua pattern matched against the name, or the path if `use_path` is set.
+---@field use_path? boolean
+---@field match_dir? boolean Only match directories, with a trailing forward slash.
+
+---
+---Starts indexing a directory.
+---
+---If the cache file was saved by `close` for the same root and filters, the
+---index is loaded from it, and every directory is checked for changes.
+---
+---Fails if a pattern could raise an error when matched, like with an
+---unfinished capture, as the index would then disagree with `string.match`.
+---
+---@param root string Absolute path of the directory to index.
+---@param filters projectindex.filter[]
+---@param size_limit? number Files of this size or bigger are ignored.
+---@param cache_path? string File the index is loaded from and saved to.
+---
+---@return projectindex
+function projectindex.new(root, filters, size_limit, cache_path) end
+
+---
+---Queues a directory to be listed again.
+---
+---@param path string Absolute path of the directory.
+---@param names? string[] Update only these entries of the directory, instead of listing it all.
+function projectindex:refresh(path, names) end
+
+---
+---Get the directories indexed and removed since the last poll, to be watched
+---for changes.
+---
+---Returns nil and an error if matching a filter failed, in which case the
+---index should be closed, as some entries may be missing.
+---
+---@return string[]? added Absolute paths of the directories.
+---@return string[]|string removed
+---@return boolean? scanning
+function projectindex:poll() end
+
+---
+---Check if there are directories left to list.
+---
+---@return boolean
+function projectindex:is_scanning() end
+
+---
+---Get the paths of every indexed file, relative to the root.
+---
+---@param prefix? string Prepended to every path.
+---@param details? boolean Return the files as records, with their size and modification time.
+---
+---@return string[]|{ filename: string, type: "file", size: integer, modified: number }[] files
+---@return boolean scanning
+function projectindex:files(prefix, details) end
+
+---
+---Get the indexed entries of a directory.
+---
+---@param path string Absolute path of the directory.
+---
+---@return { name: string, type: "file"|"dir", size: integer, modified: number }[]? entries Nil if the directory wasn't listed yet.
+function projectindex:list_dir(path) end
+
+---
+---Stops indexing, saving the index to its cache file if it has one and no
+---filter failed.
+---
+---@return boolean? ok
+---@return string? error
+function projectindex:close() end
+
+
+return projectindex
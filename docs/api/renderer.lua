@@ -100,6 +100,30 @@ function renderer.font:set_size(size) end
 ---@return string | table<integer, string>
 function renderer.font:get_path() end
 
+---
+---Get the memory in bytes used by the glyphs cached by the font, or an array
+---of them if a group font.
+---
+---@return integer | table<integer, integer>
+function renderer.font:get_bytesize() end
+
+---
+---Set the memory in bytes the font can cache glyphs in, 16MB by default.
+---Past it, the pages of glyphs used the longest ago are freed and rendered
+---again when needed; glyphs used by the current frame are always kept.
+---
+---@param budget integer
+function renderer.font:set_atlas_budget(budget) end
+
+---
+---Render the glyphs of a range of codepoints from a background thread, so
+---that they are ready when first drawn. Glyphs drawn before being rendered
+---show as a faint box until the "glyphsloaded" event.
+---
+---@param first? integer Defaults to 0x20.
+---@param last? integer Defaults to 0xFF, the end of Latin-1.
+function renderer.font:prewarm(first, last) end
+
 ---
 ---Toggles drawing debugging rectangles on the currently rendered sections
 ---of the window to help troubleshoot the renderer.
@@ -107,6 +131,40 @@ function renderer.font:get_path() end
 ---@param enable boolean
 function renderer.show_debug(enable) end
 
+---
+---Toggles checking the sections of the window that weren't rendered again
+---against a full render of the frame, to find the ones wrongly kept from a
+---previous frame. Debugging rectangles aren't drawn while checking.
+---
+---@param enable boolean
+---
+---@return integer checked Number of cells checked since the last call.
+---@return integer stale Number of those found out of date.
+function renderer.validate_cache(enable) end
+
+---
+---Set how the frames drawn by the SDL renderer reach its texture. This has no
+---effect unless Lite XL is built with the `renderer` option.
+---
+---* "rects" - Upload each updated region of the frame on its own. This is
+---  the default.
+---* "batched" - Lock the box around the updated regions once per frame and
+---  copy all of it to the texture. Regions far apart are uploaded on their
+---  own instead.
+---
+---@param mode "rects"|"batched"
+function renderer.set_upload_mode(mode) end
+
+---
+---Get the usage of the cache of measured texts, shared by all fonts.
+---
+---`hits` and `misses` count the texts measured, either by
+---`renderer.font:get_width` or before drawing them, while `draw_hits` and
+---`draw_misses` count the texts drawn. The counters are reset once read.
+---
+---@return { runs: integer, hits: integer, misses: integer, draw_hits: integer, draw_misses: integer }
+function renderer.get_text_run_stats() end
+
 ---
 ---Get the size of the screen area been rendered.
 ---
@@ -31,6 +31,7 @@ system = {}
 --- * "maximized"
 --- * "restored"
 --- * "focuslost"
+--- * "glyphsloaded"
 ---
 ---File events:
 --- * "filedropped" -> filename, x, y
@@ -52,6 +53,10 @@ system = {}
 --- * "touchreleased" -> x, y, finger_id
 --- * "touchmoved" -> x, y, distance_x, distance_y, finger_id
 ---
+---Background job events:
+--- * "processready"
+--- * "docsaved"
+---
 ---@return string type
 ---@return any? arg1
 ---@return any? arg2
@@ -336,6 +341,69 @@ function system.exec(command) end
 ---@return integer score
 function system.fuzzy_match(haystack, needle, file) end
 
+---
+---Scores every string of a list like `system.fuzzy_match`, and returns
+---the best matching ones, sorted by descending score and then by text.
+---Items that aren't strings are converted like `tostring`.
+---
+---Nothing is remembered between calls, use `system.fuzzy_session` to
+---match a list incrementally as the needle is typed.
+---
+---@param items string[]
+---@param needle string
+---@param file? boolean Same as in `system.fuzzy_match`.
+---@param limit? integer The maximum amount of items returned.
+---
+---@return string[] matches
+function system.fuzzy_match_list(items, needle, file, limit) end
+
+---
+---A list of strings matched against a needle as it's typed, narrowing
+---down the previous matches when the needle grows and getting back to
+---them when it shrinks.
+---@class system.fuzzy_session
+local fuzzy_session = {}
+
+---
+---Appends strings to the candidates, they are matched on the next call
+---to `fuzzy_session:match`.
+---
+---@param items string|string[]
+---@param first? integer Index of the first item of the list to append.
+---
+---@return integer count The number of candidates.
+function fuzzy_session:add(items, first) end
+
+---
+---@return integer count The number of candidates.
+function fuzzy_session:count() end
+
+---
+---Matches the candidates against a needle, like `system.fuzzy_match`.
+---
+---@param needle string
+---
+---@return integer matches The number of matching candidates.
+function fuzzy_session:match(needle) end
+
+---
+---Get a range of the matches of the last needle, sorted by descending
+---score and then by text. Only the matches up to `last` are ranked.
+---
+---@param first integer
+---@param last integer
+---
+---@return string[] matches
+function fuzzy_session:get(first, last) end
+
+---
+---Creates an empty fuzzy session.
+---
+---@param file? boolean Same as in `system.fuzzy_match`.
+---
+---@return system.fuzzy_session
+function system.fuzzy_session(file) end
+
 ---
 ---Change the opacity (also known as transparency) of the window.
 ---
@@ -7,15 +7,23 @@ int luaopen_regex(lua_State *L);
 int luaopen_process(lua_State *L);
 int luaopen_dirmonitor(lua_State* L);
 int luaopen_utf8extra(lua_State* L);
+int luaopen_piecetable(lua_State* L);
+int luaopen_lexer(lua_State* L);
+int luaopen_projectindex(lua_State* L);
+int luaopen_filesearch(lua_State* L);
 
 static const luaL_Reg libs[] = {
-  { "system",     luaopen_system     },
-  { "renderer",   luaopen_renderer   },
-  { "renwindow",  luaopen_renwindow  },
-  { "regex",      luaopen_regex      },
-  { "process",    luaopen_process    },
-  { "dirmonitor", luaopen_dirmonitor },
-  { "utf8extra",  luaopen_utf8extra  },
+  { "system",       luaopen_system       },
+  { "renderer",     luaopen_renderer     },
+  { "renwindow",    luaopen_renwindow    },
+  { "regex",        luaopen_regex        },
+  { "process",      luaopen_process      },
+  { "dirmonitor",   luaopen_dirmonitor   },
+  { "utf8extra",    luaopen_utf8extra    },
+  { "piecetable",   luaopen_piecetable   },
+  { "lexer",        luaopen_lexer        },
+  { "projectindex", luaopen_projectindex },
+  { "filesearch",   luaopen_filesearch   },
   { NULL, NULL }
 };
 
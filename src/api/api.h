@@ -1,6 +1,7 @@
 #ifndef API_H
 #define API_H
 
+#include <stdint.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -10,9 +11,19 @@
 #define API_TYPE_DIRMONITOR "Dirmonitor"
 #define API_TYPE_NATIVE_PLUGIN "NativePlugin"
 #define API_TYPE_RENWINDOW "RenWindow"
+#define API_TYPE_PIECETABLE "PieceTable"
+#define API_TYPE_PIECETABLE_SAVE "PieceTableSave"
+#define API_TYPE_LEXER "Lexer"
+#define API_TYPE_LEXER_JOB "LexerJob"
+#define API_TYPE_LEXER_TOKENS "LexerTokens"
+#define API_TYPE_PROJECT_INDEX "ProjectIndex"
+#define API_TYPE_FILE_SEARCH "FileSearch"
+#define API_TYPE_FUZZY_SESSION "FuzzySession"
 
 #define API_CONSTANT_DEFINE(L, idx, key, n) (lua_pushnumber(L, n), lua_setfield(L, idx - 1, key))
 
 void api_load_libs(lua_State *L);
+uint32_t process_get_ready_event(void);
+uint32_t piecetable_get_save_event(void);
 
 #endif
@@ -1,71 +1,101 @@
 #include "api.h"
+#include "dirmonitor.h"
 #include "lua.h"
 #include <SDL3/SDL.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+// Milliseconds to wait before asking the backend again when it returned no changes.
+#define DIRMONITOR_RETRY_DELAY 50
+// Changes kept for a watch in a single check, past which only the watch is reported.
+#define DIRMONITOR_MAX_CHANGES 1024
+
 static unsigned int DIR_EVENT_TYPE = 0;
 
 struct dirmonitor {
   SDL_Thread* thread;
   SDL_Mutex* mutex;
+  // signaled when the buffered changes are consumed, or on shutdown
+  SDL_Condition* condition;
   char buffer[64512];
   volatile int length;
   struct dirmonitor_internal* internal;
 };
 
 
-struct dirmonitor_internal* init_dirmonitor();
-void deinit_dirmonitor(struct dirmonitor_internal*);
-int get_changes_dirmonitor(struct dirmonitor_internal*, char*, int);
-int translate_changes_dirmonitor(struct dirmonitor_internal*, char*, int, int (*)(int, const char*, void*), void*);
-int add_dirmonitor(struct dirmonitor_internal*, const char*);
-void remove_dirmonitor(struct dirmonitor_internal*, int);
-int get_mode_dirmonitor();
-
-
-static int f_check_dir_callback(int watch_id, const char* path, void* L) {
-  // using absolute indices from f_dirmonitor_check (2: callback, 3: error_callback, 4: watch_id notified table)
+static const char* change_kinds[] = { "unknown", "created", "deleted", "modified", "moved_from", "moved_to" };
 
-  // Check if we already notified about this watch
-  lua_rawgeti(L, 4, watch_id);
-  bool skip = !lua_isnoneornil(L, -1);
-  lua_pop(L, 1);
-  if (skip) return 0;
 
-  // Set watch as notified
-  lua_pushboolean(L, true);
-  lua_rawseti(L, 4, watch_id);
-
-  // Prepare callback call
-  lua_pushvalue(L, 2);
+static int f_check_dir_callback(int watch_id, const char* path, const char* name, int kind, void* data) {
+  // using absolute indices from f_dirmonitor_check (4: changes by watch, 5: watches in notify order)
+  lua_State* L = data;
   if (path)
     lua_pushlstring(L, path, watch_id);
   else
     lua_pushnumber(L, watch_id);
 
-  int result = 0;
-  if (lua_pcall(L, 1, 1, 3) == LUA_OK)
-    result = lua_toboolean(L, -1);
-  lua_pop(L, 1);
-  return !result;
+  lua_pushvalue(L, -1);
+  lua_rawget(L, 4);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 5, lua_rawlen(L, 5) + 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 4);
+  }
+
+  // records without a name or a kind only tell that the watch changed
+  if (lua_istable(L, -1) && (name || kind != DIRMONITOR_CHANGE_UNKNOWN)) {
+    lua_Integer count = lua_rawlen(L, -1);
+    if (count >= DIRMONITOR_MAX_CHANGES) {
+      lua_pushvalue(L, -2);
+      lua_pushboolean(L, 0);
+      lua_rawset(L, 4);
+    } else {
+      lua_createtable(L, 0, 2);
+      if (name) {
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+      }
+      lua_pushstring(L, change_kinds[kind]);
+      lua_setfield(L, -2, "kind");
+      lua_rawseti(L, -2, count + 1);
+    }
+  }
+  lua_pop(L, 2);
+  return 0;
 }
 
 
+// Blocks on the backend until there are changes, and then until they are
+// consumed by check before reading again. Changes arriving meanwhile are
+// queued by the backend and read at once, so a burst wakes the main loop
+// only once per check.
 static int dirmonitor_check_thread(void* data) {
   struct dirmonitor* monitor = data;
-  while (monitor->length >= 0) {
-    if (monitor->length == 0) {
-      int result = get_changes_dirmonitor(monitor->internal, monitor->buffer, sizeof(monitor->buffer));
-      SDL_LockMutex(monitor->mutex);
-      if (monitor->length == 0)
-        monitor->length = result;
-      SDL_UnlockMutex(monitor->mutex);
+  while (true) {
+    SDL_LockMutex(monitor->mutex);
+    while (monitor->length > 0)
+      SDL_WaitCondition(monitor->condition, monitor->mutex);
+    bool running = monitor->length == 0;
+    SDL_UnlockMutex(monitor->mutex);
+    if (!running) break;
+
+    int result = get_changes_dirmonitor(monitor->internal, monitor->buffer, sizeof(monitor->buffer));
+    SDL_LockMutex(monitor->mutex);
+    if (monitor->length == 0)
+      monitor->length = result;
+    SDL_UnlockMutex(monitor->mutex);
+    if (result > 0) {
+      SDL_Event event = { .type = DIR_EVENT_TYPE };
+      SDL_PushEvent(&event);
+    } else if (result == 0) {
+      // backends can return without changes on timeouts, don't spin on them
+      SDL_Delay(DIRMONITOR_RETRY_DELAY);
     }
-    SDL_Delay(1);
-    SDL_Event event = { .type = DIR_EVENT_TYPE };
-    SDL_PushEvent(&event);
   }
   return 0;
 }
@@ -78,6 +108,7 @@ static int f_dirmonitor_new(lua_State* L) {
   luaL_setmetatable(L, API_TYPE_DIRMONITOR);
   memset(monitor, 0, sizeof(struct dirmonitor));
   monitor->mutex = SDL_CreateMutex();
+  monitor->condition = SDL_CreateCondition();
   monitor->internal = init_dirmonitor();
   return 1;
 }
@@ -87,10 +118,12 @@ static int f_dirmonitor_gc(lua_State* L) {
   struct dirmonitor* monitor = luaL_checkudata(L, 1, API_TYPE_DIRMONITOR);
   SDL_LockMutex(monitor->mutex);
   monitor->length = -1;
+  SDL_SignalCondition(monitor->condition);
   deinit_dirmonitor(monitor->internal);
   SDL_UnlockMutex(monitor->mutex);
   SDL_WaitThread(monitor->thread, NULL);
   SDL_free(monitor->internal);
+  SDL_DestroyCondition(monitor->condition);
   SDL_DestroyMutex(monitor->mutex);
   return 0;
 }
@@ -125,19 +158,40 @@ static int f_dirmonitor_check(lua_State* L) {
   }
   lua_settop(L, 3);
 
+  // Changes are collected per watch before calling back, so that every watch
+  // is notified once, and without holding the lock.
+  lua_newtable(L);
+  lua_newtable(L);
   SDL_LockMutex(monitor->mutex);
-  if (monitor->length < 0)
-    lua_pushnil(L);
-  else if (monitor->length > 0) {
-    // Create a table for keeping track of what watch ids were notified in this check,
-    // so that we avoid notifying multiple times.
-    lua_newtable(L);
-    if (translate_changes_dirmonitor(monitor->internal, monitor->buffer, monitor->length, f_check_dir_callback, L) == 0)
-      monitor->length = 0;
-    lua_pushboolean(L, 1);
-  } else
-    lua_pushboolean(L, 0);
+  int length = monitor->length;
   SDL_UnlockMutex(monitor->mutex);
+  // The thread leaves the buffer alone until its changes are consumed, so it
+  // can be translated unlocked; a Lua error raised by the callback must not
+  // leave the mutex held.
+  if (length > 0 && translate_changes_dirmonitor(monitor->internal, monitor->buffer, length, f_check_dir_callback, L) == 0) {
+    SDL_LockMutex(monitor->mutex);
+    monitor->length = 0;
+    SDL_SignalCondition(monitor->condition);
+    SDL_UnlockMutex(monitor->mutex);
+  }
+
+  if (length < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  for (lua_Integer i = 1, n = lua_rawlen(L, 5); i <= n; ++i) {
+    lua_pushvalue(L, 2);
+    lua_rawgeti(L, 5, i);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, 4);
+    if (!lua_istable(L, -1) || lua_rawlen(L, -1) == 0) {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+    }
+    if (lua_pcall(L, 2, 0, 3) != LUA_OK)
+      lua_pop(L, 1);
+  }
+  lua_pushboolean(L, length > 0);
   return 1;
 }
 
@@ -0,0 +1,37 @@
+#ifndef DIRMONITOR_H
+#define DIRMONITOR_H
+
+// Interface implemented by each of the backends in api/dirmonitor.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  DIRMONITOR_CHANGE_UNKNOWN,
+  DIRMONITOR_CHANGE_CREATED,
+  DIRMONITOR_CHANGE_DELETED,
+  DIRMONITOR_CHANGE_MODIFIED,
+  DIRMONITOR_CHANGE_MOVED_FROM,
+  DIRMONITOR_CHANGE_MOVED_TO,
+};
+
+// Called for every change, with the id of the watch that changed, or in
+// single mode the changed path and its length. The name is the file that
+// changed inside the watched directory, or NULL for the watched path itself
+// or when the backend doesn't tell.
+typedef int (*dirmonitor_callback)(int watch_id, const char* path, const char* name, int kind, void* data);
+
+struct dirmonitor_internal* init_dirmonitor();
+void deinit_dirmonitor(struct dirmonitor_internal*);
+int get_changes_dirmonitor(struct dirmonitor_internal*, char*, int);
+int translate_changes_dirmonitor(struct dirmonitor_internal*, char*, int, dirmonitor_callback, void*);
+int add_dirmonitor(struct dirmonitor_internal*, const char*);
+void remove_dirmonitor(struct dirmonitor_internal*, int);
+int get_mode_dirmonitor();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,15 +8,7 @@
 #include <fcntl.h>
 #include <poll.h>
 
-extern "C" {
-struct dirmonitor_internal* init_dirmonitor();
-void deinit_dirmonitor(struct dirmonitor_internal*);
-int get_changes_dirmonitor(struct dirmonitor_internal*, char*, int);
-int translate_changes_dirmonitor(struct dirmonitor_internal*, char*, int, int (*)(int, const char*, void*), void*);
-int add_dirmonitor(struct dirmonitor_internal*, const char*);
-void remove_dirmonitor(struct dirmonitor_internal*, int);
-int get_mode_dirmonitor();
-}
+#include "../dirmonitor.h"
 
 struct dirmonitor_internal {
   int fd;
@@ -50,9 +42,9 @@ int get_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, in
 }
 
 
-int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int length, int (*change_callback)(int, const char*, void*), void* data) {
+int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int length, dirmonitor_callback change_callback, void* data) {
   InodeWatcherEvent* event = (InodeWatcherEvent*)buffer;
-  change_callback(event->watch_descriptor, NULL, data);
+  change_callback(event->watch_descriptor, NULL, NULL, DIRMONITOR_CHANGE_UNKNOWN, data);
   return 0;
 }
 
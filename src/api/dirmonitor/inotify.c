@@ -1,3 +1,4 @@
+#include "../dirmonitor.h"
 #include <SDL3/SDL.h>
 #include <sys/inotify.h>
 #include <stdlib.h>
@@ -37,10 +38,21 @@ int get_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, in
 }
 
 
-int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int length, int (*change_callback)(int, const char*, void*), void* data) {
-  for (struct inotify_event* info = (struct inotify_event*)buffer; (char*)info < buffer + length; info = (struct inotify_event*)((char*)info + sizeof(struct inotify_event))) {
+static int change_kind(uint32_t mask) {
+  if (mask & IN_CREATE) return DIRMONITOR_CHANGE_CREATED;
+  if (mask & IN_DELETE) return DIRMONITOR_CHANGE_DELETED;
+  if (mask & IN_MODIFY) return DIRMONITOR_CHANGE_MODIFIED;
+  if (mask & IN_MOVED_FROM) return DIRMONITOR_CHANGE_MOVED_FROM;
+  if (mask & IN_MOVED_TO) return DIRMONITOR_CHANGE_MOVED_TO;
+  return DIRMONITOR_CHANGE_UNKNOWN;
+}
+
+
+int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int length, dirmonitor_callback change_callback, void* data) {
+  // records are followed by a padded name of info->len bytes
+  for (struct inotify_event* info = (struct inotify_event*)buffer; (char*)info < buffer + length; info = (struct inotify_event*)((char*)info + sizeof(struct inotify_event) + info->len)) {
     if ((info->mask & (~IN_IGNORED)) > 0)
-      change_callback(info->wd, NULL, data);
+      change_callback(info->wd, NULL, info->len > 0 ? info->name : NULL, change_kind(info->mask), data);
   }
   return 0;
 }
@@ -1,3 +1,4 @@
+#include "../dirmonitor.h"
 #include <SDL3/SDL.h>
 #include <sys/event.h>
 #include <sys/stat.h>
@@ -36,9 +37,16 @@ int get_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, in
 }
 
 
-int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int buffer_size, int (*change_callback)(int, const char*, void*), void* data) {
-  for (struct kevent* info = (struct kevent*)buffer; (char*)info < buffer + buffer_size; info = (struct kevent*)(((char*)info) + sizeof(kevent)))
-    change_callback(info->ident, NULL, data);
+int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int buffer_size, dirmonitor_callback change_callback, void* data) {
+  for (struct kevent* info = (struct kevent*)buffer; (char*)info < buffer + buffer_size; info = (struct kevent*)(((char*)info) + sizeof(kevent))) {
+    // vnode events are about the watched path itself, file names aren't known
+    int kind = DIRMONITOR_CHANGE_MODIFIED;
+    if (info->fflags & NOTE_DELETE)
+      kind = DIRMONITOR_CHANGE_DELETED;
+    else if (info->fflags & NOTE_RENAME)
+      kind = DIRMONITOR_CHANGE_MOVED_FROM;
+    change_callback(info->ident, NULL, NULL, kind, data);
+  }
   return 0;
 }
 
@@ -1,3 +1,4 @@
+#include "../dirmonitor.h"
 #include <SDL3/SDL.h>
 #include <windows.h>
 
@@ -39,11 +40,23 @@ void deinit_dirmonitor(struct dirmonitor_internal* monitor) {
 }
 
 
-int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int buffer_size, int (*change_callback)(int, const char*, void*), void* data) {
+static int change_kind(DWORD action) {
+  switch (action) {
+    case FILE_ACTION_ADDED: return DIRMONITOR_CHANGE_CREATED;
+    case FILE_ACTION_REMOVED: return DIRMONITOR_CHANGE_DELETED;
+    case FILE_ACTION_MODIFIED: return DIRMONITOR_CHANGE_MODIFIED;
+    case FILE_ACTION_RENAMED_OLD_NAME: return DIRMONITOR_CHANGE_MOVED_FROM;
+    case FILE_ACTION_RENAMED_NEW_NAME: return DIRMONITOR_CHANGE_MOVED_TO;
+  }
+  return DIRMONITOR_CHANGE_UNKNOWN;
+}
+
+
+int translate_changes_dirmonitor(struct dirmonitor_internal* monitor, char* buffer, int buffer_size, dirmonitor_callback change_callback, void* data) {
   for (FILE_NOTIFY_INFORMATION* info = (FILE_NOTIFY_INFORMATION*)buffer; (char*)info < buffer + buffer_size; info = (FILE_NOTIFY_INFORMATION*)(((char*)info) + info->NextEntryOffset)) {
     char transform_buffer[MAX_PATH*4];
     int count = WideCharToMultiByte(CP_UTF8, 0, (WCHAR*)info->FileName, info->FileNameLength / 2, transform_buffer, MAX_PATH*4 - 1, NULL, NULL);
-    change_callback(count, transform_buffer, data);
+    change_callback(count, transform_buffer, NULL, change_kind(info->Action), data);
     if (!info->NextEntryOffset)
       break;
   }
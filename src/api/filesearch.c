@@ -0,0 +1,431 @@
+#include "api.h"
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+
+#include <SDL3/SDL.h>
+#include <pcre2.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Amount of files searched between wakes of the main loop.
+#define SEARCH_WAKE_INTERVAL 64
+// Maximum amount of workers searching files at the same time.
+#define SEARCH_MAX_WORKERS 8
+// Size of the chunks files are read by, grown for lines longer than this.
+#define SEARCH_CHUNK_SIZE (1 << 20)
+// Excerpts of the matching lines start this many bytes before the match,
+// and are cut after as many more as the excerpt length.
+#define SEARCH_EXCERPT_BEFORE 80
+#define SEARCH_EXCERPT_LENGTH 256
+
+typedef struct {
+  size_t line, col;
+  // excerpt of the line in the text of the file
+  size_t text_offset, text_length;
+} search_match_t;
+
+typedef struct {
+  search_match_t* matches;
+  size_t count, capacity;
+  char* text;
+  size_t text_length, text_capacity;
+} search_results_t;
+
+typedef struct {
+  char* path;
+  // owned by the worker until done is set, then by the main thread
+  search_results_t results;
+  SDL_AtomicInt done;
+} search_file_t;
+
+typedef struct search_job_t search_job_t;
+
+typedef struct {
+  SDL_Thread* thread;
+  search_job_t* job;
+  char* buffer;
+  char* lowered;
+  size_t capacity;
+  pcre2_match_data* match_data;
+} search_worker_t;
+
+// A job searches a list of files from a pool of workers, which take the
+// files in turn and hand over the matches of each one as a whole. Matches
+// are read by the main thread in the order of the files, as soon as all the
+// files before them are searched.
+struct search_job_t {
+  search_worker_t workers[SEARCH_MAX_WORKERS];
+  int worker_count;
+  search_file_t* files;
+  size_t file_count;
+  char* needle;
+  size_t needle_length;
+  bool insensitive;
+  pcre2_code* re;
+  SDL_AtomicInt next_file, searched, running, cancelled;
+  // next match to be read by the main thread
+  size_t read_file, read_match;
+  bool finished;
+};
+
+static unsigned int SEARCH_EVENT_TYPE = 0;
+
+
+static bool search_grow(void** data, size_t* capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  while (new_capacity < needed) new_capacity *= 2;
+  void* new_data = SDL_realloc(*data, new_capacity * size);
+  if (!new_data) return false;
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+static void search_results_free(search_results_t* results) {
+  SDL_free(results->matches);
+  SDL_free(results->text);
+  memset(results, 0, sizeof(search_results_t));
+}
+
+
+static inline char search_lower(char c) {
+  return (unsigned char)(c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+
+// Finds the needle with memchr on its first byte, which is vectorized by
+// the C library, checking the rest of the needle at each candidate.
+static const char* search_find(const char* text, size_t length, const char* needle, size_t needle_length) {
+  const char* end = text + length;
+  while ((size_t)(end - text) >= needle_length) {
+    const char* candidate = memchr(text, needle[0], (end - text) - needle_length + 1);
+    if (!candidate) return NULL;
+    if (memcmp(candidate + 1, needle + 1, needle_length - 1) == 0) return candidate;
+    text = candidate + 1;
+  }
+  return NULL;
+}
+
+
+// Mirrors the excerpt made by the Lua search, cutting long lines around the match.
+static bool search_add_match(search_results_t* results, const char* line, size_t length, size_t line_number, size_t col) {
+  size_t start = col > SEARCH_EXCERPT_BEFORE ? col - SEARCH_EXCERPT_BEFORE : 1;
+  size_t end = SDL_min(length, start + SEARCH_EXCERPT_LENGTH);
+  size_t excerpt_length = (start > 1 ? 3 : 0) + (end - start + 1) + (length > end ? 3 : 0);
+  if (!search_grow((void**)&results->matches, &results->capacity, results->count + 1, sizeof(search_match_t))
+    || !search_grow((void**)&results->text, &results->text_capacity, results->text_length + excerpt_length, 1))
+    return false;
+  char* text = results->text + results->text_length;
+  if (start > 1) { memcpy(text, "...", 3); text += 3; }
+  memcpy(text, line + start - 1, end - start + 1);
+  text += end - start + 1;
+  if (length > end) memcpy(text, "...", 3);
+  results->matches[results->count++] = (search_match_t){ line_number, col, results->text_length, excerpt_length };
+  results->text_length += excerpt_length;
+  return true;
+}
+
+
+// Searches a run of whole lines, the last one may lack its newline at the
+// end of the file. Only the first match of each line is reported.
+static bool search_lines(search_worker_t* worker, const char* text, size_t length, size_t* line, search_results_t* results) {
+  search_job_t* job = worker->job;
+  const char* end = text + length;
+  const char* line_start = text;
+  if (job->re) {
+    while (line_start < end) {
+      const char* newline = memchr(line_start, '\n', end - line_start);
+      const char* line_end = newline ? newline : end;
+      int rc = pcre2_match(job->re, (PCRE2_SPTR)line_start, line_end - line_start, 0, 0, worker->match_data, NULL);
+      if (rc >= 0) {
+        PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(worker->match_data);
+        if (!search_add_match(results, line_start, line_end - line_start, *line, ovector[0] + 1))
+          return false;
+      }
+      (*line)++;
+      line_start = line_end + 1;
+    }
+    return true;
+  }
+  // matches are looked for in the whole run at once, and the lines counted up to them
+  const char* haystack = text;
+  if (job->insensitive) {
+    for (size_t i = 0; i < length; i++)
+      worker->lowered[i] = search_lower(text[i]);
+    haystack = worker->lowered;
+  }
+  const char* match;
+  while (line_start < end
+    && (match = search_find(haystack + (line_start - text), end - line_start, job->needle, job->needle_length))) {
+    match = text + (match - haystack);
+    const char* newline;
+    while ((newline = memchr(line_start, '\n', match - line_start))) {
+      (*line)++;
+      line_start = newline + 1;
+    }
+    newline = memchr(match, '\n', end - match);
+    const char* line_end = newline ? newline : end;
+    if (!search_add_match(results, line_start, line_end - line_start, *line, match - line_start + 1))
+      return false;
+    (*line)++;
+    line_start = line_end + 1;
+  }
+  while (line_start < end) {
+    const char* newline = memchr(line_start, '\n', end - line_start);
+    (*line)++;
+    line_start = newline ? newline + 1 : end;
+  }
+  return true;
+}
+
+
+// Reads the file in chunks of whole lines, carrying the partial line at the
+// end of each chunk over to the next one.
+static void search_file(search_worker_t* worker, search_file_t* file) {
+  search_job_t* job = worker->job;
+  SDL_IOStream* io = SDL_IOFromFile(file->path, "rb");
+  if (!io) return;
+  size_t used = 0, line = 1;
+  bool eof = false;
+  while (!eof && !SDL_GetAtomicInt(&job->cancelled)) {
+    if (used == worker->capacity) {
+      size_t capacity = worker->capacity ? worker->capacity * 2 : SEARCH_CHUNK_SIZE;
+      char* buffer = SDL_realloc(worker->buffer, capacity);
+      if (!buffer) break;
+      worker->buffer = buffer;
+      if (job->insensitive) {
+        char* lowered = SDL_realloc(worker->lowered, capacity);
+        if (!lowered) break;
+        worker->lowered = lowered;
+      }
+      worker->capacity = capacity;
+    }
+    size_t read = SDL_ReadIO(io, worker->buffer + used, worker->capacity - used);
+    eof = read == 0;
+    used += read;
+    size_t length = used;
+    if (!eof) {
+      while (length > 0 && worker->buffer[length - 1] != '\n') length--;
+      // a line longer than the buffer, read more of it first
+      if (length == 0) continue;
+    }
+    if (!search_lines(worker, worker->buffer, length, &line, &file->results))
+      break;
+    memmove(worker->buffer, worker->buffer + length, used - length);
+    used -= length;
+  }
+  SDL_CloseIO(io);
+}
+
+
+static int search_thread(void* data) {
+  search_worker_t* worker = data;
+  search_job_t* job = worker->job;
+  SDL_Event event = { .type = SEARCH_EVENT_TYPE };
+  while (!SDL_GetAtomicInt(&job->cancelled)) {
+    size_t i = (size_t)SDL_AddAtomicInt(&job->next_file, 1);
+    if (i >= job->file_count) break;
+    search_file(worker, &job->files[i]);
+    SDL_SetAtomicInt(&job->files[i].done, 1);
+    if ((SDL_AddAtomicInt(&job->searched, 1) + 1) % SEARCH_WAKE_INTERVAL == 0)
+      SDL_PushEvent(&event);
+  }
+  SDL_free(worker->buffer);
+  SDL_free(worker->lowered);
+  worker->buffer = worker->lowered = NULL;
+  if (worker->match_data)
+    pcre2_match_data_free(worker->match_data);
+  worker->match_data = NULL;
+  SDL_AddAtomicInt(&job->running, -1);
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+
+static void search_stop(search_job_t* job) {
+  if (job->finished) return;
+  SDL_SetAtomicInt(&job->cancelled, 1);
+  for (int i = 0; i < job->worker_count; i++)
+    SDL_WaitThread(job->workers[i].thread, NULL);
+  job->worker_count = 0;
+  job->finished = true;
+}
+
+
+static int f_search_new(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t needle_length;
+  const char* needle = luaL_checklstring(L, 2, &needle_length);
+  luaL_argcheck(L, needle_length > 0, 2, "expected a non-empty string");
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  bool regex = false, insensitive = false;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "regex");
+    regex = lua_toboolean(L, -1);
+    lua_getfield(L, 3, "insensitive");
+    insensitive = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  if (SEARCH_EVENT_TYPE == 0)
+    SEARCH_EVENT_TYPE = SDL_RegisterEvents(1);
+
+  search_job_t* job = lua_newuserdata(L, sizeof(search_job_t));
+  memset(job, 0, sizeof(search_job_t));
+  job->finished = true;
+  luaL_setmetatable(L, API_TYPE_FILE_SEARCH);
+  job->insensitive = insensitive && !regex;
+  if (regex) {
+    int errornumber;
+    PCRE2_SIZE erroroffset;
+    uint32_t options = PCRE2_UTF | (insensitive ? PCRE2_CASELESS : 0);
+#ifdef PCRE2_MATCH_INVALID_UTF
+    // lines that aren't valid UTF-8 are searched instead of failing to match
+    options |= PCRE2_MATCH_INVALID_UTF;
+#endif
+    job->re = pcre2_compile((PCRE2_SPTR)needle, needle_length, options, &errornumber, &erroroffset, NULL);
+    if (!job->re) {
+      PCRE2_UCHAR buffer[256];
+      pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
+      lua_pushnil(L);
+      lua_pushfstring(L, "regex compilation failed at offset %d: %s", (int)erroroffset, buffer);
+      return 2;
+    }
+    pcre2_jit_compile(job->re, PCRE2_JIT_COMPLETE);
+  } else {
+    if (!(job->needle = SDL_malloc(needle_length)))
+      return luaL_error(L, "not enough memory to start searching");
+    for (size_t i = 0; i < needle_length; i++)
+      job->needle[i] = job->insensitive ? search_lower(needle[i]) : needle[i];
+    job->needle_length = needle_length;
+  }
+
+  size_t file_count = lua_rawlen(L, 1);
+  if (file_count > 0 && !(job->files = SDL_calloc(file_count, sizeof(search_file_t))))
+    return luaL_error(L, "not enough memory to start searching");
+  for (size_t i = 1; i <= file_count; i++) {
+    lua_rawgeti(L, 1, i);
+    const char* path = lua_tostring(L, -1);
+    if (path) {
+      if (!(job->files[job->file_count].path = SDL_strdup(path)))
+        return luaL_error(L, "not enough memory to start searching");
+      job->file_count++;
+    }
+    lua_pop(L, 1);
+  }
+
+  job->finished = false;
+  int workers = SDL_clamp(SDL_GetNumLogicalCPUCores(), 1, SEARCH_MAX_WORKERS);
+  for (int i = 0; job->re && i < workers; i++) {
+    if (!(job->workers[i].match_data = pcre2_match_data_create_from_pattern(job->re, NULL)))
+      return luaL_error(L, "not enough memory to start searching");
+  }
+  SDL_SetAtomicInt(&job->running, workers);
+  for (; job->worker_count < workers; job->worker_count++) {
+    search_worker_t* worker = &job->workers[job->worker_count];
+    worker->job = job;
+    if (!(worker->thread = SDL_CreateThread(search_thread, "file_search", worker)))
+      break;
+  }
+  for (int i = job->worker_count; i < workers; i++) {
+    if (job->workers[i].match_data)
+      pcre2_match_data_free(job->workers[i].match_data);
+    job->workers[i].match_data = NULL;
+    SDL_AddAtomicInt(&job->running, -1);
+  }
+  // without any worker the files are searched right away
+  if (job->worker_count == 0) {
+    search_worker_t* worker = &job->workers[0];
+    worker->job = job;
+    SDL_SetAtomicInt(&job->running, 1);
+    if (job->re && !(worker->match_data = pcre2_match_data_create_from_pattern(job->re, NULL)))
+      return luaL_error(L, "not enough memory to start searching");
+    search_thread(worker);
+    job->finished = true;
+  }
+  return 1;
+}
+
+
+static int f_search_poll(lua_State* L) {
+  search_job_t* job = luaL_checkudata(L, 1, API_TYPE_FILE_SEARCH);
+  lua_Integer limit = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+  // read first, so that files done right before the workers stopped aren't missed
+  bool running = SDL_GetAtomicInt(&job->running) > 0;
+  lua_newtable(L);
+  lua_Integer count = 0;
+  while (count < limit && job->read_file < job->file_count
+    && SDL_GetAtomicInt(&job->files[job->read_file].done)) {
+    search_file_t* file = &job->files[job->read_file];
+    search_results_t* results = &file->results;
+    for (; job->read_match < results->count && count < limit; job->read_match++) {
+      const search_match_t* match = &results->matches[job->read_match];
+      lua_createtable(L, 0, 4);
+      lua_pushstring(L, file->path);
+      lua_setfield(L, -2, "file");
+      lua_pushlstring(L, results->text + match->text_offset, match->text_length);
+      lua_setfield(L, -2, "text");
+      lua_pushinteger(L, (lua_Integer)match->line);
+      lua_setfield(L, -2, "line");
+      lua_pushinteger(L, (lua_Integer)match->col);
+      lua_setfield(L, -2, "col");
+      lua_rawseti(L, -2, ++count);
+    }
+    if (job->read_match < results->count) break;
+    search_results_free(results);
+    job->read_file++;
+    job->read_match = 0;
+  }
+  lua_pushinteger(L, SDL_GetAtomicInt(&job->searched));
+  // once cancelled, the files left unsearched are never done
+  bool pending = job->read_file < job->file_count && !SDL_GetAtomicInt(&job->cancelled);
+  lua_pushboolean(L, running || pending);
+  return 3;
+}
+
+
+static int f_search_cancel(lua_State* L) {
+  search_job_t* job = luaL_checkudata(L, 1, API_TYPE_FILE_SEARCH);
+  SDL_SetAtomicInt(&job->cancelled, 1);
+  return 0;
+}
+
+
+static int f_search_gc(lua_State* L) {
+  search_job_t* job = luaL_checkudata(L, 1, API_TYPE_FILE_SEARCH);
+  search_stop(job);
+  for (size_t i = 0; i < job->file_count; i++) {
+    search_results_free(&job->files[i].results);
+    SDL_free(job->files[i].path);
+  }
+  SDL_free(job->files);
+  SDL_free(job->needle);
+  if (job->re)
+    pcre2_code_free(job->re);
+  return 0;
+}
+
+
+static const luaL_Reg filesearch_lib[] = {
+  { "new", f_search_new },
+  { NULL,  NULL         }
+};
+
+static const luaL_Reg search_metatable[] = {
+  { "__gc",   f_search_gc     },
+  { "poll",   f_search_poll   },
+  { "cancel", f_search_cancel },
+  { NULL,     NULL            }
+};
+
+
+int luaopen_filesearch(lua_State* L) {
+  luaL_newmetatable(L, API_TYPE_FILE_SEARCH);
+  luaL_setfuncs(L, search_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_newlib(L, filesearch_lib);
+  return 1;
+}
@@ -0,0 +1,1388 @@
+#include "api.h"
+#include "utf8.h"
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+
+#include <SDL3/SDL.h>
+#include <pcre2.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Maximum amount of offsets a match returns: start, end and position captures.
+#define LEXER_MAX_RESULTS 34
+// Amount of bytes tokenized between checks of the time budget.
+#define LEXER_BUDGET_INTERVAL 200
+
+enum { LEXER_TYPE_NORMAL, LEXER_TYPE_INCOMPLETE };
+
+enum {
+  LEXER_REPORT_EMPTY_MATCH,
+  LEXER_REPORT_TYPE_TABLE,
+  LEXER_REPORT_NOT_ENOUGH_TYPES,
+  LEXER_REPORT_TOO_MANY_TYPES,
+};
+
+typedef struct {
+  // pattern or regex source, without the leading '^' of whole line matchers
+  char* code;
+  size_t length;
+  pcre2_code* re;
+  bool whole_line;
+  // set of bytes an anchored match can start with, to skip trying the
+  // matcher on text it can't match
+  unsigned char first_bytes[32];
+} lexer_matcher_t;
+
+typedef struct {
+  // opening and closing matchers, only the first is used if not a pair
+  lexer_matcher_t matchers[2];
+  int* types;
+  int type_count;
+  bool type_is_table;
+  // index of the syntax entered by a pair, or -1
+  int subsyntax;
+  // first character of the escape string of a pair
+  char escape[8];
+  size_t escape_length;
+  bool pair, regex, disabled;
+  // bad patterns are only reported once, from whichever thread found them
+  SDL_AtomicInt reported;
+} lexer_pattern_t;
+
+typedef struct {
+  char* text;
+  size_t length;
+  int type;
+} lexer_symbol_t;
+
+typedef struct {
+  lexer_pattern_t* patterns;
+  int pattern_count;
+  // open addressing hash table, with a power of two capacity
+  lexer_symbol_t* symbols;
+  size_t symbol_capacity;
+} lexer_syntax_t;
+
+// A syntax compiled along with every subsyntax it can enter, which is only
+// read while tokenizing so that it can be shared with other threads.
+typedef struct {
+  lexer_syntax_t* syntaxes;
+  int syntax_count, syntax_capacity;
+  char** types;
+  int type_count, type_capacity;
+} lexer_t;
+
+typedef struct {
+  size_t offset, length;
+  int type;
+} lexer_token_t;
+
+typedef struct {
+  int syntax, pattern, kind, got, needed;
+} lexer_report_t;
+
+// Tokens of a line packed into a single userdata, referencing the line text
+// and the type names of the lexer through its uservalues.
+typedef struct {
+  uint32_t offset, length;
+  uint16_t type;
+} lexer_packed_token_t;
+
+typedef struct {
+  size_t count;
+  lexer_packed_token_t tokens[];
+} lexer_tokens_t;
+
+typedef struct {
+  lexer_token_t* tokens;
+  size_t token_count, token_capacity;
+  unsigned char* state;
+  size_t state_length, state_capacity;
+  lexer_report_t* reports;
+  size_t report_count, report_capacity;
+  // offset tokenizing stopped at when out of time, or the length of the text
+  size_t offset;
+  // token preceding the text when resuming, the first token was merged
+  // into it if carry_merged is set
+  int carry_type;
+  bool has_carry, carry_space, carry_merged;
+  // set when tokenizing from a worker thread, which can't report bad
+  // patterns, so tokenizing fails instead if they weren't reported yet
+  bool shared;
+  // stops tokenizing when set from another thread
+  SDL_AtomicInt* cancelled;
+  const char* error;
+} lexer_result_t;
+
+typedef struct {
+  const lexer_t* lexer;
+  const char* text;
+  size_t length;
+  lexer_result_t* out;
+  pcre2_match_data* match_data;
+  // current syntax, the pair that entered it and the pair we're inside of
+  int syntax;
+  lexer_pattern_t* subsyntax_info;
+  int pattern_idx;
+  size_t level;
+  size_t results[LEXER_MAX_RESULTS];
+} lexer_run_t;
+
+
+static bool lexer_grow(void** data, size_t* capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  while (new_capacity < needed) new_capacity *= 2;
+  void* new_data = SDL_realloc(*data, new_capacity * size);
+  if (!new_data) return false;
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+static uint32_t lexer_hash(const char* text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+  return hash;
+}
+
+
+static int lexer_find_symbol(const lexer_syntax_t* syntax, const char* text, size_t length, int type) {
+  if (!syntax->symbols) return type;
+  size_t mask = syntax->symbol_capacity - 1;
+  for (size_t i = lexer_hash(text, length) & mask; syntax->symbols[i].text; i = (i + 1) & mask) {
+    const lexer_symbol_t* symbol = &syntax->symbols[i];
+    if (symbol->length == length && memcmp(symbol->text, text, length) == 0)
+      return symbol->type;
+  }
+  return type;
+}
+
+
+static void lexer_free(lexer_t* lexer) {
+  for (int i = 0; i < lexer->syntax_count; i++) {
+    lexer_syntax_t* syntax = &lexer->syntaxes[i];
+    for (int j = 0; j < syntax->pattern_count; j++) {
+      lexer_pattern_t* pattern = &syntax->patterns[j];
+      for (int k = 0; k < 2; k++) {
+        SDL_free(pattern->matchers[k].code);
+        if (pattern->matchers[k].re)
+          pcre2_code_free(pattern->matchers[k].re);
+      }
+      SDL_free(pattern->types);
+    }
+    for (size_t j = 0; j < syntax->symbol_capacity; j++)
+      SDL_free(syntax->symbols[j].text);
+    SDL_free(syntax->patterns);
+    SDL_free(syntax->symbols);
+  }
+  for (int i = 0; i < lexer->type_count; i++)
+    SDL_free(lexer->types[i]);
+  SDL_free(lexer->syntaxes);
+  SDL_free(lexer->types);
+  memset(lexer, 0, sizeof(lexer_t));
+}
+
+
+static void lexer_result_free(lexer_result_t* out) {
+  SDL_free(out->tokens);
+  SDL_free(out->state);
+  SDL_free(out->reports);
+}
+
+
+static bool lexer_fail(lexer_run_t* run, const char* error) {
+  run->out->error = error;
+  return false;
+}
+
+
+/* Matching */
+
+static bool lexer_is_space(lexer_run_t* run, size_t offset, size_t length, bool* space) {
+  size_t results[2];
+  const char* error = NULL;
+  int count = utf8_pattern_find(run->text + offset, length, 0, "%s*$", 4, 1, results, 2, &error);
+  if (count < 0) return lexer_fail(run, error);
+  *space = count > 0;
+  return true;
+}
+
+
+// Matches a single matcher at the given offset, returning the amount of
+// results, 0 when nothing was found and -1 on errors.
+static int lexer_match(lexer_run_t* run, const lexer_pattern_t* pattern, const lexer_matcher_t* matcher, size_t offset, bool anchored) {
+  size_t* results = run->results;
+  if (!pattern->regex) {
+    const char* error = NULL;
+    int count = utf8_pattern_find(run->text, run->length, offset, matcher->code, matcher->length,
+      anchored, results, LEXER_MAX_RESULTS, &error);
+    if (count < 0) lexer_fail(run, error);
+    return count;
+  }
+  // like regex.find, the subject starts at the offset
+  int rc = pcre2_match(matcher->re, (PCRE2_SPTR)(run->text + offset), run->length - offset, 0,
+    anchored ? PCRE2_ANCHORED : 0, run->match_data, NULL);
+  if (rc == PCRE2_ERROR_NOMATCH) return 0;
+  if (rc <= 0 || rc * 2 > LEXER_MAX_RESULTS) return lexer_fail(run, "regex matching error"), -1;
+  PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(run->match_data);
+  if (ovector[0] > ovector[1]) return lexer_fail(run, "regex matching error: \\K was used in an assertion"), -1;
+  results[0] = ovector[0] + offset;
+  results[1] = ovector[1] + offset;
+  for (int i = 1; i < rc; i++) {
+    // non empty captures are returned as strings by regex.find
+    if (ovector[i * 2] == PCRE2_UNSET || ovector[i * 2] != ovector[i * 2 + 1])
+      return lexer_fail(run, "only position captures are supported"), -1;
+    results[i + 1] = ovector[i * 2] + offset;
+  }
+  return rc + 1;
+}
+
+
+static bool lexer_is_escaped(lexer_run_t* run, const lexer_pattern_t* pattern, size_t offset) {
+  size_t count = 0;
+  while (offset > 0) {
+    size_t prev = offset - 1;
+    while (prev > 0 && (run->text[prev] & 0xC0) == 0x80) prev--;
+    if (offset - prev != pattern->escape_length || memcmp(run->text + prev, pattern->escape, offset - prev) != 0)
+      break;
+    count++;
+    offset = prev;
+  }
+  return count % 2 == 1;
+}
+
+
+// Equivalent of find_text in core.tokenizer, on byte offsets.
+static int lexer_find(lexer_run_t* run, const lexer_pattern_t* pattern, size_t offset, bool at_start, bool close) {
+  const lexer_matcher_t* matcher = &pattern->matchers[pattern->pair && close ? 1 : 0];
+  if (pattern->disabled) return 0;
+  size_t next = offset;
+  for (;;) {
+    // if the pattern contained '^', allow matching only the whole line
+    if (matcher->whole_line && next > 0) return 0;
+    int count = lexer_match(run, pattern, matcher, next, at_start || matcher->whole_line);
+    if (count <= 0 || pattern->escape_length == 0) return count;
+    if (!lexer_is_escaped(run, pattern, run->results[0])) return count;
+    if (at_start || !close) return 0;
+    if (run->results[1] > next) {
+      next = run->results[1];
+    } else {
+      if (next >= run->length) return 0;
+      while (++next < run->length && (run->text[next] & 0xC0) == 0x80);
+    }
+  }
+}
+
+
+/* Tokens and state */
+
+static bool lexer_push_token(lexer_run_t* run, int type, size_t start, size_t end) {
+  lexer_result_t* out = run->out;
+  if (end <= start) return true;
+  if (out->token_count > 0 || out->has_carry) {
+    lexer_token_t* last = out->token_count > 0 ? &out->tokens[out->token_count - 1] : NULL;
+    int prev_type = last ? last->type : out->carry_type;
+    bool merge = prev_type == type;
+    if (!merge && type != LEXER_TYPE_INCOMPLETE) {
+      merge = true;
+      if (!last || (out->token_count == 1 && out->carry_merged))
+        merge = out->carry_space;
+      if (merge && last && !lexer_is_space(run, last->offset, last->length, &merge))
+        return false;
+    }
+    if (merge && !last) {
+      out->carry_merged = true;
+    } else if (merge) {
+      if (last->offset + last->length != start)
+        return lexer_fail(run, "can't merge tokens that aren't contiguous");
+      last->type = type;
+      last->length += end - start;
+      return true;
+    }
+  }
+  if (!lexer_grow((void**)&out->tokens, &out->token_capacity, out->token_count + 1, sizeof(lexer_token_t)))
+    return lexer_fail(run, "out of memory");
+  out->tokens[out->token_count++] = (lexer_token_t){ start, end - start, type };
+  return true;
+}
+
+
+static bool lexer_push_tokens(lexer_run_t* run, const lexer_pattern_t* pattern, const size_t* results, int count) {
+  const lexer_syntax_t* syntax = &run->lexer->syntaxes[run->syntax];
+  if (count > 2) {
+    // each capture splits the match, with spans typed in order
+    for (int i = 0; i < count - 1; i++) {
+      size_t start = i == 0 ? results[0] : results[i + 1];
+      size_t end = i == count - 2 ? results[1] : results[i + 2];
+      int type = pattern->type_is_table && i < pattern->type_count ? pattern->types[i] : LEXER_TYPE_NORMAL;
+      if (end > start && !lexer_push_token(run, lexer_find_symbol(syntax, run->text + start, end - start, type), start, end))
+        return false;
+    }
+    return true;
+  }
+  size_t start = results[0], end = results[1];
+  if (end <= start) return true;
+  return lexer_push_token(run, lexer_find_symbol(syntax, run->text + start, end - start, pattern->types[0]), start, end);
+}
+
+
+static bool lexer_report(lexer_run_t* run, lexer_pattern_t* pattern, int kind, int got, int needed) {
+  lexer_result_t* out = run->out;
+  if (SDL_GetAtomicInt(&pattern->reported)) return true;
+  if (out->shared) return lexer_fail(run, "bad pattern");
+  if (!SDL_CompareAndSwapAtomicInt(&pattern->reported, 0, 1)) return true;
+  if (!lexer_grow((void**)&out->reports, &out->report_capacity, out->report_count + 1, sizeof(lexer_report_t)))
+    return lexer_fail(run, "out of memory");
+  const lexer_syntax_t* syntax = &run->lexer->syntaxes[run->syntax];
+  out->reports[out->report_count++] = (lexer_report_t){ run->syntax, (int)(pattern - syntax->patterns) + 1, kind, got, needed };
+  return true;
+}
+
+
+static bool lexer_set_pattern_idx(lexer_run_t* run, int pattern_idx) {
+  lexer_result_t* out = run->out;
+  if (pattern_idx > 255) return lexer_fail(run, "too many patterns in syntax");
+  run->pattern_idx = pattern_idx;
+  if (run->level > out->state_length) {
+    if (!lexer_grow((void**)&out->state, &out->state_capacity, out->state_length + 1, 1))
+      return lexer_fail(run, "out of memory");
+    out->state[out->state_length++] = pattern_idx;
+  } else {
+    out->state[run->level - 1] = pattern_idx;
+  }
+  return true;
+}
+
+
+static bool lexer_retrieve_state(lexer_run_t* run) {
+  const lexer_result_t* out = run->out;
+  run->syntax = 0;
+  run->subsyntax_info = NULL;
+  run->pattern_idx = out->state_length > 0 ? out->state[0] : 0;
+  run->level = 1;
+  if (run->pattern_idx == 0 || run->pattern_idx > run->lexer->syntaxes[0].pattern_count)
+    return true;
+  for (size_t i = 0; i < out->state_length && out->state[i] != 0; i++) {
+    const lexer_syntax_t* syntax = &run->lexer->syntaxes[run->syntax];
+    if (out->state[i] > syntax->pattern_count)
+      return lexer_fail(run, "invalid tokenizer state");
+    lexer_pattern_t* pattern = &syntax->patterns[out->state[i] - 1];
+    if (pattern->subsyntax < 0) {
+      run->pattern_idx = out->state[i];
+      break;
+    }
+    run->subsyntax_info = pattern;
+    run->syntax = pattern->subsyntax;
+    run->pattern_idx = 0;
+    run->level = i + 2;
+  }
+  return true;
+}
+
+
+static bool lexer_push_subsyntax(lexer_run_t* run, lexer_pattern_t* pattern, int pattern_idx) {
+  if (!lexer_set_pattern_idx(run, pattern_idx)) return false;
+  run->level++;
+  run->subsyntax_info = pattern;
+  run->syntax = pattern->subsyntax;
+  run->pattern_idx = 0;
+  return true;
+}
+
+
+static bool lexer_pop_subsyntax(lexer_run_t* run) {
+  run->level--;
+  run->out->state_length = run->level;
+  return lexer_set_pattern_idx(run, 0) && lexer_retrieve_state(run);
+}
+
+
+/* Tokenizer */
+
+// Tokenizes text starting at offset with the state in out, mirroring
+// tokenizer.tokenize in core.tokenizer. Doesn't touch any lua_State, and
+// stops once budget nanoseconds are spent if non zero, or when cancelled.
+static bool lexer_tokenize(const lexer_t* lexer, const char* text, size_t length, size_t offset, uint64_t budget, lexer_result_t* out) {
+  lexer_run_t run = { .lexer = lexer, .text = text, .length = length, .out = out };
+  size_t results[LEXER_MAX_RESULTS];
+  bool ok = false;
+  out->offset = length;
+  if (!utf8_check(text, length))
+    return lexer_fail(&run, "invalid UTF-8 code");
+  if (!(run.match_data = pcre2_match_data_create(LEXER_MAX_RESULTS / 2, NULL)))
+    return lexer_fail(&run, "out of memory");
+  if (!lexer_retrieve_state(&run))
+    goto done;
+
+  size_t i = offset, starting_i = offset;
+  uint64_t start_time = SDL_GetTicksNS();
+  while (i < length) {
+    // every few bytes, check if we're out of time
+    if ((budget || out->cancelled) && i - starting_i > LEXER_BUDGET_INTERVAL) {
+      starting_i = i;
+      if (out->cancelled && SDL_GetAtomicInt(out->cancelled)) {
+        lexer_fail(&run, "cancelled");
+        goto done;
+      }
+      if (budget && SDL_GetTicksNS() - start_time > budget) {
+        if (!lexer_push_token(&run, LEXER_TYPE_INCOMPLETE, i, length)) goto done;
+        out->offset = i;
+        ok = true;
+        goto done;
+      }
+    }
+    const lexer_syntax_t* syntax = &lexer->syntaxes[run.syntax];
+    // continue trying to match the end pattern of a pair if we have a state set
+    if (run.pattern_idx > 0) {
+      if (run.pattern_idx > syntax->pattern_count) {
+        lexer_fail(&run, "invalid tokenizer state");
+        goto done;
+      }
+      lexer_pattern_t* pattern = &syntax->patterns[run.pattern_idx - 1];
+      int count = lexer_find(&run, pattern, i, false, true);
+      if (count < 0) goto done;
+      memcpy(results, run.results, sizeof(size_t) * count);
+      int type = pattern->types[0];
+      bool cont = true;
+      // ending the subsyntax takes precedence over ending the pair inside it
+      if (run.subsyntax_info) {
+        int sub_count = lexer_find(&run, run.subsyntax_info, i, false, true);
+        if (sub_count < 0) goto done;
+        if (sub_count > 0 && (count == 0 || run.results[0] < results[0])) {
+          size_t sub_start = run.results[0];
+          if (!lexer_push_token(&run, type, i, sub_start)) goto done;
+          i = sub_start;
+          cont = false;
+        }
+      }
+      if (cont) {
+        if (count > 0) {
+          if (!lexer_push_token(&run, type, i, results[0])
+            || !lexer_push_tokens(&run, pattern, results, count)
+            || !lexer_set_pattern_idx(&run, 0))
+            goto done;
+          i = results[1];
+        } else {
+          if (!lexer_push_token(&run, type, i, length)) goto done;
+          break;
+        }
+      }
+    }
+    // general end of syntax check, on finding an unescaped delimiter pop it
+    while (run.subsyntax_info) {
+      int count = lexer_find(&run, run.subsyntax_info, i, true, true);
+      if (count < 0) goto done;
+      if (count == 0) break;
+      size_t end = run.results[1];
+      if (!lexer_push_tokens(&run, run.subsyntax_info, run.results, count) || !lexer_pop_subsyntax(&run))
+        goto done;
+      i = end;
+    }
+
+    // find matching pattern
+    syntax = &lexer->syntaxes[run.syntax];
+    bool matched = false;
+    for (int n = 0; n < syntax->pattern_count && !matched; n++) {
+      lexer_pattern_t* pattern = &syntax->patterns[n];
+      unsigned char byte = i < length ? text[i] : 0;
+      if (i < length && !(pattern->matchers[0].first_bytes[byte >> 3] & (1 << (byte & 7))))
+        continue;
+      int count = lexer_find(&run, pattern, i, true, false);
+      if (count < 0) goto done;
+      if (count == 0) continue;
+      if (run.results[0] >= run.results[1]) {
+        if (!lexer_report(&run, pattern, LEXER_REPORT_EMPTY_MATCH, 0, 0)) goto done;
+        continue;
+      }
+      int type_count = pattern->type_is_table ? pattern->type_count : 1;
+      if (count == 2 && pattern->type_is_table) {
+        if (!lexer_report(&run, pattern, LEXER_REPORT_TYPE_TABLE, 0, 0)) goto done;
+      } else if (count - 1 > type_count) {
+        if (!lexer_report(&run, pattern, LEXER_REPORT_NOT_ENOUGH_TYPES, type_count, count - 1)) goto done;
+      } else if (count - 1 < type_count) {
+        if (!lexer_report(&run, pattern, LEXER_REPORT_TOO_MANY_TYPES, type_count, count - 1)) goto done;
+      }
+      size_t end = run.results[1];
+      if (!lexer_push_tokens(&run, pattern, run.results, count)) goto done;
+      // update state if this was a start|end pattern pair
+      if (pattern->pair) {
+        if (pattern->subsyntax >= 0 ? !lexer_push_subsyntax(&run, pattern, n + 1) : !lexer_set_pattern_idx(&run, n + 1))
+          goto done;
+      }
+      i = end;
+      matched = true;
+    }
+
+    // consume character if we didn't match
+    if (!matched) {
+      if (i >= length) break;
+      size_t next = i + 1;
+      while (next < length && (text[next] & 0xC0) == 0x80) next++;
+      if (!lexer_push_token(&run, LEXER_TYPE_NORMAL, i, next)) goto done;
+      i = next;
+    }
+  }
+  ok = true;
+
+done:
+  pcre2_match_data_free(run.match_data);
+  return ok;
+}
+
+
+/* Compiling */
+
+static int lexer_intern_type(lexer_t* lexer, const char* name) {
+  for (int i = 0; i < lexer->type_count; i++) {
+    if (strcmp(lexer->types[i], name) == 0)
+      return i;
+  }
+  size_t capacity = lexer->type_capacity;
+  if (!lexer_grow((void**)&lexer->types, &capacity, lexer->type_count + 1, sizeof(char*)))
+    return -1;
+  lexer->type_capacity = capacity;
+  if (!(lexer->types[lexer->type_count] = SDL_strdup(name)))
+    return -1;
+  return lexer->type_count++;
+}
+
+
+static int lexer_check_type(lua_State* L, lexer_t* lexer, int idx) {
+  if (lua_type(L, idx) != LUA_TSTRING) return LEXER_TYPE_NORMAL;
+  int type = lexer_intern_type(lexer, lua_tostring(L, idx));
+  if (type < 0) luaL_error(L, "not enough memory to compile syntax");
+  return type;
+}
+
+
+static int lexer_compile_syntax(lua_State* L, lexer_t* lexer, int syntax_idx);
+
+
+static void lexer_compile_matcher(lua_State* L, lexer_pattern_t* pattern, int matcher_idx, int code_idx, int whole_line_idx) {
+  lexer_matcher_t* matcher = &pattern->matchers[matcher_idx];
+  size_t length;
+  if (lua_type(L, code_idx) != LUA_TSTRING) {
+    pattern->disabled = true;
+    return;
+  }
+  const char* code = lua_tolstring(L, code_idx, &length);
+  // core.tokenizer strips the '^' from the pattern when it first uses it
+  if (lua_type(L, whole_line_idx) == LUA_TTABLE && lua_rawgeti(L, whole_line_idx, matcher_idx + 1) != LUA_TNIL) {
+    matcher->whole_line = lua_toboolean(L, -1);
+  } else if (length > 0 && code[0] == '^') {
+    matcher->whole_line = true;
+    code++;
+    length--;
+  }
+  if (lua_type(L, whole_line_idx) == LUA_TTABLE) lua_pop(L, 1);
+  if (!(matcher->code = SDL_malloc(length + 1)))
+    luaL_error(L, "not enough memory to compile syntax");
+  memcpy(matcher->code, code, length);
+  matcher->code[length] = '\0';
+  matcher->length = length;
+  if (!pattern->regex) {
+    utf8_pattern_first_bytes(matcher->code, length, matcher->first_bytes);
+    return;
+  }
+  int error;
+  PCRE2_SIZE error_offset;
+  if (!(matcher->re = pcre2_compile((PCRE2_SPTR)code, length, PCRE2_UTF, &error, &error_offset, NULL))) {
+    pattern->disabled = true;
+    return;
+  }
+  pcre2_jit_compile(matcher->re, PCRE2_JIT_COMPLETE);
+  uint32_t match_empty = 1, first_type = 0, first_unit = 0;
+  const uint8_t* bitmap = NULL;
+  memset(matcher->first_bytes, 0xFF, sizeof(matcher->first_bytes));
+  pcre2_pattern_info(matcher->re, PCRE2_INFO_MATCHEMPTY, &match_empty);
+  pcre2_pattern_info(matcher->re, PCRE2_INFO_FIRSTBITMAP, &bitmap);
+  pcre2_pattern_info(matcher->re, PCRE2_INFO_FIRSTCODETYPE, &first_type);
+  pcre2_pattern_info(matcher->re, PCRE2_INFO_FIRSTCODEUNIT, &first_unit);
+  if (match_empty) return;
+  if (bitmap) {
+    memcpy(matcher->first_bytes, bitmap, sizeof(matcher->first_bytes));
+  } else if (first_type == 1 && first_unit < 256) {
+    // the first code unit could be caseless
+    uint8_t units[2] = { first_unit, first_unit };
+    if (first_unit < 0x80) units[1] = SDL_isupper(first_unit) ? SDL_tolower(first_unit) : SDL_toupper(first_unit);
+    memset(matcher->first_bytes, 0, sizeof(matcher->first_bytes));
+    for (int i = 0; i < 2; i++)
+      matcher->first_bytes[units[i] >> 3] |= 1 << (units[i] & 7);
+  }
+}
+
+
+static void lexer_compile_pattern(lua_State* L, lexer_t* lexer, lexer_pattern_t* pattern, int idx) {
+  pattern->subsyntax = -1;
+  lua_getfield(L, idx, "pattern");
+  pattern->regex = !lua_toboolean(L, -1);
+  if (pattern->regex) {
+    lua_pop(L, 1);
+    lua_getfield(L, idx, "regex");
+  }
+  lua_getfield(L, idx, "whole_line");
+  int target = lua_absindex(L, -2), whole_line = lua_absindex(L, -1);
+  if (lua_type(L, target) == LUA_TTABLE) {
+    pattern->pair = true;
+    lua_rawgeti(L, target, 1);
+    lua_rawgeti(L, target, 2);
+    lexer_compile_matcher(L, pattern, 0, -2, whole_line);
+    lexer_compile_matcher(L, pattern, 1, -1, whole_line);
+    lua_pop(L, 2);
+    size_t length;
+    const char* escape = lua_rawgeti(L, target, 3) == LUA_TSTRING ? lua_tolstring(L, -1, &length) : NULL;
+    if (escape && length > 0) {
+      size_t n = 1;
+      while (n < length && n < sizeof(pattern->escape) && (escape[n] & 0xC0) == 0x80) n++;
+      memcpy(pattern->escape, escape, n);
+      pattern->escape_length = n;
+    }
+    lua_pop(L, 1);
+  } else {
+    lexer_compile_matcher(L, pattern, 0, target, whole_line);
+  }
+  lua_pop(L, 2);
+
+  if (lua_getfield(L, idx, "disabled") != LUA_TNIL && lua_toboolean(L, -1))
+    pattern->disabled = true;
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "type");
+  pattern->type_is_table = lua_type(L, -1) == LUA_TTABLE;
+  pattern->type_count = pattern->type_is_table ? (int)lua_rawlen(L, -1) : 1;
+  if (!(pattern->types = SDL_calloc(pattern->type_count > 0 ? pattern->type_count : 1, sizeof(int))))
+    luaL_error(L, "not enough memory to compile syntax");
+  if (pattern->type_is_table) {
+    for (int i = 0; i < pattern->type_count; i++) {
+      lua_rawgeti(L, -1, i + 1);
+      pattern->types[i] = lexer_check_type(L, lexer, -1);
+      lua_pop(L, 1);
+    }
+  } else {
+    pattern->types[0] = lexer_check_type(L, lexer, -1);
+  }
+  lua_pop(L, 1);
+
+  if (pattern->pair && lua_getfield(L, idx, "syntax") != LUA_TNIL) {
+    // resolve syntax names the same way as the tokenizer
+    if (lua_type(L, -1) != LUA_TTABLE) {
+      lua_pushvalue(L, lua_upvalueindex(1));
+      lua_insert(L, -2);
+      lua_call(L, 1, 1);
+      luaL_checktype(L, -1, LUA_TTABLE);
+    }
+    pattern->subsyntax = lexer_compile_syntax(L, lexer, lua_absindex(L, -1));
+    lua_pop(L, 1);
+  } else if (pattern->pair) {
+    lua_pop(L, 1);
+  }
+}
+
+
+static void lexer_compile_symbols(lua_State* L, lexer_t* lexer, lexer_syntax_t* syntax, int idx) {
+  size_t count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    count++;
+    lua_pop(L, 1);
+  }
+  if (count == 0) return;
+  size_t capacity = 16;
+  while (capacity < count * 2) capacity *= 2;
+  if (!(syntax->symbols = SDL_calloc(capacity, sizeof(lexer_symbol_t))))
+    luaL_error(L, "not enough memory to compile syntax");
+  syntax->symbol_capacity = capacity;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+      size_t length;
+      const char* text = lua_tolstring(L, -2, &length);
+      size_t i = lexer_hash(text, length) & (capacity - 1);
+      while (syntax->symbols[i].text)
+        i = (i + 1) & (capacity - 1);
+      lexer_symbol_t* symbol = &syntax->symbols[i];
+      if (!(symbol->text = SDL_malloc(length + 1)))
+        luaL_error(L, "not enough memory to compile syntax");
+      memcpy(symbol->text, text, length + 1);
+      symbol->length = length;
+      symbol->type = lexer_check_type(L, lexer, -1);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+
+// Compiles the syntax table at idx, returning its index. Syntaxes are
+// registered in the table at upvalue 2 by table, and appended to the one at
+// upvalue 3 by index, before compiling their patterns so that recursive
+// subsyntaxes resolve to themselves.
+static int lexer_compile_syntax(lua_State* L, lexer_t* lexer, int idx) {
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, lua_upvalueindex(2)) != LUA_TNIL) {
+    int syntax_idx = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return syntax_idx;
+  }
+  lua_pop(L, 1);
+
+  size_t capacity = lexer->syntax_capacity;
+  if (!lexer_grow((void**)&lexer->syntaxes, &capacity, lexer->syntax_count + 1, sizeof(lexer_syntax_t)))
+    luaL_error(L, "not enough memory to compile syntax");
+  lexer->syntax_capacity = capacity;
+  int syntax_idx = lexer->syntax_count++;
+  memset(&lexer->syntaxes[syntax_idx], 0, sizeof(lexer_syntax_t));
+  lua_pushvalue(L, idx);
+  lua_pushinteger(L, syntax_idx);
+  lua_rawset(L, lua_upvalueindex(2));
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, lua_upvalueindex(3), syntax_idx + 1);
+
+  if (lua_getfield(L, idx, "patterns") == LUA_TTABLE) {
+    int count = (int)lua_rawlen(L, -1);
+    lexer_pattern_t* patterns = SDL_calloc(count > 0 ? count : 1, sizeof(lexer_pattern_t));
+    if (!patterns) luaL_error(L, "not enough memory to compile syntax");
+    // subsyntaxes can grow the syntax array
+    lexer->syntaxes[syntax_idx].patterns = patterns;
+    lexer->syntaxes[syntax_idx].pattern_count = count;
+    for (int i = 0; i < count; i++) {
+      if (lua_rawgeti(L, -1, i + 1) == LUA_TTABLE)
+        lexer_compile_pattern(L, lexer, &patterns[i], lua_absindex(L, -1));
+      else
+        patterns[i].disabled = true, patterns[i].subsyntax = -1;
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  if (lua_getfield(L, idx, "symbols") == LUA_TTABLE)
+    lexer_compile_symbols(L, lexer, &lexer->syntaxes[syntax_idx], lua_absindex(L, -1));
+  lua_pop(L, 1);
+  return syntax_idx;
+}
+
+
+static int f_compile(lua_State* L) {
+  lexer_t* lexer = lua_touserdata(L, 1);
+  lexer_compile_syntax(L, lexer, 2);
+  return 0;
+}
+
+
+/* Lua API */
+
+static const char* const lexer_report_messages[] = {
+  "Pattern successfully matched, but nothing was captured.",
+  "Token type is a table, but a string was expected.",
+  "Not enough token types: got %d needed %d.",
+  "Too many token types: got %d needed %d.",
+};
+
+
+static int f_new(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  lexer_t* lexer = lua_newuserdatauv(L, sizeof(lexer_t), 4);
+  memset(lexer, 0, sizeof(lexer_t));
+  luaL_setmetatable(L, API_TYPE_LEXER);
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setiuservalue(L, 4, 1);
+  lua_pushvalue(L, 3);
+  lua_setiuservalue(L, 4, 2);
+  if (lexer_intern_type(lexer, "normal") != LEXER_TYPE_NORMAL
+    || lexer_intern_type(lexer, "incomplete") != LEXER_TYPE_INCOMPLETE)
+    return luaL_error(L, "not enough memory to compile syntax");
+  // compile from a closure holding the syntax resolver and the seen syntaxes
+  lua_pushvalue(L, 2);
+  lua_newtable(L);
+  lua_pushvalue(L, 5);
+  lua_pushcclosure(L, f_compile, 3);
+  lua_pushvalue(L, 4);
+  lua_pushvalue(L, 1);
+  lua_call(L, 2, 0);
+  lua_settop(L, 4);
+  if (lexer->type_count > UINT16_MAX)
+    return luaL_error(L, "too many token types in syntax");
+  // type names by id, and ids by name, for packed tokens
+  lua_createtable(L, lexer->type_count, 0);
+  lua_createtable(L, 0, lexer->type_count);
+  for (int i = 0; i < lexer->type_count; i++) {
+    lua_pushstring(L, lexer->types[i]);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 5, i + 1);
+    lua_pushinteger(L, i);
+    lua_rawset(L, 6);
+  }
+  lua_setiuservalue(L, 4, 4);
+  lua_setiuservalue(L, 4, 3);
+  return 1;
+}
+
+
+static size_t lexer_char_index(const char* text, size_t offset) {
+  size_t index = 1;
+  for (size_t i = 0; i < offset; index++) {
+    i++;
+    while (i < offset && (text[i] & 0xC0) == 0x80) i++;
+  }
+  return index;
+}
+
+
+// States default to the one of the first line, a single zero byte.
+static const char* lexer_opt_state(lua_State* L, int idx, size_t* length) {
+  if (lua_isnoneornil(L, idx)) {
+    *length = 1;
+    return "\0";
+  }
+  return luaL_checklstring(L, idx, length);
+}
+
+
+static void lexer_push_state(lua_State* L, const lexer_result_t* out) {
+  lua_pushlstring(L, (const char*)out->state, out->state_length);
+}
+
+
+static int f_tokenize(lua_State* L) {
+  lexer_t* lexer = luaL_checkudata(L, 1, API_TYPE_LEXER);
+  size_t length, state_length;
+  const char* text = luaL_checklstring(L, 2, &length);
+  const char* state = lexer_opt_state(L, 3, &state_length);
+  lua_Number budget = luaL_optnumber(L, 5, 0);
+  size_t offset = 0;
+  lua_settop(L, 5);
+  if (lua_type(L, 4) == LUA_TTABLE) {
+    lua_getfield(L, 4, "res");
+    luaL_checktype(L, -1, LUA_TTABLE);
+    lua_getfield(L, 4, "state");
+    state = luaL_checklstring(L, -1, &state_length);
+    lua_getfield(L, 4, "offset");
+    if (lua_isinteger(L, -1)) {
+      offset = lua_tointeger(L, -1);
+    } else {
+      lua_getfield(L, 4, "i");
+      lua_Integer i = luaL_checkinteger(L, -1);
+      while (offset < length && i-- > 1) {
+        offset++;
+        while (offset < length && (text[offset] & 0xC0) == 0x80) offset++;
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    luaL_argcheck(L, offset <= length, 4, "invalid resume offset");
+    lua_pushvalue(L, -2);
+  } else {
+    lua_newtable(L);
+  }
+  int res = lua_gettop(L);
+  // remove "incomplete" tokens
+  lua_Integer count = (lua_Integer)lua_rawlen(L, res);
+  while (count >= 2) {
+    lua_rawgeti(L, res, count - 1);
+    bool incomplete = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "incomplete") == 0;
+    lua_pop(L, 1);
+    if (!incomplete) break;
+    lua_pushnil(L);
+    lua_rawseti(L, res, count--);
+    lua_pushnil(L);
+    lua_rawseti(L, res, count--);
+  }
+
+  lexer_result_t out = { 0 };
+  out.state_capacity = state_length + 16;
+  if (!(out.state = SDL_malloc(out.state_capacity)))
+    return luaL_error(L, "not enough memory to tokenize");
+  memcpy(out.state, state, state_length);
+  out.state_length = state_length;
+  if (count >= 2) {
+    lua_rawgeti(L, res, count - 1);
+    lua_rawgeti(L, res, count);
+    size_t carry_length;
+    const char* carry = lua_tolstring(L, -1, &carry_length);
+    size_t results[2];
+    out.has_carry = true;
+    out.carry_type = -1;
+    for (int i = 0; i < lexer->type_count; i++) {
+      if (lua_type(L, -2) == LUA_TSTRING && strcmp(lexer->types[i], lua_tostring(L, -2)) == 0)
+        out.carry_type = i;
+    }
+    out.carry_space = carry && utf8_pattern_find(carry, carry_length, 0, "%s*$", 4, 1, results, 2, NULL) > 0;
+    lua_pop(L, 2);
+  }
+
+  uint64_t budget_ns = budget > 0 ? (uint64_t)(budget * 1e9) : 0;
+  if (!lexer_tokenize(lexer, text, length, offset, budget_ns, &out)) {
+    lua_pushnil(L);
+    lua_pushstring(L, out.error);
+    lexer_result_free(&out);
+    return 2;
+  }
+
+  for (size_t i = 0; i < out.token_count; i++) {
+    const lexer_token_t* token = &out.tokens[i];
+    if (i == 0 && out.carry_merged) {
+      lua_pushstring(L, lexer->types[token->type]);
+      lua_rawseti(L, res, count - 1);
+      lua_rawgeti(L, res, count);
+      lua_pushlstring(L, text + token->offset, token->length);
+      lua_concat(L, 2);
+      lua_rawseti(L, res, count);
+      continue;
+    }
+    lua_pushstring(L, lexer->types[token->type]);
+    lua_rawseti(L, res, ++count);
+    lua_pushlstring(L, text + token->offset, token->length);
+    lua_rawseti(L, res, ++count);
+  }
+
+  if (out.report_count > 0 && lua_getiuservalue(L, 1, 2) == LUA_TFUNCTION) {
+    lua_getiuservalue(L, 1, 1);
+    for (size_t i = 0; i < out.report_count; i++) {
+      const lexer_report_t* report = &out.reports[i];
+      lua_pushvalue(L, -2);
+      lua_rawgeti(L, -2, report->syntax + 1);
+      lua_pushinteger(L, report->pattern);
+      lua_pushstring(L, report->kind == LEXER_REPORT_NOT_ENOUGH_TYPES ? "error" : "warn");
+      lua_pushstring(L, lexer_report_messages[report->kind]);
+      lua_pushinteger(L, report->got);
+      lua_pushinteger(L, report->needed);
+      if (lua_pcall(L, 6, 0, 0) != LUA_OK) lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, res);
+
+  if (out.offset < length) {
+    lua_pushlstring(L, "\0", 1);
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, res);
+    lua_setfield(L, -2, "res");
+    lua_pushinteger(L, lexer_char_index(text, out.offset));
+    lua_setfield(L, -2, "i");
+    lua_pushinteger(L, out.offset);
+    lua_setfield(L, -2, "offset");
+    lexer_push_state(L, &out);
+    lua_setfield(L, -2, "state");
+    lexer_result_free(&out);
+    return 3;
+  }
+  lexer_push_state(L, &out);
+  lexer_result_free(&out);
+  return 2;
+}
+
+
+/* Packed tokens */
+
+// Pushes the packed tokens of a line, with the line text and the type names
+// of the lexer at the given stack indices.
+static lexer_tokens_t* lexer_push_packed(lua_State* L, int text_idx, int types_idx, size_t count) {
+  text_idx = lua_absindex(L, text_idx);
+  types_idx = lua_absindex(L, types_idx);
+  lexer_tokens_t* tokens = lua_newuserdatauv(L, sizeof(lexer_tokens_t) + count * sizeof(lexer_packed_token_t), 2);
+  tokens->count = count;
+  luaL_setmetatable(L, API_TYPE_LEXER_TOKENS);
+  lua_pushvalue(L, text_idx);
+  lua_setiuservalue(L, -2, 1);
+  lua_pushvalue(L, types_idx);
+  lua_setiuservalue(L, -2, 2);
+  return tokens;
+}
+
+
+// Pushes the type or the text of a token, as found at index i of a tokens table.
+static int lexer_push_token_part(lua_State* L, int tokens_idx, const lexer_tokens_t* tokens, lua_Integer i) {
+  if (i < 1 || (lua_Unsigned)i > tokens->count * 2) {
+    lua_pushnil(L);
+    return LUA_TNIL;
+  }
+  const lexer_packed_token_t* token = &tokens->tokens[(i - 1) / 2];
+  if (i % 2 == 1) {
+    lua_getiuservalue(L, tokens_idx, 2);
+    lua_rawgeti(L, -1, token->type + 1);
+    lua_remove(L, -2);
+  } else {
+    lua_getiuservalue(L, tokens_idx, 1);
+    lua_pushlstring(L, lua_tostring(L, -1) + token->offset, token->length);
+    lua_remove(L, -2);
+  }
+  return LUA_TSTRING;
+}
+
+
+static int f_pack(lua_State* L) {
+  luaL_checkudata(L, 1, API_TYPE_LEXER);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  size_t length;
+  const char* text = luaL_checklstring(L, 3, &length);
+  size_t count = lua_rawlen(L, 2) / 2;
+  lua_settop(L, 3);
+  lua_getiuservalue(L, 1, 3);
+  lua_getiuservalue(L, 1, 4);
+  lexer_tokens_t* tokens = lexer_push_packed(L, 3, 4, count);
+  // the tokens must cover the text in order, with types known by the lexer
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    lua_rawgeti(L, 2, i * 2 + 1);
+    lua_rawget(L, 5);
+    lua_rawgeti(L, 2, i * 2 + 2);
+    size_t token_length;
+    const char* token = lua_tolstring(L, -1, &token_length);
+    if (!lua_isinteger(L, -2) || !token || token_length > length - offset
+      || memcmp(text + offset, token, token_length) != 0) {
+      lua_pushnil(L);
+      return 1;
+    }
+    tokens->tokens[i] = (lexer_packed_token_t){ offset, token_length, lua_tointeger(L, -2) };
+    offset += token_length;
+    lua_pop(L, 2);
+  }
+  if (offset != length) lua_pushnil(L);
+  return 1;
+}
+
+
+static int f_tokens_index(lua_State* L) {
+  const lexer_tokens_t* tokens = luaL_checkudata(L, 1, API_TYPE_LEXER_TOKENS);
+  if (!lua_isinteger(L, 2)) return 0;
+  lexer_push_token_part(L, 1, tokens, lua_tointeger(L, 2));
+  return 1;
+}
+
+
+static int f_tokens_len(lua_State* L) {
+  const lexer_tokens_t* tokens = luaL_checkudata(L, 1, API_TYPE_LEXER_TOKENS);
+  lua_pushinteger(L, tokens->count * 2);
+  return 1;
+}
+
+
+static int f_tokens_iter(lua_State* L) {
+  const lexer_tokens_t* tokens = luaL_checkudata(L, 1, API_TYPE_LEXER_TOKENS);
+  lua_Integer i = luaL_checkinteger(L, 2) + 2;
+  if (i < 1 || (lua_Unsigned)i > tokens->count * 2) return 0;
+  lua_pushinteger(L, i);
+  lexer_push_token_part(L, 1, tokens, i);
+  lexer_push_token_part(L, 1, tokens, i + 1);
+  return 3;
+}
+
+
+static int f_each_token(lua_State* L) {
+  luaL_checkudata(L, 1, API_TYPE_LEXER_TOKENS);
+  lua_pushcfunction(L, f_tokens_iter);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, -1);
+  return 3;
+}
+
+
+/* Background jobs */
+
+// Amount of lines tokenized by a job between events waking up the main loop.
+#define LEXER_JOB_BATCH 256
+
+enum { LEXER_JOB_RUNNING, LEXER_JOB_DONE, LEXER_JOB_CONVERGED, LEXER_JOB_STOPPED };
+
+typedef struct {
+  // line in the job text, with its tokens and the state it ends with
+  size_t offset, length;
+  size_t token_start, token_count;
+  size_t state_start, state_length;
+} lexer_job_line_t;
+
+typedef struct {
+  lexer_job_line_t* lines;
+  size_t line_count, line_capacity;
+  lexer_token_t* tokens;
+  size_t token_count, token_capacity;
+  unsigned char* states;
+  size_t state_length, state_capacity;
+} lexer_job_queue_t;
+
+typedef struct {
+  size_t line;
+  char* state;
+  size_t length;
+} lexer_checkpoint_t;
+
+// A job tokenizes a run of lines from a worker thread, stopping early once a
+// line starts with the state of its checkpoint, as every following line
+// would be tokenized the same as before. Lines are queued in batches, the
+// worker fills the first queue under the mutex and the main thread swaps it
+// with the second one to read it.
+typedef struct {
+  SDL_Thread* thread;
+  SDL_Mutex* mutex;
+  SDL_AtomicInt cancelled, status;
+  const lexer_t* lexer;
+  const char* text;
+  size_t length;
+  unsigned char* state;
+  size_t state_length;
+  lexer_checkpoint_t* checkpoints;
+  size_t checkpoint_count;
+  lexer_job_queue_t queues[2];
+  bool finished;
+} lexer_job_t;
+
+static unsigned int LEXER_EVENT_TYPE = 0;
+
+
+static bool lexer_job_queue(lexer_job_t* job, const lexer_result_t* out, size_t offset, size_t length) {
+  lexer_job_queue_t* queue = &job->queues[0];
+  bool ok = false;
+  SDL_LockMutex(job->mutex);
+  if (lexer_grow((void**)&queue->lines, &queue->line_capacity, queue->line_count + 1, sizeof(lexer_job_line_t))
+    && lexer_grow((void**)&queue->tokens, &queue->token_capacity, queue->token_count + out->token_count, sizeof(lexer_token_t))
+    && lexer_grow((void**)&queue->states, &queue->state_capacity, queue->state_length + out->state_length, 1)) {
+    queue->lines[queue->line_count++] = (lexer_job_line_t){
+      offset, length, queue->token_count, out->token_count, queue->state_length, out->state_length
+    };
+    memcpy(queue->tokens + queue->token_count, out->tokens, out->token_count * sizeof(lexer_token_t));
+    queue->token_count += out->token_count;
+    memcpy(queue->states + queue->state_length, out->state, out->state_length);
+    queue->state_length += out->state_length;
+    ok = true;
+  }
+  SDL_UnlockMutex(job->mutex);
+  return ok;
+}
+
+
+static int lexer_job_thread(void* data) {
+  lexer_job_t* job = data;
+  lexer_result_t out = { .shared = true, .cancelled = &job->cancelled };
+  out.state = job->state;
+  out.state_length = out.state_capacity = job->state_length;
+  size_t offset = 0, line = 1, checkpoint = 0;
+  int status = LEXER_JOB_STOPPED;
+  SDL_Event event = { .type = LEXER_EVENT_TYPE };
+  while (!SDL_GetAtomicInt(&job->cancelled)) {
+    if (offset >= job->length) {
+      status = LEXER_JOB_DONE;
+      break;
+    }
+    while (checkpoint < job->checkpoint_count && job->checkpoints[checkpoint].line < line)
+      checkpoint++;
+    if (checkpoint < job->checkpoint_count && job->checkpoints[checkpoint].line == line
+      && job->checkpoints[checkpoint].length == out.state_length
+      && memcmp(job->checkpoints[checkpoint].state, out.state, out.state_length) == 0) {
+      status = LEXER_JOB_CONVERGED;
+      break;
+    }
+    const char* newline = memchr(job->text + offset, '\n', job->length - offset);
+    size_t end = newline ? (size_t)(newline - job->text) + 1 : job->length;
+    out.token_count = 0;
+    if (!lexer_tokenize(job->lexer, job->text + offset, end - offset, 0, 0, &out)
+      || !lexer_job_queue(job, &out, offset, end - offset))
+      break;
+    offset = end;
+    if (line++ % LEXER_JOB_BATCH == 0)
+      SDL_PushEvent(&event);
+  }
+  // the state buffer may have been reallocated
+  job->state = out.state;
+  out.state = NULL;
+  lexer_result_free(&out);
+  SDL_SetAtomicInt(&job->status, status);
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+
+static int lexer_compare_checkpoints(const void* a, const void* b) {
+  size_t line_a = ((const lexer_checkpoint_t*)a)->line, line_b = ((const lexer_checkpoint_t*)b)->line;
+  return line_a < line_b ? -1 : line_a > line_b;
+}
+
+
+static int f_highlight(lua_State* L) {
+  lexer_t* lexer = luaL_checkudata(L, 1, API_TYPE_LEXER);
+  size_t length, state_length;
+  const char* text = luaL_checklstring(L, 2, &length);
+  const char* state = lexer_opt_state(L, 3, &state_length);
+  if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+  lua_settop(L, 4);
+  if (LEXER_EVENT_TYPE == 0)
+    LEXER_EVENT_TYPE = SDL_RegisterEvents(1);
+
+  lexer_job_t* job = lua_newuserdatauv(L, sizeof(lexer_job_t), 2);
+  memset(job, 0, sizeof(lexer_job_t));
+  job->finished = true;
+  luaL_setmetatable(L, API_TYPE_LEXER_JOB);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  lua_pushvalue(L, 2);
+  lua_setiuservalue(L, -2, 2);
+  job->lexer = lexer;
+  job->text = text;
+  job->length = length;
+  if (!(job->state = SDL_malloc(state_length + 16)) || !(job->mutex = SDL_CreateMutex()))
+    return luaL_error(L, "not enough memory to start highlighting");
+  memcpy(job->state, state, state_length);
+  job->state_length = state_length;
+
+  if (lua_istable(L, 4)) {
+    size_t capacity = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 4)) {
+      if (lua_isinteger(L, -2) && lua_tointeger(L, -2) > 0 && lua_type(L, -1) == LUA_TSTRING) {
+        size_t checkpoint_length;
+        const char* checkpoint = lua_tolstring(L, -1, &checkpoint_length);
+        if (!lexer_grow((void**)&job->checkpoints, &capacity, job->checkpoint_count + 1, sizeof(lexer_checkpoint_t)))
+          return luaL_error(L, "not enough memory to start highlighting");
+        lexer_checkpoint_t* entry = &job->checkpoints[job->checkpoint_count];
+        if (!(entry->state = SDL_malloc(checkpoint_length + 1)))
+          return luaL_error(L, "not enough memory to start highlighting");
+        memcpy(entry->state, checkpoint, checkpoint_length);
+        entry->length = checkpoint_length;
+        entry->line = lua_tointeger(L, -2);
+        job->checkpoint_count++;
+      }
+      lua_pop(L, 1);
+    }
+    SDL_qsort(job->checkpoints, job->checkpoint_count, sizeof(lexer_checkpoint_t), lexer_compare_checkpoints);
+  }
+
+  job->finished = false;
+  if (!(job->thread = SDL_CreateThread(lexer_job_thread, "lexer_highlight", job)))
+    lexer_job_thread(job);
+  return 1;
+}
+
+
+static void lexer_job_finish(lexer_job_t* job) {
+  if (job->finished) return;
+  SDL_SetAtomicInt(&job->cancelled, 1);
+  if (job->thread)
+    SDL_WaitThread(job->thread, NULL);
+  job->thread = NULL;
+  job->finished = true;
+}
+
+
+static int f_job_poll(lua_State* L) {
+  lexer_job_t* job = luaL_checkudata(L, 1, API_TYPE_LEXER_JOB);
+  // read the status first, so that lines queued right before finishing aren't missed
+  int status = SDL_GetAtomicInt(&job->status);
+  // the queue given back to the worker was emptied by the previous poll
+  lexer_job_queue_t empty = job->queues[1];
+  SDL_LockMutex(job->mutex);
+  job->queues[1] = job->queues[0];
+  job->queues[0] = empty;
+  SDL_UnlockMutex(job->mutex);
+  lexer_job_queue_t* queue = &job->queues[1];
+
+  lua_getiuservalue(L, 1, 1);
+  lua_getiuservalue(L, -1, 3);
+  lua_createtable(L, (int)queue->line_count, 0);
+  for (size_t i = 0; i < queue->line_count; i++) {
+    const lexer_job_line_t* line = &queue->lines[i];
+    lua_createtable(L, 0, 3);
+    lua_pushlstring(L, job->text + line->offset, line->length);
+    lexer_tokens_t* tokens = lexer_push_packed(L, -1, -4, line->token_count);
+    for (size_t j = 0; j < line->token_count; j++) {
+      const lexer_token_t* token = &queue->tokens[line->token_start + j];
+      tokens->tokens[j] = (lexer_packed_token_t){ token->offset, token->length, token->type };
+    }
+    lua_setfield(L, -3, "tokens");
+    lua_setfield(L, -2, "text");
+    lua_pushlstring(L, (const char*)queue->states + line->state_start, line->state_length);
+    lua_setfield(L, -2, "state");
+    lua_rawseti(L, -2, i + 1);
+  }
+  queue->line_count = queue->token_count = queue->state_length = 0;
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+
+  static const char* const statuses[] = { NULL, "done", "converged", "stopped" };
+  if (status == LEXER_JOB_RUNNING)
+    lua_pushnil(L);
+  else
+    lua_pushstring(L, statuses[status]);
+  return 2;
+}
+
+
+static int f_job_cancel(lua_State* L) {
+  lexer_job_t* job = luaL_checkudata(L, 1, API_TYPE_LEXER_JOB);
+  SDL_SetAtomicInt(&job->cancelled, 1);
+  return 0;
+}
+
+
+static int f_job_gc(lua_State* L) {
+  lexer_job_t* job = luaL_checkudata(L, 1, API_TYPE_LEXER_JOB);
+  lexer_job_finish(job);
+  for (int i = 0; i < 2; i++) {
+    SDL_free(job->queues[i].lines);
+    SDL_free(job->queues[i].tokens);
+    SDL_free(job->queues[i].states);
+  }
+  for (size_t i = 0; i < job->checkpoint_count; i++)
+    SDL_free(job->checkpoints[i].state);
+  SDL_free(job->checkpoints);
+  SDL_free(job->state);
+  if (job->mutex)
+    SDL_DestroyMutex(job->mutex);
+  return 0;
+}
+
+
+static int f_gc(lua_State* L) {
+  lexer_free(luaL_checkudata(L, 1, API_TYPE_LEXER));
+  return 0;
+}
+
+
+static const luaL_Reg lexer_metatable[] = {
+  { "__gc",      f_gc        },
+  { "tokenize",  f_tokenize  },
+  { "highlight", f_highlight },
+  { "pack",      f_pack      },
+  { NULL,        NULL        }
+};
+
+static const luaL_Reg tokens_metatable[] = {
+  { "__index", f_tokens_index },
+  { "__len",   f_tokens_len   },
+  { NULL,      NULL           }
+};
+
+static const luaL_Reg job_metatable[] = {
+  { "__gc",   f_job_gc     },
+  { "poll",   f_job_poll   },
+  { "cancel", f_job_cancel },
+  { NULL,     NULL         }
+};
+
+
+static const luaL_Reg lib[] = {
+  { "new",        f_new        },
+  { "each_token", f_each_token },
+  { NULL,         NULL         }
+};
+
+
+int luaopen_lexer(lua_State* L) {
+  luaL_newmetatable(L, API_TYPE_LEXER);
+  luaL_setfuncs(L, lexer_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_newmetatable(L, API_TYPE_LEXER_JOB);
+  luaL_setfuncs(L, job_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_newmetatable(L, API_TYPE_LEXER_TOKENS);
+  luaL_setfuncs(L, tokens_metatable, 0);
+  lua_pop(L, 3);
+  luaL_newlib(L, lib);
+  return 1;
+}
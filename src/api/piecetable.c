@@ -0,0 +1,1098 @@
+#include "api.h"
+#include <SDL3/SDL.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef _WIN32
+  #include <windows.h>
+  #include "../utfconv.h"
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+  #include <sys/uio.h>
+#endif
+
+// Size of the append-only chunks edits are written to. Chunks are never
+// reallocated, so pointers into them stay valid for the lifetime of the table.
+#define PIECETABLE_CHUNK_SIZE (64 * 1024)
+// Maximum amount of line strings kept alive in the lookup cache.
+#define PIECETABLE_LINE_CACHE_MAX 4096
+// Size of the buffer used to expand newlines when saving with CRLF endings.
+#define PIECETABLE_SAVE_BUFFER_SIZE (1024 * 1024)
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+typedef struct {
+  char* data;
+  size_t size, capacity;
+  // byte offsets of every '\n' in data, in ascending order
+  size_t* newlines;
+  size_t newline_count, newline_capacity;
+} pt_buffer_t;
+
+// A piece references a byte range of one buffer; pieces are kept in an
+// implicit treap ordered by document position, with every node storing the
+// byte and newline totals of its subtree.
+typedef struct pt_node {
+  struct pt_node *left, *right;
+  uint32_t priority;
+  uint32_t buffer;
+  size_t start, length;
+  size_t newline_start, newline_count;
+  size_t total_length, total_newlines;
+} pt_node_t;
+
+typedef struct {
+  pt_node_t* root;
+  pt_buffer_t* buffers;
+  size_t buffer_count, buffer_capacity;
+  size_t line_count;
+  size_t cached_lines;
+  uint32_t seed;
+  // amount of running save jobs reading from the buffers
+  int save_jobs;
+} piecetable_t;
+
+
+static size_t node_length(pt_node_t* node) { return node ? node->total_length : 0; }
+static size_t node_newlines(pt_node_t* node) { return node ? node->total_newlines : 0; }
+
+
+static void node_update(pt_node_t* node) {
+  node->total_length = node->length + node_length(node->left) + node_length(node->right);
+  node->total_newlines = node->newline_count + node_newlines(node->left) + node_newlines(node->right);
+}
+
+
+static void node_free(pt_node_t* node) {
+  if (!node) return;
+  node_free(node->left);
+  node_free(node->right);
+  SDL_free(node);
+}
+
+
+static uint32_t pt_random(piecetable_t* pt) {
+  // xorshift32
+  pt->seed ^= pt->seed << 13;
+  pt->seed ^= pt->seed >> 17;
+  pt->seed ^= pt->seed << 5;
+  return pt->seed;
+}
+
+
+// Returns the index of the first newline in buffer at or after offset,
+// searching inside [first, first + count).
+static size_t buffer_newline_bound(pt_buffer_t* buffer, size_t first, size_t count, size_t offset) {
+  while (count > 0) {
+    size_t half = count / 2;
+    if (buffer->newlines[first + half] < offset) {
+      first += half + 1;
+      count -= half + 1;
+    } else
+      count = half;
+  }
+  return first;
+}
+
+
+static bool buffer_push_newline(pt_buffer_t* buffer, size_t offset) {
+  if (buffer->newline_count == buffer->newline_capacity) {
+    size_t capacity = buffer->newline_capacity ? buffer->newline_capacity * 2 : 64;
+    size_t* newlines = SDL_realloc(buffer->newlines, capacity * sizeof(size_t));
+    if (!newlines) return false;
+    buffer->newlines = newlines;
+    buffer->newline_capacity = capacity;
+  }
+  buffer->newlines[buffer->newline_count++] = offset;
+  return true;
+}
+
+
+static bool buffer_append(pt_buffer_t* buffer, const char* text, size_t len) {
+  if (len == 0) return true;
+  memcpy(buffer->data + buffer->size, text, len);
+  const char* end = buffer->data + buffer->size + len;
+  for (const char* p = buffer->data + buffer->size; (p = memchr(p, '\n', end - p)); ++p) {
+    if (!buffer_push_newline(buffer, p - buffer->data))
+      return false;
+  }
+  buffer->size += len;
+  return true;
+}
+
+
+// Indexes the newlines of data in a single pass, which the C library
+// vectorizes; offsets are recorded as if every CR preceding a LF was
+// already removed. Returns the amount of such CRs found.
+static size_t buffer_index_newlines(pt_buffer_t* buffer, const char* data, size_t size, bool* ok) {
+  size_t crs = 0;
+  const char* end = data + size;
+  *ok = true;
+  for (const char* p = data; (p = memchr(p, '\n', end - p)); ++p) {
+    if (p > data && p[-1] == '\r') crs++;
+    if (!buffer_push_newline(buffer, p - data - crs)) {
+      *ok = false;
+      break;
+    }
+  }
+  return crs;
+}
+
+
+// Copies src into dst dropping every CR that precedes a LF; dst may be src.
+static size_t buffer_strip_crlf(char* dst, const char* src, size_t size) {
+  const char* end = src + size;
+  size_t len = 0;
+  while (src < end) {
+    const char* p = memchr(src, '\n', end - src);
+    if (!p) {
+      memmove(dst + len, src, end - src);
+      len += end - src;
+      break;
+    }
+    size_t n = p - src;
+    if (n > 0 && p[-1] == '\r') n--;
+    memmove(dst + len, src, n);
+    len += n;
+    dst[len++] = '\n';
+    src = p + 1;
+  }
+  return len;
+}
+
+
+static void buffer_free(pt_buffer_t* buffer) {
+  SDL_free(buffer->data);
+  SDL_free(buffer->newlines);
+}
+
+
+static pt_buffer_t* pt_new_buffer(piecetable_t* pt, size_t capacity) {
+  if (pt->buffer_count == pt->buffer_capacity) {
+    size_t count = pt->buffer_capacity ? pt->buffer_capacity * 2 : 4;
+    pt_buffer_t* buffers = SDL_realloc(pt->buffers, count * sizeof(pt_buffer_t));
+    if (!buffers) return NULL;
+    pt->buffers = buffers;
+    pt->buffer_capacity = count;
+  }
+  pt_buffer_t* buffer = &pt->buffers[pt->buffer_count];
+  memset(buffer, 0, sizeof(pt_buffer_t));
+  if (capacity > 0 && !(buffer->data = SDL_malloc(capacity)))
+    return NULL;
+  buffer->capacity = capacity;
+  pt->buffer_count++;
+  return buffer;
+}
+
+
+static pt_node_t* pt_new_node(piecetable_t* pt, uint32_t buffer_idx, size_t start, size_t length) {
+  pt_node_t* node = SDL_malloc(sizeof(pt_node_t));
+  if (!node) return NULL;
+  pt_buffer_t* buffer = &pt->buffers[buffer_idx];
+  node->left = node->right = NULL;
+  node->priority = pt_random(pt);
+  node->buffer = buffer_idx;
+  node->start = start;
+  node->length = length;
+  node->newline_start = buffer_newline_bound(buffer, 0, buffer->newline_count, start);
+  node->newline_count = buffer_newline_bound(buffer, node->newline_start, buffer->newline_count - node->newline_start, start + length) - node->newline_start;
+  node_update(node);
+  return node;
+}
+
+
+static pt_node_t* node_merge(pt_node_t* a, pt_node_t* b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a->priority > b->priority) {
+    a->right = node_merge(a->right, b);
+    node_update(a);
+    return a;
+  }
+  b->left = node_merge(a, b->left);
+  node_update(b);
+  return b;
+}
+
+
+// Splits the subtree so that the first `offset` bytes end up in *left,
+// cutting a piece in two if the offset falls inside of it.
+static bool node_split(piecetable_t* pt, pt_node_t* node, size_t offset, pt_node_t** left, pt_node_t** right) {
+  if (!node) {
+    *left = *right = NULL;
+    return true;
+  }
+  size_t left_length = node_length(node->left);
+  bool ok = true;
+  if (offset <= left_length) {
+    ok = node_split(pt, node->left, offset, left, &node->left);
+    node_update(node);
+    *right = node;
+  } else if (offset >= left_length + node->length) {
+    ok = node_split(pt, node->right, offset - left_length - node->length, &node->right, right);
+    node_update(node);
+    *left = node;
+  } else {
+    size_t cut = offset - left_length;
+    pt_node_t* tail = pt_new_node(pt, node->buffer, node->start + cut, node->length - cut);
+    if (!tail) {
+      *left = node;
+      *right = NULL;
+      return false;
+    }
+    pt_node_t* rest = node->right;
+    node->right = NULL;
+    node->length = cut;
+    node->newline_count -= tail->newline_count;
+    node_update(node);
+    *left = node;
+    *right = node_merge(tail, rest);
+  }
+  return ok;
+}
+
+
+// Byte offset of the k-th (0-based) newline in the document.
+static size_t pt_newline_offset(piecetable_t* pt, size_t k) {
+  pt_node_t* node = pt->root;
+  size_t base = 0;
+  while (node) {
+    size_t left_newlines = node_newlines(node->left);
+    if (k < left_newlines) {
+      node = node->left;
+      continue;
+    }
+    k -= left_newlines;
+    base += node_length(node->left);
+    if (k < node->newline_count)
+      return base + pt->buffers[node->buffer].newlines[node->newline_start + k] - node->start;
+    k -= node->newline_count;
+    base += node->length;
+    node = node->right;
+  }
+  return base;
+}
+
+
+// Amount of newlines found before the given byte offset.
+static size_t pt_newlines_before(piecetable_t* pt, size_t offset) {
+  pt_node_t* node = pt->root;
+  size_t count = 0;
+  while (node) {
+    size_t left_length = node_length(node->left);
+    if (offset < left_length) {
+      node = node->left;
+      continue;
+    }
+    offset -= left_length;
+    count += node_newlines(node->left);
+    if (offset < node->length) {
+      pt_buffer_t* buffer = &pt->buffers[node->buffer];
+      return count + buffer_newline_bound(buffer, node->newline_start, node->newline_count, node->start + offset) - node->newline_start;
+    }
+    offset -= node->length;
+    count += node->newline_count;
+    node = node->right;
+  }
+  return count;
+}
+
+
+// Byte offset where the given 1-based line starts.
+static size_t pt_line_offset(piecetable_t* pt, size_t line) {
+  if (line <= 1) return 0;
+  if (line - 2 >= node_newlines(pt->root)) return node_length(pt->root);
+  return pt_newline_offset(pt, line - 2) + 1;
+}
+
+
+static void pt_update_line_count(piecetable_t* pt) {
+  size_t newlines = node_newlines(pt->root);
+  pt->line_count = newlines + (pt_line_offset(pt, newlines + 1) < node_length(pt->root) ? 1 : 0);
+}
+
+
+static void pt_offset_position(piecetable_t* pt, size_t offset, size_t* line, size_t* col) {
+  *line = pt_newlines_before(pt, offset) + 1;
+  *col = offset - pt_line_offset(pt, *line) + 1;
+}
+
+
+static void node_text(piecetable_t* pt, pt_node_t* node, size_t from, size_t to, luaL_Buffer* b) {
+  if (!node || from >= to) return;
+  size_t left_length = node_length(node->left);
+  if (from < left_length)
+    node_text(pt, node->left, from, to < left_length ? to : left_length, b);
+  if (to > left_length && from < left_length + node->length) {
+    size_t start = from > left_length ? from - left_length : 0;
+    size_t end = to - left_length < node->length ? to - left_length : node->length;
+    luaL_addlstring(b, pt->buffers[node->buffer].data + node->start + start, end - start);
+  }
+  size_t right_start = left_length + node->length;
+  if (to > right_start)
+    node_text(pt, node->right, from > right_start ? from - right_start : 0, to - right_start, b);
+}
+
+
+static void pt_push_text(lua_State* L, piecetable_t* pt, size_t from, size_t to) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  node_text(pt, pt->root, from, to, &b);
+  luaL_pushresult(&b);
+}
+
+
+// Grows the piece that ends right at the tail of the current edit chunk,
+// so that sequential typing does not create a new piece per keystroke.
+static bool node_extend_last(piecetable_t* pt, pt_node_t* node, const char* text, size_t len) {
+  if (node->right) {
+    if (!node_extend_last(pt, node->right, text, len)) return false;
+    node_update(node);
+    return true;
+  }
+  pt_buffer_t* buffer = &pt->buffers[node->buffer];
+  if (node->buffer == 0 || node->buffer != pt->buffer_count - 1 || node->start + node->length != buffer->size || buffer->capacity - buffer->size < len)
+    return false;
+  size_t newlines = buffer->newline_count;
+  if (!buffer_append(buffer, text, len)) return false;
+  node->length += len;
+  node->newline_count += buffer->newline_count - newlines;
+  node_update(node);
+  return true;
+}
+
+
+static bool pt_insert(piecetable_t* pt, size_t offset, const char* text, size_t len) {
+  if (len == 0) return true;
+  pt_node_t *left, *right;
+  bool ok = node_split(pt, pt->root, offset, &left, &right);
+  if (ok && !(left && node_extend_last(pt, left, text, len))) {
+    pt_buffer_t* buffer = &pt->buffers[pt->buffer_count - 1];
+    if (pt->buffer_count == 1 || buffer->capacity - buffer->size < len)
+      buffer = pt_new_buffer(pt, len > PIECETABLE_CHUNK_SIZE ? len : PIECETABLE_CHUNK_SIZE);
+    size_t start = buffer ? buffer->size : 0;
+    pt_node_t* node = NULL;
+    if (buffer && buffer_append(buffer, text, len))
+      node = pt_new_node(pt, pt->buffer_count - 1, start, len);
+    if (node)
+      left = node_merge(left, node);
+    else
+      ok = false;
+  }
+  pt->root = node_merge(left, right);
+  pt_update_line_count(pt);
+  return ok;
+}
+
+
+static bool pt_remove(piecetable_t* pt, size_t from, size_t to) {
+  if (from >= to) return true;
+  pt_node_t *left, *middle, *right;
+  bool ok = node_split(pt, pt->root, from, &left, &middle);
+  ok = node_split(pt, middle, to - from, &middle, &right) && ok;
+  if (ok)
+    node_free(middle);
+  else
+    right = node_merge(middle, right);
+  pt->root = node_merge(left, right);
+  pt_update_line_count(pt);
+  return ok;
+}
+
+
+// Converts the line/column pair at idx to a byte offset, clamped the same
+// way Doc:sanitize_position does; the end of a line is its newline character.
+static size_t pt_check_position(lua_State* L, piecetable_t* pt, int idx) {
+  lua_Number line = luaL_checknumber(L, idx);
+  lua_Number col = luaL_checknumber(L, idx + 1);
+  if (pt->line_count == 0 || line < 1) return 0;
+  size_t l = line > pt->line_count ? pt->line_count : (size_t)line;
+  size_t start = pt_line_offset(pt, l);
+  size_t end = pt_line_offset(pt, l + 1);
+  if (l <= node_newlines(pt->root)) end--;
+  if (line > pt->line_count || col - 1 >= (lua_Number)(end - start)) return end;
+  return col < 1 ? start : start + (size_t)col - 1;
+}
+
+
+static void pt_reset_line_cache(lua_State* L, piecetable_t* pt, int idx) {
+  lua_newtable(L);
+  lua_setiuservalue(L, idx, 1);
+  pt->cached_lines = 0;
+}
+
+
+static void pt_invalidate_line(lua_State* L, int idx, size_t line) {
+  lua_getiuservalue(L, idx, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, line);
+  lua_pop(L, 1);
+}
+
+
+static int pt_push_line(lua_State* L, piecetable_t* pt, int idx, lua_Integer line) {
+  if (line < 1 || (size_t)line > pt->line_count) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_getiuservalue(L, idx, 1);
+  if (lua_rawgeti(L, -1, line) != LUA_TNIL)
+    return 1;
+  lua_pop(L, 1);
+  if (pt->cached_lines >= PIECETABLE_LINE_CACHE_MAX) {
+    lua_pop(L, 1);
+    pt_reset_line_cache(L, pt, idx);
+    lua_getiuservalue(L, idx, 1);
+  }
+  pt_push_text(L, pt, pt_line_offset(pt, line), pt_line_offset(pt, line + 1));
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, line);
+  pt->cached_lines++;
+  return 1;
+}
+
+
+static piecetable_t* pt_push(lua_State* L) {
+  piecetable_t* pt = lua_newuserdatauv(L, sizeof(piecetable_t), 1);
+  memset(pt, 0, sizeof(piecetable_t));
+  luaL_setmetatable(L, API_TYPE_PIECETABLE);
+  pt_reset_line_cache(L, pt, -2);
+  pt->seed = 0x9e3779b9u ^ (uint32_t)(uintptr_t)pt;
+  return pt;
+}
+
+
+static piecetable_t* pt_new(lua_State* L, const char* text, size_t len) {
+  piecetable_t* pt = pt_push(L);
+  pt_buffer_t* buffer = pt_new_buffer(pt, len);
+  if (!buffer || !buffer_append(buffer, text, len))
+    luaL_error(L, "not enough memory to create piece table");
+  if (len > 0 && !(pt->root = pt_new_node(pt, 0, 0, len)))
+    luaL_error(L, "not enough memory to create piece table");
+  pt_update_line_count(pt);
+  return pt;
+}
+
+
+static int f_new(lua_State* L) {
+  size_t len = 0;
+  const char* text = luaL_optlstring(L, 1, "", &len);
+  pt_new(L, text, len);
+  return 1;
+}
+
+
+static int f_load(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  piecetable_t* pt = pt_push(L);
+  pt_buffer_t* buffer = pt_new_buffer(pt, 0);
+  if (!buffer)
+    return luaL_error(L, "not enough memory to create piece table");
+
+  // The file is always copied into memory: a mapping would crash the editor
+  // with SIGBUS if another program truncated the file underneath it.
+  // SDL_LoadFile null terminates the data, leaving room to append a newline
+  buffer->data = SDL_LoadFile(path, &buffer->size);
+  if (!buffer->data) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, SDL_GetError());
+    return 2;
+  }
+  buffer->capacity = buffer->size + 1;
+
+  // Like Doc did, strip CRs ending lines and make sure the text ends with a newline.
+  bool crlf = false, ok;
+  size_t size = buffer->size;
+  if (size > 0 && buffer->data[size - 1] == '\r') {
+    size--;
+    crlf = true;
+  }
+  size_t crs = buffer_index_newlines(buffer, buffer->data, size, &ok);
+  if (!ok)
+    return luaL_error(L, "not enough memory to load file");
+  if (crs > 0) {
+    crlf = true;
+    size = buffer_strip_crlf(buffer->data, buffer->data, size);
+  }
+  buffer->size = size;
+  bool newline = size > 0 && buffer->data[size - 1] == '\n';
+  if (!newline) {
+    buffer->data[buffer->size++] = '\n';
+    if (!buffer_push_newline(buffer, size))
+      return luaL_error(L, "not enough memory to load file");
+  }
+  if (!(pt->root = pt_new_node(pt, 0, 0, buffer->size)))
+    return luaL_error(L, "not enough memory to load file");
+  pt_update_line_count(pt);
+  lua_pushboolean(L, crlf);
+  return 2;
+}
+
+
+typedef struct {
+  const char* data;
+  size_t size;
+} pt_span_t;
+
+// A save job writes a snapshot of the piece table from a worker thread.
+// The snapshot points straight into the piece table buffers, which is safe
+// because their contents are never modified or moved once written.
+typedef struct {
+  SDL_Thread* thread;
+  SDL_AtomicInt done;
+  piecetable_t* pt;
+  pt_span_t* spans;
+  size_t span_count, span_capacity;
+  bool crlf, finished;
+  char* path;
+  // temporary file renamed over path when done, NULL to write in place
+  char* temp_path;
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  int fd;
+#endif
+  char error[256];
+} pt_save_t;
+
+static unsigned int SAVE_EVENT_TYPE = 0;
+
+
+static bool save_snapshot(pt_save_t* job, piecetable_t* pt, pt_node_t* node) {
+  if (!node) return true;
+  if (!save_snapshot(job, pt, node->left)) return false;
+  if (job->span_count == job->span_capacity) {
+    size_t capacity = job->span_capacity ? job->span_capacity * 2 : 64;
+    pt_span_t* spans = SDL_realloc(job->spans, capacity * sizeof(pt_span_t));
+    if (!spans) return false;
+    job->spans = spans;
+    job->span_capacity = capacity;
+  }
+  job->spans[job->span_count++] = (pt_span_t){ pt->buffers[node->buffer].data + node->start, node->length };
+  return save_snapshot(job, pt, node->right);
+}
+
+
+static void save_set_error(pt_save_t* job, const char* path) {
+#ifdef _WIN32
+  char message[200] = "";
+  FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), 0, message, sizeof(message), NULL);
+  SDL_snprintf(job->error, sizeof(job->error), "%s: %s", path, message);
+#else
+  SDL_snprintf(job->error, sizeof(job->error), "%s: %s", path, strerror(errno));
+#endif
+}
+
+
+#ifdef _WIN32
+static bool save_write_all(pt_save_t* job, const char* data, size_t size) {
+  while (size > 0) {
+    DWORD written, chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+    if (!WriteFile(job->handle, data, chunk, &written, NULL))
+      return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+#else
+static bool save_write_all(pt_save_t* job, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(job->fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+
+static bool save_writev_all(pt_save_t* job, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(job->fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+#endif
+
+
+static bool save_write_spans(pt_save_t* job) {
+  if (job->crlf) {
+    char* buffer = SDL_malloc(PIECETABLE_SAVE_BUFFER_SIZE);
+    if (!buffer) {
+      SDL_snprintf(job->error, sizeof(job->error), "not enough memory to save file");
+      return false;
+    }
+    size_t len = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < job->span_count; ++i) {
+      const char* data = job->spans[i].data;
+      const char* end = data + job->spans[i].size;
+      while (ok && data < end) {
+        // reserve room for the expanded newline
+        size_t room = PIECETABLE_SAVE_BUFFER_SIZE - len - 1;
+        const char* newline = memchr(data, '\n', (size_t)(end - data) < room ? (size_t)(end - data) : room);
+        size_t n = newline ? (size_t)(newline - data) : ((size_t)(end - data) < room ? (size_t)(end - data) : room);
+        memcpy(buffer + len, data, n);
+        len += n;
+        data += n;
+        if (newline) {
+          buffer[len++] = '\r';
+          buffer[len++] = '\n';
+          data++;
+        }
+        if (PIECETABLE_SAVE_BUFFER_SIZE - len < 2) {
+          ok = save_write_all(job, buffer, len);
+          len = 0;
+        }
+      }
+    }
+    ok = ok && save_write_all(job, buffer, len);
+    SDL_free(buffer);
+    return ok;
+  }
+#ifdef _WIN32
+  for (size_t i = 0; i < job->span_count; ++i) {
+    if (!save_write_all(job, job->spans[i].data, job->spans[i].size))
+      return false;
+  }
+#else
+  struct iovec iov[IOV_MAX];
+  for (size_t i = 0; i < job->span_count;) {
+    int count = 0;
+    for (; i < job->span_count && count < IOV_MAX; ++i, ++count) {
+      iov[count].iov_base = (void*)job->spans[i].data;
+      iov[count].iov_len = job->spans[i].size;
+    }
+    if (!save_writev_all(job, iov, count))
+      return false;
+  }
+#endif
+  return true;
+}
+
+
+static int save_thread(void* data) {
+  pt_save_t* job = data;
+  const char* path = job->temp_path ? job->temp_path : job->path;
+#ifdef _WIN32
+  bool ok = true;
+  if (!job->temp_path) {
+    LPWSTR wpath = utfconv_utf8towc(job->path);
+    job->handle = wpath ? CreateFileW(wpath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL) : INVALID_HANDLE_VALUE;
+    SDL_free(wpath);
+  }
+  if (job->handle == INVALID_HANDLE_VALUE)
+    ok = false;
+  // in place writes truncate afterwards, as opening hidden files for overwriting fails
+  ok = ok && save_write_spans(job) && SetEndOfFile(job->handle) && FlushFileBuffers(job->handle);
+  if (!ok && !job->error[0])
+    save_set_error(job, path);
+  if (job->handle != INVALID_HANDLE_VALUE)
+    CloseHandle(job->handle);
+  if (ok && job->temp_path) {
+    LPWSTR wtemp = utfconv_utf8towc(job->temp_path);
+    LPWSTR wpath = utfconv_utf8towc(job->path);
+    // ReplaceFileW keeps the attributes and ACLs of the file being replaced
+    ok = wtemp && wpath && (
+      ReplaceFileW(wpath, wtemp, NULL, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL) ||
+      (GetLastError() == ERROR_FILE_NOT_FOUND && MoveFileExW(wtemp, wpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    );
+    if (!ok) {
+      save_set_error(job, job->path);
+      if (wtemp) DeleteFileW(wtemp);
+    }
+    SDL_free(wtemp);
+    SDL_free(wpath);
+  } else if (job->temp_path) {
+    LPWSTR wtemp = utfconv_utf8towc(job->temp_path);
+    if (wtemp) DeleteFileW(wtemp);
+    SDL_free(wtemp);
+  }
+#else
+  if (!job->temp_path)
+    job->fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool ok = job->fd != -1 && save_write_spans(job) && fsync(job->fd) == 0;
+  if (!ok && !job->error[0])
+    save_set_error(job, path);
+  if (job->fd != -1 && close(job->fd) != 0 && ok) {
+    ok = false;
+    save_set_error(job, path);
+  }
+  if (job->temp_path) {
+    if (ok && rename(job->temp_path, job->path) != 0) {
+      ok = false;
+      save_set_error(job, job->path);
+    }
+    if (!ok)
+      unlink(job->temp_path);
+  }
+  if (ok && job->temp_path) {
+    // make the rename itself durable
+    char* slash = strrchr(job->path, '/');
+    if (slash) {
+      *slash = '\0';
+      int dir = open(slash == job->path ? "/" : job->path, O_RDONLY);
+      *slash = '/';
+      if (dir != -1) {
+        fsync(dir);
+        close(dir);
+      }
+    }
+  }
+#endif
+  SDL_SetAtomicInt(&job->done, ok ? 1 : -1);
+  SDL_Event event = { .type = SAVE_EVENT_TYPE };
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+
+// Creates the temporary file next to the target, preserving its permissions;
+// returns false if the file has to be written in place instead.
+static bool save_open_temp(pt_save_t* job) {
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(job->path);
+  if (!wpath) return false;
+  WCHAR wdir[MAX_PATH], wtemp[MAX_PATH];
+  size_t len = wcslen(wpath);
+  while (len > 0 && wpath[len - 1] != L'\\' && wpath[len - 1] != L'/') len--;
+  bool ok = len > 0 && len < MAX_PATH;
+  if (ok) {
+    memcpy(wdir, wpath, len * sizeof(WCHAR));
+    wdir[len] = 0;
+    ok = GetTempFileNameW(wdir, L"lxl", 0, wtemp) != 0;
+  }
+  SDL_free(wpath);
+  if (!ok) return false;
+  job->handle = CreateFileW(wtemp, GENERIC_WRITE, 0, NULL, TRUNCATE_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (job->handle == INVALID_HANDLE_VALUE || !(job->temp_path = utfconv_wctoutf8(wtemp))) {
+    if (job->handle != INVALID_HANDLE_VALUE) CloseHandle(job->handle);
+    job->handle = INVALID_HANDLE_VALUE;
+    DeleteFileW(wtemp);
+    return false;
+  }
+  return true;
+#else
+  struct stat s;
+  bool exists = stat(job->path, &s) == 0;
+  // hard links and special files must keep their identity
+  if (exists && (!S_ISREG(s.st_mode) || s.st_nlink > 1))
+    return false;
+  const char* slash = strrchr(job->path, '/');
+  size_t dir_len = slash ? (size_t)(slash - job->path) + 1 : 0;
+  size_t len = strlen(job->path) + 16;
+  if (!(job->temp_path = SDL_malloc(len)))
+    return false;
+  SDL_snprintf(job->temp_path, len, "%.*s.%s.XXXXXX", (int)dir_len, job->path, job->path + dir_len);
+  job->fd = mkstemp(job->temp_path);
+  if (job->fd == -1) {
+    SDL_free(job->temp_path);
+    job->temp_path = NULL;
+    return false;
+  }
+  if (exists) {
+    // a file we can't give back its owner is written in place, which keeps it
+    if (fchown(job->fd, s.st_uid, s.st_gid) != 0) {
+      close(job->fd);
+      job->fd = -1;
+      unlink(job->temp_path);
+      SDL_free(job->temp_path);
+      job->temp_path = NULL;
+      return false;
+    }
+    fchmod(job->fd, s.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(job->fd, 0666 & ~mask);
+  }
+  return true;
+#endif
+}
+
+
+uint32_t piecetable_get_save_event(void) {
+  return SAVE_EVENT_TYPE;
+}
+
+
+static int f_save(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  const char* path = luaL_checkstring(L, 2);
+  bool crlf = lua_toboolean(L, 3);
+  if (SAVE_EVENT_TYPE == 0)
+    SAVE_EVENT_TYPE = SDL_RegisterEvents(1);
+
+  pt_save_t* job = lua_newuserdatauv(L, sizeof(pt_save_t), 1);
+  memset(job, 0, sizeof(pt_save_t));
+  luaL_setmetatable(L, API_TYPE_PIECETABLE_SAVE);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  job->crlf = crlf;
+  job->finished = true;
+#ifdef _WIN32
+  job->handle = INVALID_HANDLE_VALUE;
+  job->path = SDL_strdup(path);
+#else
+  job->fd = -1;
+  // write through symlinks instead of replacing them
+  job->path = realpath(path, NULL);
+  if (!job->path)
+    job->path = SDL_strdup(path);
+#endif
+  if (!job->path)
+    return luaL_error(L, "not enough memory to save file");
+  // falls back to writing in place when no temporary file can be created
+  save_open_temp(job);
+  if (!save_snapshot(job, pt, pt->root))
+    return luaL_error(L, "not enough memory to save file");
+
+  job->pt = pt;
+  job->finished = false;
+  pt->save_jobs++;
+  if (!(job->thread = SDL_CreateThread(save_thread, "piecetable_save", job)))
+    save_thread(job);
+  return 1;
+}
+
+
+static void save_finish(pt_save_t* job) {
+  if (job->finished) return;
+  if (job->thread)
+    SDL_WaitThread(job->thread, NULL);
+  job->thread = NULL;
+  job->finished = true;
+  job->pt->save_jobs--;
+}
+
+
+static int f_save_done(lua_State* L) {
+  pt_save_t* job = luaL_checkudata(L, 1, API_TYPE_PIECETABLE_SAVE);
+  lua_pushboolean(L, SDL_GetAtomicInt(&job->done) != 0);
+  return 1;
+}
+
+
+static int f_save_wait(lua_State* L) {
+  pt_save_t* job = luaL_checkudata(L, 1, API_TYPE_PIECETABLE_SAVE);
+  save_finish(job);
+  if (SDL_GetAtomicInt(&job->done) > 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushstring(L, job->error[0] ? job->error : "unable to save file");
+  return 2;
+}
+
+
+static int f_save_gc(lua_State* L) {
+  pt_save_t* job = luaL_checkudata(L, 1, API_TYPE_PIECETABLE_SAVE);
+  save_finish(job);
+  if (!job->pt && job->temp_path) {
+    // the job failed to start, discard its temporary file
+#ifdef _WIN32
+    CloseHandle(job->handle);
+    LPWSTR wtemp = utfconv_utf8towc(job->temp_path);
+    if (wtemp) DeleteFileW(wtemp);
+    SDL_free(wtemp);
+#else
+    close(job->fd);
+    unlink(job->temp_path);
+#endif
+  }
+  SDL_free(job->spans);
+  SDL_free(job->path);
+  SDL_free(job->temp_path);
+  return 0;
+}
+
+
+static int f_gc(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  node_free(pt->root);
+  for (size_t i = 0; i < pt->buffer_count; ++i)
+    buffer_free(&pt->buffers[i]);
+  SDL_free(pt->buffers);
+  memset(pt, 0, sizeof(piecetable_t));
+  return 0;
+}
+
+
+static int f_index(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  int isnum = 0;
+  lua_Integer line = lua_tointegerx(L, 2, &isnum);
+  if (isnum)
+    return pt_push_line(L, pt, 1, line);
+  luaL_getmetatable(L, API_TYPE_PIECETABLE);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+
+static int f_len(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  lua_pushinteger(L, pt->line_count);
+  return 1;
+}
+
+
+static int f_get_line(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  return pt_push_line(L, pt, 1, luaL_checkinteger(L, 2));
+}
+
+
+static int f_get_size(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  lua_pushinteger(L, node_length(pt->root));
+  return 1;
+}
+
+
+static int f_get_text(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  size_t size = node_length(pt->root);
+  if (lua_isnoneornil(L, 2)) {
+    pt_push_text(L, pt, 0, size);
+    return 1;
+  }
+  size_t from = pt_check_position(L, pt, 2);
+  size_t to = pt_check_position(L, pt, 4);
+  if (from > to) {
+    size_t tmp = from; from = to; to = tmp;
+  }
+  if (lua_toboolean(L, 6) && to < size)
+    to++;
+  pt_push_text(L, pt, from, to);
+  return 1;
+}
+
+
+static int f_insert(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  size_t offset = pt_check_position(L, pt, 2);
+  size_t len;
+  const char* text = luaL_checklstring(L, 4, &len);
+  size_t newlines = 0, tail = len;
+  for (const char* p = text; (p = memchr(p, '\n', text + len - p)); ++p) {
+    newlines++;
+    tail = text + len - p - 1;
+  }
+  size_t line = pt_newlines_before(pt, offset) + 1;
+  if (!pt_insert(pt, offset, text, len))
+    return luaL_error(L, "not enough memory to insert text");
+  if (newlines > 0)
+    pt_reset_line_cache(L, pt, 1);
+  else
+    pt_invalidate_line(L, 1, line);
+  lua_pushinteger(L, newlines);
+  lua_pushinteger(L, tail);
+  return 2;
+}
+
+
+static int f_remove(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  size_t from = pt_check_position(L, pt, 2);
+  size_t to = pt_check_position(L, pt, 4);
+  if (from > to) {
+    size_t tmp = from; from = to; to = tmp;
+  }
+  size_t line1 = pt_newlines_before(pt, from) + 1;
+  size_t line2 = pt_newlines_before(pt, to) + 1;
+  if (!pt_remove(pt, from, to))
+    return luaL_error(L, "not enough memory to remove text");
+  if (line1 != line2)
+    pt_reset_line_cache(L, pt, 1);
+  else
+    pt_invalidate_line(L, 1, line1);
+  lua_pushinteger(L, line2 - line1);
+  return 1;
+}
+
+
+static int f_position_offset(lua_State* L) {
+  piecetable_t* pt = luaL_checkudata(L, 1, API_TYPE_PIECETABLE);
+  size_t offset = pt_check_position(L, pt, 2);
+  lua_Integer delta = luaL_checkinteger(L, 4);
+  size_t size = node_length(pt->root);
+  if (delta < 0)
+    offset = (size_t)-delta > offset ? 0 : offset + delta;
+  else
+    offset = (size_t)delta > size - offset ? size : offset + delta;
+  // the position after a trailing newline is not addressable
+  if (offset == size && offset > 0 && pt->line_count == node_newlines(pt->root))
+    offset--;
+  size_t line, col;
+  pt_offset_position(pt, offset, &line, &col);
+  lua_pushinteger(L, line);
+  lua_pushinteger(L, col);
+  return 2;
+}
+
+
+static const luaL_Reg piecetable_metatable[] = {
+  { "__gc",            f_gc              },
+  { "__index",         f_index           },
+  { "__len",           f_len             },
+  { "get_line",        f_get_line        },
+  { "get_size",        f_get_size        },
+  { "get_text",        f_get_text        },
+  { "insert",          f_insert          },
+  { "remove",          f_remove          },
+  { "position_offset", f_position_offset },
+  { "save",            f_save            },
+  { NULL, NULL }
+};
+
+static const luaL_Reg save_metatable[] = {
+  { "__gc", f_save_gc   },
+  { "done", f_save_done },
+  { "wait", f_save_wait },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lib[] = {
+  { "new",  f_new  },
+  { "load", f_load },
+  { NULL, NULL }
+};
+
+
+int luaopen_piecetable(lua_State* L) {
+  luaL_newmetatable(L, API_TYPE_PIECETABLE);
+  luaL_setfuncs(L, piecetable_metatable, 0);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, API_TYPE_PIECETABLE_SAVE);
+  luaL_setfuncs(L, save_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  luaL_newlib(L, lib);
+  return 1;
+}
@@ -22,9 +22,23 @@
   #include <sys/wait.h>
 #endif
 
+#if __linux__
+  #include <poll.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/syscall.h>
+  // the output of processes is drained by a reactor thread, rather than read when asked for
+  #define PROCESS_REACTOR
+#endif
+
 #include "../arena_allocator.h"
 
 #define READ_BUF_SIZE 2048
+#define READ_CHUNK_SIZE (64 * 1024)
+#define READ_MAX_SIZE (1024 * 1024)
+#define OUTPUT_BUFFER_MIN (64 * 1024)
+#define OUTPUT_BUFFER_MAX (8 * 1024 * 1024)
+#define REACTOR_MAX_EVENTS 64
 #define PROCESS_TERM_TRIES 3
 #define PROCESS_TERM_DELAY 50
 #define PROCESS_KILL_LIST_NAME "__process_kill_list__"
@@ -63,6 +77,33 @@ typedef char **process_env_t;
 #define UNUSED
 #endif
 
+#ifdef PROCESS_REACTOR
+// Output of a child, read by the reactor into a ring buffer as it comes.
+// With a pidfd, only tells the exit of the child: eof is set once it exited.
+typedef struct process_output_s {
+  int fd, error;
+  bool pidfd;
+  char *data;
+  size_t capacity, start, length;
+  // while reading, the main thread copies out of data, which must stay in place
+  bool eof, armed, signalled, reading;
+  struct process_output_s *next;
+} process_output_t;
+
+typedef struct {
+  bool stop;
+  int epoll_fd, wake_fd;
+  SDL_Mutex *mutex;
+  SDL_Thread *thread;
+  // outputs of collected processes, freed by the reactor once it can't have events left for them
+  process_output_t *garbage;
+} process_reactor_t;
+
+static process_reactor_t reactor = { .epoll_fd = -1, .wake_fd = -1 };
+#endif
+
+static uint32_t PROCESS_READY_EVENT_TYPE = 0;
+
 typedef struct {
   bool running, detached;
   int returncode, deadline;
@@ -73,6 +114,10 @@ typedef struct {
     bool reading[2];
     char buffer[2][READ_BUF_SIZE];
   #endif
+  #ifdef PROCESS_REACTOR
+    process_output_t *output[2];
+    process_output_t *exit_watch;
+  #endif
   process_stream_t child_pipes[3][2];
 } process_t;
 
@@ -324,6 +369,10 @@ static void push_error(lua_State *L, const char *extra, process_error_t err) {
   lua_pushfstring(L, "%s: %s (%d)", extra, msg, err);
 }
 
+#ifdef PROCESS_REACTOR
+static bool exit_watch_wait(process_output_t *watch, int timeout);
+#endif
+
 static bool poll_process(process_t* proc, int timeout) {
   uint32_t ticks;
 
@@ -333,6 +382,12 @@ static bool poll_process(process_t* proc, int timeout) {
   if (timeout == WAIT_DEADLINE)
     timeout = proc->deadline;
 
+#ifdef PROCESS_REACTOR
+  // with a pidfd there's no need to ask, nor to sleep, until the child exited
+  if (proc->exit_watch && !exit_watch_wait(proc->exit_watch, timeout))
+    return true;
+#endif
+
   ticks = SDL_GetTicks();
   do {
     int status;
@@ -354,6 +409,254 @@ static bool signal_process(process_t* proc, signal_e sig) {
   return true;
 }
 
+#ifdef PROCESS_REACTOR
+static void output_arm(process_output_t *output) {
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = output };
+  output->armed = epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, output->fd, &ev) == 0;
+}
+
+static bool output_grow(process_output_t *output) {
+  size_t capacity = output->capacity ? output->capacity * 2 : OUTPUT_BUFFER_MIN;
+  char *data = SDL_malloc(capacity);
+  if (!data)
+    return false;
+  // unwrap the ring at the start of the new buffer
+  size_t head = SDL_min(output->length, output->capacity - output->start);
+  if (output->length) {
+    memcpy(data, output->data + output->start, head);
+    memcpy(data + head, output->data, output->length - head);
+  }
+  SDL_free(output->data);
+  output->data = data;
+  output->capacity = capacity;
+  output->start = 0;
+  return true;
+}
+
+// Reads everything available, returns whether the main thread has to be told about it.
+static bool output_fill(process_output_t *output) {
+  output->armed = false;
+  if (output->pidfd)
+    output->eof = true;
+  while (!output->eof) {
+    if (output->length == output->capacity &&
+        (output->reading || output->capacity >= OUTPUT_BUFFER_MAX || !output_grow(output)))
+      break;
+    if (!output->length && !output->reading)
+      output->start = 0;
+    size_t end = (output->start + output->length) % output->capacity;
+    size_t space = end < output->start ? output->start - end : output->capacity - end;
+    long length = read(output->fd, output->data + end, space);
+    if (length > 0)
+      output->length += length;
+    else if (length == 0)
+      output->eof = true;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+    else if (errno != EINTR) {
+      output->error = errno;
+      output->eof = true;
+    }
+  }
+  // a full buffer is armed again by the main thread, once it's read from
+  if (!output->eof && output->length < output->capacity)
+    output_arm(output);
+  if (output->signalled || (!output->length && !output->eof))
+    return false;
+  output->signalled = true;
+  return true;
+}
+
+static void output_free(process_output_t *output) {
+  SDL_free(output->data);
+  SDL_free(output);
+}
+
+static int reactor_worker(void *ud) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  SDL_Event event = { .type = PROCESS_READY_EVENT_TYPE };
+  bool stop = false;
+  while (!stop) {
+    int count = epoll_wait(reactor.epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+    if (count < 0 && errno != EINTR)
+      break;
+    bool ready = false;
+    SDL_LockMutex(reactor.mutex);
+    for (int i = 0; i < count; ++i) {
+      process_output_t *output = events[i].data.ptr;
+      uint64_t value;
+      if (!output)
+        (void) !read(reactor.wake_fd, &value, sizeof(value));
+      else if (output->fd != -1)
+        ready |= output_fill(output);
+    }
+    while (reactor.garbage) {
+      process_output_t *next = reactor.garbage->next;
+      output_free(reactor.garbage);
+      reactor.garbage = next;
+    }
+    stop = reactor.stop;
+    SDL_UnlockMutex(reactor.mutex);
+    if (ready)
+      SDL_PushEvent(&event);
+  }
+  return 0;
+}
+
+static void reactor_wake(void) {
+  uint64_t value = 1;
+  (void) !write(reactor.wake_fd, &value, sizeof(value));
+}
+
+static void reactor_free(void) {
+  if (reactor.thread) {
+    SDL_LockMutex(reactor.mutex);
+    reactor.stop = true;
+    reactor_wake();
+    SDL_UnlockMutex(reactor.mutex);
+    SDL_WaitThread(reactor.thread, NULL);
+  }
+  while (reactor.garbage) {
+    process_output_t *next = reactor.garbage->next;
+    output_free(reactor.garbage);
+    reactor.garbage = next;
+  }
+  if (reactor.mutex) SDL_DestroyMutex(reactor.mutex);
+  if (reactor.epoll_fd != -1) close(reactor.epoll_fd);
+  if (reactor.wake_fd != -1) close(reactor.wake_fd);
+  memset(&reactor, 0, sizeof(process_reactor_t));
+  reactor.epoll_fd = reactor.wake_fd = -1;
+}
+
+static bool reactor_init(void) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (!PROCESS_READY_EVENT_TYPE)
+    PROCESS_READY_EVENT_TYPE = SDL_RegisterEvents(1);
+  reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  reactor.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (!PROCESS_READY_EVENT_TYPE || reactor.epoll_fd == -1 || reactor.wake_fd == -1
+      || epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.wake_fd, &ev) == -1
+      || !(reactor.mutex = SDL_CreateMutex())
+      || !(reactor.thread = SDL_CreateThread(reactor_worker, "process_reactor", NULL))) {
+    reactor_free();
+    return false;
+  }
+  return true;
+}
+
+static process_output_t *output_new(int fd, bool pidfd) {
+  process_output_t *output = SDL_calloc(1, sizeof(process_output_t));
+  if (!output)
+    return NULL;
+  output->fd = fd;
+  output->pidfd = pidfd;
+  output->armed = true;
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = output };
+  if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    SDL_free(output);
+    return NULL;
+  }
+  return output;
+}
+
+static process_output_t *exit_watch_new(process_handle_t pid) {
+#ifdef SYS_pidfd_open
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  process_output_t *watch;
+  if (fd == -1)
+    return NULL;
+  if (!(watch = output_new(fd, true)))
+    close(fd);
+  return watch;
+#else
+  return NULL;
+#endif
+}
+
+// Waits for the pidfd to be readable, which it stays once the child exited.
+static bool exit_watch_wait(process_output_t *watch, int timeout) {
+  SDL_LockMutex(reactor.mutex);
+  bool exited = watch->eof;
+  int fd = watch->fd;
+  SDL_UnlockMutex(reactor.mutex);
+  if (exited || fd == -1)
+    return true;
+  // the reactor tells as soon as it exited
+  if (timeout == WAIT_NONE)
+    return false;
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int ready;
+  while ((ready = poll(&pfd, 1, timeout == WAIT_INFINITE ? -1 : timeout)) == -1 && errno == EINTR);
+  return ready != 0;
+}
+
+// Stops watching the output, what was already read can still be.
+static void output_close(process_output_t *output) {
+  SDL_LockMutex(reactor.mutex);
+  if (output->fd != -1) {
+    epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, output->fd, NULL);
+    close(output->fd);
+    output->fd = -1;
+    output->eof = true;
+  }
+  SDL_UnlockMutex(reactor.mutex);
+}
+
+static void output_release(process_output_t *output) {
+  output_close(output);
+  if (!reactor.thread) {
+    output_free(output);
+    return;
+  }
+  SDL_LockMutex(reactor.mutex);
+  output->next = reactor.garbage;
+  reactor.garbage = output;
+  reactor_wake();
+  SDL_UnlockMutex(reactor.mutex);
+}
+
+static int output_read(lua_State *L, process_t *self, process_output_t *output, unsigned long read_size) {
+  // Lua may collect other processes while the string is created, so the lock
+  // isn't held meanwhile; the reactor leaves the data in place while reading.
+  SDL_LockMutex(reactor.mutex);
+  size_t length = SDL_min(read_size, SDL_min(output->length, output->capacity - output->start));
+  const char *data = output->data + output->start;
+  bool eof = output->eof;
+  int error = output->error;
+  output->reading = length > 0;
+  if (!length)
+    output->signalled = false;
+  SDL_UnlockMutex(reactor.mutex);
+
+  if (!length) {
+    if (error) {
+      signal_process(self, SIGNAL_TERM);
+      return 0;
+    }
+    if (eof && !poll_process(self, WAIT_NONE))
+      return 0;
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  lua_pushlstring(L, data, length);
+
+  SDL_LockMutex(reactor.mutex);
+  output->reading = false;
+  output->length -= length;
+  output->start = output->length ? (output->start + length) % output->capacity : 0;
+  if (!output->length)
+    output->signalled = false;
+  if (!output->armed && !output->eof && output->fd != -1)
+    output_arm(output);
+  SDL_UnlockMutex(reactor.mutex);
+  return 1;
+}
+#endif
+
+uint32_t process_get_ready_event(void) {
+  return PROCESS_READY_EVENT_TYPE;
+}
+
 static int process_start(lua_State* L) {
   int retval = 1;
   process_t *self = NULL;
@@ -595,6 +898,13 @@ static int process_start(lua_State* L) {
   if (retval == -1)
     return lua_error(L);
 
+#ifdef PROCESS_REACTOR
+  if (reactor.thread || reactor_init()) {
+    for (int stream = STDOUT_FD; stream <= STDERR_FD; ++stream)
+      self->output[stream - 1] = output_new(self->child_pipes[stream][0], false);
+    self->exit_watch = exit_watch_new(self->pid);
+  }
+#endif
   self->running = true;
   return retval;
 }
@@ -626,19 +936,32 @@ static int g_read(lua_State* L, int stream, unsigned long read_size) {
     }
     lua_pushlstring(L, self->buffer[writable_stream_idx], length);
   #else
+    #ifdef PROCESS_REACTOR
+      if (self->output[stream - 1])
+        return output_read(L, self, self->output[stream - 1], read_size);
+    #endif
+    // read as much as is available, in chunks
     luaL_Buffer b;
     luaL_buffinit(L, &b);
-    uint8_t* buffer = (uint8_t*)luaL_prepbuffsize(&b, READ_BUF_SIZE);
-    length = read(self->child_pipes[stream][0], buffer, read_size > READ_BUF_SIZE ? READ_BUF_SIZE : read_size);
-    if (length == 0 && !poll_process(self, WAIT_NONE))
-      return 0;
-    else if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
-      length = 0;
-    if (length < 0) {
-      signal_process(self, SIGNAL_TERM);
-      return 0;
+    size_t total = 0, chunk;
+    read_size = SDL_min(read_size, READ_MAX_SIZE);
+    do {
+      chunk = SDL_min(read_size - total, READ_CHUNK_SIZE);
+      uint8_t* buffer = (uint8_t*)luaL_prepbuffsize(&b, chunk);
+      length = read(self->child_pipes[stream][0], buffer, chunk);
+      if (length > 0) {
+        luaL_addsize(&b, length);
+        total += length;
+      }
+    } while (length == (long)chunk && total < read_size);
+    if (!total) {
+      if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        signal_process(self, SIGNAL_TERM);
+        return 0;
+      }
+      if (length == 0 && !poll_process(self, WAIT_NONE))
+        return 0;
     }
-    luaL_addsize(&b, length);
     luaL_pushresult(&b);
   #endif
   return 1;
@@ -674,6 +997,12 @@ static int f_write(lua_State* L) {
 static int f_close_stream(lua_State* L) {
   process_t* self = (process_t*) luaL_checkudata(L, 1, API_TYPE_PROCESS);
   int stream = luaL_checknumber(L, 2);
+#ifdef PROCESS_REACTOR
+  if (stream != STDIN_FD && self->output[stream - 1]) {
+    output_close(self->output[stream - 1]);
+    self->child_pipes[stream][0] = HANDLE_INVALID;
+  }
+#endif
   close_fd(&self->child_pipes[stream][stream == STDIN_FD ? 1 : 0]);
   lua_pushboolean(L, 1);
   return 1;
@@ -715,6 +1044,32 @@ static int f_read(lua_State* L) {
   return g_read(L, luaL_checknumber(L, 2), luaL_optinteger(L, 3, READ_BUF_SIZE));
 }
 
+static int f_ready_event(lua_State* L) {
+  process_t* self = (process_t*) luaL_checkudata(L, 1, API_TYPE_PROCESS);
+  bool ready_event = false;
+  if (lua_isnoneornil(L, 2)) {
+#ifdef PROCESS_REACTOR
+    ready_event = self->exit_watch != NULL;
+#endif
+    lua_pushboolean(L, ready_event);
+    return 1;
+  }
+  int stream = luaL_checknumber(L, 2);
+  if (stream != STDOUT_FD && stream != STDERR_FD)
+    return luaL_error(L, "error: redirect to handles, FILE* and paths are not supported");
+#ifdef PROCESS_REACTOR
+  // once the stream ended, only the exit of the child is left to tell
+  process_output_t *output = self->output[stream - 1];
+  if (output) {
+    SDL_LockMutex(reactor.mutex);
+    ready_event = !output->eof || self->exit_watch;
+    SDL_UnlockMutex(reactor.mutex);
+  }
+#endif
+  lua_pushboolean(L, ready_event);
+  return 1;
+}
+
 static int f_wait(lua_State* L) {
   process_t* self = (process_t*) luaL_checkudata(L, 1, API_TYPE_PROCESS);
   int timeout = luaL_optnumber(L, 2, 0);
@@ -763,6 +1118,19 @@ static int f_gc(lua_State* L) {
       SDL_UnlockMutex(list->mutex);
     }
   }
+#ifdef PROCESS_REACTOR
+  for (int stream = STDOUT_FD; stream <= STDERR_FD; ++stream) {
+    if (self->output[stream - 1]) {
+      output_release(self->output[stream - 1]);
+      self->output[stream - 1] = NULL;
+      self->child_pipes[stream][0] = HANDLE_INVALID;
+    }
+  }
+  if (self->exit_watch) {
+    output_release(self->exit_watch);
+    self->exit_watch = NULL;
+  }
+#endif
   close_fd(&self->child_pipes[STDIN_FD ][1]);
   close_fd(&self->child_pipes[STDOUT_FD][0]);
   close_fd(&self->child_pipes[STDERR_FD][0]);
@@ -783,6 +1151,9 @@ static int process_gc(lua_State *L) {
     kill_list_wait_all(list);
     kill_list_free(list);
   }
+#ifdef PROCESS_REACTOR
+  reactor_free();
+#endif
   return 0;
 }
 
@@ -794,6 +1165,7 @@ static const struct luaL_Reg process_metatable[] = {
   {"read", f_read},
   {"read_stdout", f_read_stdout},
   {"read_stderr", f_read_stderr},
+  {"ready_event", f_ready_event},
   {"write", f_write},
   {"close_stream", f_close_stream},
   {"wait", f_wait},
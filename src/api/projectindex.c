@@ -0,0 +1,1107 @@
+#include "api.h"
+#include "utf8.h"
+
+#include <SDL3/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+  #include "../utfconv.h"
+  #define INDEX_PATHSEP '\\'
+#else
+  #include <dirent.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #define INDEX_PATHSEP '/'
+#endif
+
+// Amount of directories scanned between wakes of the main loop.
+#define INDEX_WAKE_INTERVAL 64
+// Maximum amount of workers listing directories at the same time.
+#define INDEX_MAX_WORKERS 8
+#define INDEX_CACHE_VERSION "lite-xl project index 1"
+
+typedef struct index_dir_t index_dir_t;
+
+typedef struct {
+  char* name;
+  bool dir;
+  uint64_t size;
+  SDL_Time modified;
+  // contents of directories, NULL for files
+  index_dir_t* content;
+} index_entry_t;
+
+struct index_dir_t {
+  SDL_Time modified;
+  bool scanned;
+  // sorted by name, so that entries can be found by bisecting
+  index_entry_t* entries;
+  size_t count;
+};
+
+typedef struct {
+  // relative to the root, empty for the root itself
+  char* path;
+  // entries to update, or NULL to scan the whole directory
+  char** names;
+  size_t name_count;
+  // scan only if the directory changed since it was cached
+  bool verify;
+} index_task_t;
+
+typedef struct {
+  char* pattern;
+  size_t length;
+  bool use_path, match_dir;
+} index_filter_t;
+
+typedef struct {
+  char** paths;
+  size_t count, capacity;
+} index_paths_t;
+
+typedef struct project_index_t project_index_t;
+
+typedef struct {
+  SDL_Thread* thread;
+  project_index_t* index;
+  // directory being listed, NULL when waiting for tasks
+  const char* path;
+} index_worker_t;
+
+// The index is built and updated from a pool of workers, which list
+// directories at the same time, and take the mutex to merge the listings
+// into the tree. The main thread takes it to read the tree.
+struct project_index_t {
+  index_worker_t workers[INDEX_MAX_WORKERS];
+  int worker_count;
+  SDL_Mutex* mutex;
+  SDL_Condition* condition;
+  SDL_AtomicInt stopping;
+  char* root;
+  size_t root_length;
+  index_dir_t* tree;
+  index_filter_t* filters;
+  size_t filter_count;
+  uint64_t size_limit, signature;
+  char* cache_path;
+  // queued tasks, plus the one being run
+  index_task_t* tasks;
+  size_t task_head, task_count, task_capacity, pending, done;
+  // absolute paths of the directories added and removed since the last poll
+  index_paths_t added, removed;
+  // set by the workers when a filter fails to match, like a pattern too complex
+  void* error;
+  bool closed;
+};
+
+static unsigned int INDEX_EVENT_TYPE = 0;
+
+
+static bool index_grow(void** data, size_t* capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  while (new_capacity < needed) new_capacity *= 2;
+  void* new_data = SDL_realloc(*data, new_capacity * size);
+  if (!new_data) return false;
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+static char* index_join(const char* a, size_t a_length, const char* b) {
+  size_t b_length = strlen(b);
+  char* path = SDL_malloc(a_length + b_length + 2);
+  if (!path) return NULL;
+  memcpy(path, a, a_length);
+  size_t offset = a_length;
+  if (a_length > 0 && b_length > 0)
+    path[offset++] = INDEX_PATHSEP;
+  memcpy(path + offset, b, b_length + 1);
+  return path;
+}
+
+
+static char* index_absolute(const project_index_t* index, const char* relative) {
+  return index_join(index->root, index->root_length, relative);
+}
+
+
+// Returns the path relative to the root, or NULL if it's outside of it.
+static const char* index_relative(const project_index_t* index, const char* path) {
+  if (strncmp(path, index->root, index->root_length) != 0) return NULL;
+  path += index->root_length;
+  if (*path == INDEX_PATHSEP) return path + 1;
+  return *path ? NULL : path;
+}
+
+
+static void index_paths_push(index_paths_t* paths, char* path) {
+  if (path && index_grow((void**)&paths->paths, &paths->capacity, paths->count + 1, sizeof(char*)))
+    paths->paths[paths->count++] = path;
+  else
+    SDL_free(path);
+}
+
+
+static void index_paths_free(index_paths_t* paths) {
+  for (size_t i = 0; i < paths->count; i++)
+    SDL_free(paths->paths[i]);
+  paths->count = 0;
+}
+
+
+static void index_dir_free(project_index_t* index, index_dir_t* dir, const char* path, index_paths_t* removed) {
+  if (!dir) return;
+  if (removed)
+    index_paths_push(removed, index_absolute(index, path));
+  for (size_t i = 0; i < dir->count; i++) {
+    index_entry_t* entry = &dir->entries[i];
+    if (entry->content) {
+      char* child = removed ? index_join(path, strlen(path), entry->name) : NULL;
+      index_dir_free(index, entry->content, child ? child : "", child ? removed : NULL);
+      SDL_free(child);
+    }
+    SDL_free(entry->name);
+  }
+  SDL_free(dir->entries);
+  SDL_free(dir);
+}
+
+
+static int index_compare_entries(const void* a, const void* b) {
+  return strcmp(((const index_entry_t*)a)->name, ((const index_entry_t*)b)->name);
+}
+
+
+static index_entry_t* index_find_entry(index_dir_t* dir, const char* name, size_t length) {
+  size_t lo = 0, hi = dir->count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int cmp = strncmp(dir->entries[mid].name, name, length);
+    if (cmp == 0 && dir->entries[mid].name[length] != '\0') cmp = 1;
+    if (cmp == 0) return &dir->entries[mid];
+    if (cmp < 0) lo = mid + 1; else hi = mid;
+  }
+  return NULL;
+}
+
+
+static index_dir_t* index_find_dir(project_index_t* index, const char* relative) {
+  index_dir_t* dir = index->tree;
+  while (dir && *relative) {
+    const char* separator = strchr(relative, INDEX_PATHSEP);
+    size_t length = separator ? (size_t)(separator - relative) : strlen(relative);
+    index_entry_t* entry = index_find_entry(dir, relative, length);
+    dir = entry ? entry->content : NULL;
+    relative += separator ? length + 1 : length;
+  }
+  return dir;
+}
+
+
+static bool index_queue(project_index_t* index, const char* path, char** names, size_t name_count, bool verify) {
+  if (index->task_head > 0 && index->task_head * 2 >= index->task_count) {
+    memmove(index->tasks, index->tasks + index->task_head, (index->task_count - index->task_head) * sizeof(index_task_t));
+    index->task_count -= index->task_head;
+    index->task_head = 0;
+  }
+  char* copy = SDL_strdup(path);
+  if (!copy || !index_grow((void**)&index->tasks, &index->task_capacity, index->task_count + 1, sizeof(index_task_t))) {
+    SDL_free(copy);
+    return false;
+  }
+  index->tasks[index->task_count++] = (index_task_t){ copy, names, name_count, verify };
+  index->pending++;
+  return true;
+}
+
+
+static void index_task_free(index_task_t* task) {
+  for (size_t i = 0; i < task->name_count; i++)
+    SDL_free(task->names[i]);
+  SDL_free(task->names);
+  SDL_free(task->path);
+}
+
+
+// Matches like string.match, so that the index agrees with Project:is_ignored.
+static bool index_match(const project_index_t* index, const index_filter_t* filter, const char* text, size_t length) {
+  const char* error = NULL;
+  int matched = utf8_pattern_match_bytes(text, length, filter->pattern, filter->length, &error);
+  if (matched < 0)
+    SDL_CompareAndSwapAtomicPointer((void**)&index->error, NULL, (void*)error);
+  return matched > 0;
+}
+
+
+// Mirrors the filtering done by Project:is_ignored, apart from the size
+// limit, along with the check done on directory names before descending
+// into them. Only needs the type, so that ignored entries are never stated.
+static bool index_is_ignored(const project_index_t* index, const char* relative, const char* name, bool dir) {
+  size_t name_length = strlen(name);
+  char* full = NULL;
+  size_t full_length = 0;
+  for (size_t i = 0; i < index->filter_count; i++) {
+    const index_filter_t* filter = &index->filters[i];
+    const char* test = name;
+    size_t test_length = name_length;
+    if (filter->use_path) {
+      if (!full) {
+        // the absolute path, with a leading and a trailing forward slash
+        char* path = index_absolute(index, relative);
+        if (!path) return false;
+        full_length = strlen(path) + 1;
+        full = SDL_malloc(full_length + 2);
+        if (!full) { SDL_free(path); return false; }
+        full[0] = '/';
+        for (size_t j = 1; j < full_length; j++)
+          full[j] = path[j - 1] == '\\' ? '/' : path[j - 1];
+        full[full_length] = '/';
+        full[full_length + 1] = '\0';
+        SDL_free(path);
+      }
+      test = full;
+      test_length = full_length;
+    }
+    bool ignored = false;
+    if (filter->match_dir) {
+      if (dir) {
+        char buffer[512];
+        if (test == full)
+          ignored = index_match(index, filter, full, full_length + 1);
+        else if (name_length + 1 < sizeof(buffer)) {
+          memcpy(buffer, name, name_length);
+          buffer[name_length] = '/';
+          buffer[name_length + 1] = '\0';
+          ignored = index_match(index, filter, buffer, name_length + 1);
+        }
+      }
+    } else
+      ignored = index_match(index, filter, test, test_length);
+    // directories are also matched by name before descending into them
+    if (!ignored && dir && (filter->use_path || filter->match_dir))
+      ignored = index_match(index, filter, name, name_length);
+    if (ignored) {
+      SDL_free(full);
+      return true;
+    }
+  }
+  SDL_free(full);
+  return false;
+}
+
+
+static bool index_accept(const project_index_t* index, const char* relative, const char* name, bool dir) {
+  char* child = index_join(relative, strlen(relative), name);
+  bool accepted = child && !index_is_ignored(index, child, name, dir);
+  SDL_free(child);
+  return accepted;
+}
+
+
+typedef struct {
+  index_entry_t* entries;
+  size_t count, capacity;
+} index_listing_t;
+
+static bool index_listing_push(index_listing_t* listing, const char* name, bool dir, uint64_t size, SDL_Time modified) {
+  char* copy = SDL_strdup(name);
+  if (!copy || !index_grow((void**)&listing->entries, &listing->capacity, listing->count + 1, sizeof(index_entry_t))) {
+    SDL_free(copy);
+    return false;
+  }
+  listing->entries[listing->count++] = (index_entry_t){ copy, dir, size, modified, NULL };
+  return true;
+}
+
+
+static void index_listing_free(index_listing_t* listing) {
+  for (size_t i = 0; i < listing->count; i++)
+    SDL_free(listing->entries[i].name);
+  SDL_free(listing->entries);
+}
+
+
+#ifdef _WIN32
+
+static SDL_Time index_filetime(FILETIME time) {
+  return SDL_TimeFromWindows(time.dwLowDateTime, time.dwHighDateTime);
+}
+
+
+static bool index_stat(const char* path, bool* dir, uint64_t* size, SDL_Time* modified) {
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (!wpath) return false;
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  bool ok = GetFileAttributesExW(wpath, GetFileExInfoStandard, &data);
+  SDL_free(wpath);
+  // directory links and junctions aren't followed, as they can loop
+  if (!ok || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY && data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+    return false;
+  *dir = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+  *size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  *modified = index_filetime(data.ftLastWriteTime);
+  return true;
+}
+
+
+// Windows returns the attributes, size and modification time of every
+// entry along with its name, so nothing needs to be stated.
+static bool index_list_dir(const project_index_t* index, const char* relative, const char* path, index_listing_t* listing) {
+  char* pattern = index_join(path, strlen(path), "*");
+  LPWSTR wpattern = pattern ? utfconv_utf8towc(pattern) : NULL;
+  SDL_free(pattern);
+  if (!wpattern) return false;
+  WIN32_FIND_DATAW data;
+  HANDLE handle = FindFirstFileExW(wpattern, FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+  SDL_free(wpattern);
+  if (handle == INVALID_HANDLE_VALUE) return false;
+  bool ok = true;
+  do {
+    char* name = utfconv_wctoutf8(data.cFileName);
+    bool dir = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+    uint64_t size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    bool link = dir && data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT;
+    if (name && !link && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && size < index->size_limit
+      && index_accept(index, relative, name, dir))
+      ok = index_listing_push(listing, name, dir, size, index_filetime(data.ftLastWriteTime));
+    SDL_free(name);
+  } while (ok && !SDL_GetAtomicInt((SDL_AtomicInt*)&index->stopping) && FindNextFileW(handle, &data));
+  FindClose(handle);
+  return ok;
+}
+
+#else
+
+static bool index_stat_at(int fd, const char* name, bool* dir, uint64_t* size, SDL_Time* modified) {
+  struct stat s;
+  if (fstatat(fd, name, &s, 0) != 0 || !(S_ISREG(s.st_mode) || S_ISDIR(s.st_mode)))
+    return false;
+  *dir = S_ISDIR(s.st_mode);
+  *size = s.st_size;
+#ifdef __APPLE__
+  *modified = (SDL_Time)s.st_mtimespec.tv_sec * SDL_NS_PER_SECOND + s.st_mtimespec.tv_nsec;
+#else
+  *modified = (SDL_Time)s.st_mtim.tv_sec * SDL_NS_PER_SECOND + s.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+
+static bool index_stat(const char* path, bool* dir, uint64_t* size, SDL_Time* modified) {
+  return index_stat_at(AT_FDCWD, path, dir, size, modified);
+}
+
+
+// Symbolic links to a directory containing them, like Release -> .. in
+// build trees, would be followed forever.
+static bool index_is_loop(const char* path, const char* name, char** real_path) {
+  char* child = index_join(path, strlen(path), name);
+  struct stat s;
+  bool link = child && lstat(child, &s) == 0 && S_ISLNK(s.st_mode);
+  char* target = link ? realpath(child, NULL) : NULL;
+  SDL_free(child);
+  if (!target) return false;
+  if (!*real_path) *real_path = realpath(path, NULL);
+  size_t length = strlen(target);
+  bool loop = *real_path && strncmp(*real_path, target, length) == 0
+    && ((*real_path)[length] == '/' || (*real_path)[length] == '\0' || length == 1);
+  free(target);
+  return loop;
+}
+
+
+// Entries are filtered with the type readdir returns before stating them,
+// relative to the open directory to skip resolving the whole path again.
+static bool index_list_dir(const project_index_t* index, const char* relative, const char* path, index_listing_t* listing) {
+  DIR* handle = opendir(path);
+  if (!handle) return false;
+  int fd = dirfd(handle);
+  bool ok = true;
+  char* real_path = NULL;
+  struct dirent* entry;
+  while (ok && !SDL_GetAtomicInt((SDL_AtomicInt*)&index->stopping) && (entry = readdir(handle))) {
+    const char* name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    bool dir = false, stated = false;
+    uint64_t size = 0;
+    SDL_Time modified = 0;
+#ifdef DT_DIR
+    dir = entry->d_type == DT_DIR;
+    if (entry->d_type != DT_DIR && entry->d_type != DT_REG)
+#endif
+    {
+      // symbolic links, and file systems that don't report types
+      if (!index_stat_at(fd, name, &dir, &size, &modified) || (dir && index_is_loop(path, name, &real_path)))
+        continue;
+      stated = true;
+    }
+    if (!index_accept(index, relative, name, dir)) continue;
+    if (!stated && !index_stat_at(fd, name, &dir, &size, &modified)) continue;
+    if (size < index->size_limit)
+      ok = index_listing_push(listing, name, dir, size, modified);
+  }
+  closedir(handle);
+  free(real_path);
+  return ok;
+}
+
+#endif
+
+
+// Lists the entries of a directory, or only the given names, without
+// touching the tree, so that workers can do it at the same time.
+static bool index_list(const project_index_t* index, const char* relative, char** names, size_t name_count, index_listing_t* listing, SDL_Time* modified) {
+  char* path = index_absolute(index, relative);
+  bool dir = false;
+  uint64_t size;
+  char* real_path = NULL;
+  bool ok = path && index_stat(path, &dir, &size, modified) && dir;
+  if (ok && !names)
+    ok = index_list_dir(index, relative, path, listing);
+  for (size_t i = 0; ok && i < name_count; i++) {
+    bool duplicate = false;
+    for (size_t j = 0; j < i && !duplicate; j++)
+      duplicate = strcmp(names[i], names[j]) == 0;
+    char* child = duplicate ? NULL : index_join(path, strlen(path), names[i]);
+    SDL_Time child_modified;
+    if (child && index_stat(child, &dir, &size, &child_modified) && size < index->size_limit
+      && index_accept(index, relative, names[i], dir)
+#ifndef _WIN32
+      && !(dir && index_is_loop(path, names[i], &real_path))
+#endif
+    )
+      ok = index_listing_push(listing, names[i], dir, size, child_modified);
+    SDL_free(child);
+  }
+  free(real_path);
+  SDL_free(path);
+  return ok;
+}
+
+
+// Replaces the entries of a directory with a new listing, or only the named
+// ones, under the mutex. Subdirectories that were already indexed keep their
+// contents, new ones are queued to be scanned, and the ones gone are freed.
+static void index_merge(project_index_t* index, const char* relative, index_listing_t* listing, char** names, size_t name_count, SDL_Time modified) {
+  index_dir_t* dir = index_find_dir(index, relative);
+  if (!dir) return;
+  index_entry_t* entries = SDL_malloc((listing->count + (names ? dir->count : 0)) * sizeof(index_entry_t) + 1);
+  if (!entries) return;
+  size_t count = 0;
+  for (size_t i = 0; i < listing->count; i++) {
+    index_entry_t entry = listing->entries[i];
+    index_entry_t* previous = entry.dir ? index_find_entry(dir, entry.name, strlen(entry.name)) : NULL;
+    if (previous && previous->content) {
+      entry.content = previous->content;
+      previous->content = NULL;
+    } else if (entry.dir && (entry.content = SDL_calloc(1, sizeof(index_dir_t)))) {
+      char* child = index_join(relative, strlen(relative), entry.name);
+      if (child && index_queue(index, child, NULL, 0, false))
+        index_paths_push(&index->added, index_absolute(index, child));
+      SDL_free(child);
+    }
+    entries[count++] = entry;
+  }
+  listing->count = 0;
+  if (names) {
+    // keep the entries that weren't named, now that no more lookups are done
+    for (size_t i = 0; i < dir->count; i++) {
+      bool named = false;
+      for (size_t j = 0; j < name_count && !named; j++)
+        named = strcmp(dir->entries[i].name, names[j]) == 0;
+      if (!named) {
+        entries[count++] = dir->entries[i];
+        dir->entries[i].name = NULL;
+        dir->entries[i].content = NULL;
+      }
+    }
+  }
+  SDL_qsort(entries, count, sizeof(index_entry_t), index_compare_entries);
+
+  index_entry_t* old_entries = dir->entries;
+  size_t old_count = dir->count;
+  dir->entries = entries;
+  dir->count = count;
+  dir->modified = modified;
+  dir->scanned = true;
+  // whatever wasn't moved over was removed
+  for (size_t i = 0; i < old_count; i++) {
+    if (old_entries[i].content) {
+      char* child = index_join(relative, strlen(relative), old_entries[i].name);
+      if (child)
+        index_dir_free(index, old_entries[i].content, child, &index->removed);
+      SDL_free(child);
+    }
+    SDL_free(old_entries[i].name);
+  }
+  SDL_free(old_entries);
+}
+
+
+static void index_run(project_index_t* index, index_task_t* task) {
+  SDL_LockMutex(index->mutex);
+  index_dir_t* dir = index_find_dir(index, task->path);
+  bool found = dir != NULL, scanned = dir && dir->scanned;
+  SDL_Time cached = dir ? dir->modified : 0;
+  SDL_UnlockMutex(index->mutex);
+  if (!found) return;
+  if (task->verify && scanned) {
+    char* path = index_absolute(index, task->path);
+    bool is_dir;
+    uint64_t size;
+    SDL_Time modified;
+    bool changed = !path || !index_stat(path, &is_dir, &size, &modified) || modified != cached;
+    SDL_free(path);
+    if (!changed) return;
+  }
+  // names alone would leave a directory that wasn't listed yet incomplete
+  char** names = scanned ? task->names : NULL;
+  index_listing_t listing = { 0 };
+  SDL_Time modified;
+  if (index_list(index, task->path, names, names ? task->name_count : 0, &listing, &modified)
+    && !SDL_GetAtomicInt(&index->stopping)) {
+    SDL_LockMutex(index->mutex);
+    index_merge(index, task->path, &listing, names, task->name_count, modified);
+    SDL_UnlockMutex(index->mutex);
+  }
+  index_listing_free(&listing);
+}
+
+
+// Takes the first queued task for a directory no other worker is listing,
+// so that listings of a directory are merged in the order they were made.
+static bool index_take_task(project_index_t* index, index_task_t* task) {
+  for (size_t i = index->task_head; i < index->task_count; i++) {
+    bool busy = false;
+    for (int j = 0; j < index->worker_count && !busy; j++)
+      busy = index->workers[j].path && strcmp(index->workers[j].path, index->tasks[i].path) == 0;
+    if (!busy) {
+      *task = index->tasks[i];
+      index->tasks[i] = index->tasks[index->task_head++];
+      if (index->task_head == index->task_count)
+        index->task_head = index->task_count = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static int index_thread(void* data) {
+  index_worker_t* worker = data;
+  project_index_t* index = worker->index;
+  SDL_Event event = { .type = INDEX_EVENT_TYPE };
+  SDL_LockMutex(index->mutex);
+  while (true) {
+    index_task_t task = { 0 };
+    while (!SDL_GetAtomicInt(&index->stopping) && !index_take_task(index, &task))
+      SDL_WaitCondition(index->condition, index->mutex);
+    if (SDL_GetAtomicInt(&index->stopping))
+      break;
+    worker->path = task.path;
+    SDL_UnlockMutex(index->mutex);
+
+    index_run(index, &task);
+
+    SDL_LockMutex(index->mutex);
+    worker->path = NULL;
+    index_task_free(&task);
+    bool idle = --index->pending == 0;
+    // wakes the other workers for the tasks queued, or held back for this directory
+    SDL_BroadcastCondition(index->condition);
+    if (idle || ++index->done % INDEX_WAKE_INTERVAL == 0)
+      SDL_PushEvent(&event);
+  }
+  SDL_UnlockMutex(index->mutex);
+  return 0;
+}
+
+
+static uint64_t index_hash(uint64_t hash, const void* data, size_t length) {
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
+  return hash;
+}
+
+
+// Cached trees are stored depth first, as a line with the modification time
+// and the amount of entries of a directory, followed by a line per entry,
+// and then by the contents of each subdirectory in order.
+static void index_save_dir(SDL_IOStream* io, const index_dir_t* dir) {
+  bool complete = dir->scanned;
+  for (size_t i = 0; i < dir->count; i++)
+    complete = complete && !strchr(dir->entries[i].name, '\n');
+  // directories that can't be stored fully are saved as changed, to be scanned again
+  SDL_IOprintf(io, "%lld %zu\n", complete ? (long long)dir->modified : 0LL, complete ? dir->count : 0);
+  if (!complete) return;
+  for (size_t i = 0; i < dir->count; i++) {
+    const index_entry_t* entry = &dir->entries[i];
+    SDL_IOprintf(io, "%c %llu %lld %s\n", entry->dir ? 'd' : 'f', (unsigned long long)entry->size,
+      (long long)entry->modified, entry->name);
+  }
+  for (size_t i = 0; i < dir->count; i++) {
+    if (dir->entries[i].content)
+      index_save_dir(io, dir->entries[i].content);
+  }
+}
+
+
+static bool index_save(project_index_t* index) {
+  size_t length = strlen(index->cache_path);
+  char* temp_path = SDL_malloc(length + 5);
+  if (!temp_path) return false;
+  memcpy(temp_path, index->cache_path, length);
+  memcpy(temp_path + length, ".tmp", 5);
+  SDL_IOStream* io = SDL_IOFromFile(temp_path, "wb");
+  if (!io) {
+    SDL_free(temp_path);
+    return false;
+  }
+  SDL_IOprintf(io, "%s\n%s\n%llx\n", INDEX_CACHE_VERSION, index->root, (unsigned long long)index->signature);
+  index_save_dir(io, index->tree);
+  bool ok = SDL_CloseIO(io) && SDL_RenamePath(temp_path, index->cache_path);
+  if (!ok)
+    SDL_RemovePath(temp_path);
+  SDL_free(temp_path);
+  return ok;
+}
+
+
+static char* index_read_line(char** cursor, char* end) {
+  char* line = *cursor;
+  char* newline = line < end ? memchr(line, '\n', end - line) : NULL;
+  if (!newline) return NULL;
+  *newline = '\0';
+  *cursor = newline + 1;
+  return line;
+}
+
+
+static index_dir_t* index_load_dir(project_index_t* index, char** cursor, char* end, const char* relative) {
+  char* line = index_read_line(cursor, end);
+  char* next;
+  if (!line) return NULL;
+  index_dir_t* dir = SDL_calloc(1, sizeof(index_dir_t));
+  if (!dir) return NULL;
+  dir->modified = strtoll(line, &next, 10);
+  size_t count = strtoull(next, NULL, 10);
+  dir->scanned = dir->modified != 0;
+  if (count > 0 && !(dir->entries = SDL_calloc(count, sizeof(index_entry_t))))
+    goto error;
+  for (; dir->count < count; dir->count++) {
+    index_entry_t* entry = &dir->entries[dir->count];
+    if (!(line = index_read_line(cursor, end)) || (line[0] != 'd' && line[0] != 'f') || line[1] != ' ')
+      goto error;
+    entry->dir = line[0] == 'd';
+    entry->size = strtoull(line + 2, &next, 10);
+    entry->modified = strtoll(next, &next, 10);
+    if (*next != ' ' || !(entry->name = SDL_strdup(next + 1)))
+      goto error;
+  }
+  // the worker isn't started yet while loading
+  index_paths_push(&index->added, index_absolute(index, relative));
+  index_queue(index, relative, NULL, 0, true);
+  for (size_t i = 0; i < dir->count; i++) {
+    if (!dir->entries[i].dir) continue;
+    char* child = index_join(relative, strlen(relative), dir->entries[i].name);
+    if (!child || !(dir->entries[i].content = index_load_dir(index, cursor, end, child))) {
+      SDL_free(child);
+      goto error;
+    }
+    SDL_free(child);
+  }
+  return dir;
+error:
+  index_dir_free(index, dir, "", NULL);
+  return NULL;
+}
+
+
+// Loads the cached tree if it was saved for the same root and filters, and
+// queues every directory in it to be checked for changes.
+static bool index_load(project_index_t* index) {
+  size_t size;
+  char* data = SDL_LoadFile(index->cache_path, &size);
+  if (!data) return false;
+  char* cursor = data, *end = data + size;
+  char* version = index_read_line(&cursor, end);
+  char* root = index_read_line(&cursor, end);
+  char* signature = index_read_line(&cursor, end);
+  if (version && root && signature && strcmp(version, INDEX_CACHE_VERSION) == 0 && strcmp(root, index->root) == 0
+    && strtoull(signature, NULL, 16) == index->signature)
+    index->tree = index_load_dir(index, &cursor, end, "");
+  SDL_free(data);
+  if (!index->tree) {
+    // drop whatever was queued from a partial load
+    for (size_t i = index->task_head; i < index->task_count; i++)
+      index_task_free(&index->tasks[i]);
+    index->task_head = index->task_count = index->pending = 0;
+    index_paths_free(&index->added);
+  }
+  return index->tree != NULL;
+}
+
+
+static void index_stop(project_index_t* index) {
+  if (index->closed) return;
+  index->closed = true;
+  SDL_LockMutex(index->mutex);
+  SDL_SetAtomicInt(&index->stopping, 1);
+  SDL_BroadcastCondition(index->condition);
+  SDL_UnlockMutex(index->mutex);
+  for (int i = 0; i < index->worker_count; i++)
+    SDL_WaitThread(index->workers[i].thread, NULL);
+  index->worker_count = 0;
+}
+
+
+static int f_index_new(lua_State* L) {
+  size_t root_length;
+  const char* root = luaL_checklstring(L, 1, &root_length);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_Number size_limit = luaL_optnumber(L, 3, 0);
+  const char* cache_path = luaL_optstring(L, 4, NULL);
+  if (INDEX_EVENT_TYPE == 0)
+    INDEX_EVENT_TYPE = SDL_RegisterEvents(1);
+
+  project_index_t* index = lua_newuserdata(L, sizeof(project_index_t));
+  memset(index, 0, sizeof(project_index_t));
+  index->closed = true;
+  luaL_setmetatable(L, API_TYPE_PROJECT_INDEX);
+  if (!(index->root = SDL_strdup(root)) || !(index->mutex = SDL_CreateMutex())
+    || !(index->condition = SDL_CreateCondition()) || (cache_path && !(index->cache_path = SDL_strdup(cache_path))))
+    return luaL_error(L, "not enough memory to create the project index");
+  index->root_length = root_length;
+  index->size_limit = size_limit > 0 ? (uint64_t)size_limit : UINT64_MAX;
+  index->signature = index_hash(14695981039346656037ull, &index->size_limit, sizeof(index->size_limit));
+
+  // filters as compiled by Project, { pattern = string, use_path = bool, match_dir = bool }
+  size_t filter_count = lua_rawlen(L, 2);
+  if (filter_count > 0 && !(index->filters = SDL_calloc(filter_count, sizeof(index_filter_t))))
+    return luaL_error(L, "not enough memory to create the project index");
+  for (size_t i = 1; i <= filter_count; i++) {
+    lua_rawgeti(L, 2, i);
+    if (lua_istable(L, -1)) {
+      index_filter_t* filter = &index->filters[index->filter_count];
+      lua_getfield(L, -1, "pattern");
+      size_t length;
+      const char* pattern = lua_tolstring(L, -1, &length);
+      if (pattern) {
+        // the index would disagree with Project on the names these fail on
+        const char* error;
+        if (!utf8_pattern_check(pattern, length, &error))
+          return luaL_error(L, "cannot match the pattern \"%s\": %s", pattern, error);
+        filter->length = length;
+        if (!(filter->pattern = SDL_malloc(length + 1)))
+          return luaL_error(L, "not enough memory to create the project index");
+        memcpy(filter->pattern, pattern, length + 1);
+        lua_getfield(L, -2, "use_path");
+        filter->use_path = lua_toboolean(L, -1);
+        lua_getfield(L, -3, "match_dir");
+        filter->match_dir = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        index->signature = index_hash(index->signature, pattern, length + 1);
+        index->signature = index_hash(index->signature, &filter->use_path, sizeof(bool));
+        index->signature = index_hash(index->signature, &filter->match_dir, sizeof(bool));
+        index->filter_count++;
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (!index->cache_path || !index_load(index)) {
+    if (!(index->tree = SDL_calloc(1, sizeof(index_dir_t))))
+      return luaL_error(L, "not enough memory to create the project index");
+    index_paths_push(&index->added, SDL_strdup(root));
+    index_queue(index, "", NULL, 0, false);
+  }
+  index->closed = false;
+  int workers = SDL_clamp(SDL_GetNumLogicalCPUCores(), 1, INDEX_MAX_WORKERS);
+  // the workers only take tasks once they are all started, under the mutex
+  SDL_LockMutex(index->mutex);
+  for (; index->worker_count < workers; index->worker_count++) {
+    index_worker_t* worker = &index->workers[index->worker_count];
+    worker->index = index;
+    if (!(worker->thread = SDL_CreateThread(index_thread, "project_index", worker)))
+      break;
+  }
+  SDL_UnlockMutex(index->mutex);
+  if (index->worker_count == 0) {
+    index->closed = true;
+    return luaL_error(L, "unable to start indexing: %s", SDL_GetError());
+  }
+  return 1;
+}
+
+
+static int f_index_refresh(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  const char* relative = index_relative(index, luaL_checkstring(L, 2));
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  if (!relative || index->closed) return 0;
+  char** names = NULL;
+  size_t name_count = 0;
+  if (lua_istable(L, 3)) {
+    size_t length = lua_rawlen(L, 3);
+    if (!(names = SDL_calloc(length + 1, sizeof(char*))))
+      return luaL_error(L, "not enough memory to refresh the project index");
+    for (size_t i = 1; i <= length; i++) {
+      lua_rawgeti(L, 3, i);
+      const char* name = lua_tostring(L, -1);
+      if (name && !strchr(name, INDEX_PATHSEP) && (names[name_count] = SDL_strdup(name)))
+        name_count++;
+      lua_pop(L, 1);
+    }
+  }
+  SDL_LockMutex(index->mutex);
+  bool queued = index_queue(index, relative, names, name_count, false);
+  SDL_BroadcastCondition(index->condition);
+  SDL_UnlockMutex(index->mutex);
+  if (!queued) {
+    index_task_free(&(index_task_t){ NULL, names, name_count, false });
+    return luaL_error(L, "not enough memory to refresh the project index");
+  }
+  return 0;
+}
+
+
+static void index_push_paths(lua_State* L, index_paths_t* paths) {
+  lua_createtable(L, (int)paths->count, 0);
+  for (size_t i = 0; i < paths->count; i++) {
+    lua_pushstring(L, paths->paths[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  index_paths_free(paths);
+}
+
+
+static int f_index_poll(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  const char* error = SDL_GetAtomicPointer(&index->error);
+  if (error) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "cannot match the ignored files: %s", error);
+    return 2;
+  }
+  SDL_LockMutex(index->mutex);
+  index_push_paths(L, &index->added);
+  index_push_paths(L, &index->removed);
+  lua_pushboolean(L, index->pending > 0);
+  SDL_UnlockMutex(index->mutex);
+  return 3;
+}
+
+
+static int f_index_is_scanning(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  SDL_LockMutex(index->mutex);
+  lua_pushboolean(L, index->pending > 0);
+  SDL_UnlockMutex(index->mutex);
+  return 1;
+}
+
+
+typedef struct {
+  lua_State* L;
+  char* path;
+  size_t length, capacity;
+  lua_Integer count;
+  // push records like the ones of Project:files instead of paths
+  bool details;
+} index_walk_t;
+
+static void index_push_files(index_walk_t* walk, const index_dir_t* dir) {
+  size_t length = walk->length;
+  for (size_t i = 0; i < dir->count; i++) {
+    const index_entry_t* entry = &dir->entries[i];
+    size_t name_length = strlen(entry->name);
+    if (!index_grow((void**)&walk->path, &walk->capacity, length + name_length + 2, 1))
+      luaL_error(walk->L, "not enough memory to list the project files");
+    if (length > 0) walk->path[length] = INDEX_PATHSEP;
+    memcpy(walk->path + length + (length > 0), entry->name, name_length);
+    walk->length = length + (length > 0) + name_length;
+    if (entry->content) {
+      index_push_files(walk, entry->content);
+    } else if (!entry->dir && walk->details) {
+      lua_createtable(walk->L, 0, 4);
+      lua_pushvalue(walk->L, -3);
+      lua_pushlstring(walk->L, walk->path, walk->length);
+      lua_concat(walk->L, 2);
+      lua_setfield(walk->L, -2, "filename");
+      lua_pushliteral(walk->L, "file");
+      lua_setfield(walk->L, -2, "type");
+      lua_pushinteger(walk->L, (lua_Integer)entry->size);
+      lua_setfield(walk->L, -2, "size");
+      lua_pushnumber(walk->L, (double)entry->modified / 1000000000.0);
+      lua_setfield(walk->L, -2, "modified");
+      lua_rawseti(walk->L, -2, ++walk->count);
+    } else if (!entry->dir) {
+      lua_pushvalue(walk->L, -2);
+      lua_pushlstring(walk->L, walk->path, walk->length);
+      lua_concat(walk->L, 2);
+      lua_rawseti(walk->L, -2, ++walk->count);
+    }
+  }
+  walk->length = length;
+}
+
+
+static int index_files_protected(lua_State* L) {
+  project_index_t* index = lua_touserdata(L, 1);
+  index_walk_t* walk = lua_touserdata(L, 2);
+  walk->L = L;
+  lua_settop(L, 3);
+  lua_newtable(L);
+  index_push_files(walk, index->tree);
+  return 1;
+}
+
+
+static int f_index_files(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  luaL_optstring(L, 2, NULL);
+  index_walk_t walk = { 0 };
+  walk.details = lua_toboolean(L, 3);
+  lua_settop(L, 2);
+  if (lua_isnil(L, 2)) {
+    lua_pushliteral(L, "");
+    lua_replace(L, 2);
+  }
+  // the mutex must be released whatever happens while building the list
+  lua_pushcfunction(L, index_files_protected);
+  lua_pushlightuserdata(L, index);
+  lua_pushlightuserdata(L, &walk);
+  lua_pushvalue(L, 2);
+  SDL_LockMutex(index->mutex);
+  int status = lua_pcall(L, 3, 1, 0);
+  bool scanning = index->pending > 0;
+  SDL_UnlockMutex(index->mutex);
+  SDL_free(walk.path);
+  if (status != LUA_OK)
+    return lua_error(L);
+  lua_pushboolean(L, scanning);
+  return 2;
+}
+
+
+static int f_index_list_dir(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  const char* relative = index_relative(index, luaL_checkstring(L, 2));
+  if (!relative) return 0;
+  SDL_LockMutex(index->mutex);
+  index_dir_t* dir = index_find_dir(index, relative);
+  if (!dir || !dir->scanned) {
+    SDL_UnlockMutex(index->mutex);
+    return 0;
+  }
+  // copied out first, as creating tables can raise errors
+  size_t count = dir->count;
+  index_entry_t* entries = SDL_malloc(count * sizeof(index_entry_t) + 1);
+  char** names = SDL_malloc(count * sizeof(char*) + 1);
+  bool ok = entries && names;
+  for (size_t i = 0; ok && i < count; i++) {
+    entries[i] = dir->entries[i];
+    names[i] = entries[i].name = SDL_strdup(dir->entries[i].name);
+    if (!names[i]) {
+      count = i;
+      ok = false;
+    }
+  }
+  SDL_UnlockMutex(index->mutex);
+  if (ok) {
+    lua_createtable(L, (int)count, 0);
+    for (size_t i = 0; i < count; i++) {
+      lua_createtable(L, 0, 4);
+      lua_pushstring(L, entries[i].name);
+      lua_setfield(L, -2, "name");
+      lua_pushstring(L, entries[i].dir ? "dir" : "file");
+      lua_setfield(L, -2, "type");
+      lua_pushinteger(L, (lua_Integer)entries[i].size);
+      lua_setfield(L, -2, "size");
+      lua_pushnumber(L, (double)entries[i].modified / 1000000000.0);
+      lua_setfield(L, -2, "modified");
+      lua_rawseti(L, -2, i + 1);
+    }
+  }
+  for (size_t i = 0; i < count; i++)
+    SDL_free(names[i]);
+  SDL_free(names);
+  SDL_free(entries);
+  if (!ok)
+    return luaL_error(L, "not enough memory to list the directory");
+  return 1;
+}
+
+
+static int f_index_close(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  if (index->closed) return 0;
+  index_stop(index);
+  // the tree can't be trusted once a filter failed
+  if (index->cache_path && !SDL_GetAtomicPointer(&index->error) && !index_save(index)) {
+    lua_pushnil(L);
+    lua_pushstring(L, SDL_GetError());
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int f_index_gc(lua_State* L) {
+  project_index_t* index = luaL_checkudata(L, 1, API_TYPE_PROJECT_INDEX);
+  index_stop(index);
+  for (size_t i = index->task_head; i < index->task_count; i++)
+    index_task_free(&index->tasks[i]);
+  SDL_free(index->tasks);
+  index_paths_free(&index->added);
+  index_paths_free(&index->removed);
+  SDL_free(index->added.paths);
+  SDL_free(index->removed.paths);
+  index_dir_free(index, index->tree, "", NULL);
+  for (size_t i = 0; i < index->filter_count; i++)
+    SDL_free(index->filters[i].pattern);
+  SDL_free(index->filters);
+  SDL_free(index->cache_path);
+  SDL_free(index->root);
+  if (index->condition)
+    SDL_DestroyCondition(index->condition);
+  if (index->mutex)
+    SDL_DestroyMutex(index->mutex);
+  return 0;
+}
+
+
+static const luaL_Reg projectindex_lib[] = {
+  { "new", f_index_new },
+  { NULL,  NULL        }
+};
+
+static const luaL_Reg index_metatable[] = {
+  { "__gc",        f_index_gc          },
+  { "refresh",     f_index_refresh     },
+  { "poll",        f_index_poll        },
+  { "is_scanning", f_index_is_scanning },
+  { "files",       f_index_files       },
+  { "list_dir",    f_index_list_dir    },
+  { "close",       f_index_close       },
+  { NULL,          NULL                }
+};
+
+
+int luaopen_projectindex(lua_State* L) {
+  luaL_newmetatable(L, API_TYPE_PROJECT_INDEX);
+  luaL_setfuncs(L, index_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_newlib(L, projectindex_lib);
+  return 1;
+}
@@ -188,6 +188,39 @@ static int f_font_get_path(lua_State *L) {
   return 1;
 }
 
+static int f_font_get_bytesize(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX];
+  bool table = font_retrieve(L, fonts, 1);
+
+  if (table) {
+    lua_newtable(L);
+  }
+  for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; ++i) {
+    lua_pushinteger(L, ren_font_get_bytesize(fonts[i]));
+    if (table)
+      lua_rawseti(L, -2, i+1);
+  }
+  return 1;
+}
+
+static int f_font_set_atlas_budget(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
+  lua_Integer budget = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, budget >= 0, 2, "budget must not be negative");
+  ren_font_group_set_atlas_budget(fonts, budget);
+  return 0;
+}
+
+static int f_font_prewarm(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
+  lua_Integer first = luaL_optinteger(L, 2, 0x20);
+  lua_Integer last = luaL_optinteger(L, 3, 0xFF);
+  luaL_argcheck(L, first >= 0, 2, "codepoint must not be negative");
+  if (last >= first)
+    ren_font_group_prewarm(fonts, first, last);
+  return 0;
+}
+
 static int f_font_set_tab_size(lua_State *L) {
   RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
   int n = luaL_checknumber(L, 2);
@@ -306,6 +339,43 @@ static int f_show_debug(lua_State *L) {
 }
 
 
+static int f_validate_cache(lua_State *L) {
+  size_t checked, stale;
+  luaL_checkany(L, 1);
+  rencache_validate(lua_toboolean(L, 1), &checked, &stale);
+  lua_pushinteger(L, checked);
+  lua_pushinteger(L, stale);
+  return 2;
+}
+
+
+static const char *upload_mode_opts[] = { "rects", "batched", 0 };
+
+static int f_set_upload_mode(lua_State *L) {
+  ren_set_upload_mode((ERenUploadMode) luaL_checkoption(L, 1, NULL, upload_mode_opts));
+  rencache_invalidate();
+  return 0;
+}
+
+
+static int f_get_text_run_stats(lua_State *L) {
+  RenTextRunStats stats;
+  ren_get_text_run_stats(&stats);
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, stats.count);
+  lua_setfield(L, -2, "runs");
+  lua_pushinteger(L, stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, stats.draw_hits);
+  lua_setfield(L, -2, "draw_hits");
+  lua_pushinteger(L, stats.draw_misses);
+  lua_setfield(L, -2, "draw_misses");
+  return 1;
+}
+
+
 static int f_get_size(lua_State *L) {
   int w = 0, h = 0;
   RenWindow *window = ren_get_target_window();
@@ -396,6 +466,9 @@ static int f_draw_text(lua_State *L) {
 
 static const luaL_Reg lib[] = {
   { "show_debug",         f_show_debug         },
+  { "validate_cache",     f_validate_cache     },
+  { "set_upload_mode",    f_set_upload_mode    },
+  { "get_text_run_stats", f_get_text_run_stats },
   { "get_size",           f_get_size           },
   { "begin_frame",        f_begin_frame        },
   { "end_frame",          f_end_frame          },
@@ -416,6 +489,9 @@ static const luaL_Reg fontLib[] = {
   { "get_size",           f_font_get_size           },
   { "set_size",           f_font_set_size           },
   { "get_path",           f_font_get_path           },
+  { "get_bytesize",       f_font_get_bytesize       },
+  { "set_atlas_budget",   f_font_set_atlas_budget   },
+  { "prewarm",            f_font_prewarm            },
   { NULL, NULL }
 };
 
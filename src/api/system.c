@@ -385,6 +385,21 @@ top:
       return 1;
 
     default:
+      if (e.type == ren_get_glyph_event()) {
+        /* the cells with the glyphs drawn as boxes are unchanged for the cache */
+        ren_load_rendered_glyphs();
+        rencache_invalidate();
+        lua_pushstring(L, "glyphsloaded");
+        return 1;
+      }
+      if (process_get_ready_event() && e.type == process_get_ready_event()) {
+        lua_pushstring(L, "processready");
+        return 1;
+      }
+      if (piecetable_get_save_event() && e.type == piecetable_get_save_event()) {
+        lua_pushstring(L, "docsaved");
+        return 1;
+      }
       goto top;
   }
 
@@ -891,20 +906,17 @@ static int f_exec(lua_State *L) {
   return 0;
 }
 
-static int f_fuzzy_match(lua_State *L) {
-  size_t strLen, ptnLen;
-  const char *str = luaL_checklstring(L, 1, &strLen);
-  const char *ptn = luaL_checklstring(L, 2, &ptnLen);
-  // If true match things *backwards*. This allows for better matching on filenames than the above
-  // function. For example, in the lite project, opening "renderer" has lib/font_render/build.sh
-  // as the first result, rather than src/renderer.c. Clearly that's wrong.
-  bool files = lua_gettop(L) > 2 && lua_isboolean(L,3) && lua_toboolean(L, 3);
+// If files is true, match things *backwards*. This allows for better matching on filenames than
+// forwards. For example, in the lite project, opening "renderer" has lib/font_render/build.sh
+// as the first result, rather than src/renderer.c. Clearly that's wrong.
+static bool fuzzy_score(const char* str, size_t strLen, const char* ptn, size_t ptnLen, bool files, int* result) {
   int score = 0, run = 0, increment = files ? -1 : 1;
   const char* strTarget = files ? str + strLen - 1 : str;
   const char* ptnTarget = files ? ptn + ptnLen - 1 : ptn;
   while (strTarget >= str && ptnTarget >= ptn && *strTarget && *ptnTarget) {
     while (strTarget >= str && *strTarget == ' ') { strTarget += increment; }
     while (ptnTarget >= ptn && *ptnTarget == ' ') { ptnTarget += increment; }
+    if (strTarget < str || ptnTarget < ptn) { break; }
     if (tolower(*strTarget) == tolower(*ptnTarget)) {
       score += run * 10 - (*strTarget != *ptnTarget);
       run++;
@@ -915,11 +927,409 @@ static int f_fuzzy_match(lua_State *L) {
     }
     strTarget += increment;
   }
-  if (ptnTarget >= ptn && *ptnTarget) { return 0; }
-  lua_pushinteger(L, score - (int)strLen * 10);
+  if (ptnTarget >= ptn && *ptnTarget) { return false; }
+  *result = score - (int)strLen * 10;
+  return true;
+}
+
+static int f_fuzzy_match(lua_State *L) {
+  size_t strLen, ptnLen;
+  const char *str = luaL_checklstring(L, 1, &strLen);
+  const char *ptn = luaL_checklstring(L, 2, &ptnLen);
+  bool files = lua_gettop(L) > 2 && lua_isboolean(L,3) && lua_toboolean(L, 3);
+  int score;
+  if (!fuzzy_score(str, strLen, ptn, ptnLen, files, &score)) { return 0; }
+  lua_pushinteger(L, score);
   return 1;
 }
 
+#define FUZZY_MAX_WORKERS 8
+// below this amount of candidates, spawning threads costs more than it saves
+#define FUZZY_THREADED_MIN_ITEMS 16384
+
+typedef struct {
+  const char* text;
+  size_t length;
+  lua_Integer index;
+  int score;
+  bool matched;
+} fuzzy_item_t;
+
+typedef struct {
+  fuzzy_item_t* items;
+  size_t count;
+  const char* ptn;
+  size_t ptnLen;
+  bool files;
+} fuzzy_slice_t;
+
+static void fuzzy_score_slice(fuzzy_slice_t* slice) {
+  for (size_t i = 0; i < slice->count; ++i) {
+    fuzzy_item_t* item = &slice->items[i];
+    item->matched = fuzzy_score(item->text, item->length, slice->ptn, slice->ptnLen, slice->files, &item->score);
+  }
+}
+
+static int fuzzy_score_thread(void* data) {
+  fuzzy_score_slice(data);
+  return 0;
+}
+
+static void fuzzy_score_items(fuzzy_item_t* items, size_t count, const char* ptn, size_t ptnLen, bool files) {
+  fuzzy_slice_t slices[FUZZY_MAX_WORKERS];
+  SDL_Thread* threads[FUZZY_MAX_WORKERS] = { 0 };
+  int workers = count < FUZZY_THREADED_MIN_ITEMS ? 1 : SDL_clamp(SDL_GetNumLogicalCPUCores(), 1, FUZZY_MAX_WORKERS);
+  size_t per_worker = (count + workers - 1) / workers;
+  for (int i = 0; i < workers; ++i) {
+    size_t start = SDL_min(count, i * per_worker);
+    slices[i] = (fuzzy_slice_t){ items + start, SDL_min(count - start, per_worker), ptn, ptnLen, files };
+    // the main thread scores the first slice, and those that failed to get a thread
+    if (i > 0)
+      threads[i] = SDL_CreateThread(fuzzy_score_thread, "fuzzy_match", &slices[i]);
+  }
+  for (int i = 0; i < workers; ++i) {
+    if (!threads[i])
+      fuzzy_score_slice(&slices[i]);
+  }
+  for (int i = 1; i < workers; ++i) {
+    if (threads[i])
+      SDL_WaitThread(threads[i], NULL);
+  }
+}
+
+// Same order as the lua implementation: best score first, then by text.
+static int fuzzy_compare(const fuzzy_item_t* a, const fuzzy_item_t* b) {
+  if (a->score != b->score)
+    return a->score > b->score ? -1 : 1;
+  int cmp = memcmp(a->text, b->text, SDL_min(a->length, b->length));
+  if (cmp)
+    return cmp;
+  return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static int fuzzy_sort_compare(const void* a, const void* b) {
+  return fuzzy_compare(a, b);
+}
+
+// Keeps the worst of the heap at its root.
+static void fuzzy_heap_sift_down(fuzzy_item_t* heap, size_t count, size_t i) {
+  while (true) {
+    size_t child = i * 2 + 1, worst = i;
+    if (child < count && fuzzy_compare(&heap[child], &heap[worst]) > 0)
+      worst = child;
+    if (child + 1 < count && fuzzy_compare(&heap[child + 1], &heap[worst]) > 0)
+      worst = child + 1;
+    if (worst == i)
+      return;
+    fuzzy_item_t tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+static void fuzzy_heap_sift_up(fuzzy_item_t* heap, size_t i) {
+  while (i > 0 && fuzzy_compare(&heap[i], &heap[(i - 1) / 2]) > 0) {
+    fuzzy_item_t tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+// Fetches the text of the item at index, anchoring the converted strings of non-string items.
+static const char* fuzzy_item_text(lua_State* L, int items, int anchors, lua_Integer index, size_t* length) {
+  const char* text;
+  if (lua_rawgeti(L, items, index) == LUA_TSTRING) {
+    text = lua_tolstring(L, -1, length);
+    lua_pop(L, 1);
+  } else {
+    text = luaL_tolstring(L, -1, length);
+    lua_rawseti(L, anchors, index);
+    lua_pop(L, 1);
+  }
+  return text;
+}
+
+static int f_fuzzy_match_list(lua_State *L) {
+  size_t ptnLen;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const char *ptn = luaL_checklstring(L, 2, &ptnLen);
+  bool files = lua_toboolean(L, 3);
+  lua_Integer limit = luaL_optinteger(L, 4, LUA_MAXINTEGER);
+  lua_settop(L, 4);
+  lua_Integer length = lua_rawlen(L, 1);
+
+  // anchors the texts of non-string items while they're scored
+  lua_newtable(L);
+  int anchors = lua_gettop(L);
+
+  fuzzy_item_t* candidates = SDL_malloc(sizeof(fuzzy_item_t) * (length + 1));
+  size_t count = 0;
+  if (!candidates)
+    return luaL_error(L, "can't allocate memory for %d items", (int)length);
+  for (lua_Integer index = 1; index <= length; ++index) {
+    candidates[count].index = index;
+    candidates[count].text = fuzzy_item_text(L, 1, anchors, index, &candidates[count].length);
+    count++;
+  }
+
+  fuzzy_score_items(candidates, count, ptn, ptnLen, files);
+  size_t matched = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (candidates[i].matched)
+      candidates[matched++] = candidates[i];
+  }
+
+  // only keep the best ones, with the worst of them at the root of a heap
+  size_t results = (size_t)SDL_clamp(limit, 0, (lua_Integer)matched);
+  fuzzy_item_t* best = SDL_malloc(sizeof(fuzzy_item_t) * (results + 1));
+  if (!best) {
+    SDL_free(candidates);
+    return luaL_error(L, "can't allocate memory for %d results", (int)results);
+  }
+  for (size_t i = 0; i < matched; ++i) {
+    if (i < results) {
+      best[i] = candidates[i];
+      fuzzy_heap_sift_up(best, i);
+    } else if (results > 0 && fuzzy_compare(&candidates[i], &best[0]) < 0) {
+      best[0] = candidates[i];
+      fuzzy_heap_sift_down(best, results, 0);
+    }
+  }
+  qsort(best, results, sizeof(fuzzy_item_t), fuzzy_sort_compare);
+
+  lua_createtable(L, (int)results, 0);
+  for (size_t i = 0; i < results; ++i) {
+    lua_rawgeti(L, 1, best[i].index);
+    lua_rawseti(L, -2, (lua_Integer)i + 1);
+  }
+  SDL_free(best);
+  SDL_free(candidates);
+  return 1;
+}
+
+#define FUZZY_BLOCK_SIZE 65536
+// rows ranked at least, further rows are ranked as they're requested
+#define FUZZY_RANKED_MIN 128
+
+// Candidate texts are copied in blocks, so that they never move once added.
+typedef struct fuzzy_block_t {
+  struct fuzzy_block_t* next;
+  size_t used, size;
+  char data[];
+} fuzzy_block_t;
+
+// The matches of a prefix of the needle, among the first scanned candidates.
+typedef struct {
+  size_t needle_length;
+  size_t scanned;
+  fuzzy_item_t* matches;
+  size_t count;
+} fuzzy_stage_t;
+
+typedef struct {
+  bool files;
+  fuzzy_block_t* blocks;
+  fuzzy_item_t* candidates;
+  size_t count, capacity;
+  char* needle;
+  fuzzy_stage_t* stages;
+  size_t stage_count, stage_capacity;
+  fuzzy_item_t* ranked;
+  size_t ranked_count;
+} fuzzy_session_t;
+
+static int f_fuzzy_session(lua_State *L) {
+  bool files = lua_toboolean(L, 1);
+  fuzzy_session_t* session = lua_newuserdata(L, sizeof(fuzzy_session_t));
+  memset(session, 0, sizeof(fuzzy_session_t));
+  session->files = files;
+  luaL_setmetatable(L, API_TYPE_FUZZY_SESSION);
+  return 1;
+}
+
+static bool fuzzy_session_add_text(fuzzy_session_t* session, const char* text, size_t length) {
+  if (session->count == session->capacity) {
+    size_t capacity = session->capacity ? session->capacity * 2 : 1024;
+    fuzzy_item_t* candidates = SDL_realloc(session->candidates, sizeof(fuzzy_item_t) * capacity);
+    if (!candidates) return false;
+    session->candidates = candidates;
+    session->capacity = capacity;
+  }
+  fuzzy_block_t* block = session->blocks;
+  if (!block || block->size - block->used < length + 1) {
+    size_t size = SDL_max(FUZZY_BLOCK_SIZE, length + 1);
+    if (!(block = SDL_malloc(sizeof(fuzzy_block_t) + size))) return false;
+    block->next = session->blocks;
+    block->used = 0;
+    block->size = size;
+    session->blocks = block;
+  }
+  char* copy = block->data + block->used;
+  memcpy(copy, text, length);
+  copy[length] = 0;
+  block->used += length + 1;
+  session->candidates[session->count] = (fuzzy_item_t){ copy, length, (lua_Integer)session->count, 0, false };
+  session->count++;
+  return true;
+}
+
+static int f_fuzzy_session_add(lua_State *L) {
+  fuzzy_session_t* session = luaL_checkudata(L, 1, API_TYPE_FUZZY_SESSION);
+  size_t length;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_Integer items = lua_rawlen(L, 2);
+    for (lua_Integer i = luaL_optinteger(L, 3, 1); i <= items; ++i) {
+      lua_rawgeti(L, 2, i);
+      const char* text = luaL_tolstring(L, -1, &length);
+      if (!fuzzy_session_add_text(session, text, length))
+        return luaL_error(L, "can't allocate memory for the fuzzy session");
+      lua_pop(L, 2);
+    }
+  } else {
+    const char* text = luaL_checklstring(L, 2, &length);
+    if (!fuzzy_session_add_text(session, text, length))
+      return luaL_error(L, "can't allocate memory for the fuzzy session");
+  }
+  lua_pushinteger(L, (lua_Integer)session->count);
+  return 1;
+}
+
+static int f_fuzzy_session_count(lua_State *L) {
+  fuzzy_session_t* session = luaL_checkudata(L, 1, API_TYPE_FUZZY_SESSION);
+  lua_pushinteger(L, (lua_Integer)session->count);
+  return 1;
+}
+
+// Scores the candidates from first on into stage, along with the matches of a previous stage
+// when they're matched against a longer needle.
+static bool fuzzy_session_scan(fuzzy_session_t* session, fuzzy_stage_t* stage, const fuzzy_item_t* previous, size_t previous_count, size_t first, bool rescore) {
+  size_t count = previous_count + session->count - first;
+  fuzzy_item_t* items = SDL_malloc(sizeof(fuzzy_item_t) * (count + 1));
+  if (!items) return false;
+  memcpy(items, previous, sizeof(fuzzy_item_t) * previous_count);
+  memcpy(items + previous_count, session->candidates + first, sizeof(fuzzy_item_t) * (session->count - first));
+  size_t skipped = rescore ? 0 : previous_count;
+  fuzzy_score_items(items + skipped, count - skipped, session->needle, stage->needle_length, session->files);
+  size_t matched = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (items[i].matched)
+      items[matched++] = items[i];
+  }
+  SDL_free(stage->matches);
+  stage->matches = items;
+  stage->count = matched;
+  stage->scanned = session->count;
+  return true;
+}
+
+static int f_fuzzy_session_match(lua_State *L) {
+  fuzzy_session_t* session = luaL_checkudata(L, 1, API_TYPE_FUZZY_SESSION);
+  size_t length;
+  const char* needle = luaL_checklstring(L, 2, &length);
+  // keep the stages of the previous needle that are still a prefix of this one
+  size_t kept = 0;
+  while (kept < session->stage_count && session->stages[kept].needle_length <= length &&
+    memcmp(session->needle, needle, session->stages[kept].needle_length) == 0)
+    kept++;
+  for (size_t i = kept; i < session->stage_count; ++i)
+    SDL_free(session->stages[i].matches);
+  session->stage_count = kept;
+  session->ranked_count = 0;
+  char* copy = SDL_realloc(session->needle, length + 1);
+  if (!copy) return luaL_error(L, "can't allocate memory for the fuzzy session");
+  memcpy(copy, needle, length + 1);
+  session->needle = copy;
+
+  fuzzy_stage_t* stage = kept > 0 ? &session->stages[kept - 1] : NULL;
+  if (stage && stage->needle_length == length) {
+    // same needle, only the candidates added since are left to score
+    if (stage->scanned < session->count &&
+        !fuzzy_session_scan(session, stage, stage->matches, stage->count, stage->scanned, false))
+      return luaL_error(L, "can't allocate memory for the fuzzy session");
+  } else {
+    // a longer needle only matches among the matches of its prefix
+    if (session->stage_count == session->stage_capacity) {
+      size_t capacity = session->stage_capacity ? session->stage_capacity * 2 : 16;
+      fuzzy_stage_t* stages = SDL_realloc(session->stages, sizeof(fuzzy_stage_t) * capacity);
+      if (!stages) return luaL_error(L, "can't allocate memory for the fuzzy session");
+      session->stages = stages;
+      session->stage_capacity = capacity;
+      stage = kept > 0 ? &session->stages[kept - 1] : NULL;
+    }
+    fuzzy_stage_t* next = &session->stages[session->stage_count];
+    *next = (fuzzy_stage_t){ length, 0, NULL, 0 };
+    if (!fuzzy_session_scan(session, next, stage ? stage->matches : NULL, stage ? stage->count : 0, stage ? stage->scanned : 0, true))
+      return luaL_error(L, "can't allocate memory for the fuzzy session");
+    session->stage_count++;
+    stage = next;
+  }
+  lua_pushinteger(L, (lua_Integer)stage->count);
+  return 1;
+}
+
+static int f_fuzzy_session_get(lua_State *L) {
+  fuzzy_session_t* session = luaL_checkudata(L, 1, API_TYPE_FUZZY_SESSION);
+  lua_Integer first = luaL_checkinteger(L, 2);
+  lua_Integer last = luaL_checkinteger(L, 3);
+  fuzzy_stage_t* stage = session->stage_count > 0 ? &session->stages[session->stage_count - 1] : NULL;
+  size_t count = stage ? stage->count : 0;
+  first = SDL_max(first, 1);
+  last = SDL_min(last, (lua_Integer)count);
+  lua_createtable(L, (int)SDL_max(last - first + 1, 0), 0);
+  if (first > last)
+    return 1;
+  // rank more of the matches, doubling the amount each time to not redo it on every page
+  if ((size_t)last > session->ranked_count) {
+    size_t ranked = SDL_min(count, SDL_max((size_t)last, SDL_max(session->ranked_count * 2, FUZZY_RANKED_MIN)));
+    fuzzy_item_t* best = SDL_realloc(session->ranked, sizeof(fuzzy_item_t) * ranked);
+    if (!best) return luaL_error(L, "can't allocate memory for the fuzzy session");
+    session->ranked = best;
+    for (size_t i = 0; i < stage->count; ++i) {
+      if (i < ranked) {
+        best[i] = stage->matches[i];
+        fuzzy_heap_sift_up(best, i);
+      } else if (fuzzy_compare(&stage->matches[i], &best[0]) < 0) {
+        best[0] = stage->matches[i];
+        fuzzy_heap_sift_down(best, ranked, 0);
+      }
+    }
+    qsort(best, ranked, sizeof(fuzzy_item_t), fuzzy_sort_compare);
+    session->ranked_count = ranked;
+  }
+  for (lua_Integer i = first; i <= last; ++i) {
+    lua_pushlstring(L, session->ranked[i - 1].text, session->ranked[i - 1].length);
+    lua_rawseti(L, -2, i - first + 1);
+  }
+  return 1;
+}
+
+static int f_fuzzy_session_gc(lua_State *L) {
+  fuzzy_session_t* session = luaL_checkudata(L, 1, API_TYPE_FUZZY_SESSION);
+  while (session->blocks) {
+    fuzzy_block_t* next = session->blocks->next;
+    SDL_free(session->blocks);
+    session->blocks = next;
+  }
+  for (size_t i = 0; i < session->stage_count; ++i)
+    SDL_free(session->stages[i].matches);
+  SDL_free(session->stages);
+  SDL_free(session->candidates);
+  SDL_free(session->needle);
+  SDL_free(session->ranked);
+  return 0;
+}
+
+static const luaL_Reg fuzzy_session_metatable[] = {
+  { "__gc",  f_fuzzy_session_gc    },
+  { "add",   f_fuzzy_session_add   },
+  { "count", f_fuzzy_session_count },
+  { "match", f_fuzzy_session_match },
+  { "get",   f_fuzzy_session_get   },
+  { NULL,    NULL                  }
+};
+
 static int f_set_window_opacity(lua_State *L) {
   RenWindow *window_renderer = *(RenWindow**)luaL_checkudata(L, 1, API_TYPE_RENWINDOW);
   double n = luaL_checknumber(L, 2);
@@ -1200,6 +1610,8 @@ static const luaL_Reg lib[] = {
   { "sleep",                 f_sleep                 },
   { "exec",                  f_exec                  },
   { "fuzzy_match",           f_fuzzy_match           },
+  { "fuzzy_match_list",      f_fuzzy_match_list      },
+  { "fuzzy_session",         f_fuzzy_session         },
   { "set_window_opacity",    f_set_window_opacity    },
   { "load_native_plugin",    f_load_native_plugin    },
   { "path_compare",          f_path_compare          },
@@ -1215,6 +1627,11 @@ int luaopen_system(lua_State *L) {
   luaL_newmetatable(L, API_TYPE_NATIVE_PLUGIN);
   lua_pushcfunction(L, f_library_gc);
   lua_setfield(L, -2, "__gc");
+  luaL_newmetatable(L, API_TYPE_FUZZY_SESSION);
+  luaL_setfuncs(L, fuzzy_session_metatable, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
   luaL_newlib(L, lib);
   return 1;
 }
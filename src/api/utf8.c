@@ -30,9 +30,13 @@
 
 
 #include <assert.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <string.h>
 
 #include "../unidata.h"
+#include "utf8.h"
 
 /* UTF-8 string operations */
 
@@ -704,7 +708,10 @@ typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
   const char *p_end;  /* end ('\0') of pattern */
-  lua_State *L;
+  lua_State *L;  /* NULL when matching from C, errors jump to 'error_jmp' */
+  int bytes;  /* match bytes with C classes, like the string library */
+  jmp_buf error_jmp;
+  const char *error;
   int level;  /* total number of captures (finished or unfinished) */
   struct {
     const char *init;
@@ -723,10 +730,42 @@ static const char *match (MatchState *ms, const char *s, const char *p);
 #define L_ESC           '%'
 #define SPECIALS        "^$*+?.([%-"
 
+static int match_error (MatchState *ms, const char *fmt, ...) {
+  if (ms->L) {
+    va_list argp;
+    va_start(argp, fmt);
+    luaL_where(ms->L, 1);
+    lua_pushvfstring(ms->L, fmt, argp);
+    va_end(argp);
+    lua_concat(ms->L, 2);
+    return lua_error(ms->L);
+  }
+  ms->error = fmt;
+  longjmp(ms->error_jmp, 1);
+}
+
+static const char *match_decode (MatchState *ms, const char *p, utfint *pval) {
+  if (ms->bytes) {
+    *pval = (unsigned char)*p;
+    return p + 1;
+  }
+  p = utf8_decode(p, pval, 0);
+  if (p == NULL) match_error(ms, "invalid UTF-8 code");
+  return p;
+}
+
+static const char *match_next (MatchState *ms, const char *p, const char *e) {
+  return ms->bytes ? p + 1 : utf8_next(p, e);
+}
+
+static const char *match_prev (MatchState *ms, const char *s, const char *p) {
+  return ms->bytes ? p - 1 : utf8_prev(s, p);
+}
+
 static int check_capture (MatchState *ms, int l) {
   l -= '1';
   if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
-    return luaL_error(ms->L, "invalid capture index %%%d", l + 1);
+    return match_error(ms, "invalid capture index %%%d", l + 1);
   return l;
 }
 
@@ -734,23 +773,23 @@ static int capture_to_close (MatchState *ms) {
   int level = ms->level;
   while (--level >= 0)
     if (ms->capture[level].len == CAP_UNFINISHED) return level;
-  return luaL_error(ms->L, "invalid pattern capture");
+  return match_error(ms, "invalid pattern capture");
 }
 
 static const char *classend (MatchState *ms, const char *p) {
   utfint ch = 0;
-  p = utf8_safe_decode(ms->L, p, &ch);
+  p = match_decode(ms, p, &ch);
   switch (ch) {
     case L_ESC: {
       if (p == ms->p_end)
-        luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
-      return utf8_next(p, ms->p_end);
+        match_error(ms, "malformed pattern (ends with " LUA_QL("%%") ")");
+      return match_next(ms, p, ms->p_end);
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a `]' */
         if (p == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
+          match_error(ms, "malformed pattern (missing " LUA_QL("]") ")");
         if (*(p++) == L_ESC && p < ms->p_end)
           p++;  /* skip escapes (e.g. `%]') */
       } while (*p != ']');
@@ -762,7 +801,7 @@ static const char *classend (MatchState *ms, const char *p) {
   }
 }
 
-static int match_class (utfint c, utfint cl) {
+static int match_class_unicode (utfint c, utfint cl) {
   int res;
   switch (utf8_tolower(cl)) {
 #define X(cls, name) case cls: res = utf8_is##name(c); break;
@@ -776,6 +815,51 @@ static int match_class (utfint c, utfint cl) {
   return (utf8_islower(cl) ? res : !res);
 }
 
+/* ascii results of match_class, as the table lookups dominate matching time;
+   filled when the module is opened, before any other thread can match */
+static unsigned char ascii_match_class[128][128 / 8];
+static int ascii_match_class_ready;
+
+static void init_ascii_match_class (void) {
+  utfint c, cl;
+  if (ascii_match_class_ready) return;
+  for (cl = 0; cl < 128; cl++)
+    for (c = 0; c < 128; c++)
+      if (match_class_unicode(c, cl))
+        ascii_match_class[cl][c >> 3] |= 1 << (c & 7);
+  ascii_match_class_ready = 1;
+}
+
+static int match_class (utfint c, utfint cl) {
+  if (c < 128 && cl < 128 && ascii_match_class_ready)
+    return (ascii_match_class[cl][c >> 3] >> (c & 7)) & 1;
+  return match_class_unicode(c, cl);
+}
+
+/* the classes of the string library, for matching bytes */
+static int match_class_byte (int c, int cl) {
+  int res;
+  switch (tolower(cl)) {
+    case 'a' : res = isalpha(c); break;
+    case 'c' : res = iscntrl(c); break;
+    case 'd' : res = isdigit(c); break;
+    case 'g' : res = isgraph(c); break;
+    case 'l' : res = islower(c); break;
+    case 'p' : res = ispunct(c); break;
+    case 's' : res = isspace(c); break;
+    case 'u' : res = isupper(c); break;
+    case 'w' : res = isalnum(c); break;
+    case 'x' : res = isxdigit(c); break;
+    default: return (cl == c);
+  }
+  if (isupper(cl)) res = !res;
+  return res;
+}
+
+static int match_class_state (MatchState *ms, utfint c, utfint cl) {
+  return ms->bytes ? match_class_byte((int)c, (int)cl) : match_class(c, cl);
+}
+
 static int matchbracketclass (MatchState *ms, utfint c, const char *p, const char *ec) {
   int sig = 1;
   assert(*p == '[');
@@ -785,16 +869,16 @@ static int matchbracketclass (MatchState *ms, utfint c, const char *p, const cha
   }
   while (p < ec) {
     utfint ch = 0;
-    p = utf8_safe_decode(ms->L, p, &ch);
+    p = match_decode(ms, p, &ch);
     if (ch == L_ESC) {
-      p = utf8_safe_decode(ms->L, p, &ch);
-      if (match_class(c, ch))
+      p = match_decode(ms, p, &ch);
+      if (match_class_state(ms, c, ch))
         return sig;
     } else {
       utfint next = 0;
-      const char *np = utf8_safe_decode(ms->L, p, &next);
+      const char *np = match_decode(ms, p, &next);
       if (next == '-' && np < ec) {
-        p = utf8_safe_decode(ms->L, np, &next);
+        p = match_decode(ms, np, &next);
         if (ch <= c && c <= next)
           return sig;
       }
@@ -809,12 +893,12 @@ static int singlematch (MatchState *ms, const char *s, const char *p, const char
     return 0;
   else {
     utfint ch=0, pch=0;
-    utf8_safe_decode(ms->L, s, &ch);
-    p = utf8_safe_decode(ms->L, p, &pch);
+    match_decode(ms, s, &ch);
+    p = match_decode(ms, p, &pch);
     switch (pch) {
       case '.': return 1;  /* matches any char */
-      case L_ESC: utf8_safe_decode(ms->L, p, &pch);
-                  return match_class(ch, pch);
+      case L_ESC: match_decode(ms, p, &pch);
+                  return match_class_state(ms, ch, pch);
       case '[': return matchbracketclass(ms, ch, p-1, ep-1);
       default:  return pch == ch;
     }
@@ -823,17 +907,17 @@ static int singlematch (MatchState *ms, const char *s, const char *p, const char
 
 static const char *matchbalance (MatchState *ms, const char *s, const char **p) {
   utfint ch=0, begin=0, end=0;
-  *p = utf8_safe_decode(ms->L, *p, &begin);
+  *p = match_decode(ms, *p, &begin);
   if (*p >= ms->p_end)
-    luaL_error(ms->L, "malformed pattern "
+    match_error(ms, "malformed pattern "
                       "(missing arguments to " LUA_QL("%%b") ")");
-  *p = utf8_safe_decode(ms->L, *p, &end);
-  s = utf8_safe_decode(ms->L, s, &ch);
+  *p = match_decode(ms, *p, &end);
+  s = match_decode(ms, s, &ch);
   if (ch != begin) return NULL;
   else {
     int cont = 1;
     while (s < ms->src_end) {
-      s = utf8_safe_decode(ms->L, s, &ch);
+      s = match_decode(ms, s, &ch);
       if (ch == end) {
         if (--cont == 0) return s;
       }
@@ -846,14 +930,14 @@ static const char *matchbalance (MatchState *ms, const char *s, const char **p)
 static const char *max_expand (MatchState *ms, const char *s, const char *p, const char *ep) {
   const char *m = s; /* matched end of single match p */
   while (singlematch(ms, m, p, ep))
-    m = utf8_next(m, ms->src_end);
+    m = match_next(ms, m, ms->src_end);
   /* keeps trying to match with the maximum repetitions */
   while (s <= m) {
     const char *res = match(ms, m, ep+1);
     if (res) return res;
     /* else didn't match; reduce 1 repetition to try again */
     if (s == m) break;
-    m = utf8_prev(s, m);
+    m = match_prev(ms, s, m);
   }
   return NULL;
 }
@@ -864,7 +948,7 @@ static const char *min_expand (MatchState *ms, const char *s, const char *p, con
     if (res != NULL)
       return res;
     else if (singlematch(ms, s, p, ep))
-      s = utf8_next(s, ms->src_end);  /* try with one more repetition */
+      s = match_next(ms, s, ms->src_end);  /* try with one more repetition */
     else return NULL;
   }
 }
@@ -872,7 +956,7 @@ static const char *min_expand (MatchState *ms, const char *s, const char *p, con
 static const char *start_capture (MatchState *ms, const char *s, const char *p, int what) {
   const char *res;
   int level = ms->level;
-  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  if (level >= LUA_MAXCAPTURES) match_error(ms, "too many captures");
   ms->capture[level].init = s;
   ms->capture[level].len = what;
   ms->level = level+1;
@@ -902,11 +986,11 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 
 static const char *match (MatchState *ms, const char *s, const char *p) {
   if (ms->matchdepth-- == 0)
-    luaL_error(ms->L, "pattern too complex");
+    match_error(ms, "pattern too complex");
   init: /* using goto's to optimize tail recursion */
   if (p != ms->p_end) {  /* end of pattern? */
     utfint ch = 0;
-    utf8_safe_decode(ms->L, p, &ch);
+    match_decode(ms, p, &ch);
     switch (ch) {
       case '(': {  /* start capture */
         if (*(p + 1) == ')')  /* position capture? */
@@ -927,7 +1011,7 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
       }
       case L_ESC: {  /* escaped sequence not in the format class[*+?-]? */
         const char *prev_p = p;
-        p = utf8_safe_decode(ms->L, p+1, &ch);
+        p = match_decode(ms, p+1, &ch);
         switch (ch) {
           case 'b': {  /* balanced string? */
             s = matchbalance(ms, s, &p);
@@ -939,13 +1023,18 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
           case 'f': {  /* frontier? */
             const char *ep; utfint previous = 0, current = 0;
             if (*p != '[')
-              luaL_error(ms->L, "missing " LUA_QL("[") " after "
+              match_error(ms, "missing " LUA_QL("[") " after "
                                  LUA_QL("%%f") " in pattern");
             ep = classend(ms, p);  /* points to what is next */
-            if (s != ms->src_init)
-              utf8_decode(utf8_prev(ms->src_init, s), &previous, 0);
-            if (s != ms->src_end)
-              utf8_decode(s, &current, 0);
+            if (ms->bytes) {
+              previous = s != ms->src_init ? (unsigned char)s[-1] : 0;
+              current = s != ms->src_end ? (unsigned char)*s : 0;
+            } else {
+              if (s != ms->src_init)
+                utf8_decode(utf8_prev(ms->src_init, s), &previous, 0);
+              if (s != ms->src_end)
+                utf8_decode(s, &current, 0);
+            }
             if (!matchbracketclass(ms, previous, p, ep - 1) &&
                  matchbracketclass(ms, current, p, ep - 1)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
@@ -973,11 +1062,11 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
           } else  /* '+' or no suffix */
             s = NULL;  /* fail */
         } else {  /* matched once */
-          const char *next_s = utf8_next(s, ms->src_end);
+          const char *next_s = match_next(ms, s, ms->src_end);
           switch (*ep) {  /* handle optional suffix */
             case '?': {  /* optional */
               const char *res;
-              const char *next_ep = utf8_next(ep, ms->p_end);
+              const char *next_ep = match_next(ms, ep, ms->p_end);
               if ((res = match(ms, next_s, next_ep)) != NULL)
                 s = res;
               else {
@@ -1070,6 +1159,220 @@ static int nospecials (const char *p, const char * ep) {
 }
 
 
+/* utf8 pattern matching interface for C code */
+
+int utf8_check (const char *s, size_t len) {
+  const char *e = s + len;
+  while (s < e) {
+    utfint ch;
+    const char *n = utf8_decode(s, &ch, 1);
+    if (n == NULL || n > e) return 0;
+    s = n;
+  }
+  return 1;
+}
+
+static int first_bytes (MatchState *ms, const char *p, unsigned char *set) {
+  while (p < ms->p_end) {
+    switch (*p) {
+      case '(': p += (*(p + 1) == ')') ? 2 : 1; continue;  /* captures don't consume */
+      case ')': p++; continue;
+      case '$': if ((p + 1) == ms->p_end) return 0; goto dflt;
+      case L_ESC: {
+        if (*(p + 1) == 'b') {  /* balanced string starts with its opening char */
+          unsigned char ch = (unsigned char)*(p + 2);
+          if (p + 2 >= ms->p_end) return 0;
+          if (ch < 0x80) set[ch >> 3] |= 1 << (ch & 7);
+          else memset(set + 16, 0xFF, 16);
+          return 1;
+        }
+        if (*(p + 1) == 'f') { p = classend(ms, p + 2); continue; }  /* zero width */
+        if (*(p + 1) >= '0' && *(p + 1) <= '9') return 0;
+        goto dflt;
+      }
+      default: dflt: {
+        const char *ep = classend(ms, p);
+        const char *init = ms->src_init, *end = ms->src_end;
+        char src;
+        int ch;
+        ms->src_init = &src;
+        ms->src_end = &src + 1;
+        for (ch = 0; ch < 0x80; ch++) {  /* every ascii character */
+          src = (char)ch;
+          if (singlematch(ms, &src, p, ep))
+            set[ch >> 3] |= 1 << (ch & 7);
+        }
+        ms->src_init = init;
+        ms->src_end = end;
+        memset(set + 16, 0xFF, 16);  /* non ascii characters aren't checked */
+        if (*ep == '*' || *ep == '?' || *ep == '-') {  /* may not match, add what follows */
+          p = ep + 1;
+          continue;
+        }
+        return 1;
+      }
+    }
+  }
+  return 0;  /* can match an empty string */
+}
+
+int utf8_pattern_first_bytes (const char *p, size_t plen, unsigned char *set) {
+  MatchState ms;
+  memset(set, 0, 32);
+  ms.L = NULL;
+  ms.bytes = 0;
+  ms.src_init = ms.src_end = NULL;
+  ms.p_end = p + plen;
+  ms.matchdepth = MAXCCALLS;
+  ms.level = 0;
+  if (setjmp(ms.error_jmp) || !first_bytes(&ms, p, set)) {
+    memset(set, 0xFF, 32);
+    return 0;
+  }
+  return 1;
+}
+
+int utf8_pattern_find (const char *s, size_t len, size_t init,
+                       const char *p, size_t plen, int anchor,
+                       size_t *results, int max_results, const char **error) {
+  MatchState ms;
+  const char *es = s + len, *ep = p + plen;
+  const char *volatile start = s + init;
+  if (init > len) return 0;
+  ms.L = NULL;
+  ms.bytes = 0;
+  ms.error = NULL;
+  ms.src_init = s;
+  ms.src_end = es;
+  ms.p_end = ep;
+  if (setjmp(ms.error_jmp)) {
+    if (error) *error = ms.error;
+    return -1;
+  }
+  for (;;) {
+    const char *res;
+    ms.level = 0;
+    ms.matchdepth = MAXCCALLS;
+    if ((res = match(&ms, start, p)) != NULL) {
+      int i, count = 2;
+      if (ms.level + 2 > max_results) match_error(&ms, "too many captures");
+      results[0] = start - s;
+      results[1] = res - s;
+      for (i = 0; i < ms.level; i++) {
+        if (ms.capture[i].len != CAP_POSITION)
+          match_error(&ms, "only position captures are supported");
+        results[count++] = ms.capture[i].init - s;
+      }
+      return count;
+    }
+    if (anchor || start == es) break;
+    start = utf8_next(start, es);
+  }
+  return 0;
+}
+
+static int match_bytes (const char *s, size_t len, const char *p, size_t plen,
+                        int anchor, const char **error) {
+  MatchState ms;
+  const char *es = s + len, *ep = p + plen;
+  const char *volatile start = s;
+  ms.L = NULL;
+  ms.bytes = 1;
+  ms.error = NULL;
+  ms.src_init = s;
+  ms.src_end = es;
+  ms.p_end = ep;
+  if (setjmp(ms.error_jmp)) {
+    if (error) *error = ms.error;
+    return -1;
+  }
+  for (;;) {
+    ms.level = 0;
+    ms.matchdepth = MAXCCALLS;
+    if (match(&ms, start, p) != NULL) {
+      int i;
+      /* string.match fails the same way when returning the captures */
+      for (i = 0; i < ms.level; i++)
+        if (ms.capture[i].len == CAP_UNFINISHED)
+          match_error(&ms, "unfinished capture");
+      return 1;
+    }
+    if (anchor || start == es) break;
+    start++;
+  }
+  return 0;
+}
+
+int utf8_pattern_match_bytes (const char *s, size_t len,
+                              const char *p, size_t plen, const char **error) {
+  int anchor = plen > 0 && *p == '^';
+  return match_bytes(s, len, p + anchor, plen - anchor, anchor, error);
+}
+
+int utf8_pattern_check (const char *p, size_t plen, const char **error) {
+  /* captures open and close in pattern order, whatever the subject is, so
+  ** walking the pattern once finds every error the matcher could raise */
+  const char *ep = p + plen;
+  int level = 0, open[LUA_MAXCAPTURES];
+  const char *message = NULL;
+  if (p != ep && *p == '^') p++;
+  while (p != ep && !message) {
+    switch (*p) {
+      case '(':
+        if (level >= LUA_MAXCAPTURES) { message = "too many captures"; break; }
+        open[level++] = p[1] != ')';
+        p += p[1] == ')' ? 2 : 1;
+        continue;
+      case ')': {
+        int l = level;
+        while (--l >= 0 && !open[l]);
+        if (l < 0) { message = "invalid pattern capture"; break; }
+        open[l] = 0;
+        p++;
+        continue;
+      }
+      case L_ESC:
+        if (p + 1 != ep && p[1] == 'b') {
+          if (ep - p < 4) message = "malformed pattern (missing arguments to '%b')";
+          p += 4;
+          continue;
+        }
+        if (p + 1 != ep && p[1] == 'f') {
+          p += 2;
+          if (p == ep || *p != '[') { message = "missing '[' after '%f' in pattern"; break; }
+          break;  /* the class is checked below */
+        }
+        if (p + 1 != ep && p[1] >= '0' && p[1] <= '9') {
+          int l = p[1] - '1';
+          if (l < 0 || l >= level || open[l]) message = "invalid capture index";
+          p += 2;
+          continue;
+        }
+        break;
+    }
+    if (message) break;
+    /* single char class, followed by an optional suffix */
+    if (*p == L_ESC) {
+      if (++p == ep) { message = "malformed pattern (ends with '%')"; break; }
+      p++;
+    } else if (*p++ == '[') {
+      if (p != ep && *p == '^') p++;
+      do {
+        if (p == ep) { message = "malformed pattern (missing ']')"; break; }
+        if (*(p++) == L_ESC && p < ep) p++;
+      } while (p == ep || *p != ']');
+      if (message) break;
+      p++;
+    }
+    if (p != ep && (*p == '*' || *p == '+' || *p == '-' || *p == '?')) p++;
+  }
+  while (!message && level > 0)
+    if (open[--level]) message = "unfinished capture";
+  if (message && error) *error = message;
+  return message == NULL;
+}
+
+
 /* utf8 pattern matching interface */
 
 static int find_aux (lua_State *L, int find) {
@@ -1103,6 +1406,7 @@ static int find_aux (lua_State *L, int find) {
     if (anchor) p++;  /* skip anchor character */
     if (idx < 0) idx += utf8_length(s, es)+1; /* TODO not very good */
     ms.L = L;
+    ms.bytes = 0;
     ms.matchdepth = MAXCCALLS;
     ms.src_init = s;
     ms.src_end = es;
@@ -1137,6 +1441,7 @@ static int gmatch_aux (lua_State *L) {
   const char *ep, *p = check_utf8(L, lua_upvalueindex(2), &ep);
   const char *src;
   ms.L = L;
+  ms.bytes = 0;
   ms.matchdepth = MAXCCALLS;
   ms.src_init = s;
   ms.src_end = es;
@@ -1235,6 +1540,7 @@ static int Lutf8_gsub (lua_State *L) {
   luaL_buffinit(L, &b);
   if (anchor) p++;  /* skip anchor character */
   ms.L = L;
+  ms.bytes = 0;
   ms.matchdepth = MAXCCALLS;
   ms.src_init = s;
   ms.src_end = es;
@@ -1304,6 +1610,7 @@ int luaopen_utf8extra (lua_State *L) {
     { NULL, NULL }
   };
 
+  init_ascii_match_class();
   luaL_newlib(L, libs);
 
   lua_pushlstring(L, UTF8PATT, sizeof(UTF8PATT)-1);
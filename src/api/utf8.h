@@ -0,0 +1,49 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+/* Returns 1 if `s` is valid utf8 without surrogates or out of range code points. */
+int utf8_check(const char *s, size_t len);
+
+/*
+ * Matches an utf8 lua pattern against `s`, starting from the byte offset
+ * `init`, without needing a lua_State, so it can be used from other threads.
+ * The pattern must not include the leading '^', use `anchor` instead.
+ *
+ * On success returns the amount of byte offsets stored in `results`: the
+ * start and the end (exclusive) of the match, followed by the offset of each
+ * position capture. Returns 0 if there is no match, and -1 on errors, setting
+ * `error` to a static message. Captures other than position captures are
+ * reported as errors.
+ */
+int utf8_pattern_find(const char *s, size_t len, size_t init,
+                      const char *p, size_t plen, int anchor,
+                      size_t *results, int max_results, const char **error);
+
+/*
+ * Tells whether a lua pattern matches `s`, with the same results as
+ * string.match: bytes are matched one by one, and classes follow the C
+ * library instead of unicode. Unlike utf8_pattern_find, any capture is
+ * allowed and the pattern can start with '^'. Returns 1 if it matches, 0 if
+ * not, and -1 on errors, setting `error` to a static message.
+ */
+int utf8_pattern_match_bytes(const char *s, size_t len,
+                             const char *p, size_t plen, const char **error);
+
+/*
+ * Checks that matching a lua pattern can't fail, whatever the subject is,
+ * like with unbalanced captures or a missing ']', apart from recursing too
+ * deep. Returns 0 if it can,
+ * setting `error` to a static message.
+ */
+int utf8_pattern_check(const char *p, size_t plen, const char **error);
+
+/*
+ * Fills the 256 bit set with the bytes an anchored match of the pattern can
+ * start with, returning 0 and setting every bit if it can't be told, like
+ * for patterns that can match an empty string.
+ */
+int utf8_pattern_first_bytes(const char *p, size_t plen, unsigned char *set);
+
+#endif
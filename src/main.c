@@ -230,6 +230,7 @@ init_lua:
 
   lua_close(L);
 
+  rencache_free();
   ren_free();
 
   return EXIT_SUCCESS;
@@ -0,0 +1,223 @@
+#include "renblend.h"
+
+// Glyph coverage is blended in two steps, each one rounded to 8 bits:
+//   weight = coverage * color.a / 255
+//   result = (color * weight + destination * (255 - weight)) / 255
+// which fits in 16bit lanes, so every kernel gives the same result.
+
+// the kernels for 32bit surfaces with byte sized channels, picked for the CPU
+static RenBlendRow blend_grayscale_fast = NULL;
+static RenBlendRow blend_subpixel_fast = NULL;
+// a row of fully covered pixels, to fill rectangles with the grayscale kernel
+static uint8_t full_coverage[256];
+
+static inline unsigned int div255(unsigned int x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static inline unsigned int blend_channel(unsigned int dst, unsigned int color, unsigned int coverage, unsigned int alpha) {
+  unsigned int weight = div255(coverage * alpha);
+  return div255(color * weight + dst * (255 - weight));
+}
+
+// works with any 32bit format
+static inline void blend_row_scalar(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count, bool subpixel) {
+  const SDL_PixelFormatDetails *format = blend->format;
+  RenColor color = blend->color;
+  for (int i = 0; i < count; ++i) {
+    uint32_t pixel = dst[i];
+    unsigned int r = (pixel & format->Rmask) >> format->Rshift;
+    unsigned int g = (pixel & format->Gmask) >> format->Gshift;
+    unsigned int b = (pixel & format->Bmask) >> format->Bshift;
+    if (subpixel) {
+      r = blend_channel(r, color.r, src[0], color.a);
+      g = blend_channel(g, color.g, src[1], color.a);
+      b = blend_channel(b, color.b, src[2], color.a);
+      src += 3;
+    } else {
+      r = blend_channel(r, color.r, *src, color.a);
+      g = blend_channel(g, color.g, *src, color.a);
+      b = blend_channel(b, color.b, *src, color.a);
+      src += 1;
+    }
+    dst[i] = (pixel & ~blend->rgb_mask) | r << format->Rshift | g << format->Gshift | b << format->Bshift;
+  }
+}
+
+static void blend_grayscale_scalar(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_scalar(blend, dst, src, count, false);
+}
+
+static void blend_subpixel_scalar(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_scalar(blend, dst, src, count, true);
+}
+
+// the coverage of a subpixel glyph pixel, moved to the channels of the surface
+static inline uint32_t subpixel_coverage(const RenBlend *blend, const uint8_t *src) {
+  const SDL_PixelFormatDetails *format = blend->format;
+  return (uint32_t)src[0] << format->Rshift | (uint32_t)src[1] << format->Gshift | (uint32_t)src[2] << format->Bshift;
+}
+
+#ifdef SDL_SSE2_INTRINSICS
+// blends two pixels, unpacked to 16bit channels
+static inline __m128i SDL_TARGETING("sse2") blend_sse2(__m128i dst, __m128i coverage, __m128i color, __m128i alpha) {
+  const __m128i half = _mm_set1_epi16(128), full = _mm_set1_epi16(255);
+  __m128i weight = _mm_add_epi16(_mm_mullo_epi16(coverage, alpha), half);
+  weight = _mm_srli_epi16(_mm_add_epi16(weight, _mm_srli_epi16(weight, 8)), 8);
+  __m128i result = _mm_add_epi16(_mm_mullo_epi16(color, weight), _mm_mullo_epi16(dst, _mm_sub_epi16(full, weight)));
+  result = _mm_add_epi16(result, half);
+  return _mm_srli_epi16(_mm_add_epi16(result, _mm_srli_epi16(result, 8)), 8);
+}
+
+// blends four pixels
+static inline void SDL_TARGETING("sse2") blend_block_sse2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, bool subpixel) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i color = _mm_unpacklo_epi8(_mm_set1_epi32(blend->color_pixel), zero);
+  const __m128i alpha = _mm_set1_epi16(blend->color.a);
+  __m128i coverage;
+  if (subpixel) {
+    coverage = _mm_setr_epi32(subpixel_coverage(blend, src), subpixel_coverage(blend, src + 3),
+                              subpixel_coverage(blend, src + 6), subpixel_coverage(blend, src + 9));
+  } else {
+    uint32_t s;
+    SDL_memcpy(&s, src, sizeof(s));
+    coverage = _mm_cvtsi32_si128(s);
+    coverage = _mm_unpacklo_epi8(coverage, coverage);
+    coverage = _mm_and_si128(_mm_unpacklo_epi16(coverage, coverage), _mm_set1_epi32(blend->rgb_mask));
+  }
+  __m128i pixels = _mm_loadu_si128((__m128i *)dst);
+  __m128i lo = blend_sse2(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(coverage, zero), color, alpha);
+  __m128i hi = blend_sse2(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(coverage, zero), color, alpha);
+  _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+}
+
+static inline void SDL_TARGETING("sse2") blend_row_sse2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count, bool subpixel) {
+  int src_size = subpixel ? 3 : 1, i = 0;
+  for (; i + 4 <= count; i += 4)
+    blend_block_sse2(blend, dst + i, src + i * src_size, subpixel);
+  if (i < count) {
+    // glyphs are narrow, so the last pixels are copied out to be blended as a whole block too
+    uint32_t pixels[4];
+    uint8_t coverage[4 * 3] = { 0 };
+    SDL_memcpy(pixels, dst + i, (count - i) * sizeof(uint32_t));
+    SDL_memcpy(coverage, src + i * src_size, (count - i) * src_size);
+    blend_block_sse2(blend, pixels, coverage, subpixel);
+    SDL_memcpy(dst + i, pixels, (count - i) * sizeof(uint32_t));
+  }
+}
+
+static void SDL_TARGETING("sse2") blend_grayscale_sse2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_sse2(blend, dst, src, count, false);
+}
+
+static void SDL_TARGETING("sse2") blend_subpixel_sse2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_sse2(blend, dst, src, count, true);
+}
+#endif
+
+#ifdef SDL_AVX2_INTRINSICS
+// blends four pixels, unpacked to 16bit channels
+static inline __m256i SDL_TARGETING("avx2") blend_avx2(__m256i dst, __m256i coverage, __m256i color, __m256i alpha) {
+  const __m256i half = _mm256_set1_epi16(128), full = _mm256_set1_epi16(255);
+  __m256i weight = _mm256_add_epi16(_mm256_mullo_epi16(coverage, alpha), half);
+  weight = _mm256_srli_epi16(_mm256_add_epi16(weight, _mm256_srli_epi16(weight, 8)), 8);
+  __m256i result = _mm256_add_epi16(_mm256_mullo_epi16(color, weight), _mm256_mullo_epi16(dst, _mm256_sub_epi16(full, weight)));
+  result = _mm256_add_epi16(result, half);
+  return _mm256_srli_epi16(_mm256_add_epi16(result, _mm256_srli_epi16(result, 8)), 8);
+}
+
+// blends eight pixels
+static inline void SDL_TARGETING("avx2") blend_block_avx2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, bool subpixel) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i color = _mm256_unpacklo_epi8(_mm256_set1_epi32(blend->color_pixel), zero);
+  const __m256i alpha = _mm256_set1_epi16(blend->color.a);
+  __m256i coverage;
+  if (subpixel) {
+    coverage = _mm256_setr_epi32(subpixel_coverage(blend, src), subpixel_coverage(blend, src + 3),
+                                 subpixel_coverage(blend, src + 6), subpixel_coverage(blend, src + 9),
+                                 subpixel_coverage(blend, src + 12), subpixel_coverage(blend, src + 15),
+                                 subpixel_coverage(blend, src + 18), subpixel_coverage(blend, src + 21));
+  } else {
+    // copies the low byte of every pixel to the other three
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+                                            0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    coverage = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+    coverage = _mm256_and_si256(_mm256_shuffle_epi8(coverage, spread), _mm256_set1_epi32(blend->rgb_mask));
+  }
+  // unpacking and packing both work within 128bit lanes, so the pixels end up back in order
+  __m256i pixels = _mm256_loadu_si256((__m256i *)dst);
+  __m256i lo = blend_avx2(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpacklo_epi8(coverage, zero), color, alpha);
+  __m256i hi = blend_avx2(_mm256_unpackhi_epi8(pixels, zero), _mm256_unpackhi_epi8(coverage, zero), color, alpha);
+  _mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(lo, hi));
+}
+
+static inline void SDL_TARGETING("avx2") blend_row_avx2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count, bool subpixel) {
+  int src_size = subpixel ? 3 : 1, i = 0;
+  for (; i + 8 <= count; i += 8)
+    blend_block_avx2(blend, dst + i, src + i * src_size, subpixel);
+#ifdef SDL_SSE2_INTRINSICS
+  if (i + 4 <= count) {
+    blend_block_sse2(blend, dst + i, src + i * src_size, subpixel);
+    i += 4;
+  }
+#endif
+  if (i < count) {
+    uint32_t pixels[8];
+    uint8_t coverage[8 * 3] = { 0 };
+    SDL_memcpy(pixels, dst + i, (count - i) * sizeof(uint32_t));
+    SDL_memcpy(coverage, src + i * src_size, (count - i) * src_size);
+    blend_block_avx2(blend, pixels, coverage, subpixel);
+    SDL_memcpy(dst + i, pixels, (count - i) * sizeof(uint32_t));
+  }
+}
+
+static void SDL_TARGETING("avx2") blend_grayscale_avx2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_avx2(blend, dst, src, count, false);
+}
+
+static void SDL_TARGETING("avx2") blend_subpixel_avx2(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count) {
+  blend_row_avx2(blend, dst, src, count, true);
+}
+#endif
+
+void ren_blend_init(void) {
+  SDL_memset(full_coverage, 0xff, sizeof(full_coverage));
+  blend_grayscale_fast = blend_grayscale_scalar;
+  blend_subpixel_fast = blend_subpixel_scalar;
+#ifdef SDL_SSE2_INTRINSICS
+  if (SDL_HasSSE2()) {
+    blend_grayscale_fast = blend_grayscale_sse2;
+    blend_subpixel_fast = blend_subpixel_sse2;
+  }
+#endif
+#ifdef SDL_AVX2_INTRINSICS
+  if (SDL_HasAVX2()) {
+    blend_grayscale_fast = blend_grayscale_avx2;
+    blend_subpixel_fast = blend_subpixel_avx2;
+  }
+#endif
+}
+
+void ren_blend_prepare(RenBlend *blend, SDL_PixelFormat format, RenColor color) {
+  const SDL_PixelFormatDetails *details = SDL_GetPixelFormatDetails(format);
+  blend->format = details;
+  blend->color = color;
+  blend->color_pixel = (uint32_t)color.r << details->Rshift | (uint32_t)color.g << details->Gshift | (uint32_t)color.b << details->Bshift;
+  blend->rgb_mask = details->Rmask | details->Gmask | details->Bmask;
+  blend->grayscale = blend_grayscale_scalar;
+  blend->subpixel = blend_subpixel_scalar;
+  // the vector kernels need the channels to be whole bytes, as in BGRA32, ARGB32, XRGB8888 and the like
+  bool byte_channels = details->bytes_per_pixel == 4
+    && details->Rbits == 8 && details->Gbits == 8 && details->Bbits == 8
+    && details->Rshift % 8 == 0 && details->Gshift % 8 == 0 && details->Bshift % 8 == 0;
+  if (byte_channels && blend_grayscale_fast) {
+    blend->grayscale = blend_grayscale_fast;
+    blend->subpixel = blend_subpixel_fast;
+  }
+}
+
+void ren_blend_fill(const RenBlend *blend, uint32_t *dst, int count) {
+  for (int i = 0; i < count; i += sizeof(full_coverage))
+    blend->grayscale(blend, dst + i, full_coverage, SDL_min(count - i, (int)sizeof(full_coverage)));
+}
@@ -0,0 +1,26 @@
+#ifndef RENBLEND_H
+#define RENBLEND_H
+
+#include <SDL3/SDL.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "renderer.h"
+
+typedef struct RenBlend RenBlend;
+// blends count pixels of a glyph row, with 1 byte of coverage per pixel for
+// grayscale glyphs or 3 bytes (r, g, b) for subpixel glyphs
+typedef void (*RenBlendRow)(const RenBlend *blend, uint32_t *dst, const uint8_t *src, int count);
+
+// a text color prepared to be blended into a 32bit surface
+struct RenBlend {
+  const SDL_PixelFormatDetails *format;
+  RenColor color;
+  uint32_t color_pixel, rgb_mask; // the color and its channels, laid out as a pixel of the surface
+  RenBlendRow grayscale, subpixel;
+};
+
+void ren_blend_init(void);
+void ren_blend_prepare(RenBlend *blend, SDL_PixelFormat format, RenColor color);
+void ren_blend_fill(const RenBlend *blend, uint32_t *dst, int count);
+
+#endif
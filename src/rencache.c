@@ -23,12 +23,19 @@
 
 /* a cache over the software renderer -- all drawing operations are stored as
 ** commands when issued. At the end of the frame we write the commands to a grid
-** of hash values, take the cells that have changed since the previous frame,
-** merge them into dirty rectangles and redraw only those regions */
-
-#define CELLS_X 80
-#define CELLS_Y 50
-#define CELL_SIZE 96
+** of hash values, sized to the window, take the cells that have changed since
+** the previous frame, merge them into dirty rectangles and redraw only those
+** regions. Each window keeps its own cells, in its RenCache.
+** The same pass records which commands touch each cell. The dirty rectangles
+** are split into tiles, which gather the commands of their cells, and the
+** tiles are drawn in parallel by a pool of threads.
+** When validating, the whole frame is also redrawn aside, to find the cells
+** that were kept from the previous frame while their content changed */
+
+#define MIN_CELL_SIZE 32 /* in pixels */
+#define MAX_CELLS 8192
+#define TILE_SIZE 192
+#define MAX_RENDER_THREADS 8
 #define CMD_BUF_RESIZE_RATE 1.2
 #define CMD_BUF_INIT_SIZE (1024 * 512)
 #define COMMAND_BARE_SIZE offsetof(Command, command)
@@ -53,7 +60,6 @@ typedef struct {
   RenFont *fonts[FONT_FALLBACK_MAX];
   float text_x;
   size_t len;
-  int8_t tab_size;
   RenTab tab;
   char text[];
 } DrawTextCommand;
@@ -63,33 +69,111 @@ typedef struct {
   RenColor color;
 } DrawRectCommand;
 
-static unsigned cells_buf1[CELLS_X * CELLS_Y];
-static unsigned cells_buf2[CELLS_X * CELLS_Y];
-static unsigned *cells_prev = cells_buf1;
-static unsigned *cells = cells_buf2;
-static RenRect rect_buf[CELLS_X * CELLS_Y / 2];
-static bool resize_issue;
-static RenRect screen_rect;
-static RenRect last_clip_rect;
+/* a drawing command, with the clip rect it was issued with and the area
+** it can draw to once clipped */
+typedef struct {
+  Command *command;
+  RenRect clip, bounds;
+  int tile; /* the last tile the command was gathered into */
+  bool glyphs_loaded;
+} BinnedCommand;
+
+/* an entry of the list of binned commands touching a cell */
+typedef struct {
+  int command, next;
+} CellBin;
+
+typedef struct {
+  RenRect rect;
+  int *commands;
+  size_t count, capacity;
+} Tile;
+
+/* the threads drawing tiles along with the main thread, each one through
+** its own view of the window surface, as the clip rect is kept by the surface */
+static struct {
+  SDL_Thread *threads[MAX_RENDER_THREADS - 1];
+  RenSurface views[MAX_RENDER_THREADS];
+  int thread_count;
+  SDL_Mutex *mutex;
+  SDL_Condition *start, *finish;
+  unsigned frame;
+  int busy;
+  bool quit;
+  SDL_AtomicInt next_tile;
+} render_pool;
+
+static unsigned cells_generation;
+/* buffers used while ending a frame, shared by the windows as they are drawn
+** one after the other */
+static BinnedCommand *binned;
+static int binned_count, binned_capacity;
+static CellBin *cell_bins;
+static int cell_bin_count, cell_bin_capacity;
+static Tile *tiles;
+static int tile_count, tile_capacity;
+static int *tile_grid;
+static size_t tile_grid_size;
+static bool bin_issue;
 static bool show_debug;
+static bool validate_cells;
+static SDL_Surface *validate_surface;
+static size_t validated_cells, stale_cells;
 
 static inline int rencache_min(int a, int b) { return a < b ? a : b; }
 static inline int rencache_max(int a, int b) { return a > b ? a : b; }
 
 
-/* 32bit fnv-1a hash */
-#define HASH_INITIAL 2166136261
+#define HASH_INITIAL 0x27D4EB2F165667C5ULL
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
 
-static void hash(unsigned *h, const void *data, int size) {
-  const unsigned char *p = data;
-  while (size--) {
-    *h = (*h ^ *p++) * 16777619;
+static const uint64_t hash_keys[4] = {
+  0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/* accumulates a word of a command the way xxh3 does: a 32x32->64 product of
+** the keyed word, plus the word itself on the neighbouring lane */
+static inline void hash_word(uint64_t *acc, int lane, const uint8_t *p) {
+  uint64_t word, keyed;
+  memcpy(&word, p, sizeof(word));
+  keyed = word ^ hash_keys[lane];
+  acc[lane ^ 1] += word;
+  acc[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+}
+
+/* 64bit xxh3-style hash of a command, 32 bytes at a time over 4 independent
+** lanes that the compiler can keep in vector registers. Commands are padded
+** with zeroes to a multiple of alignof(max_align_t), so they are read by words */
+static uint64_t hash_command(const Command *cmd) {
+  const uint8_t *p = (const uint8_t*) cmd;
+  size_t words = cmd->size / sizeof(uint64_t), i = 0;
+  uint64_t acc[4] = { HASH_PRIME1, HASH_PRIME2, HASH_PRIME3, HASH_INITIAL };
+  for (; i + 4 <= words; i += 4) {
+    for (int lane = 0; lane < 4; lane++) {
+      hash_word(acc, lane, p + (i + lane) * sizeof(uint64_t));
+    }
   }
+  for (int lane = 0; i < words; i++, lane++) {
+    hash_word(acc, lane, p + i * sizeof(uint64_t));
+  }
+  uint64_t h = cmd->size * HASH_PRIME1;
+  for (int lane = 0; lane < 4; lane++) {
+    h = rotl64(h ^ (acc[lane] * HASH_PRIME2), 27) * HASH_PRIME1 + HASH_PRIME3;
+  }
+  h ^= h >> 37;
+  h *= HASH_PRIME3;
+  return h ^ (h >> 32);
 }
 
 
-static inline int cell_idx(int x, int y) {
-  return x + y * CELLS_X;
+static inline int cell_idx(RenCache *cache, int x, int y) {
+  return x + y * cache->cols;
 }
 
 
@@ -131,7 +215,7 @@ static bool expand_command_buffer(RenWindow *window_renderer) {
 }
 
 static void* push_command(RenWindow *window_renderer, enum CommandType type, int size) {
-  if (!window_renderer || resize_issue) {
+  if (!window_renderer || window_renderer->cache.resize_issue) {
     // Don't push new commands as we had problems resizing the command buffer.
     // Or, we don't have an active buffer.
     // Let's wait for the next frame.
@@ -145,7 +229,7 @@ static void* push_command(RenWindow *window_renderer, enum CommandType type, int
     if (!expand_command_buffer(window_renderer)) {
       fprintf(stderr, "Warning: (" __FILE__ "): unable to resize command buffer (%zu)\n",
               (size_t)(window_renderer->command_buf_size * CMD_BUF_RESIZE_RATE));
-      resize_issue = true;
+      window_renderer->cache.resize_issue = true;
       return NULL;
     }
   }
@@ -173,17 +257,26 @@ void rencache_show_debug(bool enable) {
 }
 
 
+void rencache_validate(bool enable, size_t *checked, size_t *stale) {
+  validate_cells = enable;
+  *checked = validated_cells;
+  *stale = stale_cells;
+  validated_cells = stale_cells = 0;
+}
+
+
 void rencache_set_clip_rect(RenWindow *window_renderer, RenRect rect) {
   SetClipCommand *cmd = push_command(window_renderer, SET_CLIP, sizeof(SetClipCommand));
   if (cmd) {
-    cmd->rect = intersect_rects(rect, screen_rect);
-    last_clip_rect = cmd->rect;
+    cmd->rect = intersect_rects(rect, window_renderer->cache.screen_rect);
+    window_renderer->cache.last_clip_rect = cmd->rect;
   }
 }
 
 
 void rencache_draw_rect(RenWindow *window_renderer, RenRect rect, RenColor color) {
-  if (rect.width == 0 || rect.height == 0 || !rects_overlap(last_clip_rect, rect)) {
+  if (!window_renderer || rect.width == 0 || rect.height == 0
+      || !rects_overlap(window_renderer->cache.last_clip_rect, rect)) {
     return;
   }
   DrawRectCommand *cmd = push_command(window_renderer, DRAW_RECT, sizeof(DrawRectCommand));
@@ -198,7 +291,7 @@ double rencache_draw_text(RenWindow *window_renderer, RenFont **fonts, const cha
   int x_offset;
   double width = ren_font_group_get_width(fonts, text, len, tab, &x_offset);
   RenRect rect = { x + x_offset, y, (int)(width - x_offset), ren_font_group_get_height(fonts) };
-  if (rects_overlap(last_clip_rect, rect)) {
+  if (window_renderer && rects_overlap(window_renderer->cache.last_clip_rect, rect)) {
     int sz = len + 1;
     DrawTextCommand *cmd = push_command(window_renderer, DRAW_TEXT, sizeof(DrawTextCommand) + sz);
     if (cmd) {
@@ -208,142 +301,546 @@ double rencache_draw_text(RenWindow *window_renderer, RenFont **fonts, const cha
       cmd->rect = rect;
       cmd->text_x = x;
       cmd->len = len;
-      cmd->tab_size = ren_font_group_get_tab_size(fonts);
       cmd->tab = tab;
+      if (!cmd->tab.size)
+        cmd->tab.size = ren_font_group_get_tab_size(fonts);
     }
   }
   return x + width;
 }
 
 
+void rencache_free(void) {
+  if (render_pool.mutex) {
+    SDL_LockMutex(render_pool.mutex);
+    render_pool.quit = true;
+    SDL_BroadcastCondition(render_pool.start);
+    SDL_UnlockMutex(render_pool.mutex);
+    for (int i = 0; i < render_pool.thread_count; i++) {
+      SDL_WaitThread(render_pool.threads[i], NULL);
+    }
+  }
+  SDL_DestroyCondition(render_pool.start);
+  SDL_DestroyCondition(render_pool.finish);
+  SDL_DestroyMutex(render_pool.mutex);
+  memset(&render_pool, 0, sizeof(render_pool));
+  for (int i = 0; i < tile_capacity; i++) {
+    SDL_free(tiles[i].commands);
+  }
+  SDL_free(tiles);
+  SDL_free(tile_grid);
+  SDL_free(binned);
+  SDL_free(cell_bins);
+  SDL_DestroySurface(validate_surface);
+  validate_surface = NULL;
+  tiles = NULL;
+  tile_grid = NULL;
+  binned = NULL;
+  cell_bins = NULL;
+  tile_count = tile_capacity = 0;
+  tile_grid_size = 0;
+  binned_count = binned_capacity = 0;
+  cell_bin_count = cell_bin_capacity = 0;
+}
+
+
+/* windows reset their cells when they are next drawn */
 void rencache_invalidate(void) {
-  memset(cells_prev, 0xff, sizeof(cells_buf1));
+  cells_generation++;
+}
+
+
+static void invalidate_cells(RenCache *cache) {
+  memset(cache->cells_prev, 0xff, cache->cols * cache->rows * sizeof(uint64_t));
+  cache->generation = cells_generation;
+}
+
+
+/* sizes the cells to keep about MAX_CELLS of them, so that small changes like
+** a blinking caret repaint as few pixels as possible on any window size */
+static bool resize_cells(RenCache *cache, int w, int h, int scale) {
+  int cell_size = rencache_max((MIN_CELL_SIZE + scale - 1) / scale, 1);
+  while ((w / cell_size + 1) * (h / cell_size + 1) > MAX_CELLS) {
+    cell_size += cell_size / 4 + 1;
+  }
+  int cols = w / cell_size + 1, rows = h / cell_size + 1;
+  int count = cols * rows;
+  if (count > cache->cols * cache->rows) {
+    uint64_t *cells = SDL_realloc(cache->cells, count * sizeof(uint64_t));
+    if (cells) { cache->cells = cells; }
+    uint64_t *cells_prev = SDL_realloc(cache->cells_prev, count * sizeof(uint64_t));
+    if (cells_prev) { cache->cells_prev = cells_prev; }
+    RenRect *rects = SDL_realloc(cache->rects, count * sizeof(RenRect));
+    if (rects) { cache->rects = rects; }
+    int *first = SDL_realloc(cache->cell_bins_first, count * sizeof(int));
+    if (first) { cache->cell_bins_first = first; }
+    int *last = SDL_realloc(cache->cell_bins_last, count * sizeof(int));
+    if (last) { cache->cell_bins_last = last; }
+    if (!cells || !cells_prev || !rects || !first || !last) { return false; }
+  }
+  cache->width = w;
+  cache->height = h;
+  cache->scale = scale;
+  cache->cols = cols;
+  cache->rows = rows;
+  cache->cell_size = cell_size;
+  cache->tile_cells = rencache_max(TILE_SIZE / cell_size, 1);
+  for (int i = 0; i < count; i++) {
+    cache->cells[i] = HASH_INITIAL;
+  }
+  invalidate_cells(cache);
+  return true;
 }
 
 
 void rencache_begin_frame(RenWindow *window_renderer) {
-  /* reset all cells if the screen width/height has changed */
+  /* resize and reset all cells if the screen width/height has changed */
   int w, h;
-  resize_issue = false;
+  RenCache *cache = &window_renderer->cache;
+  int scale = renwin_get_surface(window_renderer).scale;
+  cache->resize_issue = false;
   ren_get_size(window_renderer, &w, &h);
-  if (screen_rect.width != w || h != screen_rect.height) {
-    screen_rect.width = w;
-    screen_rect.height = h;
-    rencache_invalidate();
+  cache->screen_rect.width = w;
+  cache->screen_rect.height = h;
+  if (cache->width != w || cache->height != h || cache->scale != scale || !cache->cells) {
+    cache->cols = cache->rows = 0;
+    if (!resize_cells(cache, w, h, scale)) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to resize render cells (%dx%d)\n", w, h);
+      cache->width = cache->height = 0;
+      cache->resize_issue = true;
+    }
+  } else if (cache->generation != cells_generation) {
+    invalidate_cells(cache);
   }
-  last_clip_rect = screen_rect;
+  cache->last_clip_rect = cache->screen_rect;
 }
 
 
-static void update_overlapping_cells(RenRect r, unsigned h) {
-  int x1 = r.x / CELL_SIZE;
-  int y1 = r.y / CELL_SIZE;
-  int x2 = (r.x + r.width) / CELL_SIZE;
-  int y2 = (r.y + r.height) / CELL_SIZE;
+static void update_overlapping_cells(RenCache *cache, RenRect r, uint64_t h) {
+  int x1 = r.x / cache->cell_size;
+  int y1 = r.y / cache->cell_size;
+  int x2 = (r.x + r.width) / cache->cell_size;
+  int y2 = (r.y + r.height) / cache->cell_size;
 
   for (int y = y1; y <= y2; y++) {
     for (int x = x1; x <= x2; x++) {
-      int idx = cell_idx(x, y);
-      hash(&cells[idx], &h, sizeof(h));
+      int idx = cell_idx(cache, x, y);
+      cache->cells[idx] = (cache->cells[idx] ^ h) * HASH_PRIME1;
     }
   }
 }
 
 
-static void push_rect(RenRect r, int *count) {
+static void push_rect(RenCache *cache, RenRect r, int *count) {
   /* try to merge with existing rectangle */
   for (int i = *count - 1; i >= 0; i--) {
-    RenRect *rp = &rect_buf[i];
+    RenRect *rp = &cache->rects[i];
     if (rects_overlap(*rp, r)) {
       *rp = merge_rects(*rp, r);
       return;
     }
   }
   /* couldn't merge with previous rectangle: push */
-  rect_buf[(*count)++] = r;
+  cache->rects[(*count)++] = r;
+}
+
+
+static RenRect command_bounds(Command *cmd) {
+  RenRect r = cmd->command[0];
+  if (cmd->type == DRAW_TEXT) {
+    /* glyphs of italic and fallback fonts can reach out of the measured text */
+    r = (RenRect) { r.x - r.height, r.y - r.height, r.width + r.height * 2, r.height * 3 };
+  }
+  return r;
+}
+
+
+/* appends a drawing command to the lists of the cells it can draw to */
+static void bin_command(RenCache *cache, Command *cmd, RenRect clip) {
+  RenRect r = intersect_rects(command_bounds(cmd), clip);
+  if (r.width == 0 || r.height == 0) { return; }
+  int x1 = r.x / cache->cell_size, y1 = r.y / cache->cell_size;
+  int x2 = rencache_min((r.x + r.width) / cache->cell_size, cache->cols - 1);
+  int y2 = rencache_min((r.y + r.height) / cache->cell_size, cache->rows - 1);
+  int cell_count = (x2 - x1 + 1) * (y2 - y1 + 1);
+  if (binned_count == binned_capacity || cell_bin_count + cell_count > cell_bin_capacity) {
+    int new_binned_capacity = binned_count == binned_capacity ? rencache_max(binned_capacity * 2, 1024) : binned_capacity;
+    int new_cell_bin_capacity = rencache_max(cell_bin_capacity * 2, cell_bin_count + cell_count + 4096);
+    BinnedCommand *new_binned = SDL_realloc(binned, new_binned_capacity * sizeof(BinnedCommand));
+    if (new_binned) { binned = new_binned; binned_capacity = new_binned_capacity; }
+    CellBin *new_cell_bins = SDL_realloc(cell_bins, new_cell_bin_capacity * sizeof(CellBin));
+    if (new_cell_bins) { cell_bins = new_cell_bins; cell_bin_capacity = new_cell_bin_capacity; }
+    if (!new_binned || !new_cell_bins) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to resize command bins\n");
+      bin_issue = true;
+      return;
+    }
+  }
+  int idx = binned_count++;
+  binned[idx] = (BinnedCommand) { cmd, clip, r, -1, false };
+  for (int y = y1; y <= y2; y++) {
+    for (int x = x1; x <= x2; x++) {
+      int cell = cell_idx(cache, x, y);
+      cell_bins[cell_bin_count] = (CellBin) { idx, -1 };
+      if (cache->cell_bins_last[cell] < 0) {
+        cache->cell_bins_first[cell] = cell_bin_count;
+      } else {
+        cell_bins[cache->cell_bins_last[cell]].next = cell_bin_count;
+      }
+      cache->cell_bins_last[cell] = cell_bin_count++;
+    }
+  }
+}
+
+
+static void split_tiles(RenCache *cache, int rect_count) {
+  int tile_size = cache->cell_size * cache->tile_cells;
+  int tiles_x = cache->screen_rect.width / tile_size + 1;
+  int tiles_y = cache->screen_rect.height / tile_size + 1;
+  tile_count = 0;
+  if (tile_grid_size < (size_t) (tiles_x * tiles_y)) {
+    int *new_tile_grid = SDL_realloc(tile_grid, tiles_x * tiles_y * sizeof(int));
+    if (!new_tile_grid) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to resize tile grid\n");
+      bin_issue = true;
+      return;
+    }
+    tile_grid = new_tile_grid;
+    tile_grid_size = tiles_x * tiles_y;
+  }
+  memset(tile_grid, 0xff, tiles_x * tiles_y * sizeof(int));
+
+  for (int i = 0; i < rect_count; i++) {
+    RenRect r = cache->rects[i];
+    int x2 = rencache_min((r.x + r.width - 1) / tile_size, tiles_x - 1);
+    int y2 = rencache_min((r.y + r.height - 1) / tile_size, tiles_y - 1);
+    for (int y = r.y / tile_size; y <= y2; y++) {
+      for (int x = r.x / tile_size; x <= x2; x++) {
+        RenRect part = intersect_rects(r, (RenRect) { x * tile_size, y * tile_size, tile_size, tile_size });
+        if (part.width == 0 || part.height == 0) { continue; }
+        int *idx = &tile_grid[x + y * tiles_x];
+        if (*idx >= 0) {
+          tiles[*idx].rect = merge_rects(tiles[*idx].rect, part);
+          continue;
+        }
+        if (tile_count == tile_capacity) {
+          int new_tile_capacity = tile_capacity ? tile_capacity * 2 : 64;
+          Tile *new_tiles = SDL_realloc(tiles, new_tile_capacity * sizeof(Tile));
+          if (!new_tiles) {
+            /* the tiles split so far are still drawn */
+            fprintf(stderr, "Warning: (" __FILE__ "): unable to resize tiles\n");
+            bin_issue = true;
+            return;
+          }
+          tiles = new_tiles;
+          memset(&tiles[tile_count], 0, (new_tile_capacity - tile_count) * sizeof(Tile));
+          tile_capacity = new_tile_capacity;
+        }
+        *idx = tile_count++;
+        tiles[*idx].rect = part;
+        tiles[*idx].count = 0;
+      }
+    }
+  }
+}
+
+
+static void push_tile_command(Tile *tile, int command) {
+  if (tile->count == tile->capacity) {
+    int capacity = tile->capacity ? tile->capacity * 2 : 64;
+    int *commands = SDL_realloc(tile->commands, capacity * sizeof(int));
+    if (!commands) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to resize tile commands\n");
+      bin_issue = true;
+      return;
+    }
+    tile->commands = commands;
+    tile->capacity = capacity;
+  }
+  tile->commands[tile->count++] = command;
+}
+
+
+static int compare_commands(const void *a, const void *b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+
+/* gathers the commands in the lists of the cells covered by each tile, in the
+** order they were issued, and only those reaching the dirty part */
+static void gather_tile_commands(RenCache *cache, RenSurface rs) {
+  /* glyphs are loaded lazily by the fonts, which can't be done from several threads */
+  bool load_glyphs = render_pool.thread_count > 0 && tile_count > 1;
+  for (int i = 0; i < tile_count; i++) {
+    Tile *tile = &tiles[i];
+    int x1 = tile->rect.x / cache->cell_size, y1 = tile->rect.y / cache->cell_size;
+    int x2 = (tile->rect.x + tile->rect.width - 1) / cache->cell_size;
+    int y2 = (tile->rect.y + tile->rect.height - 1) / cache->cell_size;
+    for (int y = y1; y <= y2; y++) {
+      for (int x = x1; x <= x2; x++) {
+        for (int bin = cache->cell_bins_first[cell_idx(cache, x, y)]; bin >= 0; bin = cell_bins[bin].next) {
+          BinnedCommand *bc = &binned[cell_bins[bin].command];
+          /* commands spanning several cells of the tile come up once per cell */
+          if (bc->tile == i || !rects_overlap(tile->rect, bc->bounds)) { continue; }
+          bc->tile = i;
+          push_tile_command(tile, cell_bins[bin].command);
+          if (load_glyphs && !bc->glyphs_loaded && bc->command->type == DRAW_TEXT) {
+            DrawTextCommand *tcmd = (DrawTextCommand*)&bc->command->command;
+            ren_font_group_load_text(tcmd->fonts, tcmd->text, tcmd->len, tcmd->text_x, rs.scale, tcmd->tab);
+            bc->glyphs_loaded = true;
+          }
+        }
+      }
+    }
+    /* the list of a single cell is already in order */
+    if (x1 != x2 || y1 != y2) {
+      SDL_qsort(tile->commands, tile->count, sizeof(int), compare_commands);
+    }
+  }
+}
+
+
+static void set_view_clip(RenSurface *view, RenRect rect) {
+  SDL_Rect sr = { rect.x * view->scale, rect.y * view->scale, rect.width * view->scale, rect.height * view->scale };
+  SDL_SetSurfaceClipRect(view->surface, &sr);
+}
+
+
+static void draw_command(Command *cmd, RenSurface *view) {
+  DrawRectCommand *rcmd = (DrawRectCommand*)&cmd->command;
+  DrawTextCommand *tcmd = (DrawTextCommand*)&cmd->command;
+  switch (cmd->type) {
+    case DRAW_RECT:
+      ren_draw_rect(view, rcmd->rect, rcmd->color);
+      break;
+    case DRAW_TEXT:
+      ren_draw_text(view, tcmd->fonts, tcmd->text, tcmd->len, tcmd->text_x, tcmd->rect.y, tcmd->color, tcmd->tab);
+      break;
+    default:
+      break;
+  }
+}
+
+
+static void draw_tile(Tile *tile, RenSurface *view) {
+  for (size_t i = 0; i < tile->count; i++) {
+    BinnedCommand *bc = &binned[tile->commands[i]];
+    if (i == 0 || memcmp(&bc->clip, &binned[tile->commands[i - 1]].clip, sizeof(RenRect)) != 0) {
+      set_view_clip(view, intersect_rects(bc->clip, tile->rect));
+    }
+    draw_command(bc->command, view);
+  }
+}
+
+
+static void draw_pending_tiles(RenSurface *view) {
+  int i;
+  while ((i = SDL_AddAtomicInt(&render_pool.next_tile, 1)) < tile_count) {
+    draw_tile(&tiles[i], view);
+  }
+}
+
+
+static int render_thread(void *data) {
+  RenSurface *view = &render_pool.views[(intptr_t) data];
+  unsigned frame = 0;
+  SDL_LockMutex(render_pool.mutex);
+  while (true) {
+    while (!render_pool.quit && render_pool.frame == frame) {
+      SDL_WaitCondition(render_pool.start, render_pool.mutex);
+    }
+    if (render_pool.quit) { break; }
+    frame = render_pool.frame;
+    SDL_UnlockMutex(render_pool.mutex);
+    draw_pending_tiles(view);
+    SDL_LockMutex(render_pool.mutex);
+    if (--render_pool.busy == 0) {
+      SDL_SignalCondition(render_pool.finish);
+    }
+  }
+  SDL_UnlockMutex(render_pool.mutex);
+  return 0;
+}
+
+
+static void start_render_pool(void) {
+  render_pool.mutex = SDL_CreateMutex();
+  render_pool.start = SDL_CreateCondition();
+  render_pool.finish = SDL_CreateCondition();
+  if (!render_pool.mutex || !render_pool.start || !render_pool.finish) { return; }
+  int threads = SDL_clamp(SDL_GetNumLogicalCPUCores(), 1, MAX_RENDER_THREADS) - 1;
+  for (int i = 0; i < threads; i++) {
+    render_pool.threads[i] = SDL_CreateThread(render_thread, "rencache", (void*) (intptr_t) (i + 1));
+    if (!render_pool.threads[i]) { break; }
+    render_pool.thread_count++;
+  }
+}
+
+
+static void draw_tiles(RenSurface rs) {
+  int threads = render_pool.thread_count > 0 && tile_count > 1 ? render_pool.thread_count : 0;
+  /* views share the pixels of the window surface, which is recreated on resize */
+  for (int i = 0; i <= threads; i++) {
+    SDL_Surface *view = SDL_CreateSurfaceFrom(rs.surface->w, rs.surface->h, rs.surface->format, rs.surface->pixels, rs.surface->pitch);
+    if (!view && i > 0) {
+      threads = i - 1;
+      break;
+    }
+    render_pool.views[i] = (RenSurface) { view ? view : rs.surface, rs.scale };
+  }
+  SDL_SetAtomicInt(&render_pool.next_tile, 0);
+  if (threads > 0) {
+    SDL_LockMutex(render_pool.mutex);
+    render_pool.frame++;
+    render_pool.busy = threads;
+    SDL_BroadcastCondition(render_pool.start);
+    SDL_UnlockMutex(render_pool.mutex);
+  }
+  draw_pending_tiles(&render_pool.views[0]);
+  if (threads > 0) {
+    SDL_LockMutex(render_pool.mutex);
+    while (render_pool.busy > 0) {
+      SDL_WaitCondition(render_pool.finish, render_pool.mutex);
+    }
+    SDL_UnlockMutex(render_pool.mutex);
+  }
+  for (int i = 0; i <= threads; i++) {
+    if (render_pool.views[i].surface != rs.surface) {
+      SDL_DestroySurface(render_pool.views[i].surface);
+    }
+  }
+}
+
+
+/* redraws the whole frame on a surface of its own, and compares it with the
+** cells that weren't redrawn: those differing were kept from the previous
+** frame because their hash matched, while their content had changed */
+static void validate_frame(RenWindow *window_renderer, RenSurface rs, int rect_count) {
+  RenCache *cache = &window_renderer->cache;
+  SDL_Surface *surface = rs.surface;
+  if (!validate_surface || validate_surface->w != surface->w || validate_surface->h != surface->h
+      || validate_surface->format != surface->format) {
+    SDL_DestroySurface(validate_surface);
+    validate_surface = SDL_CreateSurface(surface->w, surface->h, surface->format);
+    if (!validate_surface) { return; }
+  }
+  RenSurface view = { validate_surface, rs.scale };
+  Command *cmd = NULL;
+  set_view_clip(&view, cache->screen_rect);
+  while (next_command(window_renderer, &cmd)) {
+    if (cmd->type == SET_CLIP) { set_view_clip(&view, cmd->command[0]); }
+    else { draw_command(cmd, &view); }
+  }
+
+  int bpp = SDL_BYTESPERPIXEL(surface->format);
+  int size = cache->cell_size;
+  for (int y = 0; y < cache->rows; y++) {
+    for (int x = 0; x < cache->cols; x++) {
+      RenRect cell = intersect_rects((RenRect) { x * size, y * size, size, size }, cache->screen_rect);
+      bool redrawn = cell.width == 0 || cell.height == 0;
+      for (int i = 0; i < rect_count && !redrawn; i++) {
+        RenRect r = intersect_rects(cell, cache->rects[i]);
+        redrawn = r.width > 0 && r.height > 0;
+      }
+      if (redrawn) { continue; }
+      int x1 = cell.x * rs.scale, y1 = cell.y * rs.scale;
+      int x2 = rencache_min((cell.x + cell.width) * rs.scale, surface->w);
+      int y2 = rencache_min((cell.y + cell.height) * rs.scale, surface->h);
+      bool stale = false;
+      for (int py = y1; py < y2 && !stale; py++) {
+        const uint8_t *shown = (const uint8_t*) surface->pixels + py * surface->pitch + x1 * bpp;
+        const uint8_t *expected = (const uint8_t*) validate_surface->pixels + py * validate_surface->pitch + x1 * bpp;
+        stale = memcmp(shown, expected, (x2 - x1) * bpp) != 0;
+      }
+      validated_cells++;
+      if (stale) {
+        stale_cells++;
+        fprintf(stderr, "Warning: (" __FILE__ "): stale cell at %d, %d\n", x, y);
+      }
+    }
+  }
 }
 
 
 void rencache_end_frame(RenWindow *window_renderer) {
-  /* update cells from commands */
+  RenCache *cache = &window_renderer->cache;
+  if (cache->cols == 0) {
+    /* the cells couldn't be allocated, skip the frame */
+    window_renderer->command_buf_idx = 0;
+    return;
+  }
+  /* update cells from commands, and record which ones touch each cell */
   Command *cmd = NULL;
-  RenRect cr = screen_rect;
+  RenRect cr = cache->screen_rect;
+  int cell_count = cache->cols * cache->rows;
+  binned_count = cell_bin_count = 0;
+  bin_issue = false;
+  memset(cache->cell_bins_first, 0xff, cell_count * sizeof(int));
+  memset(cache->cell_bins_last, 0xff, cell_count * sizeof(int));
   while (next_command(window_renderer, &cmd)) {
     /* cmd->command[0] should always be the Command rect */
     if (cmd->type == SET_CLIP) { cr = cmd->command[0]; }
+    else { bin_command(cache, cmd, cr); }
     RenRect r = intersect_rects(cmd->command[0], cr);
     if (r.width == 0 || r.height == 0) { continue; }
-    unsigned h = HASH_INITIAL;
-    hash(&h, cmd, cmd->size);
-    update_overlapping_cells(r, h);
+    update_overlapping_cells(cache, r, hash_command(cmd));
   }
 
   /* push rects for all cells changed from last frame, reset cells */
   int rect_count = 0;
-  int max_x = screen_rect.width / CELL_SIZE + 1;
-  int max_y = screen_rect.height / CELL_SIZE + 1;
-  for (int y = 0; y < max_y; y++) {
-    for (int x = 0; x < max_x; x++) {
+  for (int y = 0; y < cache->rows; y++) {
+    for (int x = 0; x < cache->cols; x++) {
       /* compare previous and current cell for change */
-      int idx = cell_idx(x, y);
-      if (cells[idx] != cells_prev[idx]) {
-        push_rect((RenRect) { x, y, 1, 1 }, &rect_count);
+      int idx = cell_idx(cache, x, y);
+      if (cache->cells[idx] != cache->cells_prev[idx]) {
+        push_rect(cache, (RenRect) { x, y, 1, 1 }, &rect_count);
       }
-      cells_prev[idx] = HASH_INITIAL;
+      cache->cells_prev[idx] = HASH_INITIAL;
     }
   }
 
   /* expand rects from cells to pixels */
   for (int i = 0; i < rect_count; i++) {
-    RenRect *r = &rect_buf[i];
-    r->x *= CELL_SIZE;
-    r->y *= CELL_SIZE;
-    r->width *= CELL_SIZE;
-    r->height *= CELL_SIZE;
-    *r = intersect_rects(*r, screen_rect);
+    RenRect *r = &cache->rects[i];
+    r->x *= cache->cell_size;
+    r->y *= cache->cell_size;
+    r->width *= cache->cell_size;
+    r->height *= cache->cell_size;
+    *r = intersect_rects(*r, cache->screen_rect);
   }
 
   RenSurface rs = renwin_get_surface(window_renderer);
   /* redraw updated regions */
-  for (int i = 0; i < rect_count; i++) {
-    /* draw */
-    RenRect r = rect_buf[i];
-    ren_set_clip_rect(window_renderer, r);
-
-    cmd = NULL;
-    while (next_command(window_renderer, &cmd)) {
-      SetClipCommand *ccmd = (SetClipCommand*)&cmd->command;
-      DrawRectCommand *rcmd = (DrawRectCommand*)&cmd->command;
-      DrawTextCommand *tcmd = (DrawTextCommand*)&cmd->command;
-      switch (cmd->type) {
-        case SET_CLIP:
-          ren_set_clip_rect(window_renderer, intersect_rects(ccmd->rect, r));
-          break;
-        case DRAW_RECT:
-          ren_draw_rect(&rs, rcmd->rect, rcmd->color);
-          break;
-        case DRAW_TEXT:
-          ren_font_group_set_tab_size(tcmd->fonts, tcmd->tab_size);
-          ren_draw_text(&rs, tcmd->fonts, tcmd->text, tcmd->len, tcmd->text_x, tcmd->rect.y, tcmd->color, tcmd->tab);
-          break;
-      }
-    }
+  if (rect_count > 0) {
+    if (!render_pool.mutex) { start_render_pool(); }
+    split_tiles(cache, rect_count);
+    gather_tile_commands(cache, rs);
+    draw_tiles(rs);
+  }
 
-    if (show_debug) {
+  if (validate_cells) {
+    validate_frame(window_renderer, rs, rect_count);
+  } else if (show_debug) {
+    /* the overlay stays on screen in the cells that aren't redrawn, so it
+    ** isn't drawn while validating */
+    for (int i = 0; i < rect_count; i++) {
       RenColor color = { rand(), rand(), rand(), 50 };
-      ren_draw_rect(&rs, r, color);
+      ren_set_clip_rect(window_renderer, cache->rects[i]);
+      ren_draw_rect(&rs, cache->rects[i], color);
     }
   }
 
   /* update dirty rects */
   if (rect_count > 0) {
-    ren_update_rects(window_renderer, rect_buf, rect_count);
+    ren_update_rects(window_renderer, cache->rects, rect_count);
   }
 
   /* swap cell buffer and reset */
-  unsigned *tmp = cells;
-  cells = cells_prev;
-  cells_prev = tmp;
+  uint64_t *tmp = cache->cells;
+  cache->cells = cache->cells_prev;
+  cache->cells_prev = tmp;
+  /* commands that couldn't be binned or tiled weren't drawn, so redraw everything next time */
+  if (bin_issue) { invalidate_cells(cache); }
   window_renderer->command_buf_idx = 0;
 }
 
@@ -12,6 +12,7 @@
 
 #include "renderer.h"
 #include "renwindow.h"
+#include "renblend.h"
 
 // uncomment the line below for more debugging information through printf
 // #define RENDERER_DEBUG
@@ -20,9 +21,9 @@ static RenWindow **window_list = NULL;
 static RenWindow *target_window = NULL;
 static size_t window_count = 0;
 
-// draw_rect_surface is used as a 1x1 surface to simplify ren_draw_rect with blending
-static SDL_Surface *draw_rect_surface = NULL;
 static FT_Library library = NULL;
+// faces, and the lcd filter of the library, can't be used from several threads at once
+static SDL_Mutex *library_lock = NULL;
 
 #define check_alloc(P) _check_alloc(P, __FILE__, __LINE__)
 static void* _check_alloc(void *ptr, const char *const file, size_t ln) {
@@ -45,11 +46,14 @@ static const char *const get_ft_error(FT_Error err) {
 
 /************************* Fonts *************************/
 
-// approximate number of glyphs per atlas surface
-#define GLYPHS_PER_ATLAS 96
-// some padding to add to atlas surface to store more glyphs
-#define FONT_HEIGHT_OVERFLOW_PX 0
-#define FONT_WIDTH_OVERFLOW_PX 9
+// the size of the square atlas pages, which hold at least ATLAS_PAGE_LINES lines of glyphs
+#define ATLAS_PAGE_MIN_SIZE 256
+#define ATLAS_PAGE_MAX_SIZE 2048
+#define ATLAS_PAGE_LINES 8
+// shelves are rounded to this height, so that glyphs of similar heights share them
+#define ATLAS_SHELF_ROUNDING 4
+// the default memory a font can cache glyphs in, before evicting the least recently used pages
+#define FONT_ATLAS_BUDGET (16 * 1024 * 1024)
 
 // maximum unicode codepoint supported (https://stackoverflow.com/a/52203901)
 #define MAX_UNICODE 0x10FFFF
@@ -77,15 +81,17 @@ typedef enum {
 typedef enum {
   EGlyphNone = 0,             // glyph is not loaded
   EGlyphXAdvance = (1 << 0L), // xadvance is loaded
-  EGlyphBitmap = (1 << 1L)    // bitmap is loaded
+  EGlyphBitmap = (1 << 1L),   // bitmap is loaded
+  EGlyphEmpty = (1 << 2L),    // bitmap was rendered, but has nothing to draw
+  EGlyphPending = (1 << 3L)   // bitmap is being rendered by the glyph worker
 } ERenGlyphFlags;
 
 // metrics for a loaded glyph
 typedef struct {
   float xadvance;
-  unsigned short atlas_idx, surface_idx;
+  unsigned short atlas_idx;
   int bitmap_left, bitmap_top;
-  unsigned int x1, y0, y1;
+  unsigned int x0, x1, y0, y1;
   unsigned short flags;
   unsigned char format;
 } GlyphMetric;
@@ -95,20 +101,26 @@ typedef struct {
   unsigned int *rows[CHARMAP_ROW];
 } CharMap;
 
-// a bitmap atlas with a fixed width, each surface acting as a bump allocator
+// a row of glyphs in an atlas page, filled from left to right
 typedef struct {
-  SDL_Surface **surfaces;
-  unsigned int width, nsurface;
+  unsigned int y, height, width;
+} GlyphShelf;
+
+// a page of glyph bitmaps, packed in shelves
+typedef struct {
+  SDL_Surface *surface; // NULL once evicted, for the slot to be reused
+  GlyphShelf *shelves;
+  unsigned int nshelf, height, last_used;
 } GlyphAtlas;
 
 // maps glyph IDs -> glyph metrics
 typedef struct {
   // accessed with metrics[bitmap_idx][glyph_id / nrow][glyph_id - (row * ncol)]
   GlyphMetric *metrics[SUBPIXEL_BITMAPS_CACHED][GLYPHMAP_ROW];
-  // accessed by atlas[glyph_format][atlas_idx].surfaces[surface_idx]
+  // accessed by atlas[glyph_format][atlas_idx]
   GlyphAtlas *atlas[EGlyphFormatSize];
   size_t natlas[EGlyphFormatSize];
-  size_t bytesize;
+  size_t bytesize, budget;
 } GlyphMap;
 
 typedef struct RenFont {
@@ -118,6 +130,7 @@ typedef struct RenFont {
 #ifdef LITE_USE_SDL_RENDERER
   int scale;
 #endif
+  unsigned int generation; // changes with the size, for the glyph worker to know its bitmaps are stale
   float size, space_advance;
   unsigned short baseline, height, tab_size;
   unsigned short underline_thickness;
@@ -127,6 +140,33 @@ typedef struct RenFont {
   char path[];
 } RenFont;
 
+// a glyph of a text run, as resolved from the fonts of its group
+typedef struct {
+  RenFont *font;
+  unsigned int codepoint, glyph_id;
+} RunGlyph;
+
+// a text measured with a font group, kept along with the glyphs it is drawn with
+typedef struct TextRun {
+  struct TextRun *prev, *next, *bucket_next;
+  uint64_t hash;
+  RenFont *fonts[FONT_FALLBACK_MAX];
+  double tab_offset, width;
+  int tab_size;
+  size_t len, nglyph;
+  RunGlyph *glyphs;
+  char *text;
+} TextRun;
+
+typedef struct {
+  RenFont **fonts;
+  const char *text;
+  size_t len;
+  double tab_offset;
+  int tab_size;
+  uint64_t hash;
+} TextRunKey;
+
 #ifdef LITE_USE_SDL_RENDERER
 void update_font_scale(RenWindow *window_renderer, RenFont **fonts) {
   if (window_renderer == NULL) return;
@@ -204,7 +244,9 @@ static unsigned int font_get_glyph_id(RenFont *font, unsigned int codepoint) {
   size_t col = codepoint - (row * CHARMAP_COL);
   if (!font->charmap.rows[row]) font->charmap.rows[row] = check_alloc(SDL_calloc(sizeof(unsigned int), CHARMAP_COL));
   if (font->charmap.rows[row][col] == 0) {
+    SDL_LockMutex(library_lock);
     unsigned int glyph_id = FT_Get_Char_Index(font->face, codepoint);
+    SDL_UnlockMutex(library_lock);
     // use -1 as a sentinel value for "glyph not available", a bit risky, but OpenType
     // uses uint16 to store glyph IDs. In theory this cannot ever be reached
     font->charmap.rows[row][col] = glyph_id ? glyph_id : (unsigned int) -1;
@@ -224,65 +266,114 @@ static inline SDL_PixelFormat glyphformat_to_pixelformat(ERenGlyphFormat format,
   }
 }
 
-static SDL_Surface *font_allocate_glyph_surface(RenFont *font, FT_GlyphSlot slot, int bitmap_idx, GlyphMetric *metric) {
-  // get an atlas with the correct width
-  ERenGlyphFormat glyph_format = SLOT_BITMAP_TYPE(slot->bitmap);
-  int atlas_idx = -1;
-  for (int i = 0; i < font->glyphs.natlas[glyph_format]; i++) {
-    if (font->glyphs.atlas[glyph_format][i].width >= metric->x1) {
-      atlas_idx = i;
-      break;
-    }
+// the frame glyphs are loaded for, as pages used by the current frame can't be evicted:
+// render threads draw the glyphs loaded for it without loading them again
+static unsigned int atlas_frame = 1;
+
+static inline size_t atlas_page_bytesize(GlyphAtlas *page) {
+  return sizeof(SDL_Surface) + (size_t) page->surface->pitch * page->surface->h;
+}
+
+// finds room for a w*h bitmap in a page, on the lowest shelf it fits on, or a new one
+static bool atlas_page_pack(GlyphAtlas *page, unsigned int w, unsigned int h, unsigned int *x, unsigned int *y) {
+  GlyphShelf *shelf = NULL;
+  for (unsigned int i = 0; i < page->nshelf; i++) {
+    GlyphShelf *s = &page->shelves[i];
+    if (s->height >= h && page->surface->w - s->width >= w && (!shelf || s->height < shelf->height))
+      shelf = s;
   }
-  if (atlas_idx < 0) {
-    font->glyphs.atlas[glyph_format] = check_alloc(
-      SDL_realloc(font->glyphs.atlas[glyph_format], sizeof(GlyphAtlas) * (font->glyphs.natlas[glyph_format] + 1))
-    );
-    font->glyphs.atlas[glyph_format][font->glyphs.natlas[glyph_format]] = (GlyphAtlas) {
-      .width = metric->x1 + FONT_WIDTH_OVERFLOW_PX, .nsurface = 0,
-      .surfaces = NULL,
-    };
-    font->glyphs.bytesize += sizeof(GlyphAtlas);
-    atlas_idx = font->glyphs.natlas[glyph_format]++;
+  unsigned int shelf_height = (h + ATLAS_SHELF_ROUNDING - 1) / ATLAS_SHELF_ROUNDING * ATLAS_SHELF_ROUNDING;
+  // don't waste more than half a shelf if a better one can be added
+  if ((!shelf || shelf->height >= shelf_height * 2) && w <= page->surface->w && page->height + shelf_height <= page->surface->h) {
+    page->shelves = check_alloc(SDL_realloc(page->shelves, sizeof(GlyphShelf) * (page->nshelf + 1)));
+    shelf = &page->shelves[page->nshelf++];
+    *shelf = (GlyphShelf) { .y = page->height, .height = shelf_height, .width = 0 };
+    page->height += shelf_height;
   }
-  metric->atlas_idx = atlas_idx;
-  GlyphAtlas *atlas = &font->glyphs.atlas[glyph_format][atlas_idx];
-  SDL_PropertiesID userdata;
-
-  // find the surface with the minimum height that can fit the glyph (limited to last 100 surfaces)
-  int surface_idx = -1, max_surface_idx = (int) atlas->nsurface - 100, min_waste = INT_MAX;
-  for (int i = atlas->nsurface - 1; i >= 0 && i > max_surface_idx; i--) {
-    userdata = SDL_GetSurfaceProperties(atlas->surfaces[i]);
-    assert(SDL_HasProperty(userdata, "metric"));
-    GlyphMetric *m = (GlyphMetric *) SDL_GetPointerProperty(userdata, "metric", NULL);
-    int new_min_waste = (int) atlas->surfaces[i]->h - (int) m->y1;
-    if (new_min_waste >= metric->y1 && new_min_waste < min_waste) {
-      surface_idx = i;
-      min_waste = new_min_waste;
+  if (!shelf || page->surface->w - shelf->width < w) return false;
+  *x = shelf->width; *y = shelf->y;
+  shelf->width += w;
+  return true;
+}
+
+// forgets the bitmaps of the glyphs in a page, to be rendered again when needed, and frees it
+static void font_evict_atlas_page(RenFont *font, ERenGlyphFormat glyph_format, int atlas_idx) {
+  GlyphAtlas *page = &font->glyphs.atlas[glyph_format][atlas_idx];
+  for (int bitmap_idx = 0; bitmap_idx < FONT_BITMAP_COUNT(font); bitmap_idx++) {
+    for (int row = 0; row < GLYPHMAP_ROW; row++) {
+      GlyphMetric *metrics = font->glyphs.metrics[bitmap_idx][row];
+      if (!metrics) continue;
+      for (int col = 0; col < GLYPHMAP_COL; col++) {
+        if ((metrics[col].flags & EGlyphBitmap) && metrics[col].format == glyph_format && metrics[col].atlas_idx == atlas_idx)
+          metrics[col].flags &= ~EGlyphBitmap;
+      }
     }
   }
-  if (surface_idx < 0) {
-    // allocate a new surface array, and a surface
-    int h = FONT_HEIGHT_OVERFLOW_PX + (double) font->face->size->metrics.height / 64.0f;
-    if (h <= FONT_HEIGHT_OVERFLOW_PX) h += slot->bitmap.rows;
-    if (h <= FONT_HEIGHT_OVERFLOW_PX) h += font->size;
+  font->glyphs.bytesize -= atlas_page_bytesize(page);
+  SDL_DestroySurface(page->surface);
+  SDL_free(page->shelves);
+  *page = (GlyphAtlas) { 0 };
+}
+
+// evicts the least recently used pages until size more bytes fit in the budget of the font
+static void font_trim_atlas(RenFont *font, size_t size) {
+  while (font->glyphs.bytesize + size > font->glyphs.budget) {
+    int lru_format = -1, lru_idx = -1;
+    unsigned int lru_age = 0;
+    for (int glyph_format = 0; glyph_format < EGlyphFormatSize; glyph_format++) {
+      for (int i = 0; i < font->glyphs.natlas[glyph_format]; i++) {
+        GlyphAtlas *page = &font->glyphs.atlas[glyph_format][i];
+        if (!page->surface || page->last_used == atlas_frame) continue;
+        if (atlas_frame - page->last_used > lru_age) {
+          lru_format = glyph_format; lru_idx = i;
+          lru_age = atlas_frame - page->last_used;
+        }
+      }
+    }
+    if (lru_idx < 0) return;
+    font_evict_atlas_page(font, lru_format, lru_idx);
+  }
+}
+
+static SDL_Surface *font_allocate_glyph_surface(RenFont *font, ERenGlyphFormat glyph_format, unsigned int w, unsigned int h, GlyphMetric *metric) {
+  // the latest pages are the likeliest to have room
+  int atlas_idx = -1;
+  unsigned int x = 0, y = 0;
+  for (int i = font->glyphs.natlas[glyph_format] - 1; i >= 0 && atlas_idx < 0; i--) {
+    GlyphAtlas *page = &font->glyphs.atlas[glyph_format][i];
+    if (page->surface && atlas_page_pack(page, w, h, &x, &y))
+      atlas_idx = i;
+  }
+  if (atlas_idx < 0) {
+    unsigned int size = ATLAS_PAGE_MIN_SIZE;
+    while (size < ATLAS_PAGE_MAX_SIZE && size < font->height * ATLAS_PAGE_LINES) size *= 2;
+    unsigned int page_w = w > size ? w : size, page_h = h + ATLAS_SHELF_ROUNDING > size ? h + ATLAS_SHELF_ROUNDING : size;
     int depth = 0;
     SDL_PixelFormat format = glyphformat_to_pixelformat(glyph_format, &depth);
-    atlas->surfaces = check_alloc(SDL_realloc(atlas->surfaces, sizeof(SDL_Surface *) * (atlas->nsurface + 1)));
-    atlas->surfaces[atlas->nsurface] = check_alloc(SDL_CreateSurface(atlas->width, GLYPHS_PER_ATLAS * h, format));
-    userdata = SDL_GetSurfaceProperties(atlas->surfaces[atlas->nsurface]);
-    SDL_SetPointerProperty(userdata, "metric", NULL);
-    surface_idx = atlas->nsurface++;
-    font->glyphs.bytesize += (sizeof(SDL_Surface *) + sizeof(SDL_Surface) + atlas->width * GLYPHS_PER_ATLAS * h * glyph_format);
-  }
-  metric->surface_idx = surface_idx;
-  userdata = SDL_GetSurfaceProperties(atlas->surfaces[surface_idx]);
-  if (SDL_HasProperty(userdata, "metric")) {
-    GlyphMetric *last_metric = (GlyphMetric *) SDL_GetPointerProperty(userdata, "metric", NULL);
-    metric->y0 = last_metric->y1; metric->y1 += last_metric->y1;
+    font_trim_atlas(font, sizeof(SDL_Surface) + (size_t) page_w * page_h * depth / 8);
+    // reuse the slot of an evicted page, as the slots of the others are stored in their glyphs
+    for (int i = 0; i < font->glyphs.natlas[glyph_format] && atlas_idx < 0; i++) {
+      if (!font->glyphs.atlas[glyph_format][i].surface)
+        atlas_idx = i;
+    }
+    if (atlas_idx < 0) {
+      font->glyphs.atlas[glyph_format] = check_alloc(
+        SDL_realloc(font->glyphs.atlas[glyph_format], sizeof(GlyphAtlas) * (font->glyphs.natlas[glyph_format] + 1))
+      );
+      font->glyphs.bytesize += sizeof(GlyphAtlas);
+      atlas_idx = font->glyphs.natlas[glyph_format]++;
+    }
+    GlyphAtlas *page = &font->glyphs.atlas[glyph_format][atlas_idx];
+    *page = (GlyphAtlas) { .surface = check_alloc(SDL_CreateSurface(page_w, page_h, format)) };
+    font->glyphs.bytesize += atlas_page_bytesize(page);
+    atlas_page_pack(page, w, h, &x, &y);
   }
-  SDL_SetPointerProperty(userdata, "metric", (void *) metric);
-  return atlas->surfaces[surface_idx];
+  GlyphAtlas *page = &font->glyphs.atlas[glyph_format][atlas_idx];
+  page->last_used = atlas_frame;
+  metric->atlas_idx = atlas_idx;
+  metric->x0 = x; metric->x1 = x + w;
+  metric->y0 = y; metric->y1 = y + h;
+  return page->surface;
 }
 
 static GlyphMetric *font_load_glyph_metric(RenFont *font, unsigned int glyph_id, unsigned int bitmap_idx) {
@@ -295,7 +386,11 @@ static GlyphMetric *font_load_glyph_metric(RenFont *font, unsigned int glyph_id,
     // load the font without hinting to fix an issue with monospaced fonts,
     // because freetype doesn't report the correct LSB and RSB delta. Transformation & subpixel positioning don't affect
     // the xadvance, so we can save some time by not doing this step multiple times
-    if (FT_Load_Glyph(font->face, glyph_id, (load_option | FT_LOAD_BITMAP_METRICS_ONLY | FT_LOAD_NO_HINTING) & ~FT_LOAD_FORCE_AUTOHINT) != 0)
+    SDL_LockMutex(library_lock);
+    FT_Error err = FT_Load_Glyph(font->face, glyph_id, (load_option | FT_LOAD_BITMAP_METRICS_ONLY | FT_LOAD_NO_HINTING) & ~FT_LOAD_FORCE_AUTOHINT);
+    float xadvance = font->face->glyph->advance.x / 64.0f;
+    SDL_UnlockMutex(library_lock);
+    if (err != 0)
       return NULL;
     for (int i = 0; i < bitmaps; i++) {
       // save the metrics for all subpixel indexes
@@ -305,62 +400,280 @@ static GlyphMetric *font_load_glyph_metric(RenFont *font, unsigned int glyph_id,
       }
       GlyphMetric *metric = &font->glyphs.metrics[i][row][col];
       metric->flags |= EGlyphXAdvance;
-      metric->xadvance = font->face->glyph->advance.x / 64.0f;
+      metric->xadvance = xadvance;
     }
   }
   return &font->glyphs.metrics[bitmap_idx][row][col];
 }
 
-static SDL_Surface *font_load_glyph_bitmap(RenFont *font, unsigned int glyph_id, unsigned int bitmap_idx) {
-  GlyphMetric *metric = font_load_glyph_metric(font, glyph_id, bitmap_idx);
-  if (!metric) return NULL;
-  if (metric->flags & EGlyphBitmap) return font->glyphs.atlas[metric->format][metric->atlas_idx].surfaces[metric->surface_idx];
-
-  // render the glyph for a bitmap_idx
+// renders a glyph in the slot of the face, which must be locked until the bitmap is copied
+static FT_GlyphSlot font_render_glyph(RenFont *font, unsigned int glyph_id, unsigned int bitmap_idx) {
   unsigned int load_option = font_set_load_options(font), render_option = font_set_render_options(font);
   FT_GlyphSlot slot = font->face->glyph;
   if (FT_Load_Glyph(font->face, glyph_id, load_option | FT_LOAD_BITMAP_METRICS_ONLY) != 0
       || font_set_style(&slot->outline, bitmap_idx * (64 / SUBPIXEL_BITMAPS_CACHED), font->style) != 0
       || FT_Render_Glyph(slot, render_option) != 0)
     return NULL;
+  return slot;
+}
 
-  // if this bitmap is empty, or has a format we don't support, just store the xadvance
-  if (!slot->bitmap.width || !slot->bitmap.rows || !slot->bitmap.buffer ||
-      (slot->bitmap.pixel_mode != FT_PIXEL_MODE_MONO
-        && slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY
-        && slot->bitmap.pixel_mode != FT_PIXEL_MODE_LCD))
-    return NULL;
+// if this bitmap is empty, or has a format we don't support, only the xadvance of the glyph is stored
+static bool glyph_bitmap_is_empty(const FT_Bitmap *bitmap) {
+  return !bitmap->width || !bitmap->rows || !bitmap->buffer ||
+    (bitmap->pixel_mode != FT_PIXEL_MODE_MONO
+      && bitmap->pixel_mode != FT_PIXEL_MODE_GRAY
+      && bitmap->pixel_mode != FT_PIXEL_MODE_LCD);
+}
 
-  unsigned int glyph_width = slot->bitmap.width / FONT_BITMAP_COUNT(font);
+static SDL_Surface *font_store_glyph_bitmap(RenFont *font, GlyphMetric *metric, const FT_Bitmap *bitmap, int bitmap_left, int bitmap_top) {
+  unsigned int glyph_width = bitmap->width / FONT_BITMAP_COUNT(font);
   // FT_PIXEL_MODE_MONO uses 1 bit per pixel packed bitmap
-  if (slot->bitmap.pixel_mode == FT_PIXEL_MODE_MONO) glyph_width *= 8;
+  if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) glyph_width *= 8;
 
-  metric->x1 = glyph_width;
-  metric->y1 = slot->bitmap.rows;
-  metric->bitmap_left = slot->bitmap_left;
-  metric->bitmap_top = slot->bitmap_top;
-  metric->flags |= EGlyphBitmap;
-  metric->format = SLOT_BITMAP_TYPE(slot->bitmap);
+  metric->bitmap_left = bitmap_left;
+  metric->bitmap_top = bitmap_top;
+  metric->format = SLOT_BITMAP_TYPE(*bitmap);
 
-  // find the best surface to copy the glyph over, and copy it
-  SDL_Surface *surface = font_allocate_glyph_surface(font, slot, bitmap_idx, metric);
+  // find room for the glyph in a page, and copy it; the page may evict others, so the glyph only
+  // counts as loaded afterwards
+  SDL_Surface *surface = font_allocate_glyph_surface(font, metric->format, glyph_width, bitmap->rows, metric);
+  metric->flags |= EGlyphBitmap;
   uint8_t* pixels = surface->pixels;
-  for (unsigned int line = 0; line < slot->bitmap.rows; ++line) {
-    int target_offset = surface->pitch * (line + metric->y0); // x0 is always assumed to be 0
-    int source_offset = line * slot->bitmap.pitch;
+  int bytes_per_pixel = SDL_GetPixelFormatDetails(surface->format)->bytes_per_pixel;
+  for (unsigned int line = 0; line < bitmap->rows; ++line) {
+    int target_offset = surface->pitch * (line + metric->y0) + metric->x0 * bytes_per_pixel;
+    int source_offset = line * bitmap->pitch;
     if (font->antialiasing == FONT_ANTIALIASING_NONE) {
-      for (unsigned int column = 0; column < slot->bitmap.width; ++column) {
+      for (unsigned int column = 0; column < bitmap->width; ++column) {
         int current_source_offset = source_offset + (column / 8);
-        int source_pixel = slot->bitmap.buffer[current_source_offset];
+        int source_pixel = bitmap->buffer[current_source_offset];
         pixels[++target_offset] = ((source_pixel >> (7 - (column % 8))) & 0x1) * 0xFF;
       }
     } else {
-      memcpy(&pixels[target_offset], &slot->bitmap.buffer[source_offset], slot->bitmap.width);
+      memcpy(&pixels[target_offset], &bitmap->buffer[source_offset], bitmap->width);
     }
   }
   return surface;
 }
 
+/******************* Glyph worker **********************/
+
+// a glyph to render in the background, and once rendered, its bitmap
+typedef struct GlyphRequest {
+  struct GlyphRequest *next;
+  RenFont *font;
+  unsigned int glyph_id, bitmap_idx, generation;
+  bool prewarm, rendered;
+  int bitmap_left, bitmap_top;
+  FT_Bitmap bitmap; // its buffer follows the request
+} GlyphRequest;
+
+typedef struct {
+  SDL_Thread *thread;
+  SDL_Mutex *mutex;
+  SDL_Condition *wake, *idle;
+  GlyphRequest *requests, **requests_tail, *results;
+  RenFont *busy_font;
+  // requests of glyphs drawn as boxes, whose results are announced as soon as there are no more
+  int urgent;
+  uint32_t event;
+  bool quit, failed;
+} GlyphWorker;
+
+static GlyphWorker glyph_worker;
+
+static GlyphRequest *glyph_worker_render(GlyphRequest *request) {
+  RenFont *font = request->font;
+  SDL_LockMutex(library_lock);
+  FT_GlyphSlot slot = font->generation == request->generation ? font_render_glyph(font, request->glyph_id, request->bitmap_idx) : NULL;
+  if (slot) {
+    size_t size = (size_t) abs(slot->bitmap.pitch) * slot->bitmap.rows;
+    request = check_alloc(SDL_realloc(request, sizeof(GlyphRequest) + size));
+    request->rendered = true;
+    request->bitmap_left = slot->bitmap_left;
+    request->bitmap_top = slot->bitmap_top;
+    request->bitmap = slot->bitmap;
+    request->bitmap.buffer = slot->bitmap.buffer ? (unsigned char *) (request + 1) : NULL;
+    if (slot->bitmap.buffer) memcpy(request->bitmap.buffer, slot->bitmap.buffer, size);
+  }
+  SDL_UnlockMutex(library_lock);
+  return request;
+}
+
+static int glyph_worker_run(void *data) {
+  SDL_LockMutex(glyph_worker.mutex);
+  while (!glyph_worker.quit) {
+    GlyphRequest *request = glyph_worker.requests;
+    if (!request) {
+      SDL_WaitCondition(glyph_worker.wake, glyph_worker.mutex);
+      continue;
+    }
+    if (!(glyph_worker.requests = request->next))
+      glyph_worker.requests_tail = &glyph_worker.requests;
+    glyph_worker.busy_font = request->font;
+    SDL_UnlockMutex(glyph_worker.mutex);
+
+    request = glyph_worker_render(request);
+
+    SDL_LockMutex(glyph_worker.mutex);
+    glyph_worker.busy_font = NULL;
+    SDL_BroadcastCondition(glyph_worker.idle);
+    bool announce = !request->prewarm && --glyph_worker.urgent == 0;
+    request->next = glyph_worker.results;
+    glyph_worker.results = request;
+    if (announce || !glyph_worker.requests) {
+      SDL_Event event = { .type = glyph_worker.event };
+      SDL_PushEvent(&event);
+    }
+  }
+  SDL_UnlockMutex(glyph_worker.mutex);
+  return 0;
+}
+
+static bool glyph_worker_start(void) {
+  if (glyph_worker.thread) return true;
+  if (glyph_worker.failed) return false;
+  glyph_worker.requests_tail = &glyph_worker.requests;
+  glyph_worker.event = SDL_RegisterEvents(1);
+  glyph_worker.mutex = SDL_CreateMutex();
+  glyph_worker.wake = SDL_CreateCondition();
+  glyph_worker.idle = SDL_CreateCondition();
+  if (glyph_worker.event && library_lock && glyph_worker.mutex && glyph_worker.wake && glyph_worker.idle)
+    glyph_worker.thread = SDL_CreateThread(glyph_worker_run, "glyph_worker", NULL);
+  if (!glyph_worker.thread) {
+    // glyphs are rendered when drawn instead
+    SDL_DestroyCondition(glyph_worker.idle);
+    SDL_DestroyCondition(glyph_worker.wake);
+    SDL_DestroyMutex(glyph_worker.mutex);
+    glyph_worker.failed = true;
+  }
+  return glyph_worker.thread != NULL;
+}
+
+static void glyph_worker_stop(void) {
+  if (!glyph_worker.thread) return;
+  SDL_LockMutex(glyph_worker.mutex);
+  glyph_worker.quit = true;
+  SDL_SignalCondition(glyph_worker.wake);
+  SDL_UnlockMutex(glyph_worker.mutex);
+  SDL_WaitThread(glyph_worker.thread, NULL);
+  GlyphRequest *lists[] = { glyph_worker.requests, glyph_worker.results };
+  for (int i = 0; i < 2; i++) {
+    while (lists[i]) {
+      GlyphRequest *next = lists[i]->next;
+      SDL_free(lists[i]);
+      lists[i] = next;
+    }
+  }
+  SDL_DestroyCondition(glyph_worker.idle);
+  SDL_DestroyCondition(glyph_worker.wake);
+  SDL_DestroyMutex(glyph_worker.mutex);
+  glyph_worker = (GlyphWorker) { 0 };
+}
+
+static bool glyph_worker_request(RenFont *font, unsigned int glyph_id, unsigned int bitmap_idx, bool prewarm) {
+  if (!glyph_worker_start()) return false;
+  GlyphRequest *request = check_alloc(SDL_malloc(sizeof(GlyphRequest)));
+  *request = (GlyphRequest) {
+    .font = font, .glyph_id = glyph_id, .bitmap_idx = bitmap_idx,
+    .generation = font->generation, .prewarm = prewarm
+  };
+  SDL_LockMutex(glyph_worker.mutex);
+  if (prewarm) {
+    *glyph_worker.requests_tail = request;
+    glyph_worker.requests_tail = &request->next;
+  } else {
+    // glyphs being drawn come before those prewarmed
+    if (!(request->next = glyph_worker.requests))
+      glyph_worker.requests_tail = &request->next;
+    glyph_worker.requests = request;
+    glyph_worker.urgent++;
+  }
+  SDL_SignalCondition(glyph_worker.wake);
+  SDL_UnlockMutex(glyph_worker.mutex);
+  return true;
+}
+
+// drops the requests of a font, and waits for the worker to be done with it
+static void glyph_worker_forget_font(RenFont *font) {
+  if (!glyph_worker.thread) return;
+  SDL_LockMutex(glyph_worker.mutex);
+  while (glyph_worker.busy_font == font)
+    SDL_WaitCondition(glyph_worker.idle, glyph_worker.mutex);
+  GlyphRequest **lists[] = { &glyph_worker.requests, &glyph_worker.results };
+  for (int i = 0; i < 2; i++) {
+    GlyphRequest **request = lists[i];
+    while (*request) {
+      GlyphRequest *r = *request;
+      if (r->font != font) {
+        request = &r->next;
+        continue;
+      }
+      *request = r->next;
+      if (i == 0 && !r->prewarm) glyph_worker.urgent--;
+      SDL_free(r);
+    }
+    if (i == 0) glyph_worker.requests_tail = request;
+  }
+  SDL_UnlockMutex(glyph_worker.mutex);
+}
+
+uint32_t ren_get_glyph_event(void) {
+  return glyph_worker.event;
+}
+
+// copies the glyphs rendered by the worker to the atlases, to be drawn from the next frame
+void ren_load_rendered_glyphs(void) {
+  if (!glyph_worker.thread) return;
+  SDL_LockMutex(glyph_worker.mutex);
+  GlyphRequest *result = glyph_worker.results;
+  glyph_worker.results = NULL;
+  SDL_UnlockMutex(glyph_worker.mutex);
+  while (result) {
+    GlyphRequest *next = result->next;
+    RenFont *font = result->font;
+    // the glyph cache of the font was cleared if its size changed since
+    GlyphMetric *metric = result->generation == font->generation ? font_load_glyph_metric(font, result->glyph_id, result->bitmap_idx) : NULL;
+    if (metric && (metric->flags & EGlyphPending)) {
+      metric->flags &= ~EGlyphPending;
+      // glyphs which failed to render are drawn as boxes rather than requested again
+      if (!result->rendered || glyph_bitmap_is_empty(&result->bitmap))
+        metric->flags |= EGlyphEmpty;
+      else
+        font_store_glyph_bitmap(font, metric, &result->bitmap, result->bitmap_left, result->bitmap_top);
+    }
+    SDL_free(result);
+    result = next;
+  }
+}
+
+static SDL_Surface *font_load_glyph_bitmap(RenFont *font, unsigned int glyph_id, unsigned int bitmap_idx) {
+  GlyphMetric *metric = font_load_glyph_metric(font, glyph_id, bitmap_idx);
+  if (!metric) return NULL;
+  if (metric->flags & EGlyphBitmap) {
+    GlyphAtlas *page = &font->glyphs.atlas[metric->format][metric->atlas_idx];
+    // only written by the first use in a frame, which is never from a render thread
+    if (page->last_used != atlas_frame) page->last_used = atlas_frame;
+    return page->surface;
+  }
+  if (metric->flags & (EGlyphEmpty | EGlyphPending)) return NULL;
+
+  // render the glyph in the background, it is drawn as a box until then
+  if (glyph_worker_request(font, glyph_id, bitmap_idx, false)) {
+    metric->flags |= EGlyphPending;
+    return NULL;
+  }
+  SDL_Surface *surface = NULL;
+  SDL_LockMutex(library_lock);
+  FT_GlyphSlot slot = font_render_glyph(font, glyph_id, bitmap_idx);
+  if (slot && glyph_bitmap_is_empty(&slot->bitmap))
+    metric->flags |= EGlyphEmpty;
+  else if (slot)
+    surface = font_store_glyph_bitmap(font, metric, &slot->bitmap, slot->bitmap_left, slot->bitmap_top);
+  SDL_UnlockMutex(library_lock);
+  return surface;
+}
+
 // https://en.wikipedia.org/wiki/Whitespace_character
 static inline int is_whitespace(unsigned int codepoint) {
   switch (codepoint) {
@@ -369,7 +682,7 @@ static inline int is_whitespace(unsigned int codepoint) {
   return (codepoint >= 0x9 && codepoint <= 0xD) || (codepoint >= 0x2000 && codepoint <= 0x200A);
 }
 
-static RenFont *font_group_get_glyph(RenFont **fonts, unsigned int codepoint, int subpixel_idx, SDL_Surface **surface, GlyphMetric **metric) {
+static RenFont *font_group_get_glyph(RenFont **fonts, unsigned int codepoint, int subpixel_idx, SDL_Surface **surface, GlyphMetric **metric, unsigned int *id) {
   if (subpixel_idx < 0) subpixel_idx += SUBPIXEL_BITMAPS_CACHED;
   RenFont *font = NULL;
   unsigned int glyph_id = 0;
@@ -383,8 +696,9 @@ static RenFont *font_group_get_glyph(RenFont **fonts, unsigned int codepoint, in
   GlyphMetric *m = font_load_glyph_metric(font, glyph_id, subpixel_idx);
   // try the box drawing character (0x25A1) if the requested codepoint is not a whitespace, and we cannot load the .notdef glyph
   if ((!m || !m->flags) && codepoint != 0x25A1 && !is_whitespace(codepoint))
-    return font_group_get_glyph(fonts, 0x25A1, subpixel_idx, surface, metric);
+    return font_group_get_glyph(fonts, 0x25A1, subpixel_idx, surface, metric, id);
   if (metric && m) *metric = m;
+  if (id) *id = glyph_id;
   if (surface && m) *surface = font_load_glyph_bitmap(font, glyph_id, subpixel_idx);
   return font;
 }
@@ -392,11 +706,9 @@ static RenFont *font_group_get_glyph(RenFont **fonts, unsigned int codepoint, in
 static void font_clear_glyph_cache(RenFont* font) {
   for (int glyph_format_idx = 0; glyph_format_idx < EGlyphFormatSize; glyph_format_idx++) {
     for (int atlas_idx = 0; atlas_idx < font->glyphs.natlas[glyph_format_idx]; atlas_idx++) {
-      GlyphAtlas *atlas = &font->glyphs.atlas[glyph_format_idx][atlas_idx];
-      for (int surface_idx = 0; surface_idx < atlas->nsurface; surface_idx++) {
-        SDL_DestroySurface(atlas->surfaces[surface_idx]);
-      }
-      SDL_free(atlas->surfaces);
+      GlyphAtlas *page = &font->glyphs.atlas[glyph_format_idx][atlas_idx];
+      SDL_DestroySurface(page->surface);
+      SDL_free(page->shelves);
     }
     SDL_free(font->glyphs.atlas[glyph_format_idx]);
     font->glyphs.atlas[glyph_format_idx] = NULL;
@@ -474,6 +786,7 @@ RenFont* ren_font_load(const char* path, float size, ERenFontAntialiasing antial
   font->hinting = hinting;
   font->style = style;
   font->tab_size = 2;
+  font->glyphs.budget = FONT_ATLAS_BUDGET;
 #ifdef LITE_USE_SDL_RENDERER
   font->scale = 1;
 #endif
@@ -486,9 +799,11 @@ RenFont* ren_font_load(const char* path, float size, ERenFontAntialiasing antial
   stream->pos = 0;
   stream->size = (unsigned long) SDL_GetIOSize(file);
 
-  if ((err = FT_Open_Face(library, &(FT_Open_Args) { .flags = FT_OPEN_STREAM, .stream = stream }, 0, &face)) != 0)
-    goto failure;
-  if ((err = font_set_face_metrics(font, face)) != 0)
+  SDL_LockMutex(library_lock);
+  if ((err = FT_Open_Face(library, &(FT_Open_Args) { .flags = FT_OPEN_STREAM, .stream = stream }, 0, &face)) == 0)
+    err = font_set_face_metrics(font, face);
+  SDL_UnlockMutex(library_lock);
+  if (err != 0)
     goto failure;
   return font;
 
@@ -496,7 +811,9 @@ stream_failure:
   if (file) SDL_CloseIO(file);
 failure:
   if (err != FT_Err_Ok) SDL_SetError("%s", get_ft_error(err));
+  SDL_LockMutex(library_lock);
   if (face) FT_Done_Face(face);
+  SDL_UnlockMutex(library_lock);
   if (font) SDL_free(font);
   return NULL;
 }
@@ -506,20 +823,32 @@ RenFont* ren_font_copy(RenFont* font, float size, ERenFontAntialiasing antialias
   hinting = hinting == -1 ? font->hinting : hinting;
   style = style == -1 ? font->style : style;
 
-  return ren_font_load(font->path, size, antialiasing, hinting, style); // SDL_SetError() will be called appropriately
+  RenFont *copy = ren_font_load(font->path, size, antialiasing, hinting, style); // SDL_SetError() will be called appropriately
+  if (copy) copy->glyphs.budget = font->glyphs.budget;
+  return copy;
 }
 
 const char* ren_font_get_path(RenFont *font) {
   return font->path;
 }
 
+size_t ren_font_get_bytesize(RenFont *font) {
+  return font->glyphs.bytesize;
+}
+
+static void text_runs_forget_font(RenFont *font);
+
 void ren_font_free(RenFont* font) {
+  text_runs_forget_font(font);
+  glyph_worker_forget_font(font);
   font_clear_glyph_cache(font);
   // free codepoint cache as well
   for (int i = 0; i < CHARMAP_ROW; i++) {
     SDL_free(font->charmap.rows[i]);
   }
+  SDL_LockMutex(library_lock);
   FT_Done_Face(font->face);
+  SDL_UnlockMutex(library_lock);
   SDL_free(font);
 }
 
@@ -529,6 +858,13 @@ void ren_font_group_set_tab_size(RenFont **fonts, int n) {
   }
 }
 
+void ren_font_group_set_atlas_budget(RenFont **fonts, size_t budget) {
+  for (int j = 0; j < FONT_FALLBACK_MAX && fonts[j]; ++j) {
+    fonts[j]->glyphs.budget = budget;
+    font_trim_atlas(fonts[j], 0);
+  }
+}
+
 int ren_font_group_get_tab_size(RenFont **fonts) {
   return fonts[0]->tab_size;
 }
@@ -539,13 +875,18 @@ float ren_font_group_get_size(RenFont **fonts) {
 
 void ren_font_group_set_size(RenFont **fonts, float size, int surface_scale) {
   for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; ++i) {
+    text_runs_forget_font(fonts[i]);
+    glyph_worker_forget_font(fonts[i]);
     font_clear_glyph_cache(fonts[i]);
     fonts[i]->size = size;
     fonts[i]->tab_size = 2;
     #ifdef LITE_USE_SDL_RENDERER
     fonts[i]->scale = surface_scale;
     #endif
+    SDL_LockMutex(library_lock);
+    fonts[i]->generation++;
     font_set_face_metrics(fonts[i], fonts[i]->face);
+    SDL_UnlockMutex(library_lock);
   }
 }
 
@@ -561,7 +902,7 @@ float font_get_xadvance(RenFont *font, unsigned int codepoint, GlyphMetric *metr
   if (codepoint != '\t') {
     return font->space_advance;
   }
-  float tab_size = font->space_advance * font->tab_size;
+  float tab_size = font->space_advance * (tab.size ? tab.size : font->tab_size);
   if (isnan(tab.offset)) {
     return tab_size;
   }
@@ -574,24 +915,214 @@ float font_get_xadvance(RenFont *font, unsigned int codepoint, GlyphMetric *metr
   return adv;
 }
 
-double ren_font_group_get_width(RenFont **fonts, const char *text, size_t len, RenTab tab, int *x_offset) {
+// measures a text, and stores the glyphs its codepoints resolve to if glyphs isn't NULL
+static double font_group_measure(RenFont **fonts, const char *text, size_t len, RenTab tab, int *x_offset, RunGlyph *glyphs, size_t *nglyph) {
   double width = 0;
   const char* end = text + len;
 
-  bool set_x_offset = x_offset == NULL;
+  bool set_x_offset = false;
+  *x_offset = 0;
   while (text < end) {
-    unsigned int codepoint;
+    unsigned int codepoint, glyph_id = 0;
     text = utf8_to_codepoint(text, end, &codepoint);
     GlyphMetric *metric = NULL;
-    font_group_get_glyph(fonts, codepoint, 0, NULL, &metric);
+    RenFont *font = font_group_get_glyph(fonts, codepoint, 0, NULL, &metric, &glyph_id);
     width += font_get_xadvance(fonts[0], codepoint, metric, width, tab);
     if (!set_x_offset && metric) {
       set_x_offset = true;
       *x_offset = metric->bitmap_left; // TODO: should this be scaled by the surface scale?
     }
+    if (glyphs)
+      glyphs[(*nglyph)++] = (RunGlyph) { font, codepoint, glyph_id };
+  }
+  return width;
+}
+
+/******************* Text runs **********************/
+// the number of text runs cached, and the longest text cached
+#define TEXT_RUN_CACHE_SIZE 4096
+#define TEXT_RUN_BUCKETS 8192
+#define TEXT_RUN_MAX_LEN 1024
+
+static struct {
+  TextRun *buckets[TEXT_RUN_BUCKETS];
+  TextRun *first, *last; // most and least recently used
+  size_t count, hits, misses;
+  // runs are looked up by the render threads as well
+  SDL_AtomicInt draw_hits, draw_misses;
+} text_runs;
+
+// false if the text is too long to be cached
+static bool text_run_key(TextRunKey *key, RenFont **fonts, const char *text, size_t len, RenTab tab) {
+  if (len > TEXT_RUN_MAX_LEN)
+    return false;
+  key->fonts = fonts;
+  key->text = text;
+  key->len = len;
+  // the tab settings only change the runs with a tab
+  bool has_tab = memchr(text, '\t', len) != NULL;
+  key->tab_size = has_tab ? (tab.size ? tab.size : fonts[0]->tab_size) : 0;
+  key->tab_offset = has_tab ? tab.offset : NAN;
+  // 64bit fnv-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char) text[i]) * 1099511628211ULL;
+  for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; i++)
+    h = (h ^ (uintptr_t) fonts[i]) * 1099511628211ULL;
+  h = (h ^ (uint64_t) key->tab_size) * 1099511628211ULL;
+  if (!isnan(key->tab_offset))
+    h = (h ^ (uint64_t) (int64_t) (key->tab_offset * 64)) * 1099511628211ULL;
+  key->hash = h;
+  return true;
+}
+
+static bool text_run_matches(const TextRun *run, const TextRunKey *key) {
+  if (run->hash != key->hash || run->len != key->len || run->tab_size != key->tab_size)
+    return false;
+  if (isnan(run->tab_offset) != isnan(key->tab_offset) || (!isnan(key->tab_offset) && run->tab_offset != key->tab_offset))
+    return false;
+  for (int i = 0; i < FONT_FALLBACK_MAX; i++) {
+    if (run->fonts[i] != key->fonts[i])
+      return false;
+    if (!key->fonts[i])
+      break;
+  }
+  return memcmp(run->text, key->text, key->len) == 0;
+}
+
+// doesn't change the cache, so that it can be used while drawing from several threads
+static TextRun *text_run_find(const TextRunKey *key) {
+  for (TextRun *run = text_runs.buckets[key->hash & (TEXT_RUN_BUCKETS - 1)]; run; run = run->bucket_next) {
+    if (text_run_matches(run, key))
+      return run;
+  }
+  return NULL;
+}
+
+static void text_run_unlink(TextRun *run) {
+  if (run->prev) run->prev->next = run->next;
+  else text_runs.first = run->next;
+  if (run->next) run->next->prev = run->prev;
+  else text_runs.last = run->prev;
+}
+
+static void text_run_push_front(TextRun *run) {
+  run->prev = NULL;
+  run->next = text_runs.first;
+  if (text_runs.first) text_runs.first->prev = run;
+  else text_runs.last = run;
+  text_runs.first = run;
+}
+
+static void text_run_remove(TextRun *run) {
+  TextRun **bucket = &text_runs.buckets[run->hash & (TEXT_RUN_BUCKETS - 1)];
+  while (*bucket != run)
+    bucket = &(*bucket)->bucket_next;
+  *bucket = run->bucket_next;
+  text_run_unlink(run);
+  text_runs.count--;
+  SDL_free(run);
+}
+
+// finds the run of a text, measuring it if it wasn't cached
+static TextRun *text_run_get(RenFont **fonts, const char *text, size_t len, RenTab tab) {
+  TextRunKey key;
+  if (!text_run_key(&key, fonts, text, len, tab))
+    return NULL;
+  TextRun *run = text_run_find(&key);
+  if (run) {
+    text_runs.hits++;
+    text_run_unlink(run);
+    text_run_push_front(run);
+    return run;
+  }
+  text_runs.misses++;
+  // a run has at most one glyph per byte of text
+  run = SDL_malloc(sizeof(TextRun) + len * sizeof(RunGlyph) + len + 1);
+  if (!run)
+    return NULL;
+  if (text_runs.count == TEXT_RUN_CACHE_SIZE)
+    text_run_remove(text_runs.last);
+  memset(run->fonts, 0, sizeof(run->fonts));
+  for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; i++)
+    run->fonts[i] = fonts[i];
+  run->glyphs = (RunGlyph*) (run + 1);
+  run->text = (char*) (run->glyphs + len);
+  memcpy(run->text, text, len);
+  run->text[len] = '\0';
+  run->len = len;
+  run->hash = key.hash;
+  run->tab_size = key.tab_size;
+  run->tab_offset = key.tab_offset;
+  run->nglyph = 0;
+  int x_offset;
+  run->width = font_group_measure(fonts, text, len, tab, &x_offset, run->glyphs, &run->nglyph);
+  TextRun **bucket = &text_runs.buckets[key.hash & (TEXT_RUN_BUCKETS - 1)];
+  run->bucket_next = *bucket;
+  *bucket = run;
+  text_run_push_front(run);
+  text_runs.count++;
+  return run;
+}
+
+// the glyph of a run for a subpixel position, as font_group_get_glyph would find it
+static RenFont *text_run_get_glyph(RenFont **fonts, const RunGlyph *glyph, int subpixel_idx, SDL_Surface **surface, GlyphMetric **metric) {
+  if (subpixel_idx < 0) subpixel_idx += SUBPIXEL_BITMAPS_CACHED;
+  int bitmap_idx = FONT_IS_SUBPIXEL(glyph->font) ? subpixel_idx : 0;
+  GlyphMetric *m = font_load_glyph_metric(glyph->font, glyph->glyph_id, bitmap_idx);
+  if (!m || !m->flags)
+    return font_group_get_glyph(fonts, glyph->codepoint, subpixel_idx, surface, metric, NULL);
+  *metric = m;
+  *surface = font_load_glyph_bitmap(glyph->font, glyph->glyph_id, bitmap_idx);
+  return glyph->font;
+}
+
+// the bitmap offset of the first glyph, which is only known once its bitmap is loaded
+static int text_run_get_x_offset(const TextRun *run) {
+  for (size_t i = 0; i < run->nglyph; i++) {
+    GlyphMetric *metric = font_load_glyph_metric(run->glyphs[i].font, run->glyphs[i].glyph_id, 0);
+    if (metric)
+      return metric->bitmap_left;
+  }
+  return 0;
+}
+
+// runs measured with a font are stale once its size changes, and wrong once it is freed
+static void text_runs_forget_font(RenFont *font) {
+  TextRun *run = text_runs.first;
+  while (run) {
+    TextRun *next = run->next;
+    for (int i = 0; i < FONT_FALLBACK_MAX && run->fonts[i]; i++) {
+      if (run->fonts[i] == font) {
+        text_run_remove(run);
+        break;
+      }
+    }
+    run = next;
   }
-  if (!set_x_offset)
-    *x_offset = 0;
+}
+
+void ren_get_text_run_stats(RenTextRunStats *stats) {
+  stats->count = text_runs.count;
+  stats->hits = text_runs.hits;
+  stats->misses = text_runs.misses;
+  stats->draw_hits = SDL_SetAtomicInt(&text_runs.draw_hits, 0);
+  stats->draw_misses = SDL_SetAtomicInt(&text_runs.draw_misses, 0);
+  text_runs.hits = text_runs.misses = 0;
+}
+
+double ren_font_group_get_width(RenFont **fonts, const char *text, size_t len, RenTab tab, int *x_offset) {
+  double width;
+  int offset;
+  TextRun *run = text_run_get(fonts, text, len, tab);
+  if (run) {
+    width = run->width;
+    offset = text_run_get_x_offset(run);
+  } else {
+    width = font_group_measure(fonts, text, len, tab, &offset, NULL, NULL);
+  }
+  if (x_offset)
+    *x_offset = offset;
 #ifdef LITE_USE_SDL_RENDERER
   return width / fonts[0]->scale;
 #else
@@ -599,17 +1130,51 @@ double ren_font_group_get_width(RenFont **fonts, const char *text, size_t len, R
 #endif
 }
 
+// loads the glyphs ren_draw_text would use for the text, so that drawing it doesn't change the fonts
+void ren_font_group_load_text(RenFont **fonts, const char *text, size_t len, float x, int surface_scale, RenTab tab) {
+  double pen_x = x * surface_scale;
+  double original_pen_x = pen_x;
+  const char* end = text + len;
+  while (text < end) {
+    unsigned int codepoint;
+    text = utf8_to_codepoint(text, end, &codepoint);
+    SDL_Surface *font_surface = NULL; GlyphMetric *metric = NULL;
+    font_group_get_glyph(fonts, codepoint, (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED), &font_surface, &metric, NULL);
+    if (!metric)
+      break;
+    pen_x += font_get_xadvance(fonts[0], codepoint, metric, pen_x - original_pen_x, tab);
+  }
+}
+
+// renders the glyphs of a range of codepoints in the background, for them to be ready when first drawn
+void ren_font_group_prewarm(RenFont **fonts, unsigned int first, unsigned int last) {
+  for (unsigned int codepoint = first; codepoint <= last && codepoint <= MAX_UNICODE; codepoint++) {
+    if (is_whitespace(codepoint)) continue;
+    RenFont *font = NULL;
+    unsigned int glyph_id = 0;
+    for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i] && !glyph_id; i++) {
+      font = fonts[i]; glyph_id = font_get_glyph_id(fonts[i], codepoint);
+    }
+    if (!glyph_id) continue;
+    for (int bitmap_idx = 0; bitmap_idx < FONT_BITMAP_COUNT(font); bitmap_idx++) {
+      GlyphMetric *metric = font_load_glyph_metric(font, glyph_id, bitmap_idx);
+      if (!metric || (metric->flags & (EGlyphBitmap | EGlyphEmpty | EGlyphPending))) continue;
+      if (!glyph_worker_request(font, glyph_id, bitmap_idx, true)) return;
+      metric->flags |= EGlyphPending;
+    }
+  }
+}
+
 #ifdef RENDERER_DEBUG
 // this function can be used to debug font atlases, it is not public
 void ren_font_dump(RenFont *font) {
   char filename[1024];
   for (int glyph_format_idx = 0; glyph_format_idx < EGlyphFormatSize; glyph_format_idx++) {
     for (int atlas_idx = 0; atlas_idx < font->glyphs.natlas[glyph_format_idx]; atlas_idx++) {
-      GlyphAtlas *atlas = &font->glyphs.atlas[glyph_format_idx][atlas_idx];
-      for (int surface_idx = 0; surface_idx < atlas->nsurface; surface_idx++) {
-        snprintf(filename, 1024, "%s-%d-%d-%d.bmp", font->face->family_name, glyph_format_idx, atlas_idx, surface_idx);
-        SDL_SaveBMP(atlas->surfaces[surface_idx], filename);
-      }
+      GlyphAtlas *page = &font->glyphs.atlas[glyph_format_idx][atlas_idx];
+      if (!page->surface) continue;
+      snprintf(filename, 1024, "%s-%d-%d.bmp", font->face->family_name, glyph_format_idx, atlas_idx);
+      SDL_SaveBMP(page->surface, filename);
     }
   }
   fprintf(stderr, "%s: %zu bytes\n", font->face->family_name, font->glyphs.bytesize);
@@ -629,24 +1194,57 @@ double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t l
   uint8_t* destination_pixels = surface->pixels;
   int clip_end_x = clip.x + clip.w, clip_end_y = clip.y + clip.h;
 
+  RenBlend blend;
+  ren_blend_prepare(&blend, surface->format, color);
+
   RenFont* last = NULL;
   double last_pen_x = x;
   bool underline = fonts[0]->style & FONT_STYLE_UNDERLINE;
   bool strikethrough = fonts[0]->style & FONT_STYLE_STRIKETHROUGH;
 
-  while (text < end) {
-    unsigned int codepoint, r, g, b;
-    text = utf8_to_codepoint(text, end,  &codepoint);
+  // the glyphs of the text were usually resolved when it was measured
+  TextRunKey key;
+  TextRun *run = text_run_key(&key, fonts, text, len, tab) ? text_run_find(&key) : NULL;
+  SDL_AddAtomicInt(run ? &text_runs.draw_hits : &text_runs.draw_misses, 1);
+  size_t glyph_idx = 0;
+
+  while (run ? glyph_idx < run->nglyph : text < end) {
+    unsigned int codepoint;
     SDL_Surface *font_surface = NULL; GlyphMetric *metric = NULL;
-    RenFont* font = font_group_get_glyph(fonts, codepoint, (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED), &font_surface, &metric);
+    int subpixel_idx = (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED);
+    RenFont* font;
+    if (run) {
+      const RunGlyph *glyph = &run->glyphs[glyph_idx++];
+      codepoint = glyph->codepoint;
+      font = text_run_get_glyph(fonts, glyph, subpixel_idx, &font_surface, &metric);
+    } else {
+      text = utf8_to_codepoint(text, end,  &codepoint);
+      font = font_group_get_glyph(fonts, codepoint, subpixel_idx, &font_surface, &metric, NULL);
+    }
+    bool last_glyph = run ? glyph_idx == run->nglyph : text == end;
     if (!metric)
       break;
     int start_x = floor(pen_x) + metric->bitmap_left;
-    int end_x = metric->x1 + start_x; // x0 is assumed to be 0
-    int glyph_end = metric->x1, glyph_start = 0;
-    if (!font_surface && !is_whitespace(codepoint))
-      ren_draw_rect(rs, (RenRect){ start_x + 1, y, font->space_advance - 1, ren_font_group_get_height(fonts) }, color);
+    int end_x = (metric->x1 - metric->x0) + start_x;
+    int glyph_end = metric->x1, glyph_start = metric->x0;
+    if (!font_surface && !is_whitespace(codepoint)) {
+      // glyphs still being rendered in the background are drawn as a fainter box,
+      // ren_draw_rect scales the rect itself
+      RenColor box_color = color;
+      if (metric->flags & EGlyphPending) box_color.a /= 4;
+      ren_draw_rect(rs, (RenRect){ (start_x + 1) / surface_scale, y / surface_scale,
+        (font->space_advance - 1) / surface_scale, ren_font_group_get_height(fonts) }, box_color);
+    }
     if (!is_whitespace(codepoint) && font_surface && color.a > 0 && end_x >= clip.x && start_x < clip_end_x) {
+      if (start_x + (glyph_end - glyph_start) >= clip_end_x)
+        glyph_end = glyph_start + (clip_end_x - start_x);
+      if (start_x < clip.x) {
+        int offset = clip.x - start_x;
+        start_x += offset;
+        glyph_start += offset;
+      }
+      RenBlendRow blend_row = metric->format == EGlyphFormatSubpixel ? blend.subpixel : blend.grayscale;
+      const SDL_PixelFormatDetails* font_surface_format = SDL_GetPixelFormatDetails(font_surface->format);
       uint8_t* source_pixels = font_surface->pixels;
       for (int line = metric->y0; line < metric->y1; ++line) {
         int target_y = line - metric->y0 + y - metric->bitmap_top + (fonts[0]->baseline * surface_scale);
@@ -654,54 +1252,17 @@ double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t l
           continue;
         if (target_y >= clip_end_y)
           break;
-        if (start_x + (glyph_end - glyph_start) >= clip_end_x)
-          glyph_end = glyph_start + (clip_end_x - start_x);
-        if (start_x < clip.x) {
-          int offset = clip.x - start_x;
-          start_x += offset;
-          glyph_start += offset;
-        }
-        
-        const SDL_PixelFormatDetails* surface_format = SDL_GetPixelFormatDetails(surface->format);
-        const SDL_PixelFormatDetails* font_surface_format = SDL_GetPixelFormatDetails(font_surface->format);
-
-        uint32_t* destination_pixel = (uint32_t*)&(destination_pixels[surface->pitch * target_y + start_x * surface_format->bytes_per_pixel]);
+        uint32_t* destination_pixel = (uint32_t*)&(destination_pixels[surface->pitch * target_y + start_x * blend.format->bytes_per_pixel]);
         uint8_t* source_pixel = &source_pixels[line * font_surface->pitch + glyph_start * font_surface_format->bytes_per_pixel];
-        for (int x = glyph_start; x < glyph_end; ++x) {
-          uint32_t destination_color = *destination_pixel;
-          // the standard way of doing this would be SDL_GetRGBA, but that introduces a performance regression. needs to be investigated
-          SDL_Color dst = {
-            (destination_color & surface_format->Rmask) >> surface_format->Rshift,
-            (destination_color & surface_format->Gmask) >> surface_format->Gshift,
-            (destination_color & surface_format->Bmask) >> surface_format->Bshift,
-            (destination_color & surface_format->Amask) >> surface_format->Ashift};
-          SDL_Color src;
-
-          if (metric->format == EGlyphFormatSubpixel) {
-            src.r = *(source_pixel++);
-            src.g = *(source_pixel++);
-          } else {
-            src.r = *(source_pixel);
-            src.g = *(source_pixel);
-          }
-
-          src.b = *(source_pixel++);
-          src.a = 0xFF;
-
-          r = (color.r * src.r * color.a + dst.r * (65025 - src.r * color.a) + 32767) / 65025;
-          g = (color.g * src.g * color.a + dst.g * (65025 - src.g * color.a) + 32767) / 65025;
-          b = (color.b * src.b * color.a + dst.b * (65025 - src.b * color.a) + 32767) / 65025;
-          // the standard way of doing this would be SDL_GetRGBA, but that introduces a performance regression. needs to be investigated
-          *destination_pixel++ = (unsigned int) dst.a << surface_format->Ashift | r << surface_format->Rshift | g << surface_format->Gshift | b << surface_format->Bshift;
-        }
+        blend_row(&blend, destination_pixel, source_pixel, glyph_end - glyph_start);
       }
     }
 
     float adv = font_get_xadvance(fonts[0], codepoint, metric, pen_x - original_pen_x, tab);
 
     if(!last) last = font;
-    else if(font != last || text == end) {
-      double local_pen_x = text == end ? pen_x + adv : pen_x;
+    else if(font != last || last_glyph) {
+      double local_pen_x = last_glyph ? pen_x + adv : pen_x;
       if (underline)
         ren_draw_rect(rs, (RenRect){last_pen_x, y / surface_scale + last->height - 1, (local_pen_x - last_pen_x) / surface_scale, last->underline_thickness * surface_scale}, color);
       if (strikethrough)
@@ -739,15 +1300,17 @@ void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color) {
     uint32_t translated = SDL_MapSurfaceRGB(surface, color.r, color.g, color.b);
     SDL_FillSurfaceRect(surface, &dest_rect, translated);
   } else {
-    // Seems like SDL doesn't handle clipping as we expect when using
-    // scaled blitting, so we "clip" manually.
+    // blended like text, rather than blitted from a shared surface, so that
+    // several threads can draw to their own views of a window surface
     SDL_Rect clip;
     SDL_GetSurfaceClipRect(surface, &clip);
     if (!SDL_GetRectIntersection(&clip, &dest_rect, &dest_rect)) return;
 
-    uint32_t *pixel = (uint32_t *)draw_rect_surface->pixels;
-    *pixel = SDL_MapSurfaceRGBA(draw_rect_surface, color.r, color.g, color.b, color.a);
-    SDL_BlitSurfaceScaled(draw_rect_surface, NULL, surface, &dest_rect, SDL_SCALEMODE_LINEAR);
+    RenBlend blend;
+    ren_blend_prepare(&blend, surface->format, color);
+    uint8_t *pixels = (uint8_t *)surface->pixels + dest_rect.x * blend.format->bytes_per_pixel;
+    for (int y = dest_rect.y; y < dest_rect.y + dest_rect.h; y++)
+      ren_blend_fill(&blend, (uint32_t *)(pixels + y * surface->pitch), dest_rect.w);
   }
 }
 
@@ -771,19 +1334,17 @@ static void ren_remove_window(RenWindow *window_renderer) {
 int ren_init(void) {
   FT_Error err;
 
-  draw_rect_surface = SDL_CreateSurface(1, 1, SDL_PIXELFORMAT_RGBA32);
-
-  if (!draw_rect_surface)
-    return -1; // error set by SDL_CreateRGBSurface
-
   if ((err = FT_Init_FreeType(&library)) != 0)
     return SDL_SetError("%s", get_ft_error(err));
+  library_lock = SDL_CreateMutex();
 
+  ren_blend_init();
   return 0;
 }
 
 void ren_free(void) {
-  SDL_DestroySurface(draw_rect_surface);
+  glyph_worker_stop();
+  SDL_DestroyMutex(library_lock);
   FT_Done_FreeType(library);
 }
 
@@ -807,6 +1368,11 @@ void ren_destroy(RenWindow* window_renderer) {
   SDL_free(window_renderer->command_buf);
   window_renderer->command_buf = NULL;
   window_renderer->command_buf_size = 0;
+  SDL_free(window_renderer->cache.cells);
+  SDL_free(window_renderer->cache.cells_prev);
+  SDL_free(window_renderer->cache.cell_bins_first);
+  SDL_free(window_renderer->cache.cell_bins_last);
+  SDL_free(window_renderer->cache.rects);
   SDL_free(window_renderer);
 }
 
@@ -819,6 +1385,8 @@ void ren_resize_window(RenWindow *window_renderer) {
 void ren_update_rects(RenWindow *window_renderer, RenRect *rects, int count) {
   static bool initial_frame = true;
   renwin_update_rects(window_renderer, rects, count);
+  // the glyphs of this frame are drawn, their pages can be evicted from now on
+  atlas_frame++;
   if (initial_frame) {
     renwin_show_window(window_renderer);
     initial_frame = false;
@@ -826,6 +1394,18 @@ void ren_update_rects(RenWindow *window_renderer, RenRect *rects, int count) {
 }
 
 
+void ren_set_upload_mode(ERenUploadMode mode) {
+  renwin_set_upload_mode(mode);
+#ifdef LITE_USE_SDL_RENDERER
+  // the surfaces are made again for the mode, their contents are lost
+  for (size_t i = 0; i < window_count; i++) {
+    renwin_init_surface(window_list[i]);
+    renwin_clip_to_surface(window_list[i]);
+  }
+#endif
+}
+
+
 void ren_set_clip_rect(RenWindow *window_renderer, RenRect rect) {
   renwin_set_clip_rect(window_renderer, rect);
 }
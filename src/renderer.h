@@ -17,10 +17,12 @@ typedef struct RenFont RenFont;
 typedef enum { FONT_HINTING_NONE, FONT_HINTING_SLIGHT, FONT_HINTING_FULL } ERenFontHinting;
 typedef enum { FONT_ANTIALIASING_NONE, FONT_ANTIALIASING_GRAYSCALE, FONT_ANTIALIASING_SUBPIXEL } ERenFontAntialiasing;
 typedef enum { FONT_STYLE_BOLD = 1, FONT_STYLE_ITALIC = 2, FONT_STYLE_UNDERLINE = 4, FONT_STYLE_SMOOTH = 8, FONT_STYLE_STRIKETHROUGH = 16 } ERenFontStyle;
+typedef enum { UPLOAD_RECTS, UPLOAD_BATCHED } ERenUploadMode;
 typedef struct { uint8_t b, g, r, a; } RenColor;
 typedef struct { int x, y, width, height; } RenRect;
-typedef struct { double offset; } RenTab;
+typedef struct { double offset; int size; } RenTab; // size overrides the tab size of the fonts when not 0
 typedef struct { SDL_Surface *surface; int scale; } RenSurface;
+typedef struct { size_t count, hits, misses, draw_hits, draw_misses; } RenTextRunStats; // counters are reset when read
 
 struct RenWindow;
 typedef struct RenWindow RenWindow;
@@ -28,6 +30,7 @@ typedef struct RenWindow RenWindow;
 RenFont* ren_font_load(const char *filename, float size, ERenFontAntialiasing antialiasing, ERenFontHinting hinting, unsigned char style);
 RenFont* ren_font_copy(RenFont* font, float size, ERenFontAntialiasing antialiasing, ERenFontHinting hinting, int style);
 const char* ren_font_get_path(RenFont *font);
+size_t ren_font_get_bytesize(RenFont *font);
 void ren_font_free(RenFont *font);
 int ren_font_group_get_tab_size(RenFont **font);
 int ren_font_group_get_height(RenFont **font);
@@ -37,8 +40,14 @@ void ren_font_group_set_size(RenFont **font, float size, int surface_scale);
 void update_font_scale(RenWindow *window_renderer, RenFont **fonts);
 #endif
 void ren_font_group_set_tab_size(RenFont **font, int n);
+void ren_font_group_set_atlas_budget(RenFont **font, size_t budget);
 double ren_font_group_get_width(RenFont **font, const char *text, size_t len, RenTab tab, int *x_offset);
 double ren_draw_text(RenSurface *rs, RenFont **font, const char *text, size_t len, float x, int y, RenColor color, RenTab tab);
+void ren_font_group_load_text(RenFont **font, const char *text, size_t len, float x, int surface_scale, RenTab tab);
+void ren_font_group_prewarm(RenFont **font, unsigned int first, unsigned int last);
+uint32_t ren_get_glyph_event(void);
+void ren_load_rendered_glyphs(void);
+void ren_get_text_run_stats(RenTextRunStats *stats);
 
 void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color);
 
@@ -48,6 +57,7 @@ RenWindow* ren_create(SDL_Window *win);
 void ren_destroy(RenWindow* window_renderer);
 void ren_resize_window(RenWindow *window_renderer);
 void ren_update_rects(RenWindow *window_renderer, RenRect *rects, int count);
+void ren_set_upload_mode(ERenUploadMode mode);
 void ren_set_clip_rect(RenWindow *window_renderer, RenRect rect);
 void ren_get_size(RenWindow *window_renderer, int *x, int *y); /* Reports the size in points. */
 size_t ren_get_window_list(RenWindow ***window_list_dest);
@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "renwindow.h"
 
 #ifdef LITE_USE_SDL_RENDERER
+/* the largest bounding box, relative to the area of the dirty rects, that is
+   uploaded at once, as all of it has to be copied */
+#define BATCH_MAX_OVERDRAW 2
+
+static ERenUploadMode upload_mode = UPLOAD_RECTS;
+
 static int query_surface_scale(RenWindow *ren) {
   int w_pixels, h_pixels;
   int w_points, h_points;
@@ -27,6 +35,43 @@ static void setup_renderer(RenWindow *ren, int w, int h) {
   ren->texture = SDL_CreateTexture(ren->renderer, ren->rensurface.surface->format, SDL_TEXTUREACCESS_STREAMING, w, h);
   ren->rensurface.scale = query_surface_scale(ren);
 }
+
+/* Copies the dirty rects to the texture under a single lock of their bounding
+   box. SDL only promises the locked pixels are write-only, so the whole box is
+   copied, and rects far apart are better uploaded one by one. */
+static bool update_texture_batched(RenWindow *ren, const RenRect *rects, int count) {
+  SDL_Surface *surface = ren->rensurface.surface;
+  const int scale = ren->rensurface.scale;
+  const int bpp = SDL_BYTESPERPIXEL(surface->format);
+  int x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+  int64_t area = 0;
+  for (int i = 0; i < count; i++) {
+    const RenRect *r = &rects[i];
+    x1 = SDL_min(x1, scale * r->x);
+    y1 = SDL_min(y1, scale * r->y);
+    x2 = SDL_max(x2, scale * (r->x + r->width));
+    y2 = SDL_max(y2, scale * (r->y + r->height));
+    area += (int64_t) scale * r->width * scale * r->height;
+  }
+  if (x1 >= x2 || y1 >= y2) {
+    return true;
+  }
+  if ((int64_t) (x2 - x1) * (y2 - y1) > area * BATCH_MAX_OVERDRAW) {
+    return false;
+  }
+  void *pixels;
+  int pitch;
+  if (!SDL_LockTexture(ren->texture, &(SDL_Rect){.x = x1, .y = y1, .w = x2 - x1, .h = y2 - y1}, &pixels, &pitch)) {
+    return false;
+  }
+  const uint8_t *src = surface->pixels;
+  uint8_t *dst = pixels;
+  for (int row = y1; row < y2; row++) {
+    memcpy(dst + (row - y1) * pitch, src + row * surface->pitch + x1 * bpp, (x2 - x1) * bpp);
+  }
+  SDL_UnlockTexture(ren->texture);
+  return true;
+}
 #endif
 
 
@@ -96,7 +141,6 @@ void renwin_resize_surface(RenWindow *ren) {
       new_h != ren->rensurface.surface->h) {
     renwin_init_surface(ren);
     renwin_clip_to_surface(ren);
-    setup_renderer(ren, new_w, new_h);
   }
 #endif
 }
@@ -117,14 +161,16 @@ void renwin_show_window(RenWindow *ren) {
 
 void renwin_update_rects(RenWindow *ren, RenRect *rects, int count) {
 #ifdef LITE_USE_SDL_RENDERER
-  const int scale = ren->rensurface.scale;
-  for (int i = 0; i < count; i++) {
-    const RenRect *r = &rects[i];
-    const int x = scale * r->x, y = scale * r->y;
-    const int w = scale * r->width, h = scale * r->height;
-    const SDL_Rect sr = {.x = x, .y = y, .w = w, .h = h};
-    uint8_t *pixels = ((uint8_t *) ren->rensurface.surface->pixels) + y * ren->rensurface.surface->pitch + x * SDL_BYTESPERPIXEL(ren->rensurface.surface->format);
-    SDL_UpdateTexture(ren->texture, &sr, pixels, ren->rensurface.surface->pitch);
+  if (upload_mode == UPLOAD_RECTS || !update_texture_batched(ren, rects, count)) {
+    const int scale = ren->rensurface.scale;
+    for (int i = 0; i < count; i++) {
+      const RenRect *r = &rects[i];
+      const int x = scale * r->x, y = scale * r->y;
+      const int w = scale * r->width, h = scale * r->height;
+      const SDL_Rect sr = {.x = x, .y = y, .w = w, .h = h};
+      uint8_t *pixels = ((uint8_t *) ren->rensurface.surface->pixels) + y * ren->rensurface.surface->pitch + x * SDL_BYTESPERPIXEL(ren->rensurface.surface->format);
+      SDL_UpdateTexture(ren->texture, &sr, pixels, ren->rensurface.surface->pitch);
+    }
   }
   SDL_RenderTexture(ren->renderer, ren->texture, NULL, NULL);
   SDL_RenderPresent(ren->renderer);
@@ -133,6 +179,12 @@ void renwin_update_rects(RenWindow *ren, RenRect *rects, int count) {
 #endif
 }
 
+void renwin_set_upload_mode(UNUSED ERenUploadMode mode) {
+#ifdef LITE_USE_SDL_RENDERER
+  upload_mode = mode;
+#endif
+}
+
 void renwin_free(RenWindow *ren) {
 #ifdef LITE_USE_SDL_RENDERER
   SDL_DestroyTexture(ren->texture);
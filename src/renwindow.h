@@ -1,11 +1,24 @@
 #include <SDL3/SDL.h>
 #include "renderer.h"
 
+/* the state kept by the render cache for each window between frames */
+typedef struct {
+  uint64_t *cells, *cells_prev; /* the cell hashes of the last two frames */
+  int *cell_bins_first, *cell_bins_last; /* the commands touching each cell */
+  RenRect *rects; /* the dirty rects of a frame */
+  RenRect screen_rect, last_clip_rect;
+  int width, height, scale; /* the size of the window the cells were made for */
+  int cols, rows, cell_size, tile_cells;
+  unsigned generation;
+  bool resize_issue;
+} RenCache;
+
 struct RenWindow {
   SDL_Window *window;
   uint8_t *command_buf;
   size_t command_buf_idx;
   size_t command_buf_size;
+  RenCache cache;
   float scale_x;
   float scale_y;
 #ifdef LITE_USE_SDL_RENDERER
@@ -24,6 +37,7 @@ void renwin_resize_surface(RenWindow *ren);
 void renwin_update_scale(RenWindow *ren);
 void renwin_show_window(RenWindow *ren);
 void renwin_update_rects(RenWindow *ren, RenRect *rects, int count);
+void renwin_set_upload_mode(ERenUploadMode mode);
 void renwin_free(RenWindow *ren);
 RenSurface renwin_get_surface(RenWindow *ren);
 